@@ -73,6 +73,12 @@ int chown_noeintr(const char *path, uid_t owner, gid_t group)
     wrap_call(int, chown(path, owner, group));
 }
 
+int fchownat_noeintr(int fd, const char *path, uid_t owner, gid_t group,
+                     int flag)
+{
+    wrap_call(int, fchownat(fd, path, owner, group, flag));
+}
+
 int closedir_noeintr(DIR *dirp)
 {
     wrap_call(int, closedir(dirp));
@@ -30,6 +30,9 @@ int chmod_noeintr(const char *path, mode_t mode);
 
 int chown_noeintr(const char *path, uid_t owner, gid_t group);
 
+int fchownat_noeintr(int fd, const char *path, uid_t owner, gid_t group,
+                     int flag);
+
 int closedir_noeintr(DIR *dirp);
 
 int fchdir_noeintr(int fildes);
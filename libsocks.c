@@ -1,17 +1,39 @@
 #define _POSIX_C_SOURCE 200809L
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
-#include <stdio.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "eintr_wrappers.h"
 #include "libsocks.h"
+#include "libsocks_cache.h"
+#include "libsocks_pvt.h"
+
+/*----------------------------------------------------------------------------*/
+
+static __thread struct socks_request *current_request = NULL;
+
+/* Client retry policy (a deadline of 0 means retrying is off), which is
+ * read and written as a whole under retry_lock, and counts of what it's done,
+ * each of which is updated atomically. */
+static pthread_mutex_t retry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct socks_retry_policy retry_policy = {0, 0, 0};
+static struct socks_retry_stats retry_stats = {0, 0, 0};
+static __thread unsigned int retry_seed = 0;
 
 /*----------------------------------------------------------------------------*/
 
@@ -33,8 +55,8 @@ static uint16_t deserialize_uint16(const char input[2])
 {
     int result = 0;
 
-    result += (input[0]) << 0;
-    result += (input[1]) << 8;
+    result += ((unsigned char) input[0]) << 0;
+    result += ((unsigned char) input[1]) << 8;
 
     return (uint16_t) (result & 0xFFFF);
 }
@@ -45,19 +67,25 @@ static uint16_t deserialize_uint16(const char input[2])
  * @param[out] buf Pointer to target data buffer
  * @param[in] nbyte Number of bytes to read
  * @return Number of bytes retrieved, or -1 in the event of an error.
- * @retval <0 A read error occured, and errno was set accordingly.
+ * @retval <0 A read error occured, and errno was set accordingly. If the peer
+ * closed the connection first, errno is set to ECONNRESET.
  * @retval >=0 Number of bytes retrieved. */
 static ssize_t read_count(int filedes, char *buf, size_t nbyte)
 {
     size_t total = 0;
 
     while (total < nbyte) {
-        ssize_t result = read_noeintr(filedes, buf, (nbyte - total));
+        ssize_t result = read_noeintr(filedes, buf + total, (nbyte - total));
 
         if (result < 0) {
             return result;
         }
 
+        if (result == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+
         total += (size_t) result;
     }
 
@@ -117,21 +145,22 @@ static int fd_socket_checkflag(int fd)
 
 enum {
     sun_path_size = get_size(struct sockaddr_un, sun_path) - 1,
-    address_maxlen = (sun_path_size > PATH_MAX) ? sun_path_size : PATH_MAX,
     backlog_target = 16,
-    backlog_size = (backlog_target < SOMAXCONN) ? backlog_target : SOMAXCONN
+    backlog_size = (backlog_target < SOMAXCONN) ? backlog_target : SOMAXCONN,
+    listen_fds_start = 3
 };
 
-static int socks_address_make(const char *filename, struct sockaddr_un *result)
+int socks_address_make(const char *filename, struct sockaddr_un *result)
 {
-    size_t length = strnlen(filename, PATH_MAX + 1);
+    size_t length = strnlen(filename, sun_path_size + 1);
 
-    if (length > address_maxlen) {
-        char buffer[address_maxlen + 1];
-        memcpy(buffer, filename, address_maxlen);
-        buffer[address_maxlen] = '\x00';
+    if (length > sun_path_size) {
+        char buffer[sun_path_size + 1];
+        memcpy(buffer, filename, sun_path_size);
+        buffer[sun_path_size] = '\x00';
 
-        fprintf(stderr, "error: pathname too long [%s]\n", buffer);
+        socks_log(SOCKS_LOG_ERROR, "pathname too long [%s]", buffer);
+        errno = ENAMETOOLONG;
         return -1;
     }
 
@@ -141,10 +170,9 @@ static int socks_address_make(const char *filename, struct sockaddr_un *result)
     return 0;
 }
 
-static ssize_t socks_recv(int fd, void *buf, size_t bufsize)
+static ssize_t socks_recv_header(int fd, uint16_t *msgsize)
 {
     char header[2];
-    uint16_t msgsize;
     ssize_t result;
 
     result = read_count(fd, header, 2);
@@ -153,9 +181,29 @@ static ssize_t socks_recv(int fd, void *buf, size_t bufsize)
         return result;
     }
 
-    msgsize = deserialize_uint16(header);
+    *msgsize = deserialize_uint16(header);
+    return result;
+}
+
+static ssize_t socks_recv(int fd, void *buf, size_t bufsize)
+{
+    uint16_t msgsize;
+    ssize_t result;
+
+    result = socks_recv_header(fd, &msgsize);
+
+    if (result < 0) {
+        return result;
+    }
+
+    /* The body is a packet of its own, and reading any of it discards the
+     * rest, so a message that doesn't fit is dropped whole. Leaving it
+     * queued would make the next receive read it as a header. */
 
     if (msgsize > bufsize) {
+        char discard;
+
+        read_noeintr(fd, &discard, 1);
         errno = EMSGSIZE;
         return -1;
     }
@@ -163,6 +211,45 @@ static ssize_t socks_recv(int fd, void *buf, size_t bufsize)
     return read_count(fd, (char *) buf, msgsize);
 }
 
+/** @brief Receives one message into a buffer of exactly its size, plus a
+ * terminating NUL byte. */
+static ssize_t socks_recv_alloc(int fd, char **buf)
+{
+    uint16_t msgsize;
+    ssize_t result;
+    char *output;
+
+    result = socks_recv_header(fd, &msgsize);
+
+    if (result < 0) {
+        return result;
+    }
+
+    output = malloc((size_t) msgsize + 1);
+
+    if (output == NULL) {
+        char discard;
+
+        /* Dropped whole, as in socks_recv(), keeping malloc()'s ENOMEM. */
+        read_noeintr(fd, &discard, 1);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    result = read_count(fd, output, msgsize);
+
+    if (result < 0) {
+        int prev_errno = errno;
+        free(output);
+        errno = prev_errno;
+        return result;
+    }
+
+    output[msgsize] = '\x00';
+    *buf = output;
+    return result;
+}
+
 static ssize_t socks_send(int fd, const void *buf, uint16_t nbyte)
 {
     char header[2];
@@ -179,28 +266,172 @@ static ssize_t socks_send(int fd, const void *buf, uint16_t nbyte)
 }
 
 static int socks_process_request(int connection_fd, socks_callback_t callback,
-                                 uint16_t input_size)
+                                 socks_cache_t *cache, uint16_t input_size,
+                                 struct socks_trace *trace)
 {
-    int result;
+    ssize_t result;
     char buffer[input_size + 1];
-    int callback_result;
 
     buffer[input_size] = '\x00';
 
-    result = (int) read_count(connection_fd, buffer, input_size);
+    result = read_count(connection_fd, buffer, input_size);
 
     if (result < 0) {
-        return result;
+        return (int) result;
+    }
+
+    socks_trace_body(trace, buffer, input_size);
+    return socks_request_dispatch_traced(connection_fd, callback, cache, NULL,
+                                         trace, buffer, input_size);
+}
+
+static int socks_server_select(int socket_fd, struct timeval *restrict timeout)
+{
+    fd_set read_fds;
+    fd_set error_fds;
+
+    FD_ZERO(&read_fds);
+    FD_ZERO(&error_fds);
+    FD_SET(socket_fd, &read_fds);
+    FD_SET(socket_fd, &error_fds);
+
+    int result = select_noeintr(socket_fd + 1, &read_fds, NULL, &error_fds,
+                                timeout);
+
+    /* We might normally use FD_ISSET here, but this isn't necessary
+     * because we're only listening for one item (the socket). */
+
+    if (result > 0) {
+        return 1;
+    }
+
+    return result;
+}
+
+/*----------------------------------------------------------------------------*/
+
+int socks_request_accept(int socket_fd, uint16_t *msgsize)
+{
+    return socks_request_accept_traced(socket_fd, msgsize, NULL);
+}
+
+int socks_request_accept_traced(int socket_fd, uint16_t *msgsize,
+                                struct socks_trace *trace)
+{
+    int connection_fd;
+    ssize_t result;
+    char header[2];
+
+    if (trace != NULL) {
+        socks_trace_begin(trace);
+    }
+
+    connection_fd = accept_noeintr(socket_fd, NULL, NULL);
+
+    if (connection_fd < 0) {
+        return connection_fd;
+    }
+
+    socks_trace_mark(trace, SOCKS_STAGE_ACCEPT);
+
+    if ((trace != NULL) && trace->active) {
+        trace->record.peer_known =
+            (socks_peer_fetch(connection_fd, &trace->record.peer) == 0);
+    }
+
+    result = read_count(connection_fd, header, 2);
+
+    if (result < 0) {
+        close_noeintr(connection_fd);
+        return (int) result;
+    }
+
+    socks_trace_mark(trace, SOCKS_STAGE_HEADER);
+    *msgsize = deserialize_uint16(header);
+    return connection_fd;
+}
+
+ssize_t socks_request_read(int connection_fd, char *buf, uint16_t msgsize)
+{
+    return read_count(connection_fd, buf, msgsize);
+}
+
+int socks_request_dispatch(int connection_fd, socks_callback_t callback,
+                           const char *msg, uint16_t len)
+{
+    return socks_request_dispatch_cached(connection_fd, callback, NULL, msg,
+                                         len);
+}
+
+int socks_request_dispatch_cached(int connection_fd, socks_callback_t callback,
+                                  socks_cache_t *cache, const char *msg,
+                                  uint16_t len)
+{
+    return socks_request_dispatch_peer(connection_fd, callback, cache, NULL,
+                                       msg, len);
+}
+
+int socks_request_dispatch_peer(int connection_fd, socks_callback_t callback,
+                                socks_cache_t *cache,
+                                const struct socks_peer *peer,
+                                const char *msg, uint16_t len)
+{
+    return socks_request_dispatch_traced(connection_fd, callback, cache, peer,
+                                         NULL, msg, len);
+}
+
+int socks_request_dispatch_traced(int connection_fd, socks_callback_t callback,
+                                  socks_cache_t *cache,
+                                  const struct socks_peer *peer,
+                                  struct socks_trace *trace, const char *msg,
+                                  uint16_t len)
+{
+    int result;
+    int callback_result;
+    struct socks_request request = {
+        .connection_fd = connection_fd,
+        .msg = msg,
+        .len = len,
+        .cache = NULL,
+        .capture = NULL,
+        .trace = trace
+    };
+
+    if ((peer == NULL) && (trace != NULL) && trace->active &&
+        trace->record.peer_known) {
+        peer = &trace->record.peer;
+    }
+
+    request.peer_known = (peer != NULL);
+
+    if (peer != NULL) {
+        request.peer = *peer;
+    }
+
+    if (cache != NULL) {
+        result = socks_cache_respond(cache, connection_fd, msg, len,
+                                     &request.generation);
+
+        if (result == 1) {
+            socks_trace_mark(trace, SOCKS_STAGE_RESPOND);
+            return 0;
+        }
+
+        if (result == 0) {
+            request.cache = cache;
+        }
     }
 
     result = fd_socket_clearflag(connection_fd);
 
     if (result < 0) {
-        fprintf(stderr, "couldn't clear flag\n");
+        socks_log(SOCKS_LOG_ERROR, "couldn't clear flag");
         return result;
     }
 
-    callback_result = callback(connection_fd, buffer, input_size);
+    current_request = &request;
+    callback_result = callback(connection_fd, msg, len);
+    socks_trace_mark(trace, SOCKS_STAGE_CALLBACK);
 
     switch (fd_socket_checkflag(connection_fd)) {
         case 0:
@@ -211,10 +442,21 @@ static int socks_process_request(int connection_fd, socks_callback_t callback,
             break;
 
         default:
-            fprintf(stderr, "couldn't check flag\n");
+            socks_log(SOCKS_LOG_ERROR, "couldn't check flag");
             break;
     }
 
+    current_request = NULL;
+    socks_arena_reset();
+
+    if (request.capture != NULL) {
+        if ((result == 0) && (callback_result == 0)) {
+            socks_cache_commit(cache, request.capture);
+        } else {
+            socks_cache_discard(request.capture);
+        }
+    }
+
     if (result == 0) {
         return callback_result;
     }
@@ -222,41 +464,190 @@ static int socks_process_request(int connection_fd, socks_callback_t callback,
     return result;
 }
 
-static int socks_server_select(int socket_fd, struct timeval *restrict timeout)
+int socks_request_dispatch_batch(int connection_fd, socks_callback_t callback,
+                                 struct socks_batch *batch, const char *msg,
+                                 uint16_t len)
 {
-    fd_set read_fds;
-    fd_set error_fds;
+    int callback_result;
+    struct socks_request request = {
+        .connection_fd = connection_fd,
+        .msg = msg,
+        .len = len,
+        .batch = batch
+    };
+
+    current_request = &request;
+    callback_result = callback(connection_fd, msg, len);
+    current_request = NULL;
+    socks_arena_reset();
+
+    if ((request.responded == 0) && (socks_batch_append(batch, "", 0) < 0)) {
+        return -1;
+    }
 
-    FD_ZERO(&read_fds);
-    FD_ZERO(&error_fds);
-    FD_SET(socket_fd, &read_fds);
-    FD_SET(socket_fd, &error_fds);
+    return callback_result;
+}
 
-    int result = select_noeintr(socket_fd + 1, &read_fds, NULL, &error_fds,
-                                timeout);
+/** @brief Opens a client socket and connects it to a server, without
+ * retrying. Connection failures are only reported on stderr if 'verbose' is
+ * set. */
+static int client_connect(const char *filename, int verbose)
+{
+    int result;
+    int socket_fd;
+    struct sockaddr_un address;
 
-    /* We might normally use FD_ISSET here, but this isn't necessary
-     * because we're only listening for one item (the socket). */
+    result = socks_address_make(filename, &address);
 
-    if (result > 0) {
-        return 1;
+    if (result < 0) {
+        return result;
     }
 
-    return result;
+    socket_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+
+    if (socket_fd < 0) {
+        socks_log(SOCKS_LOG_ERROR, "Couldn't open socket [%s]", filename);
+        return socket_fd;
+    }
+
+    result = connect_noeintr(socket_fd, (struct sockaddr *) &address,
+                             sizeof(address));
+
+    if (result != 0) {
+        if (verbose) {
+            socks_log(SOCKS_LOG_WARN, "Couldn't connect to socket [%s]",
+                      filename);
+        }
+
+        close_noeintr(socket_fd);
+        return result;
+    }
+
+    return socket_fd;
+}
+
+int socks_client_connect(const char *filename)
+{
+    return client_connect(filename, 1);
+}
+
+void socks_frame_header(uint16_t nbyte, char header[2])
+{
+    serialize_uint16(nbyte, header);
+}
+
+ssize_t socks_frame_send(int fd, const void *buf, uint16_t nbyte)
+{
+    return socks_send(fd, buf, nbyte);
+}
+
+ssize_t socks_frame_recv(int fd, void *buf, size_t bufsize)
+{
+    return socks_recv(fd, buf, bufsize);
+}
+
+ssize_t socks_frame_recv_header(int fd, uint16_t *msgsize)
+{
+    return socks_recv_header(fd, msgsize);
+}
+
+ssize_t socks_frame_recv_alloc(int fd, char **buf)
+{
+    return socks_recv_alloc(fd, buf);
+}
+
+struct socks_request *socks_request_current(int response_fd)
+{
+    struct socks_request *request = current_request;
+
+    if ((request == NULL) || (request->connection_fd != response_fd)) {
+        return NULL;
+    }
+
+    return request;
+}
+
+int socks_peer_fetch(int connection_fd, struct socks_peer *peer)
+{
+#ifdef SO_PEERCRED
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+
+    if (getsockopt(connection_fd, SOL_SOCKET, SO_PEERCRED, &credentials,
+                   &length) != 0) {
+        return -1;
+    }
+
+    peer->pid = credentials.pid;
+    peer->uid = credentials.uid;
+    peer->gid = credentials.gid;
+    return 0;
+#else
+    (void) connection_fd;
+    (void) peer;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+int socks_server_peer(int response_fd, struct socks_peer *peer)
+{
+    struct socks_request *request = socks_request_current(response_fd);
+
+    if (request == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!request->peer_known) {
+        if (socks_peer_fetch(response_fd, &request->peer) != 0) {
+            return -1;
+        }
+
+        request->peer_known = 1;
+    }
+
+    *peer = request->peer;
+    return 0;
 }
 
 /*----------------------------------------------------------------------------*/
 
 ssize_t socks_server_respond(int response_fd, const void *buf, uint16_t nbyte)
 {
+    struct socks_request *request = socks_request_current(response_fd);
+    ssize_t result;
+
+    if ((request != NULL) && (request->batch != NULL)) {
+        request->responded = 1;
+        return socks_batch_append(request->batch, buf, nbyte);
+    }
+
     if (fd_socket_setflag(response_fd) != 0) {
-        fprintf(stderr, "setflag failed!\n");
+        socks_log(SOCKS_LOG_ERROR, "setflag failed!");
     }
 
-    return socks_send(response_fd, buf, nbyte);
+    if ((request != NULL) && (request->cache != NULL) &&
+        (request->capture == NULL)) {
+        request->capture = socks_cache_capture(request->msg, request->len, buf,
+                                               nbyte, request->generation);
+    }
+
+    result = socks_send(response_fd, buf, nbyte);
+
+    if (request != NULL) {
+        socks_trace_mark(request->trace, SOCKS_STAGE_RESPOND);
+    }
+
+    return result;
 }
 
 int socks_server_open(const char *filename, mode_t mode)
+{
+    return socks_listener_open(filename, mode, SOCK_SEQPACKET);
+}
+
+int socks_listener_open(const char *filename, mode_t mode, int type)
 {
     int result;
     int socket_fd;
@@ -268,7 +659,7 @@ int socks_server_open(const char *filename, mode_t mode)
         return result;
     }
 
-    socket_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    socket_fd = socket(AF_UNIX, type, 0);
 
     if (socket_fd < 0) {
         return socket_fd;
@@ -301,30 +692,133 @@ int socks_server_open(const char *filename, mode_t mode)
     return socket_fd;
 }
 
+/** @brief Returns the number of listening sockets passed to this process by
+ * socket activation (LISTEN_FDS), or 0 if there are none or they were meant
+ * for another process (LISTEN_PID). They start at listen_fds_start. */
+static int socks_listen_fds(void)
+{
+    const char *pid_string = getenv("LISTEN_PID");
+    const char *fds_string = getenv("LISTEN_FDS");
+    char *end;
+    long value;
+
+    if ((pid_string == NULL) || (fds_string == NULL)) {
+        return 0;
+    }
+
+    value = strtol(pid_string, &end, 10);
+
+    if ((*end != '\x00') || (end == pid_string) || (value != getpid())) {
+        return 0;
+    }
+
+    value = strtol(fds_string, &end, 10);
+
+    if ((*end != '\x00') || (end == fds_string) || (value <= 0) ||
+        (value > INT_MAX - listen_fds_start)) {
+        return 0;
+    }
+
+    return (int) value;
+}
+
+/** @brief Returns 1 if the listening socket 'fd' is bound to the socketfile
+ * at 'target'. Besides the exact path, the file itself is compared (when
+ * 'target_stat' isn't NULL), so other spellings of the same path match. */
+static int listener_matches(int fd, const struct sockaddr_un *target,
+                            const struct stat *target_stat)
+{
+    struct sockaddr_un address;
+    struct stat bound_stat;
+    socklen_t length = sizeof(address);
+
+    memset(&address, 0, sizeof(address));
+
+    if (getsockname(fd, (struct sockaddr *) &address, &length) != 0) {
+        return 0;
+    }
+
+    if (strncmp(address.sun_path, target->sun_path,
+                sizeof(address.sun_path)) == 0) {
+        return 1;
+    }
+
+    return (target_stat != NULL) && (address.sun_path[0] != '\x00') &&
+           (stat(address.sun_path, &bound_stat) == 0) &&
+           (bound_stat.st_dev == target_stat->st_dev) &&
+           (bound_stat.st_ino == target_stat->st_ino);
+}
+
+int socks_server_open_activated(const char *filename, mode_t mode)
+{
+    struct sockaddr_un target;
+    struct stat target_stat;
+    int target_known;
+    int count;
+
+    if (socks_address_make(filename, &target) < 0) {
+        return -1;
+    }
+
+    count = socks_listen_fds();
+
+    if (count == 0) {
+        return socks_server_open(filename, mode);
+    }
+
+    /* Every inherited socket has to be usable as is, including the ones that
+     * other servers in the process will adopt. */
+
+    for (int fd = listen_fds_start; fd < listen_fds_start + count; fd++) {
+        if (socks_listener_check(fd) != 0) {
+            return -1;
+        }
+    }
+
+    target_known = (stat(filename, &target_stat) == 0) &&
+                   S_ISSOCK(target_stat.st_mode);
+
+    for (int fd = listen_fds_start; fd < listen_fds_start + count; fd++) {
+        if (listener_matches(fd, &target, target_known ? &target_stat :
+                             NULL)) {
+            return (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) ? -1 : fd;
+        }
+    }
+
+    /* Binding a new socket in place of an inherited one would strand the
+     * connections in its backlog, so a path that matches none of them is an
+     * error rather than a reason to fall back. */
+
+    errno = ENOENT;
+    return -1;
+}
+
 int socks_server_process(int socket_fd, socks_callback_t callback)
+{
+    return socks_server_process_cached(socket_fd, callback, NULL);
+}
+
+int socks_server_process_cached(int socket_fd, socks_callback_t callback,
+                                socks_cache_t *cache)
 {
     int connection_fd;
-    ssize_t result;
-    char header[2];
+    int result;
     uint16_t msgsize;
+    struct socks_trace trace;
 
-    connection_fd = accept_noeintr(socket_fd, NULL, NULL);
+    connection_fd = socks_request_accept_traced(socket_fd, &msgsize, &trace);
 
     if (connection_fd < 0) {
         return connection_fd;
     }
 
-    result = read_count(connection_fd, header, 2);
-
-    if (result < 0) {
-        return (int) result;
-    }
-
-    msgsize = deserialize_uint16(header);
-    result = socks_process_request(connection_fd, callback, msgsize);
+    result = socks_process_request(connection_fd, callback, cache, msgsize,
+                                   &trace);
     close_noeintr(connection_fd);
+    socks_trace_mark(&trace, SOCKS_STAGE_CLOSE);
+    socks_trace_end(&trace);
 
-    return (int) result;
+    return result;
 }
 
 int socks_server_poll(int socket_fd)
@@ -354,6 +848,47 @@ int socks_server_wait(int socket_fd)
     return result;
 }
 
+int socks_listener_check(int socket_fd)
+{
+    int value;
+    socklen_t length = sizeof(value);
+    struct sockaddr_un address;
+
+    if (getsockopt(socket_fd, SOL_SOCKET, SO_TYPE, &value, &length) != 0) {
+        return -1;
+    }
+
+    if (value != SOCK_SEQPACKET) {
+        errno = EPROTOTYPE;
+        return -1;
+    }
+
+    length = sizeof(value);
+
+    if (getsockopt(socket_fd, SOL_SOCKET, SO_ACCEPTCONN, &value,
+                   &length) != 0) {
+        return -1;
+    }
+
+    if (value == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    length = sizeof(address);
+
+    if (getsockname(socket_fd, (struct sockaddr *) &address, &length) != 0) {
+        return -1;
+    }
+
+    if (address.sun_family != AF_UNIX) {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+
+    return 0;
+}
+
 int socks_server_close(int socket_fd)
 {
     return close_noeintr(socket_fd);
@@ -361,43 +896,174 @@ int socks_server_close(int socket_fd)
 
 /*----------------------------------------------------------------------------*/
 
+static unsigned long monotonic_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((unsigned long) now.tv_sec * 1000) +
+           ((unsigned long) now.tv_nsec / 1000000);
+}
+
+/** @brief Returns a delay between half of 'delay_ms' and all of it, chosen at
+ * random, so that clients that failed at the same moment spread out. */
+static unsigned int retry_jitter(unsigned int delay_ms)
+{
+    unsigned int half = delay_ms / 2;
+
+    if (retry_seed == 0) {
+        retry_seed = (unsigned int) monotonic_ms() ^
+                     (unsigned int)(uintptr_t) &retry_seed;
+    }
+
+    return half + (unsigned int) rand_r(&retry_seed) % (delay_ms - half + 1);
+}
+
+static int retry_possible(int error)
+{
+    return (error == EAGAIN) || (error == ENOENT) || (error == ECONNREFUSED);
+}
+
+/** @brief Connects to a server as socks_client_connect() does, retrying
+ * according to the process's retry policy. */
+static int client_connect_retry(const char *filename)
+{
+    struct socks_retry_policy policy;
+    unsigned int delay_ms;
+    unsigned long deadline;
+    unsigned long now;
+    int retried = 0;
+    int socket_fd;
+
+    pthread_mutex_lock(&retry_lock);
+    policy = retry_policy;
+    pthread_mutex_unlock(&retry_lock);
+
+    if (policy.deadline_ms == 0) {
+        return client_connect(filename, 1);
+    }
+
+    delay_ms = policy.initial_ms;
+    deadline = monotonic_ms() + policy.deadline_ms;
+    socket_fd = client_connect(filename, 0);
+
+    while ((socket_fd < 0) && retry_possible(errno)) {
+        unsigned int sleep_ms = retry_jitter(delay_ms);
+        struct timespec pause;
+
+        now = monotonic_ms();
+
+        if (now >= deadline) {
+            __atomic_add_fetch(&retry_stats.exhausted, 1, __ATOMIC_RELAXED);
+            break;
+        }
+
+        if (sleep_ms > deadline - now) {
+            sleep_ms = (unsigned int)(deadline - now);
+        }
+
+        pause.tv_sec = sleep_ms / 1000;
+        pause.tv_nsec = (long)(sleep_ms % 1000) * 1000000;
+        nanosleep(&pause, NULL);
+
+        delay_ms = (delay_ms > policy.max_ms / 2) ? policy.max_ms :
+                   delay_ms * 2;
+        retried = 1;
+        __atomic_add_fetch(&retry_stats.retries, 1, __ATOMIC_RELAXED);
+        socket_fd = client_connect(filename, 0);
+    }
+
+    if (socket_fd < 0) {
+        socks_log(SOCKS_LOG_WARN, "Couldn't connect to socket [%s]", filename);
+    } else if (retried) {
+        __atomic_add_fetch(&retry_stats.recovered, 1, __ATOMIC_RELAXED);
+    }
+
+    return socket_fd;
+}
+
+int socks_client_set_retry(const struct socks_retry_policy *policy)
+{
+    const struct socks_retry_policy off = {0, 0, 0};
+
+    if ((policy != NULL) &&
+        ((policy->initial_ms == 0) || (policy->deadline_ms == 0) ||
+         (policy->max_ms < policy->initial_ms))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&retry_lock);
+    retry_policy = (policy != NULL) ? *policy : off;
+    pthread_mutex_unlock(&retry_lock);
+    return 0;
+}
+
+void socks_client_get_retry(struct socks_retry_policy *policy)
+{
+    pthread_mutex_lock(&retry_lock);
+    *policy = retry_policy;
+    pthread_mutex_unlock(&retry_lock);
+}
+
+void socks_client_get_retry_stats(struct socks_retry_stats *stats)
+{
+    stats->retries = __atomic_load_n(&retry_stats.retries, __ATOMIC_RELAXED);
+    stats->recovered = __atomic_load_n(&retry_stats.recovered,
+                                       __ATOMIC_RELAXED);
+    stats->exhausted = __atomic_load_n(&retry_stats.exhausted,
+                                       __ATOMIC_RELAXED);
+}
+
 ssize_t socks_client_process(const char *filename, const char *input,
                              uint16_t nbyte, char *output, uint16_t maxlen)
 {
     ssize_t result;
     int socket_fd;
-    struct sockaddr_un address;
 
-    result = socks_address_make(filename, &address);
+    socket_fd = client_connect_retry(filename);
+
+    if (socket_fd < 0) {
+        return socket_fd;
+    }
+
+    result = socks_send(socket_fd, input, nbyte);
 
     if (result < 0) {
+        close_noeintr(socket_fd);
         return result;
     }
 
-    socket_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    result = socks_recv(socket_fd, output, maxlen);
+    close_noeintr(socket_fd);
+    return result;
+}
+
+ssize_t socks_client_process_alloc(const char *filename, const char *input,
+                                   uint16_t nbyte, char **output)
+{
+    ssize_t result;
+    int socket_fd;
+
+    socket_fd = client_connect_retry(filename);
 
     if (socket_fd < 0) {
-        fprintf(stderr, "Couldn't open socket [%s]\n", filename);
         return socket_fd;
     }
 
-    result = connect_noeintr(socket_fd, (struct sockaddr *) &address,
-                             sizeof(address));
+    result = socks_send(socket_fd, input, nbyte);
 
-    if (result != 0) {
-        fprintf(stderr, "Couldn't connect to socket [%s]\n", filename);
-        close_noeintr(socket_fd);
-        return result;
+    if (result >= 0) {
+        result = socks_recv_alloc(socket_fd, output);
     }
 
-    result = socks_send(socket_fd, input, nbyte);
-
     if (result < 0) {
+        int prev_errno = errno;
         close_noeintr(socket_fd);
+        errno = prev_errno;
         return result;
     }
 
-    result = socks_recv(socket_fd, output, maxlen);
     close_noeintr(socket_fd);
     return result;
 }
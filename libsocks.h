@@ -4,6 +4,10 @@
 #include <stdint.h>
 #include <sys/types.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*----------------------------------------------------------------------------*/
 
 /** @brief Sends a packet of data to a libsocks server and receives the
@@ -16,10 +20,67 @@
  * @return Number of bytes returned from server, or a negative number in the
  * event of an error.
  * @retval <0 A communications error occured, and errno was set accordingly.
+ * EMSGSIZE means the response was longer than maxlen (it's discarded).
  * @retval >=0 Length of response from server. */
 ssize_t socks_client_process(const char *filename, const char *input,
                              uint16_t nbyte, char *output, uint16_t maxlen);
 
+/** @brief Same as socks_client_process(), but receives the response into a
+ * buffer allocated to fit it exactly, so the caller doesn't have to guess
+ * its size. The buffer holds one extra byte, set to NUL, past the end of the
+ * response.
+ * @param[in] filename Filename of target socketfile.
+ * @param[in] input Input packet to send to server.
+ * @param[in] nbyte Length of input packet (in bytes).
+ * @param[out] output Set to the response buffer, which the caller must
+ * free() (only if the call succeeded).
+ * @return Number of bytes returned from server, or a negative number in the
+ * event of an error.
+ * @retval <0 A communications error occured, and errno was set accordingly.
+ * @retval >=0 Length of response from server. */
+ssize_t socks_client_process_alloc(const char *filename, const char *input,
+                                   uint16_t nbyte, char **output);
+
+/** @brief How socks_client_process() and socks_client_process_alloc() retry
+ * a connection that fails because the server is busy or restarting: its
+ * listen queue is full (EAGAIN), or its socketfile is missing (ENOENT) or
+ * not being listened on (ECONNREFUSED). Any other failure, and any failure
+ * once connected, is returned at once. Retries back off exponentially, from
+ * 'initial_ms' up to 'max_ms', each delay jittered so that clients which
+ * failed together don't retry together, and stop when 'deadline_ms' has
+ * passed since the first attempt. */
+struct socks_retry_policy {
+    unsigned int initial_ms;
+    unsigned int max_ms;
+    unsigned int deadline_ms;
+};
+
+/** @brief Counts of connection retries by clients in this process. */
+struct socks_retry_stats {
+    unsigned long retries;
+    unsigned long recovered;
+    unsigned long exhausted;
+};
+
+/** @brief Sets the policy for retrying client connections, for the whole
+ * process. Retrying is off until this is called. Safe to call at any time.
+ * @param[in] policy Policy to use, or NULL to stop retrying.
+ * @return Exit status of function.
+ * @retval 0 Policy was set.
+ * @retval -1 The policy had a zero 'initial_ms' or 'deadline_ms', or a
+ * 'max_ms' less than 'initial_ms', and errno was set to EINVAL. */
+int socks_client_set_retry(const struct socks_retry_policy *policy);
+
+/** @brief Reads the policy set by socks_client_set_retry(), for clients that
+ * connect on their own (libsocks_coro.hpp) and retry the same way.
+ * @param[out] policy Current policy; all zeros while retrying is off. */
+void socks_client_get_retry(struct socks_retry_policy *policy);
+
+/** @brief Reads how many times client connections have been retried, how
+ * many connections succeeded after retrying, and how many ran out of time.
+ * @param[out] stats Counts since the process started. */
+void socks_client_get_retry_stats(struct socks_retry_stats *stats);
+
 /*----------------------------------------------------------------------------*/
 
 /** @brief Creates a unix-domain socket and opens it as a libsocks server.
@@ -31,6 +92,24 @@ ssize_t socks_client_process(const char *filename, const char *input,
  * @retval >=0 File descriptor for the open socket. */
 int socks_server_open(const char *filename, mode_t mode);
 
+/** @brief Opens a libsocks server on a socket inherited through socket
+ * activation, or with socks_server_open() if nothing was inherited.
+ * Inherited sockets are found with the LISTEN_FDS and LISTEN_PID environment
+ * variables (starting at file descriptor 3), and matched to 'filename' by
+ * the socketfile they're bound to, so any spelling of its path will do. The
+ * environment is left as is, so other servers in the process can adopt their
+ * own sockets.
+ * @param[in] filename Filename of target socketfile.
+ * @param[in] mode Permissions for the socketfile, if it has to be created.
+ * @return File descriptor for the open socket, or a negative number in the
+ * event of an error.
+ * @retval <0 Socketfile couldn't be opened, and errno was set accordingly.
+ * EPROTOTYPE or EINVAL means an inherited socket isn't a listening
+ * SOCK_SEQPACKET socket, and ENOENT means sockets were inherited but none is
+ * bound to 'filename'. The socketfile is never replaced in either case.
+ * @retval >=0 File descriptor for the open socket. */
+int socks_server_open_activated(const char *filename, mode_t mode);
+
 /** @brief Shuts down an active libsocks server.
  * @param[in] socket_fd File descriptor of open libsocks server.
  * @return Exit status of function.
@@ -67,6 +146,26 @@ int socks_server_poll(int socket_fd);
  * @retval >=0 Number of bytes written. */
 ssize_t socks_server_respond(int response_fd, const void *buf, uint16_t nbyte);
 
+/** @brief Credentials of the process at the other end of a connection, as
+ * reported by the kernel when it connected. */
+struct socks_peer {
+    pid_t pid;
+    uid_t uid;
+    gid_t gid;
+};
+
+/** @brief Gets the credentials of the client whose request is being handled.
+ * For use in your callback. They're read from the kernel (SO_PEERCRED) at
+ * most once per connection, and pooled servers read them when the connection
+ * is accepted.
+ * @param[in] response_fd File descriptor provided to your callback.
+ * @param[out] peer Destination for the credentials.
+ * @return Exit status of function.
+ * @retval 0 Credentials were stored in 'peer'.
+ * @retval -1 'response_fd' isn't the request being handled by this thread,
+ * or the credentials couldn't be read, and errno was set accordingly. */
+int socks_server_peer(int response_fd, struct socks_peer *peer);
+
 /** @brief Function-type for the user-provided callback function. A function
  * of this type is given to socks_server_process(), which will call it
  * automatically when appropriate. The 'msg' pointer holds the incoming message
@@ -88,4 +187,8 @@ int socks_server_process(int socket_fd, socks_callback_t callback);
 
 /*----------------------------------------------------------------------------*/
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,197 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "libsocks_arena.h"
+#include "libsocks_pvt.h"
+
+/*----------------------------------------------------------------------------*/
+
+enum {
+    arena_align = 16
+};
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    unsigned char data[];
+};
+
+/* The first block is the arena proper, and is kept between requests. Any
+ * blocks after it are overflow. */
+struct socks_arena {
+    struct arena_block *first;
+    struct arena_block *current;
+    size_t size;
+};
+
+static size_t arena_size = SOCKS_ARENA_DEFAULT_SIZE;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t arena_key;
+
+/*----------------------------------------------------------------------------*/
+
+static void arena_free_chain(struct arena_block *block)
+{
+    while (block != NULL) {
+        struct arena_block *next = block->next;
+
+        free(block);
+        block = next;
+    }
+}
+
+/** @brief Thread-exit destructor for a thread's arena. */
+static void arena_destroy(void *arg)
+{
+    struct socks_arena *arena = arg;
+
+    arena_free_chain(arena->first);
+    free(arena);
+}
+
+static void arena_key_create(void)
+{
+    pthread_key_create(&arena_key, arena_destroy);
+}
+
+static struct arena_block *block_create(size_t size)
+{
+    struct arena_block *block = malloc(sizeof(*block) + size);
+
+    if (block != NULL) {
+        block->next = NULL;
+        block->size = size;
+        block->used = 0;
+    }
+
+    return block;
+}
+
+/** @brief Carves 'size' bytes out of a block, or returns NULL if they don't
+ * fit. */
+static void *block_take(struct arena_block *block, size_t size)
+{
+    uintptr_t start = (uintptr_t)(block->data + block->used);
+    size_t padding = (arena_align - (start % arena_align)) % arena_align;
+
+    if ((block->size - block->used < padding) ||
+        (block->size - block->used - padding < size)) {
+        return NULL;
+    }
+
+    block->used += padding + size;
+    return (void *)(start + padding);
+}
+
+/** @brief Returns the calling thread's arena, creating it if need be. */
+static struct socks_arena *arena_get(void)
+{
+    struct socks_arena *arena;
+
+    pthread_once(&arena_once, arena_key_create);
+    arena = pthread_getspecific(arena_key);
+
+    if (arena != NULL) {
+        return arena;
+    }
+
+    arena = calloc(1, sizeof(*arena));
+
+    if ((arena != NULL) && (pthread_setspecific(arena_key, arena) != 0)) {
+        free(arena);
+        return NULL;
+    }
+
+    return arena;
+}
+
+/*----------------------------------------------------------------------------*/
+
+void socks_arena_reset(void)
+{
+    struct socks_arena *arena;
+
+    pthread_once(&arena_once, arena_key_create);
+    arena = pthread_getspecific(arena_key);
+
+    if ((arena == NULL) || (arena->first == NULL)) {
+        return;
+    }
+
+    arena_free_chain(arena->first->next);
+    arena->first->next = NULL;
+    arena->first->used = 0;
+    arena->current = arena->first;
+
+    if (arena->size != __atomic_load_n(&arena_size, __ATOMIC_RELAXED)) {
+        free(arena->first);
+        arena->first = NULL;
+        arena->current = NULL;
+    }
+}
+
+void *socks_server_alloc(int response_fd, size_t size)
+{
+    struct socks_arena *arena;
+    struct arena_block *block;
+    void *result;
+
+    if (socks_request_current(response_fd) == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    arena = arena_get();
+
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    if (arena->first == NULL) {
+        arena->size = __atomic_load_n(&arena_size, __ATOMIC_RELAXED);
+        arena->first = block_create(arena->size);
+        arena->current = arena->first;
+
+        if (arena->first == NULL) {
+            return NULL;
+        }
+    }
+
+    result = block_take(arena->current, size);
+
+    if (result != NULL) {
+        return result;
+    }
+
+    if (size > SIZE_MAX - arena_align - sizeof(*block)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    block = block_create((size + arena_align > arena->size) ?
+                         size + arena_align : arena->size);
+
+    if (block == NULL) {
+        return NULL;
+    }
+
+    arena->current->next = block;
+    arena->current = block;
+    return block_take(block, size);
+}
+
+int socks_arena_set_size(size_t size)
+{
+    if (size == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    __atomic_store_n(&arena_size, size, __ATOMIC_RELAXED);
+    return 0;
+}
@@ -0,0 +1,44 @@
+#ifndef LIBSOCKS_ARENA_H
+#define LIBSOCKS_ARENA_H
+
+#include <stddef.h>
+
+#include "libsocks.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Scratch memory for callbacks. Each thread that runs callbacks has an arena
+ * of a fixed size (see socks_arena_set_size()), and socks_server_alloc()
+ * hands out pieces of it by bumping a pointer. Everything allocated during a
+ * request is released at once when the request's response has been sent, so
+ * callbacks never free it. If a request needs more than the arena holds,
+ * overflow blocks are chained on with malloc(), and freed at the same time. */
+
+/** @brief Default size of each thread's arena. */
+#define SOCKS_ARENA_DEFAULT_SIZE 16384
+
+/** @brief Allocates scratch memory for the request being handled. For use in
+ * your callback. The memory is aligned for any type, is uninitialized, and
+ * stays valid until the callback returns.
+ * @param[in] response_fd File descriptor provided to your callback.
+ * @param[in] size Number of bytes to allocate.
+ * @return Pointer to the memory, or NULL in the event of an error (in which
+ * case errno was set to EINVAL if 'response_fd' isn't the request being
+ * handled by this thread, or to ENOMEM). */
+void *socks_server_alloc(int response_fd, size_t size);
+
+/** @brief Sets the size of the arenas. Each thread picks up the new size
+ * after its next request. Safe to call at any time.
+ * @param[in] size Size of each thread's arena (in bytes).
+ * @return Exit status of function.
+ * @retval 0 Size was set.
+ * @retval -1 The size was 0, and errno was set to EINVAL. */
+int socks_arena_set_size(size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
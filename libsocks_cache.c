@@ -0,0 +1,450 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libsocks_cache.h"
+#include "libsocks_pvt.h"
+
+/*----------------------------------------------------------------------------*/
+
+enum {
+    bucket_min = 64,
+    bucket_max = 65536,
+    bytes_per_bucket = 512
+};
+
+struct socks_cache_entry {
+    struct socks_cache_entry *chain;
+    struct socks_cache_entry *prev;
+    struct socks_cache_entry *next;
+    uint64_t hash;
+    uint64_t expires_ms;
+    uint64_t generation;
+    unsigned int refs;
+    unsigned char referenced;
+    unsigned char linked;
+    uint16_t key_len;
+    uint16_t data_len;
+    char bytes[];
+};
+
+struct socks_cache {
+    pthread_mutex_t lock;
+    size_t max_bytes;
+    size_t bytes;
+    unsigned int ttl_ms;
+    int by_opcode;
+    unsigned int opcode_ttl[256];
+    struct socks_cache_entry *hand;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    uint64_t generation;
+    uint64_t opcode_generation[256];
+    uint64_t *bucket_generation;
+    size_t bucket_mask;
+    struct socks_cache_entry *buckets[];
+};
+
+/*----------------------------------------------------------------------------*/
+
+static uint64_t now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000) + ((uint64_t) now.tv_nsec / 1000000);
+}
+
+/** @brief 64-bit FNV-1a hash of a request. */
+static uint64_t hash_bytes(const char *msg, uint16_t len)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    for (uint16_t x = 0; x < len; x++) {
+        hash ^= (unsigned char) msg[x];
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+static size_t entry_size(const struct socks_cache_entry *entry)
+{
+    return sizeof(*entry) + entry->key_len + entry->data_len;
+}
+
+/** @brief Returns the lifetime to use for a request's response, 0 for no
+ * expiry, or -1 if the request shouldn't be cached at all. */
+static long cache_ttl(const struct socks_cache *cache, const char *msg,
+                      uint16_t len)
+{
+    unsigned int ttl;
+
+    if (cache->by_opcode == 0) {
+        return (long) cache->ttl_ms;
+    }
+
+    if (len == 0) {
+        return -1;
+    }
+
+    ttl = cache->opcode_ttl[(unsigned char) msg[0]];
+    return (ttl == 0) ? -1 : (long) ttl;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Everything in this section must be called with the cache locked. */
+
+static void ring_insert(struct socks_cache *cache,
+                        struct socks_cache_entry *entry)
+{
+    if (cache->hand == NULL) {
+        entry->prev = entry;
+        entry->next = entry;
+        cache->hand = entry;
+        return;
+    }
+
+    /* New entries go just behind the hand, so they're the last to be
+     * considered for eviction. */
+
+    entry->next = cache->hand;
+    entry->prev = cache->hand->prev;
+    entry->prev->next = entry;
+    cache->hand->prev = entry;
+}
+
+static void ring_remove(struct socks_cache *cache,
+                        struct socks_cache_entry *entry)
+{
+    if (entry->next == entry) {
+        cache->hand = NULL;
+        return;
+    }
+
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+
+    if (cache->hand == entry) {
+        cache->hand = entry->next;
+    }
+}
+
+/** @brief Removes an entry from the cache. The entry is freed right away
+ * unless a response is still being sent from it, in which case the last
+ * sender frees it. */
+static void cache_unlink(struct socks_cache *cache,
+                         struct socks_cache_entry *entry)
+{
+    struct socks_cache_entry **link = &cache->buckets[entry->hash &
+                                                      cache->bucket_mask];
+
+    while (*link != entry) {
+        link = &(*link)->chain;
+    }
+
+    *link = entry->chain;
+    ring_remove(cache, entry);
+    cache->bytes -= entry_size(entry);
+    entry->linked = 0;
+
+    if (entry->refs == 0) {
+        free(entry);
+    }
+}
+
+static struct socks_cache_entry *cache_find(struct socks_cache *cache,
+                                            uint64_t hash, const char *msg,
+                                            uint16_t len)
+{
+    struct socks_cache_entry *entry = cache->buckets[hash & cache->bucket_mask];
+
+    while (entry != NULL) {
+        if ((entry->hash == hash) && (entry->key_len == len) &&
+            (memcmp(entry->bytes, msg, len) == 0)) {
+            return entry;
+        }
+
+        entry = entry->chain;
+    }
+
+    return NULL;
+}
+
+/** @brief Returns a count that changes whenever a request's cached response
+ * could have been invalidated: by socks_cache_clear(), by invalidating its
+ * opcode, or by invalidating any request in its bucket. Each of those only
+ * ever increases, so their sum does too. */
+static uint64_t key_generation(const struct socks_cache *cache, uint64_t hash,
+                               const char *msg, uint16_t len)
+{
+    uint64_t generation = cache->generation;
+
+    generation += cache->bucket_generation[hash & cache->bucket_mask];
+
+    if (len != 0) {
+        generation += cache->opcode_generation[(unsigned char) msg[0]];
+    }
+
+    return generation;
+}
+
+/** @brief Runs the CLOCK hand until there's room for 'needed' more bytes.
+ * Entries that were hit since the hand last passed get a second chance. */
+static void cache_evict(struct socks_cache *cache, size_t needed)
+{
+    while ((cache->hand != NULL) &&
+           ((cache->bytes + needed) > cache->max_bytes)) {
+        struct socks_cache_entry *entry = cache->hand;
+
+        if (entry->referenced != 0) {
+            entry->referenced = 0;
+            cache->hand = entry->next;
+            continue;
+        }
+
+        cache_unlink(cache, entry);
+        cache->evictions++;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+int socks_cache_respond(socks_cache_t *cache, int response_fd,
+                        const char *msg, uint16_t len, uint64_t *generation)
+{
+    uint64_t hash = hash_bytes(msg, len);
+    struct socks_cache_entry *entry;
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (cache_ttl(cache, msg, len) < 0) {
+        pthread_mutex_unlock(&cache->lock);
+        return -1;
+    }
+
+    entry = cache_find(cache, hash, msg, len);
+
+    if ((entry != NULL) && (entry->expires_ms != 0) &&
+        (entry->expires_ms <= now_ms())) {
+        cache_unlink(cache, entry);
+        entry = NULL;
+    }
+
+    if (entry == NULL) {
+        cache->misses++;
+        *generation = key_generation(cache, hash, msg, len);
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+
+    entry->referenced = 1;
+    entry->refs++;
+    cache->hits++;
+    pthread_mutex_unlock(&cache->lock);
+
+    /* The response is sent straight out of the entry. The reference keeps
+     * it alive even if it gets evicted or invalidated in the meantime. */
+
+    socks_server_respond(response_fd, entry->bytes + entry->key_len,
+                         entry->data_len);
+
+    pthread_mutex_lock(&cache->lock);
+    entry->refs--;
+
+    if ((entry->refs == 0) && (entry->linked == 0)) {
+        free(entry);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    return 1;
+}
+
+struct socks_cache_entry *socks_cache_capture(const char *msg, uint16_t len,
+                                              const void *buf, uint16_t nbyte,
+                                              uint64_t generation)
+{
+    struct socks_cache_entry *entry;
+
+    entry = malloc(sizeof(*entry) + len + nbyte);
+
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    entry->hash = hash_bytes(msg, len);
+    entry->generation = generation;
+    entry->key_len = len;
+    entry->data_len = nbyte;
+    memcpy(entry->bytes, msg, len);
+    memcpy(entry->bytes + len, buf, nbyte);
+    return entry;
+}
+
+void socks_cache_commit(socks_cache_t *cache, struct socks_cache_entry *entry)
+{
+    long ttl;
+    size_t size = entry_size(entry);
+    struct socks_cache_entry *previous;
+    struct socks_cache_entry **bucket;
+
+    pthread_mutex_lock(&cache->lock);
+    ttl = cache_ttl(cache, entry->bytes, entry->key_len);
+
+    /* If the request could have been invalidated since it missed, the
+     * callback may have built its response from the old state, so the
+     * response isn't kept. */
+
+    if ((ttl < 0) || (size > cache->max_bytes) ||
+        (entry->generation != key_generation(cache, entry->hash, entry->bytes,
+                                             entry->key_len))) {
+        pthread_mutex_unlock(&cache->lock);
+        free(entry);
+        return;
+    }
+
+    entry->expires_ms = (ttl == 0) ? 0 : (now_ms() + (uint64_t) ttl);
+
+    previous = cache_find(cache, entry->hash, entry->bytes, entry->key_len);
+
+    if (previous != NULL) {
+        cache_unlink(cache, previous);
+    }
+
+    cache_evict(cache, size);
+
+    bucket = &cache->buckets[entry->hash & cache->bucket_mask];
+    entry->chain = *bucket;
+    *bucket = entry;
+    entry->linked = 1;
+    ring_insert(cache, entry);
+    cache->bytes += size;
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void socks_cache_discard(struct socks_cache_entry *entry)
+{
+    free(entry);
+}
+
+/*----------------------------------------------------------------------------*/
+
+socks_cache_t *socks_cache_create(size_t max_bytes, unsigned int ttl_ms)
+{
+    struct socks_cache *cache;
+    size_t buckets = bucket_min;
+
+    while ((buckets < bucket_max) &&
+           ((buckets * bytes_per_bucket) < max_bytes)) {
+        buckets *= 2;
+    }
+
+    cache = calloc(1, sizeof(*cache) + (buckets * sizeof(cache->buckets[0])));
+
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->bucket_generation = calloc(buckets,
+                                      sizeof(*cache->bucket_generation));
+
+    if (cache->bucket_generation == NULL) {
+        free(cache);
+        return NULL;
+    }
+
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->max_bytes = max_bytes;
+    cache->ttl_ms = ttl_ms;
+    cache->bucket_mask = buckets - 1;
+    return cache;
+}
+
+void socks_cache_destroy(socks_cache_t *cache)
+{
+    socks_cache_clear(cache);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->bucket_generation);
+    free(cache);
+}
+
+int socks_cache_set_opcode(socks_cache_t *cache, unsigned char opcode,
+                           unsigned int ttl_ms)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache->by_opcode = 1;
+    cache->opcode_ttl[opcode] = ttl_ms;
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+void socks_cache_invalidate(socks_cache_t *cache, const char *msg,
+                            uint16_t len)
+{
+    uint64_t hash = hash_bytes(msg, len);
+    struct socks_cache_entry *entry;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->bucket_generation[hash & cache->bucket_mask]++;
+    entry = cache_find(cache, hash, msg, len);
+
+    if (entry != NULL) {
+        cache_unlink(cache, entry);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void socks_cache_invalidate_opcode(socks_cache_t *cache, unsigned char opcode)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache->opcode_generation[opcode]++;
+
+    for (size_t x = 0; x <= cache->bucket_mask; x++) {
+        struct socks_cache_entry *entry = cache->buckets[x];
+
+        while (entry != NULL) {
+            struct socks_cache_entry *chain = entry->chain;
+
+            if ((entry->key_len != 0) &&
+                ((unsigned char) entry->bytes[0] == opcode)) {
+                cache_unlink(cache, entry);
+            }
+
+            entry = chain;
+        }
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void socks_cache_clear(socks_cache_t *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache->generation++;
+
+    while (cache->hand != NULL) {
+        cache_unlink(cache, cache->hand);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void socks_cache_get_stats(socks_cache_t *cache,
+                           struct socks_cache_stats *stats)
+{
+    pthread_mutex_lock(&cache->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->bytes = cache->bytes;
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,87 @@
+#ifndef LIBSOCKS_CACHE_H
+#define LIBSOCKS_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libsocks.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief Opaque handle for a libsocks response cache. */
+typedef struct socks_cache socks_cache_t;
+
+/** @brief Hit/miss counters for a cache, as filled in by
+ * socks_cache_get_stats(). */
+struct socks_cache_stats {
+    unsigned long hits;       /**< Requests answered from the cache. */
+    unsigned long misses;     /**< Cacheable requests passed to the callback. */
+    unsigned long evictions;  /**< Entries dropped to stay within size. */
+    size_t bytes;             /**< Memory currently held by entries. */
+};
+
+/** @brief Creates a response cache for idempotent requests. Responses are
+ * keyed by the exact bytes of the request. Once the cache is full, entries
+ * are evicted in CLOCK (second-chance) order. A cache is safe to share between
+ * threads.
+ * @param[in] max_bytes Upper bound on the memory held by cached entries.
+ * @param[in] ttl_ms Lifetime of an entry in milliseconds, or 0 for no expiry.
+ * @return Handle for the new cache, or NULL in the event of an error (in which
+ * case errno was set accordingly). */
+socks_cache_t *socks_cache_create(size_t max_bytes, unsigned int ttl_ms);
+
+/** @brief Frees a cache and all of its entries. The cache must no longer be
+ * in use by any server or pool. */
+void socks_cache_destroy(socks_cache_t *cache);
+
+/** @brief Switches the cache to per-opcode mode, where the first byte of a
+ * request is its opcode. Once any opcode has been set, only requests with a
+ * configured opcode are cached, each with its own lifetime.
+ * @param[in] cache Cache to configure.
+ * @param[in] opcode Opcode to configure.
+ * @param[in] ttl_ms Lifetime for this opcode's entries in milliseconds, or 0
+ * to stop caching it.
+ * @return Exit status of function. Always 0. */
+int socks_cache_set_opcode(socks_cache_t *cache, unsigned char opcode,
+                           unsigned int ttl_ms);
+
+/** @brief Drops the cached response for one request, if there is one. Safe to
+ * call from a callback.
+ * @param[in] cache Cache to invalidate.
+ * @param[in] msg Request whose response should be dropped.
+ * @param[in] len Length of the request (in bytes). */
+void socks_cache_invalidate(socks_cache_t *cache, const char *msg,
+                            uint16_t len);
+
+/** @brief Drops every cached response whose request starts with the given
+ * opcode byte. Safe to call from a callback. */
+void socks_cache_invalidate_opcode(socks_cache_t *cache, unsigned char opcode);
+
+/** @brief Drops every cached response. Safe to call from a callback. */
+void socks_cache_clear(socks_cache_t *cache);
+
+/** @brief Takes a snapshot of a cache's counters. */
+void socks_cache_get_stats(socks_cache_t *cache,
+                           struct socks_cache_stats *stats);
+
+/** @brief Same as socks_server_process(), but answers cacheable requests from
+ * 'cache' when possible. On a hit, the cached response is sent straight from
+ * the cache without calling 'callback', and 0 is returned. On a miss, the
+ * callback's response is stored if the callback returns 0, and nothing that
+ * could cover the request was invalidated while the callback ran: the cache
+ * wasn't cleared, its opcode wasn't invalidated, and no request sharing its
+ * hash bucket was. Invalidating other requests doesn't affect it.
+ * @param[in] socket_fd File descriptor of open libsocks server.
+ * @param[in] callback Callback function for the server to use.
+ * @param[in] cache Cache to use, or NULL for none.
+ * @return Same as socks_server_process(). */
+int socks_server_process_cached(int socket_fd, socks_callback_t callback,
+                                socks_cache_t *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
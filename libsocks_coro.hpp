@@ -0,0 +1,829 @@
+#ifndef LIBSOCKS_CORO_HPP
+#define LIBSOCKS_CORO_HPP
+
+#include <cerrno>
+#include <algorithm>
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "libsocks.h"
+
+/* Coroutines for C++20. A socks::coro::scheduler runs any number of
+ * coroutines on the thread that calls its run(), switching between them
+ * whenever one waits for a socket or a timer, so a server can have many
+ * requests in flight, each waiting on its own downstream calls, without a
+ * thread per request:
+ *
+ *     socks::coro::task<int> relay(socks::coro::incoming &request)
+ *     {
+ *         std::string answer;
+ *
+ *         if (co_await socks::coro::process(request.owner(), "/run/db.sock",
+ *                                           request.data(), request.size(),
+ *                                           answer) < 0) {
+ *             co_return -1;
+ *         }
+ *
+ *         co_await request.respond(answer.data(),
+ *                                  static_cast<uint16_t>(answer.size()));
+ *         co_return 0;
+ *     }
+ *
+ *     socks::coro::scheduler scheduler;
+ *     scheduler.spawn(socks::coro::serve(scheduler, socket_fd, relay));
+ *     scheduler.run();
+ *
+ * A scheduler is single-threaded. To use more cores, run one scheduler per
+ * thread, each serving the same listening socket: serve() switches it to
+ * non-blocking mode, so a scheduler that loses an accept() race just goes
+ * back to waiting. Coroutines use the same wire format as the rest of the
+ * library, so either end can be an ordinary libsocks client or server. */
+
+namespace socks::coro {
+
+template <typename T = void>
+class task;
+
+namespace detail {
+
+struct promise_base {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+
+    std::suspend_always initial_suspend() noexcept
+    {
+        return {};
+    }
+
+    /* Resumes whoever was waiting for the task, without going back through
+     * the scheduler. */
+    struct final_awaiter {
+        bool await_ready() noexcept
+        {
+            return false;
+        }
+
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle)
+        noexcept
+        {
+            std::coroutine_handle<> next = handle.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept
+        {
+        }
+    };
+
+    final_awaiter final_suspend() noexcept
+    {
+        return {};
+    }
+
+    void unhandled_exception() noexcept
+    {
+        error = std::current_exception();
+    }
+};
+
+template <typename T>
+struct result_holder {
+    std::optional<T> value;
+
+    void return_value(T result)
+    {
+        value.emplace(std::move(result));
+    }
+
+    T take()
+    {
+        return std::move(*value);
+    }
+};
+
+template <>
+struct result_holder<void> {
+    void return_void() noexcept
+    {
+    }
+
+    void take() noexcept
+    {
+    }
+};
+
+/** @brief Coroutine that owns itself, for scheduler::spawn(). */
+struct detached {
+    struct promise_type {
+        detached get_return_object() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void() noexcept
+        {
+        }
+
+        void unhandled_exception() noexcept
+        {
+            std::terminate();
+        }
+    };
+};
+
+} // namespace detail
+
+/** @brief Lazily-started coroutine returning a T. It starts when it's
+ * awaited (or spawned), and whoever awaits it resumes as soon as it
+ * finishes. Exceptions are passed on to the awaiting coroutine. */
+template <typename T>
+class task {
+public:
+    struct promise_type : detail::promise_base, detail::result_holder<T> {
+        task get_return_object() noexcept
+        {
+            return task(std::coroutine_handle<promise_type>::from_promise(
+                            *this));
+        }
+    };
+
+    task(task &&other) noexcept : handle_(std::exchange(other.handle_, {}))
+    {
+    }
+
+    task &operator=(task &&other) noexcept
+    {
+        if (this != &other) {
+            if (handle_) {
+                handle_.destroy();
+            }
+
+            handle_ = std::exchange(other.handle_, {});
+        }
+
+        return *this;
+    }
+
+    ~task()
+    {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    auto operator co_await() noexcept
+    {
+        struct awaiter {
+            std::coroutine_handle<promise_type> handle;
+
+            bool await_ready() noexcept
+            {
+                return handle.done();
+            }
+
+            std::coroutine_handle<> await_suspend(
+                std::coroutine_handle<> waiting) noexcept
+            {
+                handle.promise().continuation = waiting;
+                return handle;
+            }
+
+            T await_resume()
+            {
+                if (handle.promise().error) {
+                    std::rethrow_exception(handle.promise().error);
+                }
+
+                return handle.promise().take();
+            }
+        };
+
+        return awaiter{handle_};
+    }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> handle) noexcept
+        : handle_(handle)
+    {
+    }
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+/*----------------------------------------------------------------------------*/
+
+/** @brief Runs coroutines on one thread, waiting for their sockets with
+ * poll(). Coroutines left waiting when the scheduler is destroyed are never
+ * resumed, and their frames are leaked. */
+class scheduler {
+public:
+    scheduler() = default;
+    scheduler(const scheduler &) = delete;
+    scheduler &operator=(const scheduler &) = delete;
+
+    /** @brief Starts a task in the background. It first runs from run(), and
+     * its result (if any) is discarded. An exception that escapes it calls
+     * std::terminate(), as for std::thread. */
+    template <typename T>
+    void spawn(task<T> work)
+    {
+        run_detached(*this, std::move(work));
+    }
+
+    /** @brief Runs spawned tasks until all of them have finished, or until
+     * stop() is called.
+     * @return Exit status of function.
+     * @retval 0 There was nothing left to run, or stop() was called. Tasks
+     * that were still waiting carry on from the next run().
+     * @retval -1 poll() failed, and errno was set accordingly. */
+    int run()
+    {
+        stopping_ = false;
+
+        while (!stopping_) {
+            while (!ready_.empty() && !stopping_) {
+                std::coroutine_handle<> next = ready_.front();
+                ready_.pop_front();
+                next.resume();
+            }
+
+            if (stopping_ || !ready_.empty()) {
+                continue;
+            }
+
+            if (waiters_.empty() && timers_.empty()) {
+                return 0;
+            }
+
+            if (wait() != 0) {
+                return -1;
+            }
+        }
+
+        return 0;
+    }
+
+    /** @brief Makes run() return once the running task suspends. Safe to
+     * call from a task. */
+    void stop() noexcept
+    {
+        stopping_ = true;
+    }
+
+    /** @brief Awaitable that resumes once 'fd' is readable (or has failed).
+     */
+    auto readable(int fd) noexcept
+    {
+        return fd_awaiter{*this, fd, POLLIN};
+    }
+
+    /** @brief Awaitable that resumes once 'fd' is writable (or has failed).
+     */
+    auto writable(int fd) noexcept
+    {
+        return fd_awaiter{*this, fd, POLLOUT};
+    }
+
+    /** @brief Awaitable that resumes after at least 'duration'. */
+    auto sleep_for(std::chrono::nanoseconds duration) noexcept
+    {
+        return timer_awaiter{*this, clock::now() + duration};
+    }
+
+    /** @brief Awaitable that lets every other ready task run first. */
+    auto yield() noexcept
+    {
+        return yield_awaiter{*this};
+    }
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct waiter {
+        int fd;
+        short events;
+        std::coroutine_handle<> handle;
+    };
+
+    struct timer {
+        clock::time_point deadline;
+        std::uint64_t sequence;
+        std::coroutine_handle<> handle;
+
+        bool operator>(const timer &other) const noexcept
+        {
+            return (deadline != other.deadline) ?
+                   (deadline > other.deadline) : (sequence > other.sequence);
+        }
+    };
+
+    struct fd_awaiter {
+        scheduler &owner;
+        int fd;
+        short events;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            owner.waiters_.push_back({fd, events, handle});
+        }
+
+        void await_resume() const noexcept
+        {
+        }
+    };
+
+    struct timer_awaiter {
+        scheduler &owner;
+        clock::time_point deadline;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            owner.timers_.push({deadline, owner.sequence_++, handle});
+        }
+
+        void await_resume() const noexcept
+        {
+        }
+    };
+
+    struct yield_awaiter {
+        scheduler &owner;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            owner.ready_.push_back(handle);
+        }
+
+        void await_resume() const noexcept
+        {
+        }
+    };
+
+    template <typename T>
+    static detail::detached run_detached(scheduler &owner, task<T> work)
+    {
+        co_await owner.yield();
+        co_await std::move(work);
+    }
+
+    /** @brief Waits for the next socket or timer, and queues whatever is
+     * ready. */
+    int wait()
+    {
+        int timeout = -1;
+        int result;
+
+        if (!timers_.empty()) {
+            auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+                timers_.top().deadline - clock::now());
+            timeout = (remaining.count() < 0) ? 0 :
+                      static_cast<int>(remaining.count());
+        }
+
+        pollfds_.clear();
+
+        for (const waiter &entry : waiters_) {
+            pollfds_.push_back({entry.fd, entry.events, 0});
+        }
+
+        do {
+            result = poll(pollfds_.data(), pollfds_.size(), timeout);
+        } while ((result < 0) && (errno == EINTR));
+
+        if (result < 0) {
+            return -1;
+        }
+
+        std::size_t kept = 0;
+
+        for (std::size_t x = 0; x < waiters_.size(); x++) {
+            if (pollfds_[x].revents != 0) {
+                ready_.push_back(waiters_[x].handle);
+            } else {
+                waiters_[kept++] = waiters_[x];
+            }
+        }
+
+        waiters_.resize(kept);
+
+        while (!timers_.empty() && (timers_.top().deadline <= clock::now())) {
+            ready_.push_back(timers_.top().handle);
+            timers_.pop();
+        }
+
+        return 0;
+    }
+
+    std::deque<std::coroutine_handle<>> ready_;
+    std::vector<waiter> waiters_;
+    std::vector<struct pollfd> pollfds_;
+    std::priority_queue<timer, std::vector<timer>, std::greater<timer>>
+        timers_;
+    std::uint64_t sequence_ = 0;
+    bool stopping_ = false;
+};
+
+/*----------------------------------------------------------------------------*/
+
+namespace detail {
+
+/* These return 0 or an errno value rather than setting errno, since other
+ * coroutines run (and may change errno) while they're suspended. */
+
+inline task<int> send_packet(scheduler &owner, int fd, const void *buf,
+                             std::size_t nbyte)
+{
+    while (true) {
+        if (send(fd, buf, nbyte, MSG_NOSIGNAL) >= 0) {
+            co_return 0;
+        }
+
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+            if (errno != EINTR) {
+                co_return errno;
+            }
+
+            continue;
+        }
+
+        co_await owner.writable(fd);
+    }
+}
+
+inline task<int> recv_packet(scheduler &owner, int fd, void *buf,
+                             std::size_t nbyte, std::size_t &received)
+{
+    while (true) {
+        ssize_t result = recv(fd, buf, nbyte, 0);
+
+        if (result > 0) {
+            received = static_cast<std::size_t>(result);
+            co_return 0;
+        }
+
+        if (result == 0) {
+            co_return ECONNRESET;
+        }
+
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+            if (errno != EINTR) {
+                co_return errno;
+            }
+
+            continue;
+        }
+
+        co_await owner.readable(fd);
+    }
+}
+
+inline task<int> send_frame(scheduler &owner, int fd, const void *buf,
+                            std::uint16_t nbyte)
+{
+    const char header[2] = {static_cast<char>(nbyte & 0xff),
+                            static_cast<char>(nbyte >> 8)};
+    int error = co_await send_packet(owner, fd, header, sizeof(header));
+
+    if ((error == 0) && (nbyte != 0)) {
+        error = co_await send_packet(owner, fd, buf, nbyte);
+    }
+
+    co_return error;
+}
+
+inline task<int> recv_frame(scheduler &owner, int fd, std::string &output)
+{
+    unsigned char header[2];
+    std::size_t received = 0;
+    std::uint16_t msgsize;
+    int error = co_await recv_packet(owner, fd, header, sizeof(header),
+                                     received);
+
+    if (error != 0) {
+        co_return error;
+    }
+
+    if (received != sizeof(header)) {
+        co_return EPROTO;
+    }
+
+    msgsize = static_cast<std::uint16_t>(header[0] | (header[1] << 8));
+    output.resize(msgsize);
+
+    if (msgsize == 0) {
+        co_return 0;
+    }
+
+    error = co_await recv_packet(owner, fd, output.data(), msgsize, received);
+
+    if ((error == 0) && (received != msgsize)) {
+        error = EPROTO;
+    }
+
+    co_return error;
+}
+
+inline int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if ((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) ||
+        (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0)) {
+        return errno;
+    }
+
+    return 0;
+}
+
+/** @brief How long connect_to() waits out a full backlog while the process
+ * has no retry policy (see socks_client_set_retry()). */
+inline constexpr std::chrono::milliseconds connect_deadline{1000};
+
+/** @brief Connects a non-blocking socket to 'filename'. A full backlog
+ * makes connect() fail with EAGAIN instead of waiting, so this retries with
+ * backoff, the way a blocking connect() would have waited, until the retry
+ * policy's deadline (or connect_deadline) passes and EAGAIN is returned. */
+inline task<int> connect_to(scheduler &owner, const char *filename, int &fd)
+{
+    struct sockaddr_un address;
+    struct socks_retry_policy policy;
+    std::size_t length = strnlen(filename, sizeof(address.sun_path));
+    int error = 0;
+
+    socks_client_get_retry(&policy);
+
+    auto deadline = std::chrono::steady_clock::now() +
+                    ((policy.deadline_ms != 0) ?
+                     std::chrono::milliseconds(policy.deadline_ms) :
+                     connect_deadline);
+    auto delay = std::chrono::milliseconds(
+        (policy.deadline_ms != 0) ? policy.initial_ms : 1);
+    auto delay_max = std::chrono::milliseconds(
+        (policy.deadline_ms != 0) ? policy.max_ms : 64);
+
+    if (length == sizeof(address.sun_path)) {
+        co_return ENAMETOOLONG;
+    }
+
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, filename, length);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+
+    if ((fd < 0) || ((error = set_nonblocking(fd)) != 0)) {
+        error = (fd < 0) ? errno : error;
+        co_return error;
+    }
+
+    while (connect(fd, reinterpret_cast<struct sockaddr *>(&address),
+                   sizeof(address)) != 0) {
+        if (errno == EAGAIN) {
+            auto now = std::chrono::steady_clock::now();
+
+            if (now >= deadline) {
+                co_return EAGAIN;
+            }
+
+            co_await owner.sleep_for(std::min<std::chrono::nanoseconds>(
+                delay, deadline - now));
+            delay = std::min(delay * 2, delay_max);
+        } else if (errno != EINTR) {
+            co_return errno;
+        }
+    }
+
+    co_return 0;
+}
+
+} // namespace detail
+
+/*----------------------------------------------------------------------------*/
+
+/** @brief Sends a request to a libsocks server and receives its response,
+ * as socks_client_process() does, suspending instead of blocking.
+ * @param[in] owner Scheduler running the calling coroutine.
+ * @param[in] filename Filename of target socketfile.
+ * @param[in] input Request to send.
+ * @param[in] nbyte Length of the request (in bytes).
+ * @param[out] output Response.
+ * @return Length of the response, or -1 in the event of an error (in which
+ * case errno was set accordingly). */
+inline task<ssize_t> process(scheduler &owner, const char *filename,
+                             const void *input, std::uint16_t nbyte,
+                             std::string &output)
+{
+    int fd = -1;
+    int error = co_await detail::connect_to(owner, filename, fd);
+
+    if (error == 0) {
+        error = co_await detail::send_frame(owner, fd, input, nbyte);
+    }
+
+    if (error == 0) {
+        error = co_await detail::recv_frame(owner, fd, output);
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (error != 0) {
+        errno = error;
+        co_return -1;
+    }
+
+    co_return static_cast<ssize_t>(output.size());
+}
+
+/** @brief Request being handled by a coroutine server. */
+class incoming {
+public:
+    incoming(scheduler &owner, int fd, std::string msg)
+        : owner_(owner), fd_(fd), msg_(std::move(msg))
+    {
+    }
+
+    incoming(const incoming &) = delete;
+    incoming &operator=(const incoming &) = delete;
+
+    /** @brief Scheduler that the handler is running on. */
+    scheduler &owner() const noexcept
+    {
+        return owner_;
+    }
+
+    /** @brief Connection to the client. */
+    int fd() const noexcept
+    {
+        return fd_;
+    }
+
+    /** @brief Request, followed by a NUL byte (as for callbacks). */
+    const char *data() const noexcept
+    {
+        return msg_.c_str();
+    }
+
+    std::uint16_t size() const noexcept
+    {
+        return static_cast<std::uint16_t>(msg_.size());
+    }
+
+    std::string_view message() const noexcept
+    {
+        return msg_;
+    }
+
+    bool responded() const noexcept
+    {
+        return responded_;
+    }
+
+    /** @brief Sends the response, suspending until the client can take it.
+     * Should be awaited at most once per request; an empty response is sent
+     * if it isn't awaited at all.
+     * @return Same as socks_server_respond(). */
+    task<ssize_t> respond(const void *buf, std::uint16_t nbyte)
+    {
+        responded_ = true;
+        int error = co_await detail::send_frame(owner_, fd_, buf, nbyte);
+
+        if (error != 0) {
+            errno = error;
+            co_return -1;
+        }
+
+        co_return static_cast<ssize_t>(nbyte);
+    }
+
+private:
+    scheduler &owner_;
+    int fd_;
+    std::string msg_;
+    bool responded_ = false;
+};
+
+/** @brief Coroutine that handles one request. The result is ignored, as it
+ * is for pre-forked workers. */
+using handler = std::function<task<int>(incoming &)>;
+
+namespace detail {
+
+inline task<void> serve_connection(scheduler &owner, int fd, handler work)
+{
+    std::string msg;
+
+    if (co_await recv_frame(owner, fd, msg) == 0) {
+        incoming request(owner, fd, std::move(msg));
+        bool failed = false;
+
+        /* A handler that throws leaves the client with a closed connection
+         * rather than an empty response. */
+
+        try {
+            co_await work(request);
+        } catch (...) {
+            failed = true;
+        }
+
+        if (!failed && !request.responded()) {
+            co_await request.respond("", 0);
+        }
+    }
+
+    close(fd);
+}
+
+} // namespace detail
+
+/** @brief Serves an open libsocks server with a coroutine per request. Each
+ * connection is handled in a task of its own, so a handler that suspends
+ * doesn't hold up the others. Switches 'socket_fd' to non-blocking mode.
+ * @param[in] owner Scheduler to run the handlers on.
+ * @param[in] socket_fd File descriptor of open libsocks server.
+ * @param[in] work Handler for each request. It's copied for each request, so
+ * a lambda's captures stay valid for as long as the request is handled.
+ * @return Only returns if accepting fails, with -1 and errno set. */
+inline task<int> serve(scheduler &owner, int socket_fd, handler work)
+{
+    int flags = fcntl(socket_fd, F_GETFL);
+
+    if ((flags < 0) || (fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK) != 0)) {
+        co_return -1;
+    }
+
+    while (true) {
+        co_await owner.readable(socket_fd);
+
+        while (true) {
+            int fd = accept(socket_fd, nullptr, nullptr);
+
+            if (fd >= 0) {
+                if (detail::set_nonblocking(fd) == 0) {
+                    owner.spawn(detail::serve_connection(owner, fd, work));
+                } else {
+                    close(fd);
+                }
+
+                continue;
+            }
+
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                break;
+            }
+
+            if ((errno != EINTR) && (errno != ECONNABORTED)) {
+                co_return -1;
+            }
+        }
+    }
+}
+
+} // namespace socks::coro
+
+#endif
@@ -4,6 +4,7 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -57,7 +58,23 @@ __attribute__ ((unused)) static int show_mkdir(const char *path, mode_t mode)
     return 0;
 }
 
+__attribute__ ((unused)) static int show_mkdirat(int fd, const char *path,
+                                                mode_t mode)
+{
+    int result = mkdirat(fd, path, mode);
+
+    if (result != 0) {
+        fprintf(stderr, "Couldn't mkdir [%s] at [%d] (%s)\n", path, fd,
+                strerror(errno));
+        return result;
+    }
+
+    fprintf(stdout, "Created directory [%s] at [%d]\n", path, fd);
+    return 0;
+}
+
 #define mkdir(path, mode) show_mkdir(path, mode)
+#define mkdirat(fd, path, mode) show_mkdirat(fd, path, mode)
 #define fchdir(fd) show_fchdir(fd)
 #define chdir(path) show_chdir(path)
 
@@ -0,0 +1,501 @@
+#define _POSIX_C_SOURCE 200809L
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include "eintr_wrappers.h"
+#include "libsocks_dircache.h"
+#include "libsocks_dirs.h"
+
+#ifdef SOCKS_DIRS_STATS
+#include "libsocks_dirs_stats.h"
+#endif
+
+/*----------------------------------------------------------------------------*/
+
+enum {
+    bucket_min = 16,
+    bucket_max = 65536
+};
+
+struct dircache_entry {
+    struct dircache_entry *chain;
+    struct dircache_entry *watch_chain;
+    uint64_t hash;
+    dev_t dev;
+    ino_t ino;
+    size_t slot;
+    int wd;
+    unsigned int length;
+    char path[];
+};
+
+/* Entries sit in hash chains for lookup, and in a ring of 'capacity' slots
+ * in insertion order for eviction. Removing an entry early just empties its
+ * slot. With inotify, entries are also chained by watch descriptor, so an
+ * event finds its entries directly. Paths that alias the same directory
+ * share a watch descriptor, and the watch is only removed with the last of
+ * them. */
+struct socks_dircache {
+    pthread_mutex_t lock;
+    int inotify_fd;
+    size_t capacity;
+    size_t head;
+    size_t used;
+    size_t entries;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stale;
+    unsigned long evictions;
+    struct dircache_entry **ring;
+    struct dircache_entry **watches;
+    size_t bucket_mask;
+    struct dircache_entry *buckets[];
+};
+
+/*----------------------------------------------------------------------------*/
+
+/** @brief 64-bit FNV-1a hash of a path. */
+static uint64_t hash_path(const char *path, unsigned int length)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    for (unsigned int x = 0; x < length; x++) {
+        hash ^= (unsigned char) path[x];
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+/** @brief Writes the cache key for a path to 'key' (which must hold
+ * 'length' + 1 bytes) and returns its length. Repeated and trailing slashes
+ * and "." components are dropped, so that "/a/b", "/a/b/", "/a//b" and
+ * "/a/./b" share one entry. ".." is kept, since it can't be resolved without
+ * following symlinks. */
+static unsigned int key_make(const char *path, unsigned int length, char *key)
+{
+    unsigned int size = 0;
+    unsigned int x = 0;
+
+    if ((length > 0) && (path[0] == '/')) {
+        key[size++] = '/';
+    }
+
+    while (x < length) {
+        unsigned int start;
+
+        while ((x < length) && (path[x] == '/')) {
+            x++;
+        }
+
+        start = x;
+
+        while ((x < length) && (path[x] != '/')) {
+            x++;
+        }
+
+        if ((x == start) || ((x - start == 1) && (path[start] == '.'))) {
+            continue;
+        }
+
+        if ((size > 0) && (key[size - 1] != '/')) {
+            key[size++] = '/';
+        }
+
+        memcpy(key + size, path + start, x - start);
+        size += x - start;
+    }
+
+    key[size] = '\x00';
+    return size;
+}
+
+/* Everything in this section must be called with the cache locked. */
+
+static struct dircache_entry *cache_find(struct socks_dircache *cache,
+                                         uint64_t hash, const char *path,
+                                         unsigned int length)
+{
+    struct dircache_entry *entry = cache->buckets[hash & cache->bucket_mask];
+
+    while (entry != NULL) {
+        if ((entry->hash == hash) && (entry->length == length) &&
+            (memcmp(entry->path, path, length) == 0)) {
+            return entry;
+        }
+
+        entry = entry->chain;
+    }
+
+    return NULL;
+}
+
+static struct dircache_entry **watch_bucket(struct socks_dircache *cache,
+                                            int wd)
+{
+    return &cache->watches[(size_t) wd & cache->bucket_mask];
+}
+
+static struct dircache_entry *watch_find(struct socks_dircache *cache, int wd)
+{
+    struct dircache_entry *entry = *watch_bucket(cache, wd);
+
+    while ((entry != NULL) && (entry->wd != wd)) {
+        entry = entry->watch_chain;
+    }
+
+    return entry;
+}
+
+/** @brief Removes an inotify watch, unless another entry still uses it. */
+static void watch_release(struct socks_dircache *cache, int wd)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    if ((wd >= 0) && (watch_find(cache, wd) == NULL)) {
+        inotify_rm_watch(cache->inotify_fd, wd);
+    }
+#else
+    (void) cache;
+    (void) wd;
+#endif
+}
+
+/** @brief Removes an entry and frees it, along with its inotify watch if no
+ * other entry shares it. */
+static void cache_remove(struct socks_dircache *cache,
+                         struct dircache_entry *entry)
+{
+    struct dircache_entry **link = &cache->buckets[entry->hash &
+                                                   cache->bucket_mask];
+
+    while (*link != entry) {
+        link = &(*link)->chain;
+    }
+
+    *link = entry->chain;
+    cache->ring[entry->slot] = NULL;
+    cache->entries--;
+
+    if (entry->wd >= 0) {
+        link = watch_bucket(cache, entry->wd);
+
+        while (*link != entry) {
+            link = &(*link)->watch_chain;
+        }
+
+        *link = entry->watch_chain;
+        watch_release(cache, entry->wd);
+    }
+
+    free(entry);
+}
+
+static void cache_insert(struct socks_dircache *cache,
+                         struct dircache_entry *entry)
+{
+    struct dircache_entry **bucket;
+
+    if (cache->used == cache->capacity) {
+        struct dircache_entry *oldest = cache->ring[cache->head];
+
+        if (oldest != NULL) {
+            cache_remove(cache, oldest);
+            cache->evictions++;
+        }
+
+        cache->head = (cache->head + 1) % cache->capacity;
+        cache->used--;
+    }
+
+    entry->slot = (cache->head + cache->used) % cache->capacity;
+    cache->ring[entry->slot] = entry;
+    cache->used++;
+    cache->entries++;
+
+    bucket = &cache->buckets[entry->hash & cache->bucket_mask];
+    entry->chain = *bucket;
+    *bucket = entry;
+
+    if (entry->wd >= 0) {
+        bucket = watch_bucket(cache, entry->wd);
+        entry->watch_chain = *bucket;
+        *bucket = entry;
+    }
+}
+
+/** @brief Evicts every entry whose directory inotify reported as deleted or
+ * moved. IN_IGNORED only says a watch went away, which the entries' own
+ * events (or our own inotify_rm_watch()) already covered. Doesn't block. */
+static void cache_drain_events(struct socks_dircache *cache)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    char buffer[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    if (cache->inotify_fd < 0) {
+        return;
+    }
+
+    while (1) {
+        ssize_t result = read_noeintr(cache->inotify_fd, buffer,
+                                      sizeof(buffer));
+        ssize_t offset = 0;
+
+        if (result <= 0) {
+            return;
+        }
+
+        while (offset < result) {
+            const struct inotify_event *event = (const void *)(buffer + offset);
+            struct dircache_entry *entry;
+
+            offset += (ssize_t)(sizeof(*event) + event->len);
+
+            if ((event->mask & IN_IGNORED) != 0) {
+                continue;
+            }
+
+            while ((entry = watch_find(cache, event->wd)) != NULL) {
+                cache_remove(cache, entry);
+                cache->evictions++;
+            }
+        }
+    }
+#else
+    (void) cache;
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+
+socks_dircache_t *socks_dircache_create(size_t capacity, int flags)
+{
+    struct socks_dircache *cache;
+    size_t buckets = bucket_min;
+
+    if (capacity == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+#ifndef HAVE_SYS_INOTIFY_H
+    if ((flags & SOCKS_DIRCACHE_INOTIFY) != 0) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+#endif
+
+    while ((buckets < bucket_max) && (buckets < capacity)) {
+        buckets *= 2;
+    }
+
+    cache = calloc(1, sizeof(*cache) + (buckets * sizeof(cache->buckets[0])));
+
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->ring = calloc(capacity, sizeof(cache->ring[0]));
+
+    if (cache->ring == NULL) {
+        free(cache);
+        return NULL;
+    }
+
+    cache->inotify_fd = -1;
+
+#ifdef HAVE_SYS_INOTIFY_H
+    if ((flags & SOCKS_DIRCACHE_INOTIFY) != 0) {
+        cache->watches = calloc(buckets, sizeof(cache->watches[0]));
+        cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+        if ((cache->watches == NULL) || (cache->inotify_fd < 0)) {
+            if (cache->inotify_fd >= 0) {
+                close_noeintr(cache->inotify_fd);
+            }
+
+            free(cache->watches);
+            free(cache->ring);
+            free(cache);
+            return NULL;
+        }
+    }
+#endif
+
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->capacity = capacity;
+    cache->bucket_mask = buckets - 1;
+    return cache;
+}
+
+void socks_dircache_destroy(socks_dircache_t *cache)
+{
+    socks_dircache_clear(cache);
+
+    if (cache->inotify_fd >= 0) {
+        close_noeintr(cache->inotify_fd);
+    }
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->watches);
+    free(cache->ring);
+    free(cache);
+}
+
+int socks_mkdirs_cached(socks_dircache_t *cache, const char *path,
+                        unsigned int length, mode_t mode, uid_t uid, gid_t gid)
+{
+    struct dircache_entry *entry;
+    struct stat buffer;
+    uint64_t hash;
+    int result;
+    int fd;
+
+    length = (unsigned int) strnlen(path, length);
+
+    if ((length == 0) || (path[0] != '/')) {
+        return socks_mkdirs(path, length, mode, uid, gid);
+    }
+
+    char key[length + 1];
+
+    length = key_make(path, length, key);
+    hash = hash_path(key, length);
+
+    pthread_mutex_lock(&cache->lock);
+    cache_drain_events(cache);
+    entry = cache_find(cache, hash, key, length);
+
+    if (entry != NULL) {
+        result = fstatat(AT_FDCWD, key, &buffer, 0);
+
+        if ((result == 0) && S_ISDIR(buffer.st_mode) &&
+            (buffer.st_dev == entry->dev) && (buffer.st_ino == entry->ino)) {
+            cache->hits++;
+            pthread_mutex_unlock(&cache->lock);
+            return 0;
+        }
+
+        cache_remove(cache, entry);
+        cache->stale++;
+    }
+
+    cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+
+    /* The walk happens unlocked, so other paths aren't held up by it. */
+
+    fd = socks_mkdirs_open(AT_FDCWD, key, length, mode, uid, gid);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    result = fstat(fd, &buffer);
+    close_noeintr(fd);
+
+    if (result != 0) {
+        return -1;
+    }
+
+    entry = malloc(sizeof(*entry) + length + 1);
+
+    if (entry == NULL) {
+        return 0;
+    }
+
+    entry->hash = hash;
+    entry->dev = buffer.st_dev;
+    entry->ino = buffer.st_ino;
+    entry->wd = -1;
+    entry->length = length;
+    memcpy(entry->path, key, length + 1);
+
+    pthread_mutex_lock(&cache->lock);
+
+#ifdef HAVE_SYS_INOTIFY_H
+    if (cache->inotify_fd >= 0) {
+        entry->wd = inotify_add_watch(cache->inotify_fd, key,
+                                      IN_DELETE_SELF | IN_MOVE_SELF |
+                                      IN_ONLYDIR);
+    }
+#endif
+
+    if (cache_find(cache, hash, key, length) == NULL) {
+        cache_insert(cache, entry);
+    } else {
+        watch_release(cache, entry->wd);
+        free(entry);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+void socks_dircache_invalidate(socks_dircache_t *cache, const char *path,
+                               unsigned int length)
+{
+    struct dircache_entry *entry;
+
+    length = (unsigned int) strnlen(path, length);
+
+    if (length == 0) {
+        return;
+    }
+
+    char key[length + 1];
+
+    length = key_make(path, length, key);
+
+    pthread_mutex_lock(&cache->lock);
+    entry = cache_find(cache, hash_path(key, length), key, length);
+
+    if (entry != NULL) {
+        cache_remove(cache, entry);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void socks_dircache_clear(socks_dircache_t *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+
+    for (size_t x = 0; x < cache->capacity; x++) {
+        if (cache->ring[x] != NULL) {
+            cache_remove(cache, cache->ring[x]);
+        }
+    }
+
+    cache->head = 0;
+    cache->used = 0;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void socks_dircache_get_stats(socks_dircache_t *cache,
+                              struct socks_dircache_stats *stats)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache_drain_events(cache);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->stale = cache->stale;
+    stats->evictions = cache->evictions;
+    stats->entries = cache->entries;
+    pthread_mutex_unlock(&cache->lock);
+}
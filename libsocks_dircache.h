@@ -0,0 +1,80 @@
+#ifndef LIBSOCKS_DIRCACHE_H
+#define LIBSOCKS_DIRCACHE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief Opaque handle for a verified-directory cache. */
+typedef struct socks_dircache socks_dircache_t;
+
+/** @brief Flags for socks_dircache_create(). */
+enum socks_dircache_flags {
+    /** Watch cached directories with inotify, and evict them as soon as they
+     * are deleted or renamed. */
+    SOCKS_DIRCACHE_INOTIFY = 1
+};
+
+/** @brief Counters for a cache, as filled in by socks_dircache_get_stats(). */
+struct socks_dircache_stats {
+    unsigned long hits;       /**< Calls answered by a single stat. */
+    unsigned long misses;     /**< Calls that walked the whole path. */
+    unsigned long stale;      /**< Entries found to point at a new inode. */
+    unsigned long evictions;  /**< Entries dropped for space or by inotify. */
+    size_t entries;           /**< Entries currently cached. */
+};
+
+/*----------------------------------------------------------------------------*/
+
+/** @brief Creates a cache of directories that socks_mkdirs_cached() has
+ * already created and verified. Entries are keyed by absolute path (with
+ * repeated and trailing slashes and "." components dropped), and remember
+ * the directory's device and inode numbers, so a repeat call only has to
+ * stat the path and compare them. (A directory that's removed and recreated
+ * can get its old inode number back; SOCKS_DIRCACHE_INOTIFY catches
+ * that case too.) A cache is safe to share between threads.
+ * @param[in] capacity Maximum number of cached paths. The oldest entry is
+ * evicted once it's full.
+ * @param[in] flags Zero, or SOCKS_DIRCACHE_INOTIFY.
+ * @return Handle for the new cache, or NULL in the event of an error (in which
+ * case errno was set accordingly). */
+socks_dircache_t *socks_dircache_create(size_t capacity, int flags);
+
+/** @brief Frees a cache, along with its inotify descriptor (if any). */
+void socks_dircache_destroy(socks_dircache_t *cache);
+
+/** @brief Same as socks_mkdirs(), but returns after a single stat when an
+ * absolute path was already verified and still refers to the same directory.
+ * Relative paths aren't cached, since they depend on the working directory.
+ * @param[in] cache Cache to use.
+ * @param[in] path Path to create (if needed).
+ * @param[in] length Length of the input path string.
+ * @param[in] mode Access mode to set for newly-created directories.
+ * @param[in] uid Owner's UID to set for newly-created directories, or -1.
+ * @param[in] gid Owner's GID to set for newly-created directories, or -1.
+ * @return Exit code of function.
+ * @retval 0 Operation completed successfully.
+ * @retval other An error occurred, and errno was set accordingly. */
+int socks_mkdirs_cached(socks_dircache_t *cache, const char *path,
+                        unsigned int length, mode_t mode, uid_t uid,
+                        gid_t gid);
+
+/** @brief Drops the entry for one path, if there is one. */
+void socks_dircache_invalidate(socks_dircache_t *cache, const char *path,
+                               unsigned int length);
+
+/** @brief Drops every entry. */
+void socks_dircache_clear(socks_dircache_t *cache);
+
+/** @brief Takes a snapshot of a cache's counters. */
+void socks_dircache_get_stats(socks_dircache_t *cache,
+                              struct socks_dircache_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
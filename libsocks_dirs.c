@@ -5,7 +5,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
-#include <stdio.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -13,6 +13,7 @@
 
 #include "eintr_wrappers.h"
 #include "libsocks_dirs.h"
+#include "libsocks_pvt.h"
 
 #ifdef VERBOSE_DEBUG
 /* Replace chdir/fchdir/mkdir calls with verbose equivalents. Intended for
@@ -20,6 +21,13 @@
 #include "libsocks_debug.h"
 #endif
 
+#ifdef SOCKS_DIRS_STATS
+/* Count filesystem calls, for the benchmark. */
+#include "libsocks_dirs_stats.h"
+
+unsigned long socks_dirs_counters[SOCKS_DIRS_OP_COUNT];
+#endif
+
 /*----------------------------------------------------------------------------*/
 
 static DIR *dirp = NULL;
@@ -80,7 +88,7 @@ static int mkdir_if_needed(const char *path, mode_t mode, uid_t uid, gid_t gid)
     parent_inode = inode_at(AT_FDCWD, "..");
 
     if (expected_inode != parent_inode) {
-        fprintf(stderr, "inodes don't match\n");
+        socks_log(SOCKS_LOG_ERROR, "inodes don't match");
         return -1;
     }
 
@@ -117,59 +125,86 @@ static unsigned int load_block(const char *restrict path, unsigned int offset,
     return count;
 }
 
-/** @brief Returns 1 if the input path is a valid directory, and 0 otherwise.
- * Follows symlinks. */
-static int is_directory(const char *path)
+/** @brief Returns 1 if 'path' cut off at 'bound' is a directory, relative to
+ * 'dir_fd', and 0 otherwise. Follows symlinks. */
+static int prefix_is_directory(int dir_fd, char *path, unsigned int bound)
 {
     struct stat stat_buffer;
+    char saved = path[bound];
     int result;
-    result = stat(path, &stat_buffer);
 
-    if (result != 0) {
-        return 0;
-    }
+    path[bound] = '\x00';
+    result = fstatat(dir_fd, path, &stat_buffer, 0);
+    path[bound] = saved;
 
-    return (S_ISDIR(stat_buffer.st_mode) != 0);
+    return (result == 0) && (S_ISDIR(stat_buffer.st_mode) != 0);
 }
 
-/** @brief Finds the length of the longest existing directory-only path in
- * 'path'. Respects symlinks. Returns the length of the path segment. */
-static unsigned int find_existing(char *path, size_t maxlen)
+/** @brief Finds the deepest of 'count' component boundaries (cut points in
+ * 'path', shallowest first) whose prefix is an existing directory. A prefix
+ * can only resolve if every shorter one does, so the answer is found by
+ * bisection. The deepest two are probed first, since in the common case
+ * nearly all of the path already exists. Costs O(log count) stats, instead
+ * of one per component.
+ * @return Index into 'bounds', or -1 if no prefix exists. */
+static long deepest_directory(int dir_fd, char *path,
+                              const unsigned int *bounds, long count)
 {
-    unsigned int position = 0;
-    unsigned int x = 0;
-    size_t length = strnlen(path, maxlen);
-    int result;
+    long low = -1;
+    long high = count;
 
-    while (1) {
-        if (path[x] == '\x00') {
-            if (x != 0) {
-                if (is_directory(path)) {
-                    position = x;
-                }
-            }
-            break;
+    for (int x = 0; (x < 2) && (high > 0); x++) {
+        if (prefix_is_directory(dir_fd, path, bounds[high - 1])) {
+            return high - 1;
         }
+        high--;
+    }
 
-        if (x == length) {
-            break;
+    while ((high - low) > 1) {
+        long middle = low + ((high - low) / 2);
+
+        if (prefix_is_directory(dir_fd, path, bounds[middle])) {
+            low = middle;
+        } else {
+            high = middle;
         }
+    }
 
-        if ((path[x] == '/') && (x != 0)) {
-            path[x] = '\x00';
-            result = is_directory(path);
-            path[x] = '/';
+    return low;
+}
 
-            if (result == 0) {
-                break;
-            }
+/** @brief Fills 'bounds' with the offset of every '/' in 'path' after the
+ * first character. Returns the number of offsets. */
+static long find_bounds(const char *path, size_t length, unsigned int *bounds)
+{
+    long count = 0;
 
-            position = x;
+    for (size_t x = 1; x < length; x++) {
+        if (path[x] == '/') {
+            bounds[count++] = (unsigned int) x;
         }
-        x++;
     }
 
-    return position;
+    return count;
+}
+
+/** @brief Finds the length of the longest existing directory-only path in
+ * 'path'. Respects symlinks. Returns the length of the path segment. */
+static unsigned int find_existing(char *path, size_t maxlen)
+{
+    size_t length = strnlen(path, maxlen);
+    unsigned int bounds[length + 1];
+    long count;
+    long found;
+
+    count = find_bounds(path, length, bounds);
+
+    if ((length != 0) && (path[length] == '\x00')) {
+        bounds[count++] = (unsigned int) length;
+    }
+
+    found = deepest_directory(AT_FDCWD, path, bounds, count);
+    return (found < 0) ? 0 : bounds[found];
 }
 
 static void safe_strncpy(char *dest, const char *src, size_t maxlen)
@@ -217,21 +252,22 @@ static void split_existing(char *path, unsigned int maxlen, char **exist,
 int socks_store_cwd(void)
 {
     if ((dirp != NULL) || (cwd_fd != -1)) {
-        fprintf(stderr, "cwd buffer is already full\n");
+        socks_log(SOCKS_LOG_ERROR, "cwd buffer is already full");
         return -1;
     }
 
     dirp = opendir(".");
 
     if (dirp == NULL) {
-        fprintf(stderr, "%s\n", strerror(errno));
+        socks_log(SOCKS_LOG_ERROR, "couldn't open cwd (%s)", strerror(errno));
         return -1;
     }
 
     cwd_fd = dirfd(dirp);
 
     if (cwd_fd < 0) {
-        fprintf(stderr, "%s\n", strerror(errno));
+        socks_log(SOCKS_LOG_ERROR, "couldn't get cwd fd (%s)",
+                  strerror(errno));
         closedir_noeintr(dirp);
         return -1;
     }
@@ -244,14 +280,15 @@ int socks_restore_cwd(void)
     int result;
 
     if ((dirp == NULL) || (cwd_fd == -1)) {
-        fprintf(stderr, "cwd buffer is empty\n");
+        socks_log(SOCKS_LOG_ERROR, "cwd buffer is empty");
         return -1;
     }
 
     result = fchdir_noeintr(cwd_fd);
 
     if (result < 0) {
-        fprintf(stderr, "%s\n", strerror(errno));
+        socks_log(SOCKS_LOG_ERROR, "couldn't restore cwd (%s)",
+                  strerror(errno));
         return result;
     }
 
@@ -261,7 +298,7 @@ int socks_restore_cwd(void)
     dirp = NULL;
 
     if (result < 0) {
-        fprintf(stderr, "%s\n", strerror(errno));
+        socks_log(SOCKS_LOG_ERROR, "couldn't close cwd (%s)", strerror(errno));
         return result;
     }
 
@@ -291,7 +328,8 @@ int socks_mkdirs_chdir(const char *path, unsigned int length, mode_t mode,
     result = chdir(existing);
 
     if (result != 0) {
-        fprintf(stderr, "%s\n", strerror(errno));
+        socks_log(SOCKS_LOG_ERROR, "couldn't chdir to [%s] (%s)", existing,
+                  strerror(errno));
         return -1;
     }
 
@@ -311,7 +349,8 @@ int socks_mkdirs_chdir(const char *path, unsigned int length, mode_t mode,
             offset += used;
             result = mkdir_if_needed(block, mode, uid, gid);
             if (result != 0) {
-                fprintf(stderr, "%s\n", strerror(errno));
+                socks_log(SOCKS_LOG_ERROR, "couldn't create [%s] (%s)",
+                          block, strerror(errno));
                 return -1;
             }
         }
@@ -323,26 +362,859 @@ int socks_mkdirs_chdir(const char *path, unsigned int length, mode_t mode,
 int socks_mkdirs(const char *path, unsigned int length, mode_t mode, uid_t uid,
                  gid_t gid)
 {
+    return socks_mkdirs_at(AT_FDCWD, path, length, mode, uid, gid);
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int open_directory(int dir_fd, const char *path, int flags)
+{
+    int fd;
+
+    do {
+        fd = openat(dir_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC | flags);
+    } while ((fd < 0) && (errno == EINTR));
+
+    return fd;
+}
+
+/** @brief Opens the directory 'name' below 'parent_fd', creating it if
+ * needed. Components are followed as-is (symlinks included) until the first
+ * missing one, after which '*verify' is set. From then on, every directory
+ * is opened without following symlinks, and must have the parent as its
+ * "..", which is the fd-relative form of mkdir_if_needed()'s inode check.
+ * Returns the directory's file descriptor, or -1 on error. */
+static int enter_component(int parent_fd, const char *name, mode_t mode,
+                           uid_t uid, gid_t gid, int *verify)
+{
+    struct stat parent;
+    struct stat child;
     int result;
-    int mkdirs_errno;
-    int mkdirs_result;
+    int fd;
 
-    result = socks_store_cwd();
+    if (*verify == 0) {
+        fd = open_directory(parent_fd, name, 0);
 
-    if (result != 0) {
-        fprintf(stderr, "%s\n", strerror(errno));
+        if ((fd >= 0) || (errno != ENOENT)) {
+            return fd;
+        }
+
+        *verify = 1;
+    }
+
+    if (fstat(parent_fd, &parent) != 0) {
+        return -1;
+    }
+
+    result = mkdirat(parent_fd, name, mode);
+
+    if ((result != 0) && (errno != EEXIST)) {
         return result;
     }
 
-    mkdirs_result = socks_mkdirs_chdir(path, length, mode, uid, gid);
-    mkdirs_errno = errno;
+    if (result == 0) {
+        result = fchownat_noeintr(parent_fd, name, uid, gid,
+                                  AT_SYMLINK_NOFOLLOW);
+        if (result != 0) {
+            int prev_errno = errno;
+            unlinkat(parent_fd, name, AT_REMOVEDIR);
+            errno = prev_errno;
+            return result;
+        }
+    }
 
-    result = socks_restore_cwd();
+    fd = open_directory(parent_fd, name, O_NOFOLLOW);
 
-    if (result != 0) {
-        fprintf(stderr, "%s\n", strerror(errno));
+    if (fd < 0) {
+        return fd;
+    }
+
+    result = fstatat(fd, "..", &child, 0);
+
+    if ((result != 0) || (child.st_dev != parent.st_dev) ||
+        (child.st_ino != parent.st_ino)) {
+        int prev_errno = (result != 0) ? errno : ELOOP;
+        close_noeintr(fd);
+        errno = prev_errno;
+        return -1;
+    }
+
+    return fd;
+}
+
+/** @brief Walks the components in 'cursor' from the open directory 'current',
+ * creating them as needed. Takes ownership of 'current'. Returns the final
+ * directory's file descriptor, or -1 on error. */
+static int walk_components(int current, char *cursor, mode_t mode, uid_t uid,
+                           gid_t gid, int verify)
+{
+    while (current >= 0) {
+        const char *name;
+        int next;
+        int prev_errno;
+
+        while (*cursor == '/') {
+            cursor++;
+        }
+
+        if (*cursor == '\x00') {
+            break;
+        }
+
+        name = cursor;
+
+        while ((*cursor != '/') && (*cursor != '\x00')) {
+            cursor++;
+        }
+
+        if (*cursor == '/') {
+            *(cursor++) = '\x00';
+        }
+
+        if (strcmp(name, ".") == 0) {
+            continue;
+        }
+
+        if (strcmp(name, "..") == 0) {
+            next = open_directory(current, "..", 0);
+        } else {
+            next = enter_component(current, name, mode, uid, gid, &verify);
+        }
+
+        prev_errno = errno;
+        close_noeintr(current);
+        errno = prev_errno;
+        current = next;
+    }
+
+    return current;
+}
+
+int socks_mkdirs_open(int dir_fd, const char *path, unsigned int length,
+                      mode_t mode, uid_t uid, gid_t gid)
+{
+    char buffer[length + 1];
+    unsigned int bounds[length + 1];
+    unsigned int start = 0;
+    long count;
+    long found;
+    int current;
+
+    safe_strncpy(buffer, path, length);
+    length = (unsigned int) strlen(buffer);
+
+    // Usually the whole path exists already, and one open is enough.
+
+    if (length != 0) {
+        current = open_directory(dir_fd, buffer, 0);
+
+        if ((current >= 0) || (errno != ENOENT)) {
+            return current;
+        }
+    }
+
+    // Otherwise, the deepest existing prefix is found by bisection, and
+    // everything below it is created with verification. When only the last
+    // component is missing, that costs one extra stat.
+
+    count = find_bounds(buffer, length, bounds);
+    found = deepest_directory(dir_fd, buffer, bounds, count);
+
+    if (found < 0) {
+        current = open_directory(dir_fd, (buffer[0] == '/') ? "/" : ".", 0);
+    } else {
+        start = bounds[found];
+        buffer[start++] = '\x00';
+        current = open_directory(dir_fd, buffer, 0);
+    }
+
+    return walk_components(current, buffer + start, mode, uid, gid, 1);
+}
+
+int socks_mkdirs_at(int dir_fd, const char *path, unsigned int length,
+                    mode_t mode, uid_t uid, gid_t gid)
+{
+    int fd = socks_mkdirs_open(dir_fd, path, length, mode, uid, gid);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    return close_noeintr(fd);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Batch creation. Each path is first opened whole, as socks_mkdirs_open()
+ * does, with the paths split between the threads, and paths that exist
+ * already are done after that one open. The rest are sorted component-wise,
+ * which places every path that shares a prefix next to each other, so a
+ * prefix trie can be built by only ever comparing against the newest child of
+ * a node. Each trie node is then opened (and created if needed) exactly once,
+ * by a small pool of threads that pull ready nodes from a shared stack. As
+ * many threads are started as the trie has leaves, since a single root (as
+ * with absolute paths) usually fans out further down. A node's directory fd
+ * stays open until all of its children have been opened from it. */
+
+enum {
+    batch_threads_max = 64,
+    batch_probe_min = 64
+};
+
+struct mkdirs_node {
+    struct mkdirs_node *parent;
+    struct mkdirs_node **children;
+    size_t child_count;
+    size_t child_capacity;
+    unsigned int remaining;
+    int fd;
+    int verify;
+    int error;
+    char name[];
+};
+
+/* Stands in for the trie node of a path that already existed. */
+static struct mkdirs_node batch_existing;
+
+struct mkdirs_batch {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct mkdirs_node **stack;
+    size_t depth;
+    size_t pending;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+};
+
+/** @brief Orders two normalized paths component by component, by treating
+ * '/' as lower than every other character. */
+static int path_compare(const char *a, const char *b)
+{
+    int left;
+    int right;
+
+    while ((*a == *b) && (*a != '\x00')) {
+        a++;
+        b++;
+    }
+
+    left = (*a == '/') ? 1 : ((*a == '\x00') ? 0 : (unsigned char) *a + 1);
+    right = (*b == '/') ? 1 : ((*b == '\x00') ? 0 : (unsigned char) *b + 1);
+    return left - right;
+}
+
+struct mkdirs_path {
+    char *normalized;
+    size_t index;
+    size_t split;
+};
+
+static int sort_compare(const void *a, const void *b)
+{
+    const struct mkdirs_path *left = a;
+    const struct mkdirs_path *right = b;
+
+    return path_compare(left->normalized, right->normalized);
+}
+
+/** @brief Copies 'path' into 'output' without duplicate slashes or "."
+ * components. The leading slash of an absolute path is kept. */
+static void normalize_path(const char *path, char *output)
+{
+    const char *cursor = path;
+    char *start = output;
+
+    if (*cursor == '/') {
+        *(output++) = '/';
+        start = output;
+    }
+
+    while (*cursor != '\x00') {
+        const char *name;
+        size_t length;
+
+        while (*cursor == '/') {
+            cursor++;
+        }
+
+        name = cursor;
+
+        while ((*cursor != '/') && (*cursor != '\x00')) {
+            cursor++;
+        }
+
+        length = (size_t)(cursor - name);
+
+        if ((length == 0) || ((length == 1) && (name[0] == '.'))) {
+            continue;
+        }
+
+        if (output != start) {
+            *(output++) = '/';
+        }
+
+        memcpy(output, name, length);
+        output += length;
+    }
+
+    *output = '\x00';
+}
+
+static struct mkdirs_node *node_create(struct mkdirs_node *parent,
+                                       const char *name, size_t length)
+{
+    struct mkdirs_node *node = calloc(1, sizeof(*node) + length + 1);
+
+    if (node == NULL) {
+        return NULL;
+    }
+
+    memcpy(node->name, name, length);
+    node->parent = parent;
+    node->fd = -1;
+
+    if (parent == NULL) {
+        return node;
+    }
+
+    if (parent->child_count == parent->child_capacity) {
+        size_t capacity = (parent->child_capacity == 0) ? 4 :
+                          (parent->child_capacity * 2);
+        struct mkdirs_node **children;
+
+        children = realloc(parent->children, capacity * sizeof(*children));
+
+        if (children == NULL) {
+            free(node);
+            return NULL;
+        }
+
+        parent->children = children;
+        parent->child_capacity = capacity;
+    }
+
+    parent->children[parent->child_count++] = node;
+    return node;
+}
+
+static void node_destroy(struct mkdirs_node *node)
+{
+    if (node == NULL) {
+        return;
+    }
+
+    for (size_t x = 0; x < node->child_count; x++) {
+        node_destroy(node->children[x]);
+    }
+
+    if (node->fd >= 0) {
+        close_noeintr(node->fd);
+    }
+
+    free(node->children);
+    free(node);
+}
+
+/** @brief Adds a normalized path below 'root', reusing the newest child at
+ * each level when its name matches. The first 'split' characters, if any, are
+ * an existing directory, and become a single node whose children start out
+ * verified. Returns the node for the full path. */
+static struct mkdirs_node *node_insert(struct mkdirs_node *root,
+                                       const char *path, size_t split,
+                                       size_t *nodes)
+{
+    struct mkdirs_node *node = root;
+
+    while (*path != '\x00') {
+        const char *name = path;
+        struct mkdirs_node *newest = NULL;
+        size_t length;
+
+        if (split != 0) {
+            path += split;
+        }
+
+        while ((*path != '/') && (*path != '\x00')) {
+            path++;
+        }
+
+        length = (size_t)(path - name);
+
+        if (*path == '/') {
+            path++;
+        }
+
+        if (node->child_count != 0) {
+            newest = node->children[node->child_count - 1];
+        }
+
+        if ((newest != NULL) && (strlen(newest->name) == length) &&
+            (memcmp(newest->name, name, length) == 0)) {
+            node = newest;
+            split = 0;
+            continue;
+        }
+
+        node = node_create(node, name, length);
+
+        if (node == NULL) {
+            return NULL;
+        }
+
+        node->verify = (split != 0);
+        split = 0;
+        (*nodes)++;
+    }
+
+    return node;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Must be called with the batch locked. */
+static void batch_push_children(struct mkdirs_batch *batch,
+                                struct mkdirs_node *node)
+{
+    for (size_t x = node->child_count; x != 0; x--) {
+        batch->stack[batch->depth++] = node->children[x - 1];
+    }
+
+    batch->pending += node->child_count;
+
+    if (node->child_count != 0) {
+        pthread_cond_broadcast(&batch->ready);
+    }
+}
+
+/** @brief Marks one child of 'node' as finished with the parent's fd, and
+ * closes the fd once no children still need it. */
+static void node_release(struct mkdirs_node *node)
+{
+    if (__atomic_sub_fetch(&node->remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+        close_noeintr(node->fd);
+        node->fd = -1;
+    }
+}
+
+static void batch_visit(struct mkdirs_batch *batch, struct mkdirs_node *node)
+{
+    struct mkdirs_node *parent = node->parent;
+    int verify = parent->verify;
+    int fd;
+
+    if (strcmp(node->name, "..") == 0) {
+        fd = open_directory(parent->fd, "..", 0);
+    } else {
+        fd = enter_component(parent->fd, node->name, batch->mode, batch->uid,
+                             batch->gid, &verify);
+    }
+
+    if (fd < 0) {
+        node->error = errno;
+    } else {
+        node->verify |= verify;
+        node->remaining = (unsigned int) node->child_count;
+
+        if (node->child_count == 0) {
+            close_noeintr(fd);
+        } else {
+            node->fd = fd;
+        }
+    }
+
+    node_release(parent);
+
+    pthread_mutex_lock(&batch->lock);
+
+    if (fd >= 0) {
+        batch_push_children(batch, node);
+    }
+
+    if (--batch->pending == 0) {
+        pthread_cond_broadcast(&batch->ready);
+    }
+
+    pthread_mutex_unlock(&batch->lock);
+}
+
+static void *batch_worker(void *arg)
+{
+    struct mkdirs_batch *batch = arg;
+
+    pthread_mutex_lock(&batch->lock);
+
+    while (batch->pending != 0) {
+        struct mkdirs_node *node;
+
+        if (batch->depth == 0) {
+            pthread_cond_wait(&batch->ready, &batch->lock);
+            continue;
+        }
+
+        node = batch->stack[--batch->depth];
+        pthread_mutex_unlock(&batch->lock);
+        batch_visit(batch, node);
+        pthread_mutex_lock(&batch->lock);
     }
 
-    errno = mkdirs_errno;
-    return mkdirs_result;
+    pthread_mutex_unlock(&batch->lock);
+    return NULL;
+}
+
+/** @brief Returns the number of leaves below 'node', which bounds how many
+ * threads can ever have work at once. */
+static size_t node_leaves(const struct mkdirs_node *node)
+{
+    size_t leaves = (node->child_count == 0) ? 1 : 0;
+
+    for (size_t x = 0; x < node->child_count; x++) {
+        leaves += node_leaves(node->children[x]);
+    }
+
+    return leaves;
+}
+
+/** @brief Opens a root of the trie and creates everything below it. */
+static void batch_run(struct mkdirs_batch *batch, struct mkdirs_node *root,
+                      int dir_fd, unsigned int threads)
+{
+    pthread_t helpers[threads];
+    unsigned int started = 0;
+    size_t leaves;
+
+    root->fd = open_directory(dir_fd, (root->name[0] == '/') ? "/" : ".", 0);
+
+    if (root->fd < 0) {
+        root->error = errno;
+        return;
+    }
+
+    root->remaining = (unsigned int) root->child_count;
+
+    if (root->child_count == 0) {
+        close_noeintr(root->fd);
+        root->fd = -1;
+        return;
+    }
+
+    batch->depth = 0;
+    batch->pending = 0;
+    batch_push_children(batch, root);
+    leaves = node_leaves(root);
+
+    while ((started + 1 < threads) && (started + 1 < leaves)) {
+        if (pthread_create(&helpers[started], NULL, batch_worker, batch) != 0) {
+            break;
+        }
+        started++;
+    }
+
+    batch_worker(batch);
+
+    for (unsigned int x = 0; x < started; x++) {
+        pthread_join(helpers[x], NULL);
+    }
+}
+
+/** @brief Returns the error that stopped a path from being created, or 0. */
+static int node_error(const struct mkdirs_node *node)
+{
+    int error = 0;
+
+    while (node != NULL) {
+        if (node->error != 0) {
+            error = node->error;
+        }
+        node = node->parent;
+    }
+
+    return error;
+}
+
+/** @brief Finds the deepest existing directory above the normalized 'path',
+ * the same way socks_mkdirs_open() does. Returns its length, not counting an
+ * absolute path's leading slash, or 0 if there is none. */
+static size_t batch_split(int dir_fd, char *path)
+{
+    size_t length = strlen(path);
+    unsigned int bounds[length + 1];
+    long count = find_bounds(path, length, bounds);
+    long found = deepest_directory(dir_fd, path, bounds, count);
+
+    if (found < 0) {
+        return 0;
+    }
+
+    return bounds[found] - ((path[0] == '/') ? 1 : 0);
+}
+
+struct mkdirs_probe {
+    int dir_fd;
+    const char *const *paths;
+    struct mkdirs_path *sorted;
+    struct mkdirs_node **ends;
+    size_t first;
+    size_t last;
+    int failed;
+};
+
+/** @brief Normalizes a slice of the paths into 'sorted', at their own
+ * indexes. Usually the whole path exists already, and one open is enough.
+ * Otherwise, the existing part is found by bisection, to join the trie as a
+ * single node. */
+static void *probe_slice(void *arg)
+{
+    struct mkdirs_probe *probe = arg;
+
+    for (size_t x = probe->first; x < probe->last; x++) {
+        struct mkdirs_path *entry = &probe->sorted[x];
+        size_t length = strnlen(probe->paths[x], PATH_MAX + 1);
+        int fd;
+
+        if (length > PATH_MAX) {
+            continue;
+        }
+
+        entry->normalized = malloc(length + 1);
+
+        if (entry->normalized == NULL) {
+            probe->failed = 1;
+            continue;
+        }
+
+        normalize_path(probe->paths[x], entry->normalized);
+
+        if (entry->normalized[0] == '\x00') {
+            continue;
+        }
+
+        fd = open_directory(probe->dir_fd, entry->normalized, 0);
+
+        if (fd >= 0) {
+            close_noeintr(fd);
+            probe->ends[x] = &batch_existing;
+        } else if (errno == ENOENT) {
+            entry->split = batch_split(probe->dir_fd, entry->normalized);
+        }
+    }
+
+    return NULL;
+}
+
+/** @brief Runs probe_slice() over all the paths, split between up to
+ * 'threads' threads. Returns 0, or -1 if memory ran out. */
+static int batch_probe(int dir_fd, const char *const *paths, size_t count,
+                       struct mkdirs_path *sorted, struct mkdirs_node **ends,
+                       unsigned int threads)
+{
+    struct mkdirs_probe probes[threads];
+    pthread_t helpers[threads];
+    unsigned int started = 0;
+    int failed = 0;
+
+    if (threads > (count / batch_probe_min) + 1) {
+        threads = (unsigned int)(count / batch_probe_min) + 1;
+    }
+
+    for (unsigned int x = 0; x < threads; x++) {
+        probes[x].dir_fd = dir_fd;
+        probes[x].paths = paths;
+        probes[x].sorted = sorted;
+        probes[x].ends = ends;
+        probes[x].first = (count * x) / threads;
+        probes[x].last = (count * (x + 1)) / threads;
+        probes[x].failed = 0;
+    }
+
+    while (started + 1 < threads) {
+        if (pthread_create(&helpers[started], NULL, probe_slice,
+                           &probes[started + 1]) != 0) {
+            break;
+        }
+        started++;
+    }
+
+    // Slices whose thread couldn't be started are run here instead.
+
+    probe_slice(&probes[0]);
+
+    for (unsigned int x = started + 1; x < threads; x++) {
+        probe_slice(&probes[x]);
+    }
+
+    for (unsigned int x = 0; x < started; x++) {
+        pthread_join(helpers[x], NULL);
+    }
+
+    for (unsigned int x = 0; x < threads; x++) {
+        failed |= probes[x].failed;
+    }
+
+    return (failed != 0) ? -1 : 0;
+}
+
+/** @brief Normalizes and sorts the paths, and builds the trie for them.
+ * 'ends' receives the node for each path, batch_existing for paths that
+ * could be opened already, or is left NULL for paths longer than PATH_MAX,
+ * which are left out. Returns the number of directory nodes, or -1 if memory
+ * ran out. */
+static long batch_build(int dir_fd, const char *const *paths, size_t count,
+                        struct mkdirs_path *sorted, struct mkdirs_node **ends,
+                        struct mkdirs_node **roots, int *used,
+                        unsigned int threads)
+{
+    long nodes = 0;
+    size_t valid = 0;
+
+    if (batch_probe(dir_fd, paths, count, sorted, ends, threads) != 0) {
+        return -1;
+    }
+
+    // Only the paths that still need the trie are kept, at the front.
+
+    for (size_t x = 0; x < count; x++) {
+        if ((sorted[x].normalized == NULL) || (ends[x] != NULL)) {
+            free(sorted[x].normalized);
+            sorted[x].normalized = NULL;
+            continue;
+        }
+
+        sorted[valid].normalized = sorted[x].normalized;
+        sorted[valid].split = sorted[x].split;
+        sorted[valid++].index = x;
+
+        if (valid - 1 != x) {
+            sorted[x].normalized = NULL;
+        }
+    }
+
+    qsort(sorted, valid, sizeof(*sorted), sort_compare);
+
+    for (size_t x = 0; x < valid; x++) {
+        const char *path = sorted[x].normalized;
+        int relative = (path[0] != '/');
+        size_t added = 0;
+
+        used[relative] = 1;
+        ends[sorted[x].index] = node_insert(roots[relative],
+                                            path + (1 - relative),
+                                            sorted[x].split, &added);
+
+        if (ends[sorted[x].index] == NULL) {
+            return -1;
+        }
+
+        nodes += (long) added;
+    }
+
+    return nodes;
+}
+
+/** @brief Creates everything in the trie, and collects each path's result.
+ * Returns the first path's error, or 0. */
+static int batch_create(int dir_fd, size_t count, long nodes,
+                        struct mkdirs_node **ends, struct mkdirs_node **roots,
+                        const int *used, mode_t mode, uid_t uid, gid_t gid,
+                        unsigned int threads, int *errors)
+{
+    struct mkdirs_batch batch;
+    int first_error = 0;
+
+    batch.stack = malloc(((size_t) nodes + 1) * sizeof(*batch.stack));
+
+    if (batch.stack == NULL) {
+        for (size_t x = 0; (errors != NULL) && (x < count); x++) {
+            errors[x] = ENOMEM;
+        }
+
+        return ENOMEM;
+    }
+
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.ready, NULL);
+    batch.mode = mode;
+    batch.uid = uid;
+    batch.gid = gid;
+
+    for (int x = 0; x < 2; x++) {
+        if (used[x] != 0) {
+            batch_run(&batch, roots[x], dir_fd, threads);
+        }
+    }
+
+    pthread_cond_destroy(&batch.ready);
+    pthread_mutex_destroy(&batch.lock);
+    free(batch.stack);
+
+    for (size_t x = 0; x < count; x++) {
+        int error = (ends[x] == NULL) ? ENAMETOOLONG : node_error(ends[x]);
+
+        if (errors != NULL) {
+            errors[x] = error;
+        }
+
+        if ((error != 0) && (first_error == 0)) {
+            first_error = error;
+        }
+    }
+
+    return first_error;
+}
+
+int socks_mkdirs_batch(int dir_fd, const char *const *paths, size_t count,
+                       mode_t mode, uid_t uid, gid_t gid, unsigned int threads,
+                       int *errors)
+{
+    struct mkdirs_node *roots[2];
+    struct mkdirs_node **ends;
+    struct mkdirs_path *sorted;
+    int used[2] = {0, 0};
+    long nodes = -1;
+    int first_error = ENOMEM;
+
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (online > 0) ? (unsigned int) online : 1;
+    }
+
+    if (threads > batch_threads_max) {
+        threads = batch_threads_max;
+    }
+
+    sorted = calloc(count + 1, sizeof(*sorted));
+    ends = calloc(count + 1, sizeof(*ends));
+    roots[0] = node_create(NULL, "/", 1);
+    roots[1] = node_create(NULL, ".", 1);
+
+    if ((sorted != NULL) && (ends != NULL) && (roots[0] != NULL) &&
+        (roots[1] != NULL)) {
+        nodes = batch_build(dir_fd, paths, count, sorted, ends, roots, used,
+                            threads);
+    }
+
+    if (nodes >= 0) {
+        first_error = batch_create(dir_fd, count, nodes, ends, roots, used,
+                                   mode, uid, gid, threads, errors);
+    } else if (errors != NULL) {
+        for (size_t x = 0; x < count; x++) {
+            errors[x] = ENOMEM;
+        }
+    }
+
+    for (size_t x = 0; (sorted != NULL) && (x < count); x++) {
+        free(sorted[x].normalized);
+    }
+
+    node_destroy(roots[0]);
+    node_destroy(roots[1]);
+    free(ends);
+    free(sorted);
+
+    if (first_error != 0) {
+        errno = first_error;
+        return -1;
+    }
+
+    return 0;
 }
@@ -3,10 +3,16 @@
 
 #define _POSIX_C_SOURCE 200809L
 
+#include <fcntl.h>
+#include <stddef.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /** @brief Creates a directory (if needed) along with any required parent
  * directories. Jumps into the target directory on completion.
  *
@@ -25,8 +31,9 @@ int socks_mkdirs_chdir(const char *path, unsigned int length, mode_t mode,
                        uid_t uid, gid_t gid);
 
 /** @brief Creates a directory (if needed) along with any required parent
- * directories, similar to mkdirs_chdir. Returns to the original directory on
- * completion.
+ * directories, similar to mkdirs_chdir. Same as socks_mkdirs_at() relative to
+ * the current directory, so it never changes the working directory and is
+ * safe to call from several threads at once.
  *
  * @param[in] path Path to create (if needed) and enter.
  * @param[in] length Length of the input path string.
@@ -42,6 +49,60 @@ int socks_mkdirs_chdir(const char *path, unsigned int length, mode_t mode,
 int socks_mkdirs(const char *path, unsigned int length, mode_t mode, uid_t uid,
                  gid_t gid);
 
+/** @brief Creates a directory (if needed) along with any required parent
+ * directories, walking from a directory file descriptor with openat() and
+ * mkdirat() instead of changing the working directory. Thread-safe. Existing
+ * leading components are followed (symlinks included); every directory below
+ * the first missing one is opened without following symlinks, and its parent
+ * inode is verified, so it can't be redirected by a symlink race.
+ *
+ * @param[in] dir_fd Directory that relative paths start from, or AT_FDCWD.
+ * Ignored for absolute paths.
+ * @param[in] path Path to create (if needed).
+ * @param[in] length Length of the input path string.
+ * @param[in] mode Access mode to set for newly-created directories.
+ * @param[in] uid Owner's UID to set for newly-created directories, or -1.
+ * @param[in] gid Owner's GID to set for newly-created directories, or -1.
+ * @return Exit code of function.
+ * @retval 0 Operation completed successfully.
+ * @retval other An error occurred, and errno was set accordingly. ELOOP means
+ * that a new directory failed the parent inode check. */
+int socks_mkdirs_at(int dir_fd, const char *path, unsigned int length,
+                    mode_t mode, uid_t uid, gid_t gid);
+
+/** @brief Same as socks_mkdirs_at(), but returns an open file descriptor for
+ * the target directory (O_DIRECTORY, O_CLOEXEC) instead of closing it, for use
+ * with further *at() calls. The caller must close it.
+ * @return File descriptor of the target directory, or -1 in the event of an
+ * error (in which case errno was set accordingly). */
+int socks_mkdirs_open(int dir_fd, const char *path, unsigned int length,
+                      mode_t mode, uid_t uid, gid_t gid);
+
+/** @brief Creates many directory paths at once, as if by socks_mkdirs_at() on
+ * each. A path that exists already costs a single open. The others are merged
+ * into a prefix tree, so every shared ancestor is opened (and created, if
+ * needed) only once, and independent subtrees are created in parallel by a
+ * pool of threads.
+ *
+ * @param[in] dir_fd Directory that relative paths start from, or AT_FDCWD.
+ * @param[in] paths Array of NUL-terminated paths to create.
+ * @param[in] count Number of paths.
+ * @param[in] mode Access mode to set for newly-created directories.
+ * @param[in] uid Owner's UID to set for newly-created directories, or -1.
+ * @param[in] gid Owner's GID to set for newly-created directories, or -1.
+ * @param[in] threads Number of threads to use (including the caller), or 0 to
+ * use one per online CPU. At most 64 are used.
+ * @param[out] errors If not NULL, an array of 'count' entries that receives
+ * 0 for each path that was created, or the errno value that stopped it.
+ * Paths longer than PATH_MAX aren't attempted, and get ENAMETOOLONG.
+ * @return Exit code of function.
+ * @retval 0 Every path was created successfully.
+ * @retval -1 At least one path failed, and errno was set to the first
+ * failing path's error. */
+int socks_mkdirs_batch(int dir_fd, const char *const *paths, size_t count,
+                       mode_t mode, uid_t uid, gid_t gid, unsigned int threads,
+                       int *errors);
+
 /** @brief Stores the current working directory in a one-deep FIFO, for later
  * retrieval with socks_restore_cwd(). Intended to be used before a call to
  * socks_mkdirs_chdir().
@@ -57,4 +118,8 @@ int socks_store_cwd(void);
  * @retval -1 An error occurred. */
 int socks_restore_cwd(void);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,55 @@
+#ifndef LIBSOCKS_DIRS_STATS_H
+#define LIBSOCKS_DIRS_STATS_H
+
+/* Counts the filesystem calls made by the directory code. Only included when
+ * built with -DSOCKS_DIRS_STATS (as the benchmark and test_chdir are), the
+ * same way libsocks_debug.h is with VERBOSE_DEBUG. */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "eintr_wrappers.h"
+
+enum socks_dirs_op {
+    SOCKS_DIRS_STAT = 0,
+    SOCKS_DIRS_OPEN,
+    SOCKS_DIRS_MKDIR,
+    SOCKS_DIRS_CHDIR,
+    SOCKS_DIRS_CHOWN,
+    SOCKS_DIRS_OP_COUNT
+};
+
+/** @brief Number of calls made so far, per operation. Defined in
+ * libsocks_dirs.c. */
+extern unsigned long socks_dirs_counters[SOCKS_DIRS_OP_COUNT];
+
+__attribute__ ((unused)) static int socks_dirs_count(enum socks_dirs_op op)
+{
+    __atomic_fetch_add(&socks_dirs_counters[op], 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+#define fstat(fd, buf) \
+    (socks_dirs_count(SOCKS_DIRS_STAT) + fstat(fd, buf))
+#define fstatat(fd, path, buf, flag) \
+    (socks_dirs_count(SOCKS_DIRS_STAT) + fstatat(fd, path, buf, flag))
+#define openat(fd, path, ...) \
+    (socks_dirs_count(SOCKS_DIRS_OPEN) + openat(fd, path, __VA_ARGS__))
+#define opendir(path) \
+    (socks_dirs_count(SOCKS_DIRS_OPEN), opendir(path))
+#define mkdir(path, mode) \
+    (socks_dirs_count(SOCKS_DIRS_MKDIR) + mkdir(path, mode))
+#define mkdirat(fd, path, mode) \
+    (socks_dirs_count(SOCKS_DIRS_MKDIR) + mkdirat(fd, path, mode))
+#define chdir(path) \
+    (socks_dirs_count(SOCKS_DIRS_CHDIR) + chdir(path))
+#define fchdir_noeintr(fd) \
+    (socks_dirs_count(SOCKS_DIRS_CHDIR) + fchdir_noeintr(fd))
+#define chown_noeintr(path, uid, gid) \
+    (socks_dirs_count(SOCKS_DIRS_CHOWN) + chown_noeintr(path, uid, gid))
+#define fchownat_noeintr(fd, path, uid, gid, flag) \
+    (socks_dirs_count(SOCKS_DIRS_CHOWN) + \
+     fchownat_noeintr(fd, path, uid, gid, flag))
+
+#endif
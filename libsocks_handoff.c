@@ -0,0 +1,222 @@
+#define _POSIX_C_SOURCE 200809L
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "eintr_wrappers.h"
+#include "libsocks_handoff.h"
+#include "libsocks_pvt.h"
+
+/*----------------------------------------------------------------------------*/
+
+/* The exchange is two packets on a connection to the control socket: the
+ * old process sends handoff_offer carrying the listening fd, and the new one
+ * answers handoff_ack once it holds the fd. */
+
+static const char handoff_offer = 'H';
+static const char handoff_ack = 'A';
+
+/* The received fd is marked close-on-exec as it arrives where the platform
+ * allows it, so a concurrent fork() and exec() can't inherit it. Elsewhere
+ * it's marked right after. */
+
+#ifdef MSG_CMSG_CLOEXEC
+static const int recv_flags = MSG_CMSG_CLOEXEC;
+#else
+static const int recv_flags = 0;
+#endif
+
+/** @brief Waits up to 'timeout_ms' for 'fd' to become readable. Returns 0 if
+ * it did, and -1 (with errno set to ETIMEDOUT on a timeout) otherwise. */
+static int wait_readable(int fd, unsigned int timeout_ms)
+{
+    struct pollfd pollfd = {.fd = fd, .events = POLLIN, .revents = 0};
+    int result;
+
+    do {
+        result = poll(&pollfd, 1, (int) timeout_ms);
+    } while ((result < 0) && (errno == EINTR));
+
+    if (result == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    return (result < 0) ? -1 : 0;
+}
+
+/** @brief Checks that the process at the other end of 'connection_fd' runs
+ * as the same user as this one, so that the control socket's permissions
+ * aren't all that stands between the listening socket and another user.
+ * Returns 1 if it does, and 0 (with errno set to EACCES if it doesn't, or to
+ * the reason the credentials couldn't be read) otherwise. */
+static int peer_trusted(int connection_fd)
+{
+    struct socks_peer peer;
+
+    if (socks_peer_fetch(connection_fd, &peer) != 0) {
+        return 0;
+    }
+
+    if (peer.uid != geteuid()) {
+        errno = EACCES;
+        return 0;
+    }
+
+    return 1;
+}
+
+/*----------------------------------------------------------------------------*/
+
+int socks_handoff_send(int control_fd, int socket_fd, unsigned int timeout_ms)
+{
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = {.iov_base = (void *) &handoff_offer, .iov_len = 1};
+    struct msghdr message;
+    struct cmsghdr *cmsg;
+    ssize_t result;
+    char ack = 0;
+    int connection_fd;
+
+    connection_fd = accept_noeintr(control_fd, NULL, NULL);
+
+    if (connection_fd < 0) {
+        return -1;
+    }
+
+    if (!peer_trusted(connection_fd)) {
+        int prev_errno = errno;
+        close_noeintr(connection_fd);
+        errno = prev_errno;
+        return -1;
+    }
+
+    memset(&message, 0, sizeof(message));
+    memset(&control, 0, sizeof(control));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &socket_fd, sizeof(int));
+
+    do {
+        result = sendmsg(connection_fd, &message, MSG_NOSIGNAL);
+    } while ((result < 0) && (errno == EINTR));
+
+    if ((result >= 0) && (wait_readable(connection_fd, timeout_ms) == 0)) {
+        result = read_noeintr(connection_fd, &ack, 1);
+
+        if ((result >= 0) && (ack != handoff_ack)) {
+            errno = ECONNABORTED;
+            result = -1;
+        }
+    } else {
+        result = -1;
+    }
+
+    if (result < 0) {
+        int prev_errno = errno;
+        close_noeintr(connection_fd);
+        errno = prev_errno;
+        return -1;
+    }
+
+    close_noeintr(connection_fd);
+    return 0;
+}
+
+int socks_handoff_receive(const char *control_path, unsigned int timeout_ms)
+{
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    char offer = 0;
+    struct iovec iov = {.iov_base = &offer, .iov_len = 1};
+    struct msghdr message;
+    struct cmsghdr *cmsg;
+    ssize_t result;
+    int connection_fd;
+    int socket_fd = -1;
+
+    connection_fd = socks_client_connect(control_path);
+
+    if (connection_fd < 0) {
+        return -1;
+    }
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    result = wait_readable(connection_fd, timeout_ms);
+
+    if (result == 0) {
+        do {
+            result = recvmsg(connection_fd, &message, recv_flags);
+        } while ((result < 0) && (errno == EINTR));
+    }
+
+    cmsg = (result > 0) ? CMSG_FIRSTHDR(&message) : NULL;
+
+    if ((cmsg != NULL) && (cmsg->cmsg_level == SOL_SOCKET) &&
+        (cmsg->cmsg_type == SCM_RIGHTS) &&
+        (cmsg->cmsg_len == CMSG_LEN(sizeof(int)))) {
+        memcpy(&socket_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if ((recv_flags == 0) && (socket_fd >= 0) &&
+        (fcntl(socket_fd, F_SETFD, FD_CLOEXEC) != 0)) {
+        result = -1;
+    }
+
+    if (result == 0) {
+        errno = ECONNABORTED;
+        result = -1;
+    } else if ((result > 0) &&
+               ((socket_fd < 0) || (offer != handoff_offer))) {
+        errno = EPROTO;
+        result = -1;
+    }
+
+    if ((result > 0) && (socks_listener_check(socket_fd) != 0)) {
+        result = -1;
+    }
+
+    if ((result > 0) && (write_noeintr(connection_fd, &handoff_ack, 1) != 1)) {
+        result = -1;
+    }
+
+    if (result < 0) {
+        int prev_errno = errno;
+
+        if (socket_fd >= 0) {
+            close_noeintr(socket_fd);
+        }
+
+        close_noeintr(connection_fd);
+        errno = prev_errno;
+        return -1;
+    }
+
+    close_noeintr(connection_fd);
+    return socket_fd;
+}
@@ -0,0 +1,49 @@
+#ifndef LIBSOCKS_HANDOFF_H
+#define LIBSOCKS_HANDOFF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Hot restart. A running server listens on a control socket (an ordinary
+ * libsocks server socket, opened with socks_server_open()) next to its main
+ * one. A replacement process calls socks_handoff_receive() on the control
+ * socket and gets a duplicate of the running server's listening socket, so
+ * the socketfile is never unlinked or rebound and no connection attempt
+ * fails. Connections that arrive during the switch wait in the shared
+ * backlog.
+ *
+ * Once socks_handoff_send() succeeds, the old process must stop accepting,
+ * finish the requests it already has (socks_pool_drain() for pools), close
+ * its copy of the socket with socks_server_close(), and exit. */
+
+/** @brief Hands a listening socket to a replacement process. Should be called
+ * only when a replacement is waiting, as determined by socks_server_wait() or
+ * socks_server_poll() on 'control_fd'. The socket is only sent to a process
+ * running as the same user as this one (by its SO_PEERCRED credentials);
+ * anyone else is disconnected and this fails with EACCES.
+ * @param[in] control_fd File descriptor of the open control socket.
+ * @param[in] socket_fd Listening socket to hand over.
+ * @param[in] timeout_ms How long to wait for the replacement to acknowledge
+ * the socket.
+ * @return Exit status of function.
+ * @retval 0 The replacement has the socket, so the caller should stop
+ * accepting and drain.
+ * @retval -1 The handoff failed, and errno was set accordingly. The caller
+ * still owns the socket and should keep serving. */
+int socks_handoff_send(int control_fd, int socket_fd, unsigned int timeout_ms);
+
+/** @brief Takes over the listening socket of the server running behind a
+ * control socket. If no server is running, this fails with ENOENT or
+ * ECONNREFUSED, and the caller can fall back to socks_server_open().
+ * @param[in] control_path Filename of the running server's control socket.
+ * @param[in] timeout_ms How long to wait for the running server to respond.
+ * @return File descriptor of the listening socket, or -1 in the event of an
+ * error (in which case errno was set accordingly). */
+int socks_handoff_receive(const char *control_path, unsigned int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,336 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "eintr_wrappers.h"
+#include "libsocks_log.h"
+#include "libsocks_pvt.h"
+
+/*----------------------------------------------------------------------------*/
+
+enum {
+    /* Number of messages the ring holds. A power of two. */
+    log_slots = 256,
+
+    /* Longest message kept, including its newline. */
+    log_message_max = 256
+};
+
+/* Whether the drain thread is running in this process. */
+enum drain_state {
+    drain_stopped = 0,
+    drain_running,
+    drain_failed  /* Couldn't start; messages are written as they come. */
+};
+
+/* The ring is a bounded queue in which each slot's sequence number says
+ * whose turn it is: a slot at position 'pos' can be filled when its sequence
+ * is 'pos', and read when it's 'pos + 1'. Producers claim positions by
+ * advancing 'log_head' with compare-and-swap, so they never wait for each
+ * other; the one consumer at a time (the drain thread, or a flush) holds
+ * 'drain_lock'. The drain thread sleeps on 'wake_cond' while the ring is
+ * empty, and the producer that fills the slot at 'log_tail' wakes it. */
+struct log_slot {
+    unsigned long sequence;
+    size_t length;
+    char message[log_message_max];
+};
+
+static struct log_slot log_ring[log_slots];
+static unsigned long log_head = 0;
+static unsigned long log_tail = 0;
+
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static int drain_state = drain_stopped;
+
+static int log_level = SOCKS_LOG_WARN;
+static socks_log_hook_t log_hook = NULL;
+static void *log_context = NULL;
+static struct socks_log_stats log_stats = {0, 0, 0};
+
+/*----------------------------------------------------------------------------*/
+
+/** @brief Returns whether the slot at 'log_tail' is ready to be written.
+ * Sequentially consistent, with the tail and sequence updates it pairs with,
+ * so that the drain thread can't go to sleep on a slot whose producer saw a
+ * different tail and didn't wake it. */
+static int log_ready(void)
+{
+    unsigned long tail = __atomic_load_n(&log_tail, __ATOMIC_SEQ_CST);
+
+    return __atomic_load_n(&log_ring[tail % log_slots].sequence,
+                           __ATOMIC_SEQ_CST) == tail + 1;
+}
+
+/** @brief Writes everything waiting in the ring to stderr. The caller holds
+ * 'drain_lock'. */
+static void log_drain(void)
+{
+    while (log_ready()) {
+        unsigned long tail = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+        struct log_slot *slot = &log_ring[tail % log_slots];
+
+        write_noeintr(STDERR_FILENO, slot->message, slot->length);
+        __atomic_store_n(&slot->sequence, tail + log_slots, __ATOMIC_RELEASE);
+        __atomic_store_n(&log_tail, tail + 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void *log_drain_thread(void *arg)
+{
+    (void) arg;
+
+    while (1) {
+        pthread_mutex_lock(&drain_lock);
+        log_drain();
+        pthread_mutex_unlock(&drain_lock);
+
+        pthread_mutex_lock(&wake_lock);
+
+        while (!log_ready()) {
+            pthread_cond_wait(&wake_cond, &wake_lock);
+        }
+
+        pthread_mutex_unlock(&wake_lock);
+    }
+
+    return NULL;
+}
+
+/** @brief Starts the drain thread, if it isn't running in this process. It
+ * runs with all signals blocked, so that it never handles the embedder's.
+ * If it can't be started, it isn't tried again, and messages are written
+ * synchronously instead. Returns the resulting state. */
+static int log_drain_start(void)
+{
+    sigset_t all;
+    sigset_t previous;
+    pthread_t thread;
+    int state = __atomic_load_n(&drain_state, __ATOMIC_ACQUIRE);
+
+    if (state != drain_stopped) {
+        return state;
+    }
+
+    pthread_mutex_lock(&drain_lock);
+
+    if (drain_state == drain_stopped) {
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &previous);
+
+        if (pthread_create(&thread, NULL, log_drain_thread, NULL) == 0) {
+            pthread_detach(thread);
+            __atomic_store_n(&drain_state, drain_running, __ATOMIC_RELEASE);
+        } else {
+            __atomic_store_n(&drain_state, drain_failed, __ATOMIC_RELEASE);
+        }
+
+        pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    }
+
+    state = drain_state;
+    pthread_mutex_unlock(&drain_lock);
+    return state;
+}
+
+/** @brief The drain thread doesn't survive fork(), so the child starts its
+ * own when it first logs. Whatever the parent had queued is the parent's to
+ * write, so the child starts with an empty ring. */
+static void log_atfork_child(void)
+{
+    pthread_mutex_init(&drain_lock, NULL);
+    pthread_mutex_init(&wake_lock, NULL);
+    pthread_cond_init(&wake_cond, NULL);
+    drain_state = drain_stopped;
+
+    for (unsigned long x = 0; x < log_slots; x++) {
+        log_ring[x].sequence = x;
+    }
+
+    log_head = 0;
+    log_tail = 0;
+}
+
+static void log_init(void)
+{
+    for (unsigned long x = 0; x < log_slots; x++) {
+        log_ring[x].sequence = x;
+    }
+
+    pthread_atfork(NULL, NULL, log_atfork_child);
+    atexit(socks_log_flush);
+}
+
+/** @brief Copies a formatted message into the ring. Returns 0, or -1 if the
+ * ring is full. */
+static int log_enqueue(const char *message, size_t length)
+{
+    unsigned long pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+    struct log_slot *slot;
+
+    while (1) {
+        unsigned long sequence;
+
+        slot = &log_ring[pos % log_slots];
+        sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+        if (sequence == pos) {
+            if (__atomic_compare_exchange_n(&log_head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if ((long)(sequence - pos) < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy(slot->message, message, length);
+    slot->length = length;
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_SEQ_CST);
+
+    /* Only the ring's first waiting message wakes the drain thread. */
+    if (__atomic_load_n(&log_tail, __ATOMIC_SEQ_CST) == pos) {
+        pthread_mutex_lock(&wake_lock);
+        pthread_cond_signal(&wake_cond);
+        pthread_mutex_unlock(&wake_lock);
+    }
+
+    return 0;
+}
+
+/** @brief Counts a message against its site's burst for this second.
+ * Returns -1 if it's over the burst, and otherwise the number suppressed
+ * since the site last got a message through. */
+static long log_site_admit(struct socks_log_site *site)
+{
+    struct timespec now;
+    unsigned long second;
+    unsigned long window;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    second = (unsigned long) now.tv_sec + 1;
+    window = __atomic_load_n(&site->window, __ATOMIC_RELAXED);
+
+    if ((window != second) &&
+        __atomic_compare_exchange_n(&site->window, &window, second, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+    }
+
+    if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) >
+        SOCKS_LOG_BURST) {
+        __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&log_stats.suppressed, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    return (long) __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+}
+
+/*----------------------------------------------------------------------------*/
+
+void socks_log_write(struct socks_log_site *site, enum socks_log_level level,
+                     const char *format, ...)
+{
+    int prev_errno = errno;
+    char message[log_message_max];
+    socks_log_hook_t hook;
+    va_list args;
+    long suppressed;
+    int length;
+
+    if ((int) level > __atomic_load_n(&log_level, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    suppressed = log_site_admit(site);
+
+    if (suppressed < 0) {
+        errno = prev_errno;
+        return;
+    }
+
+    va_start(args, format);
+    length = vsnprintf(message, sizeof(message) - 1, format, args);
+    va_end(args);
+
+    if ((length >= 0) && (suppressed > 0) &&
+        ((size_t) length < sizeof(message) - 1)) {
+        length += snprintf(message + length, sizeof(message) - 1 -
+                           (size_t) length, " (%ld similar suppressed)",
+                           suppressed);
+    }
+
+    if (length < 0) {
+        errno = prev_errno;
+        return;
+    }
+
+    if ((size_t) length > sizeof(message) - 2) {
+        length = (int)(sizeof(message) - 2);
+    }
+
+    hook = __atomic_load_n(&log_hook, __ATOMIC_ACQUIRE);
+
+    if (hook != NULL) {
+        hook(log_context, level, message);
+        __atomic_add_fetch(&log_stats.logged, 1, __ATOMIC_RELAXED);
+        errno = prev_errno;
+        return;
+    }
+
+    message[length++] = '\n';
+    pthread_once(&log_once, log_init);
+
+    if (log_enqueue(message, (size_t) length) == 0) {
+        __atomic_add_fetch(&log_stats.logged, 1, __ATOMIC_RELAXED);
+
+        if (log_drain_start() == drain_failed) {
+            socks_log_flush();
+        }
+    } else {
+        __atomic_add_fetch(&log_stats.dropped, 1, __ATOMIC_RELAXED);
+    }
+
+    errno = prev_errno;
+}
+
+void socks_log_set_level(enum socks_log_level level)
+{
+    __atomic_store_n(&log_level, (int) level, __ATOMIC_RELAXED);
+}
+
+void socks_log_set_hook(socks_log_hook_t hook, void *context)
+{
+    log_context = context;
+    __atomic_store_n(&log_hook, hook, __ATOMIC_RELEASE);
+}
+
+void socks_log_flush(void)
+{
+    pthread_mutex_lock(&drain_lock);
+    log_drain();
+    pthread_mutex_unlock(&drain_lock);
+}
+
+void socks_log_get_stats(struct socks_log_stats *stats)
+{
+    stats->logged = __atomic_load_n(&log_stats.logged, __ATOMIC_RELAXED);
+    stats->suppressed = __atomic_load_n(&log_stats.suppressed,
+                                        __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&log_stats.dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,69 @@
+#ifndef LIBSOCKS_LOG_H
+#define LIBSOCKS_LOG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Diagnostics from libsocks. By default, messages are copied into a
+ * lock-free ring, and a background thread writes them to stderr, so a
+ * thread reporting an error never waits on stderr or on other threads.
+ * Each place that logs is limited to a burst of messages per second; the
+ * rest are counted and summed up in the next message from that place. The
+ * ring holds a fixed number of messages, and any beyond that are dropped.
+ * Embedders can filter messages by level, or send them elsewhere with a
+ * hook. */
+
+/** @brief Message levels, from most to least severe. */
+enum socks_log_level {
+    SOCKS_LOG_OFF = 0,
+    SOCKS_LOG_ERROR = 1,
+    SOCKS_LOG_WARN = 2,
+    SOCKS_LOG_INFO = 3,
+    SOCKS_LOG_DEBUG = 4
+};
+
+/** @brief Most messages any one place logs per second. */
+#define SOCKS_LOG_BURST 10
+
+/** @brief Receives log messages in place of the default logger. Called on
+ * the thread that logged the message, so it mustn't block for long.
+ * @param[in] context Context given to socks_log_set_hook().
+ * @param[in] level Level of the message.
+ * @param[in] message The message, NUL-terminated, without a newline. Only
+ * valid until the hook returns. */
+typedef void (*socks_log_hook_t)(void *context, enum socks_log_level level,
+                                 const char *message);
+
+/** @brief Counts of what's happened to log messages in this process. */
+struct socks_log_stats {
+    unsigned long logged;
+    unsigned long suppressed;
+    unsigned long dropped;
+};
+
+/** @brief Sets the most verbose level of message that's logged. Defaults to
+ * SOCKS_LOG_WARN. SOCKS_LOG_OFF silences libsocks. Safe to call at any
+ * time. */
+void socks_log_set_level(enum socks_log_level level);
+
+/** @brief Sends log messages to 'hook' instead of the default logger. Set
+ * the hook before other threads use libsocks, since a message logged while
+ * it changes may reach either hook with either context.
+ * @param[in] hook Hook to call, or NULL to go back to the default logger.
+ * @param[in] context Passed to the hook as is. */
+void socks_log_set_hook(socks_log_hook_t hook, void *context);
+
+/** @brief Writes any messages waiting in the default logger's ring to
+ * stderr, before returning. Also happens at exit(). */
+void socks_log_flush(void);
+
+/** @brief Reads how many messages have been logged, suppressed by rate
+ * limiting, and dropped because the ring was full. */
+void socks_log_get_stats(struct socks_log_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,697 @@
+#ifndef LIBSOCKS_MESSAGE_HPP
+#define LIBSOCKS_MESSAGE_HPP
+
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+
+#include "libsocks.h"
+#include "libsocks_arena.h"
+
+/* Typed messages for C++17 and later. A message is a plain struct whose
+ * fields are listed once with SOCKS_MESSAGE():
+ *
+ *     struct point {
+ *         std::int32_t x;
+ *         std::int32_t y;
+ *         std::string_view label;
+ *     };
+ *
+ *     SOCKS_MESSAGE(point, x, y, label);
+ *
+ * and the encoder, decoder and view for it are generated at compile time.
+ *
+ * On the wire, the fields follow each other in the order they were listed,
+ * with no padding. Integers, enums, bools, floats and doubles are stored
+ * little-endian at their own size; std::string_view is a 2-byte length
+ * followed by that many bytes; std::array holds its elements back to back;
+ * and a field that is itself a message is stored inline.
+ *
+ * socks::view reads fields straight out of a received buffer, so a callback
+ * can use a request without copying or decoding the rest of it. Decoded
+ * string_views (from a view or from socks::decode()) point into the buffer,
+ * and are only valid as long as it is. */
+
+namespace socks {
+
+/** @brief Field list of a message type. Specialized by SOCKS_MESSAGE(). */
+template <typename T>
+struct message;
+
+namespace detail {
+
+template <typename T, typename = void>
+struct is_message : std::false_type {};
+
+template <typename T>
+struct is_message<T, std::void_t<decltype(message<T>::fields)>>
+    : std::true_type {};
+
+template <typename M>
+struct member_type;
+
+template <typename C, typename F>
+struct member_type<F C::*> {
+    using type = F;
+};
+
+template <typename T, std::size_t I>
+using field_type = typename member_type<std::remove_cv_t<
+    std::tuple_element_t<I, std::remove_cv_t<decltype(message<T>::fields)>>>>::
+    type;
+
+template <typename T>
+constexpr std::size_t field_count =
+    std::tuple_size_v<std::remove_cv_t<decltype(message<T>::fields)>>;
+
+/** @brief Unsigned integer of the same size as 'T', for scalars. */
+template <typename T>
+using bits = std::conditional_t<
+    sizeof(T) == 1, std::uint8_t,
+    std::conditional_t<sizeof(T) == 2, std::uint16_t,
+                       std::conditional_t<sizeof(T) == 4, std::uint32_t,
+                                          std::uint64_t>>>;
+
+template <typename T>
+constexpr bool is_scalar_v = std::is_integral_v<T> || std::is_enum_v<T> ||
+                             std::is_floating_point_v<T>;
+
+template <typename U>
+constexpr char *put_bits(char *out, U value)
+{
+    for (std::size_t x = 0; x < sizeof(U); x++) {
+        out[x] = static_cast<char>(
+            static_cast<unsigned char>(value >> (8 * x)));
+    }
+
+    return out + sizeof(U);
+}
+
+template <typename U>
+constexpr U get_bits(const char *in)
+{
+    U value = 0;
+
+    for (std::size_t x = 0; x < sizeof(U); x++) {
+        value = static_cast<U>(
+            value | (static_cast<U>(static_cast<unsigned char>(in[x])) <<
+                     (8 * x)));
+    }
+
+    return value;
+}
+
+/** @brief Encoder and decoder for one field type. Every codec has:
+ *  - 'fixed', true if every value has the same encoded size;
+ *  - 'fixed_size', that size (or the smallest possible one);
+ *  - size(value), the encoded size of a value;
+ *  - put(out, value), which encodes a value and returns the end of it;
+ *  - skip(in, end), which returns the end of the value at 'in', or nullptr
+ *    if it runs past 'end';
+ *  - get(in), which decodes the (already skipped) value at 'in'. */
+template <typename T, typename = void>
+struct codec;
+
+template <typename T>
+struct codec<T, std::enable_if_t<is_scalar_v<T>>> {
+    using U = bits<T>;
+
+    static constexpr bool fixed = true;
+    static constexpr std::size_t fixed_size = sizeof(T);
+
+    static constexpr std::size_t size(const T &)
+    {
+        return sizeof(T);
+    }
+
+    static constexpr char *put(char *out, const T &value)
+    {
+        if constexpr (std::is_same_v<T, bool>) {
+            return put_bits(out, static_cast<std::uint8_t>(value ? 1 : 0));
+        } else if constexpr (std::is_floating_point_v<T>) {
+            U raw = 0;
+            std::memcpy(&raw, &value, sizeof(T));
+            return put_bits(out, raw);
+        } else {
+            return put_bits(out, static_cast<U>(value));
+        }
+    }
+
+    static constexpr const char *skip(const char *in, const char *end)
+    {
+        return (end - in < static_cast<std::ptrdiff_t>(sizeof(T))) ?
+               nullptr : in + sizeof(T);
+    }
+
+    static constexpr T get(const char *in)
+    {
+        if constexpr (std::is_same_v<T, bool>) {
+            return in[0] != 0;
+        } else if constexpr (std::is_floating_point_v<T>) {
+            U raw = get_bits<U>(in);
+            T value = 0;
+            std::memcpy(&value, &raw, sizeof(T));
+            return value;
+        } else {
+            return static_cast<T>(get_bits<U>(in));
+        }
+    }
+};
+
+template <>
+struct codec<std::string_view> {
+    static constexpr bool fixed = false;
+    static constexpr std::size_t fixed_size = 2;
+
+    static constexpr std::size_t size(const std::string_view &value)
+    {
+        return 2 + value.size();
+    }
+
+    static constexpr char *put(char *out, const std::string_view &value)
+    {
+        out = put_bits(out, static_cast<std::uint16_t>(value.size()));
+
+        for (char c : value) {
+            *out++ = c;
+        }
+
+        return out;
+    }
+
+    static constexpr const char *skip(const char *in, const char *end)
+    {
+        if (end - in < 2) {
+            return nullptr;
+        }
+
+        std::size_t length = get_bits<std::uint16_t>(in);
+        return (static_cast<std::size_t>(end - in) - 2 < length) ?
+               nullptr : in + 2 + length;
+    }
+
+    static constexpr std::string_view get(const char *in)
+    {
+        return std::string_view(in + 2, get_bits<std::uint16_t>(in));
+    }
+};
+
+template <typename E, std::size_t N>
+struct codec<std::array<E, N>> {
+    static constexpr bool fixed = codec<E>::fixed;
+    static constexpr std::size_t fixed_size = N * codec<E>::fixed_size;
+
+    static constexpr std::size_t size(const std::array<E, N> &value)
+    {
+        if constexpr (fixed) {
+            return fixed_size;
+        } else {
+            std::size_t total = 0;
+
+            for (const E &element : value) {
+                total += codec<E>::size(element);
+            }
+
+            return total;
+        }
+    }
+
+    static constexpr char *put(char *out, const std::array<E, N> &value)
+    {
+        for (const E &element : value) {
+            out = codec<E>::put(out, element);
+        }
+
+        return out;
+    }
+
+    static constexpr const char *skip(const char *in, const char *end)
+    {
+        for (std::size_t x = 0; (x < N) && (in != nullptr); x++) {
+            in = codec<E>::skip(in, end);
+        }
+
+        return in;
+    }
+
+    static constexpr std::array<E, N> get(const char *in)
+    {
+        std::array<E, N> value{};
+
+        for (std::size_t x = 0; x < N; x++) {
+            value[x] = codec<E>::get(in);
+            in += codec<E>::size(value[x]);
+        }
+
+        return value;
+    }
+};
+
+template <typename T, std::size_t... I>
+constexpr bool all_fixed(std::index_sequence<I...>)
+{
+    return (codec<field_type<T, I>>::fixed && ...);
+}
+
+template <typename T, std::size_t... I>
+constexpr std::size_t sum_fixed(std::index_sequence<I...>)
+{
+    return (std::size_t{0} + ... + codec<field_type<T, I>>::fixed_size);
+}
+
+template <typename T>
+struct codec<T, std::enable_if_t<is_message<T>::value>> {
+    using indices = std::make_index_sequence<field_count<T>>;
+
+    static constexpr bool fixed = all_fixed<T>(indices{});
+    static constexpr std::size_t fixed_size = sum_fixed<T>(indices{});
+
+    static constexpr std::size_t size(const T &value)
+    {
+        if constexpr (fixed) {
+            return fixed_size;
+        } else {
+            return size_each(value, indices{});
+        }
+    }
+
+    static constexpr char *put(char *out, const T &value)
+    {
+        return put_each(out, value, indices{});
+    }
+
+    static constexpr const char *skip(const char *in, const char *end)
+    {
+        if constexpr (fixed) {
+            return (static_cast<std::size_t>(end - in) < fixed_size) ?
+                   nullptr : in + fixed_size;
+        } else {
+            return skip_each(in, end, indices{});
+        }
+    }
+
+    static constexpr T get(const char *in)
+    {
+        T value{};
+        get_each(in, value, indices{});
+        return value;
+    }
+
+private:
+    template <std::size_t... I>
+    static constexpr std::size_t size_each(const T &value,
+                                           std::index_sequence<I...>)
+    {
+        return (std::size_t{0} + ... +
+                codec<field_type<T, I>>::size(
+                    value.*std::get<I>(message<T>::fields)));
+    }
+
+    template <std::size_t... I>
+    static constexpr char *put_each(char *out, const T &value,
+                                    std::index_sequence<I...>)
+    {
+        ((out = codec<field_type<T, I>>::put(
+              out, value.*std::get<I>(message<T>::fields))), ...);
+        return out;
+    }
+
+    template <std::size_t... I>
+    static constexpr const char *skip_each(const char *in, const char *end,
+                                           std::index_sequence<I...>)
+    {
+        ((in = (in == nullptr) ? nullptr :
+                                 codec<field_type<T, I>>::skip(in, end)), ...);
+        return in;
+    }
+
+    template <std::size_t... I>
+    static constexpr void get_each(const char *in, T &value,
+                                   std::index_sequence<I...>)
+    {
+        ((value.*std::get<I>(message<T>::fields) =
+              codec<field_type<T, I>>::get(in),
+          in += codec<field_type<T, I>>::size(
+              value.*std::get<I>(message<T>::fields))), ...);
+    }
+};
+
+/** @brief Index of 'Member' in the field list of 'T', or the number of fields
+ * if it isn't there. */
+template <typename T, auto Member, std::size_t I = 0>
+constexpr std::size_t field_index()
+{
+    if constexpr (I == field_count<T>) {
+        return I;
+    } else {
+        using listed = std::remove_cv_t<std::tuple_element_t<
+            I, std::remove_cv_t<decltype(message<T>::fields)>>>;
+
+        if constexpr (std::is_same_v<listed, decltype(Member)>) {
+            if (std::get<I>(message<T>::fields) == Member) {
+                return I;
+            }
+        }
+
+        return field_index<T, Member, I + 1>();
+    }
+}
+
+/** @brief Offset of field 'I' of 'T', if every field before it has a fixed
+ * size (and 0 otherwise). */
+template <typename T, std::size_t I>
+constexpr std::size_t fixed_offset()
+{
+    if constexpr (I == 0) {
+        return 0;
+    } else {
+        return fixed_offset<T, I - 1>() +
+               codec<field_type<T, I - 1>>::fixed_size;
+    }
+}
+
+template <typename T, std::size_t I>
+constexpr bool fixed_prefix()
+{
+    if constexpr (I == 0) {
+        return true;
+    } else {
+        return fixed_prefix<T, I - 1>() && codec<field_type<T, I - 1>>::fixed;
+    }
+}
+
+} // namespace detail
+
+/*----------------------------------------------------------------------------*/
+
+/** @brief Encoded size of every value of 'T', for messages whose fields all
+ * have fixed sizes. */
+template <typename T>
+constexpr std::size_t fixed_size = detail::codec<T>::fixed_size;
+
+/** @brief True if every value of 'T' has the same encoded size. */
+template <typename T>
+constexpr bool is_fixed = detail::codec<T>::fixed;
+
+/** @brief Returns the encoded size of a message. */
+template <typename T>
+constexpr std::size_t encoded_size(const T &value)
+{
+    return detail::codec<T>::size(value);
+}
+
+/** @brief Encodes a message into a buffer.
+ * @param[in] value Message to encode.
+ * @param[out] buf Buffer for the encoded message.
+ * @param[in] bufsize Size of 'buf' (in bytes).
+ * @return Encoded size of the message, or -1 if it doesn't fit in 'buf' or
+ * in a libsocks message. */
+template <typename T>
+constexpr std::ptrdiff_t encode(const T &value, char *buf,
+                                std::size_t bufsize)
+{
+    std::size_t size = encoded_size(value);
+
+    if ((size > bufsize) || (size > UINT16_MAX)) {
+        return -1;
+    }
+
+    detail::codec<T>::put(buf, value);
+    return static_cast<std::ptrdiff_t>(size);
+}
+
+/** @brief Decodes a message. string_view fields of the result point into
+ * 'msg'.
+ * @param[in] msg Encoded message.
+ * @param[in] len Length of 'msg' (in bytes).
+ * @param[out] value Decoded message.
+ * @return True if 'msg' held exactly one message of type 'T'. */
+template <typename T>
+constexpr bool decode(const char *msg, std::size_t len, T &value)
+{
+    if (detail::codec<T>::skip(msg, msg + len) != msg + len) {
+        return false;
+    }
+
+    value = detail::codec<T>::get(msg);
+    return true;
+}
+
+/** @brief Read-only access to the fields of an encoded message, in place.
+ * Only from() checks the encoding; after that, reading a field costs at most
+ * a walk over the variable-length fields in front of it. */
+template <typename T>
+class view {
+public:
+    /** @brief Returns a view of 'msg', or nothing if 'msg' doesn't hold
+     * exactly one message of type 'T'. */
+    static constexpr std::optional<view> from(const char *msg,
+                                              std::size_t len)
+    {
+        if (detail::codec<T>::skip(msg, msg + len) != msg + len) {
+            return std::nullopt;
+        }
+
+        return view(msg, len);
+    }
+
+    /** @brief Returns field number 'I' (in SOCKS_MESSAGE() order). Nested
+     * messages are returned as views. */
+    template <std::size_t I>
+    constexpr auto get() const
+    {
+        static_assert(I < detail::field_count<T>, "no such field");
+
+        using F = detail::field_type<T, I>;
+        const char *in = field_start<I>();
+
+        if constexpr (detail::is_message<F>::value) {
+            return view<F>(in, static_cast<std::size_t>(
+                                   detail::codec<F>::skip(in, data_ + len_) -
+                                   in));
+        } else {
+            return detail::codec<F>::get(in);
+        }
+    }
+
+    /** @brief Returns the field that 'Member' points to. */
+    template <auto Member,
+              std::enable_if_t<
+                  std::is_member_object_pointer_v<decltype(Member)>, int> = 0>
+    constexpr auto get() const
+    {
+        constexpr std::size_t index = detail::field_index<T, Member>();
+        static_assert(index < detail::field_count<T>,
+                      "not a field of this message");
+        return get<index>();
+    }
+
+    /** @brief Decodes the whole message. */
+    constexpr T decode() const
+    {
+        return detail::codec<T>::get(data_);
+    }
+
+    constexpr const char *data() const
+    {
+        return data_;
+    }
+
+    constexpr std::size_t size() const
+    {
+        return len_;
+    }
+
+private:
+    template <typename>
+    friend class view;
+
+    constexpr view(const char *msg, std::size_t len) : data_(msg), len_(len)
+    {
+    }
+
+    template <std::size_t I>
+    constexpr const char *field_start() const
+    {
+        if constexpr (detail::fixed_prefix<T, I>()) {
+            return data_ + detail::fixed_offset<T, I>();
+        } else {
+            const char *in = field_start<I - 1>();
+            return detail::codec<detail::field_type<T, I - 1>>::skip(
+                in, data_ + len_);
+        }
+    }
+
+    const char *data_;
+    std::size_t len_;
+};
+
+/*----------------------------------------------------------------------------*/
+
+/** @brief Sends a message as the response to the current request. The
+ * encoding lives on the stack for fixed-size messages, and in the request's
+ * arena (see socks_server_alloc()) otherwise.
+ * @return Same as socks_server_respond(), with errno set to EMSGSIZE if the
+ * message is too large. */
+template <typename T>
+ssize_t respond(int response_fd, const T &value)
+{
+    if constexpr (is_fixed<T>) {
+        static_assert(fixed_size<T> <= UINT16_MAX, "message is too large");
+        std::array<char, fixed_size<T>> buffer;
+
+        encode(value, buffer.data(), buffer.size());
+        return socks_server_respond(response_fd, buffer.data(),
+                                    static_cast<std::uint16_t>(buffer.size()));
+    } else {
+        std::size_t size = encoded_size(value);
+        char *buffer;
+
+        if (size > UINT16_MAX) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        buffer = static_cast<char *>(socks_server_alloc(response_fd, size));
+
+        if (buffer == nullptr) {
+            return -1;
+        }
+
+        encode(value, buffer, size);
+        return socks_server_respond(response_fd, buffer,
+                                    static_cast<std::uint16_t>(size));
+    }
+}
+
+/** @brief Response received by socks::request(). Owns the buffer that views
+ * of it (and string_views decoded from it) point into. */
+class reply {
+public:
+    const char *data() const
+    {
+        return data_.get();
+    }
+
+    std::size_t size() const
+    {
+        return len_;
+    }
+
+    /** @brief Returns a view of the response, or nothing if it isn't a
+     * message of type 'T'. */
+    template <typename T>
+    std::optional<view<T>> as() const
+    {
+        return view<T>::from(data_.get(), len_);
+    }
+
+private:
+    struct deleter {
+        void operator()(char *buffer) const
+        {
+            std::free(buffer);
+        }
+    };
+
+    template <typename T>
+    friend ssize_t request(const char *, const T &, reply &);
+
+    std::unique_ptr<char, deleter> data_;
+    std::size_t len_ = 0;
+};
+
+/** @brief Sends a message to a libsocks server and receives its response, as
+ * socks_client_process_alloc() does.
+ * @return Length of the response, or -1 in the event of an error (in which
+ * case errno was set accordingly; EMSGSIZE means the message is too large). */
+template <typename T>
+ssize_t request(const char *filename, const T &value, reply &out)
+{
+    std::size_t size = encoded_size(value);
+    std::unique_ptr<char[]> buffer;
+    char *response = nullptr;
+    ssize_t result;
+
+    if (size > UINT16_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    buffer.reset(new char[size + 1]);
+    encode(value, buffer.get(), size);
+    result = socks_client_process_alloc(filename, buffer.get(),
+                                        static_cast<std::uint16_t>(size),
+                                        &response);
+
+    if (result >= 0) {
+        out.data_.reset(response);
+        out.len_ = static_cast<std::size_t>(result);
+    }
+
+    return result;
+}
+
+} // namespace socks
+
+/*----------------------------------------------------------------------------*/
+
+#define SOCKS_FIELD_(type, field) &type::field
+#define SOCKS_FIELDS_1_(t, a) SOCKS_FIELD_(t, a)
+#define SOCKS_FIELDS_2_(t, a, ...) \
+    SOCKS_FIELD_(t, a), SOCKS_FIELDS_1_(t, __VA_ARGS__)
+#define SOCKS_FIELDS_3_(t, a, ...) \
+    SOCKS_FIELD_(t, a), SOCKS_FIELDS_2_(t, __VA_ARGS__)
+#define SOCKS_FIELDS_4_(t, a, ...) \
+    SOCKS_FIELD_(t, a), SOCKS_FIELDS_3_(t, __VA_ARGS__)
+#define SOCKS_FIELDS_5_(t, a, ...) \
+    SOCKS_FIELD_(t, a), SOCKS_FIELDS_4_(t, __VA_ARGS__)
+#define SOCKS_FIELDS_6_(t, a, ...) \
+    SOCKS_FIELD_(t, a), SOCKS_FIELDS_5_(t, __VA_ARGS__)
+#define SOCKS_FIELDS_7_(t, a, ...) \
+    SOCKS_FIELD_(t, a), SOCKS_FIELDS_6_(t, __VA_ARGS__)
+#define SOCKS_FIELDS_8_(t, a, ...) \
+    SOCKS_FIELD_(t, a), SOCKS_FIELDS_7_(t, __VA_ARGS__)
+#define SOCKS_FIELDS_9_(t, a, ...) \
+    SOCKS_FIELD_(t, a), SOCKS_FIELDS_8_(t, __VA_ARGS__)
+#define SOCKS_FIELDS_10_(t, a, ...) \
+    SOCKS_FIELD_(t, a), SOCKS_FIELDS_9_(t, __VA_ARGS__)
+#define SOCKS_FIELDS_11_(t, a, ...) \
+    SOCKS_FIELD_(t, a), SOCKS_FIELDS_10_(t, __VA_ARGS__)
+#define SOCKS_FIELDS_12_(t, a, ...) \
+    SOCKS_FIELD_(t, a), SOCKS_FIELDS_11_(t, __VA_ARGS__)
+#define SOCKS_FIELDS_13_(t, a, ...) \
+    SOCKS_FIELD_(t, a), SOCKS_FIELDS_12_(t, __VA_ARGS__)
+#define SOCKS_FIELDS_14_(t, a, ...) \
+    SOCKS_FIELD_(t, a), SOCKS_FIELDS_13_(t, __VA_ARGS__)
+#define SOCKS_FIELDS_15_(t, a, ...) \
+    SOCKS_FIELD_(t, a), SOCKS_FIELDS_14_(t, __VA_ARGS__)
+#define SOCKS_FIELDS_16_(t, a, ...) \
+    SOCKS_FIELD_(t, a), SOCKS_FIELDS_15_(t, __VA_ARGS__)
+
+#define SOCKS_COUNT_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, \
+                     _14, _15, _16, count, ...) count
+#define SOCKS_CAT_(a, b) SOCKS_CAT2_(a, b)
+#define SOCKS_CAT2_(a, b) a##b
+
+/** @brief Lists the fields of a message type (up to 16), in wire order. Must
+ * be used at global scope, with the type's fully-qualified name. */
+#define SOCKS_MESSAGE(type, ...) \
+    template <> \
+    struct socks::message<type> { \
+        static constexpr auto fields = std::make_tuple(SOCKS_CAT_( \
+            SOCKS_FIELDS_, SOCKS_CAT_(SOCKS_COUNT_(__VA_ARGS__, 16, 15, 14, \
+                                                  13, 12, 11, 10, 9, 8, 7, \
+                                                  6, 5, 4, 3, 2, 1), _))( \
+            type, __VA_ARGS__)); \
+    }
+
+#endif
@@ -0,0 +1,229 @@
+#define _POSIX_C_SOURCE 200809L
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "eintr_wrappers.h"
+#include "libsocks_notify.h"
+#include "libsocks_pvt.h"
+
+/*----------------------------------------------------------------------------*/
+
+enum {
+    slot_size = UINT16_MAX + 1
+};
+
+/* Each slot has room for the largest notification plus the NUL that's added
+ * after it. */
+struct socks_notify {
+    int socket_fd;
+    unsigned int batch;
+    struct mmsghdr *headers;
+    struct iovec *iovecs;
+    char *slots;
+};
+
+/*----------------------------------------------------------------------------*/
+
+/** @brief Receives up to 'notify->batch' datagrams without blocking. Returns
+ * the number received, 0 if none were waiting, or -1. */
+static int notify_receive(struct socks_notify *notify)
+{
+    int result;
+
+    for (unsigned int x = 0; x < notify->batch; x++) {
+        notify->iovecs[x].iov_base = notify->slots + ((size_t) x * slot_size);
+        notify->iovecs[x].iov_len = slot_size - 1;
+        memset(&notify->headers[x], 0, sizeof(notify->headers[x]));
+        notify->headers[x].msg_hdr.msg_iov = &notify->iovecs[x];
+        notify->headers[x].msg_hdr.msg_iovlen = 1;
+    }
+
+#ifdef HAVE_RECVMMSG
+    do {
+        result = recvmmsg(notify->socket_fd, notify->headers, notify->batch,
+                          MSG_DONTWAIT, NULL);
+    } while ((result < 0) && (errno == EINTR));
+#else
+    result = 0;
+
+    while ((unsigned int) result < notify->batch) {
+        struct mmsghdr *header = &notify->headers[result];
+        ssize_t length = recvmsg(notify->socket_fd, &header->msg_hdr,
+                                 MSG_DONTWAIT);
+
+        if ((length < 0) && (errno == EINTR)) {
+            continue;
+        }
+
+        if (length < 0) {
+            break;
+        }
+
+        header->msg_len = (unsigned int) length;
+        result++;
+    }
+
+    if (result == 0) {
+        result = -1;
+    }
+#endif
+
+    if ((result < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+        return 0;
+    }
+
+    return result;
+}
+
+/*----------------------------------------------------------------------------*/
+
+socks_notify_t *socks_notify_open(const char *filename, mode_t mode,
+                                  unsigned int batch)
+{
+    struct socks_notify *notify;
+    struct sockaddr_un address;
+
+    if (socks_address_make(filename, &address) < 0) {
+        return NULL;
+    }
+
+    if (batch == 0) {
+        batch = SOCKS_NOTIFY_DEFAULT_BATCH;
+    }
+
+    notify = calloc(1, sizeof(*notify));
+
+    if (notify == NULL) {
+        return NULL;
+    }
+
+    notify->batch = batch;
+    notify->headers = calloc(batch, sizeof(notify->headers[0]));
+    notify->iovecs = calloc(batch, sizeof(notify->iovecs[0]));
+    notify->slots = malloc((size_t) batch * slot_size);
+    notify->socket_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+
+    if ((notify->headers == NULL) || (notify->iovecs == NULL) ||
+        (notify->slots == NULL) || (notify->socket_fd < 0)) {
+        int prev_errno = errno;
+        socks_notify_close(notify);
+        errno = prev_errno;
+        return NULL;
+    }
+
+    if (access(filename, F_OK) == 0) {
+        unlink(filename);
+    }
+
+    if ((bind(notify->socket_fd, (struct sockaddr *) &address,
+              sizeof(address)) != 0) ||
+        (chmod_noeintr(filename, mode) != 0)) {
+        int prev_errno = errno;
+        socks_notify_close(notify);
+        errno = prev_errno;
+        return NULL;
+    }
+
+    return notify;
+}
+
+void socks_notify_close(socks_notify_t *notify)
+{
+    if (notify->socket_fd >= 0) {
+        close_noeintr(notify->socket_fd);
+    }
+
+    free(notify->slots);
+    free(notify->iovecs);
+    free(notify->headers);
+    free(notify);
+}
+
+int socks_notify_fd(socks_notify_t *notify)
+{
+    return notify->socket_fd;
+}
+
+int socks_notify_process(socks_notify_t *notify, socks_callback_t callback)
+{
+    int count = notify_receive(notify);
+
+    for (int x = 0; x < count; x++) {
+        char *msg = notify->iovecs[x].iov_base;
+        unsigned int length = notify->headers[x].msg_len;
+
+        msg[length] = '\x00';
+        callback(-1, msg, (uint16_t) length);
+    }
+
+    return count;
+}
+
+int socks_notify_connect(const char *filename)
+{
+    struct sockaddr_un address;
+    int notify_fd;
+
+    if (socks_address_make(filename, &address) < 0) {
+        return -1;
+    }
+
+    notify_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+
+    if (notify_fd < 0) {
+        return -1;
+    }
+
+    if (connect_noeintr(notify_fd, (struct sockaddr *) &address,
+                        sizeof(address)) != 0) {
+        int prev_errno = errno;
+        close_noeintr(notify_fd);
+        errno = prev_errno;
+        return -1;
+    }
+
+    return notify_fd;
+}
+
+ssize_t socks_notify_send(int notify_fd, const void *buf, uint16_t nbyte)
+{
+    ssize_t result;
+
+    do {
+        result = send(notify_fd, buf, nbyte, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while ((result < 0) && (errno == EINTR));
+
+    return result;
+}
+
+ssize_t socks_notify(const char *filename, const void *buf, uint16_t nbyte)
+{
+    ssize_t result;
+    int notify_fd = socks_notify_connect(filename);
+
+    if (notify_fd < 0) {
+        return -1;
+    }
+
+    result = socks_notify_send(notify_fd, buf, nbyte);
+
+    if (result < 0) {
+        int prev_errno = errno;
+        close_noeintr(notify_fd);
+        errno = prev_errno;
+        return result;
+    }
+
+    close_noeintr(notify_fd);
+    return result;
+}
@@ -0,0 +1,87 @@
+#ifndef LIBSOCKS_NOTIFY_H
+#define LIBSOCKS_NOTIFY_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "libsocks.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* One-way notifications over SOCK_DGRAM. A notification is a single datagram
+ * with no framing and no response, so sending one on an open sender is one
+ * send() call, and a server picks up a whole batch of them with one
+ * recvmmsg(). Notification sockets use socketfiles just like ordinary
+ * libsocks servers, but a path can't be used for both at once. */
+
+/** @brief Opaque handle for a notification server. */
+typedef struct socks_notify socks_notify_t;
+
+/** @brief Default number of notifications received per batch. */
+#define SOCKS_NOTIFY_DEFAULT_BATCH 16
+
+/*----------------------------------------------------------------------------*/
+
+/** @brief Creates a unix-domain datagram socket and opens it as a
+ * notification server. Needs a buffer of 64 KiB per message in a batch.
+ * @param[in] filename Filename of target socketfile.
+ * @param[in] mode Permissions for the socketfile.
+ * @param[in] batch Most notifications to receive at once, or 0 for
+ * SOCKS_NOTIFY_DEFAULT_BATCH.
+ * @return Handle for the new server, or NULL in the event of an error (in
+ * which case errno was set accordingly). */
+socks_notify_t *socks_notify_open(const char *filename, mode_t mode,
+                                  unsigned int batch);
+
+/** @brief Closes a notification server and frees it. Notifications still
+ * queued are lost. */
+void socks_notify_close(socks_notify_t *notify);
+
+/** @brief Returns the file descriptor of a notification server, for use
+ * with socks_server_wait(), socks_server_poll() or an event loop. */
+int socks_notify_fd(socks_notify_t *notify);
+
+/** @brief Receives the notifications that are waiting (up to one batch), and
+ * passes each of them to 'callback', in order. Doesn't block. The callback's
+ * 'response_fd' is -1, since there's no one to respond to, and its message is
+ * NUL-terminated, as for socks_server_process().
+ * @param[in] notify Notification server.
+ * @param[in] callback Callback function for the server to use.
+ * @return Number of notifications processed (0 if none were waiting), or -1
+ * if they couldn't be received (in which case errno was set accordingly). */
+int socks_notify_process(socks_notify_t *notify, socks_callback_t callback);
+
+/*----------------------------------------------------------------------------*/
+
+/** @brief Opens a sender for a notification server, to be used with
+ * socks_notify_send() and closed with close().
+ * @param[in] filename Filename of the server's socketfile.
+ * @return File descriptor of the sender, or -1 in the event of an error (in
+ * which case errno was set accordingly). */
+int socks_notify_connect(const char *filename);
+
+/** @brief Sends a notification on an open sender. Never blocks: if the
+ * server has fallen behind and its queue is full, this fails with EAGAIN,
+ * and the caller can drop the notification or retry later.
+ * @param[in] notify_fd File descriptor returned by socks_notify_connect().
+ * @param[in] buf Notification to send.
+ * @param[in] nbyte Length of the notification (in bytes).
+ * @return Number of bytes sent, or -1 in the event of an error (in which case
+ * errno was set accordingly). */
+ssize_t socks_notify_send(int notify_fd, const void *buf, uint16_t nbyte);
+
+/** @brief Sends a single notification without keeping a sender open. Same as
+ * socks_notify_connect(), socks_notify_send() and close().
+ * @param[in] filename Filename of the server's socketfile.
+ * @param[in] buf Notification to send.
+ * @param[in] nbyte Length of the notification (in bytes).
+ * @return Same as socks_notify_send(). */
+ssize_t socks_notify(const char *filename, const void *buf, uint16_t nbyte);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
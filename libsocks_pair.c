@@ -0,0 +1,88 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include "libsocks_pair.h"
+#include "libsocks_pvt.h"
+
+/*----------------------------------------------------------------------------*/
+
+/** @brief Reads the body of a request whose header has been read, and
+ * dispatches it. */
+static int pair_dispatch(int server_fd, socks_callback_t callback,
+                         uint16_t msgsize)
+{
+    ssize_t result;
+    char buffer[msgsize + 1];
+
+    buffer[msgsize] = '\x00';
+
+    result = socks_request_read(server_fd, buffer, msgsize);
+
+    if (result < 0) {
+        return (int) result;
+    }
+
+    return socks_request_dispatch(server_fd, callback, buffer, msgsize);
+}
+
+/*----------------------------------------------------------------------------*/
+
+int socks_pair_open(int fds[2])
+{
+    return socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds);
+}
+
+ssize_t socks_pair_request(int client_fd, const char *input, uint16_t nbyte,
+                           char *output, uint16_t maxlen)
+{
+    ssize_t result = socks_frame_send(client_fd, input, nbyte);
+
+    if (result < 0) {
+        return result;
+    }
+
+    return socks_frame_recv(client_fd, output, maxlen);
+}
+
+ssize_t socks_pair_request_alloc(int client_fd, const char *input,
+                                 uint16_t nbyte, char **output)
+{
+    ssize_t result = socks_frame_send(client_fd, input, nbyte);
+
+    if (result < 0) {
+        return result;
+    }
+
+    return socks_frame_recv_alloc(client_fd, output);
+}
+
+int socks_pair_process(int server_fd, socks_callback_t callback)
+{
+    uint16_t msgsize;
+    ssize_t result = socks_frame_recv_header(server_fd, &msgsize);
+
+    if (result < 0) {
+        return (int) result;
+    }
+
+    return pair_dispatch(server_fd, callback, msgsize);
+}
+
+int socks_pair_serve(int server_fd, socks_callback_t callback)
+{
+    while (1) {
+        uint16_t msgsize;
+
+        if (socks_frame_recv_header(server_fd, &msgsize) < 0) {
+            return (errno == ECONNRESET) ? 0 : -1;
+        }
+
+        /* The callback's result can't be told apart from a failure to
+         * respond, so the next read is what decides whether to go on. */
+
+        pair_dispatch(server_fd, callback, msgsize);
+    }
+}
@@ -0,0 +1,89 @@
+#ifndef LIBSOCKS_PAIR_H
+#define LIBSOCKS_PAIR_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "libsocks.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Private transport for a worker that the caller starts itself, whether a
+ * forked child or a thread. Both ends come from one socketpair(), so there's
+ * no socketfile to bind, chmod or clean up, and no connect() per request:
+ * the connection stays open, and carries any number of requests in turn.
+ * Requests use the usual framing and callbacks, but since each request
+ * expects exactly one response, a callback should call
+ * socks_server_respond() at most once.
+ *
+ * After fork(), each process closes the end it doesn't use. Neither end is
+ * close-on-exec, so that a worker can also be exec()ed with its end on a
+ * known descriptor. */
+
+/** @brief Index of the end used with socks_pair_request(). */
+#define SOCKS_PAIR_CLIENT 0
+
+/** @brief Index of the end used with socks_pair_process() and
+ * socks_pair_serve(). */
+#define SOCKS_PAIR_SERVER 1
+
+/** @brief Creates a connected pair of libsocks endpoints.
+ * @param[out] fds File descriptors of the ends, indexed by SOCKS_PAIR_CLIENT
+ * and SOCKS_PAIR_SERVER. Both are closed with close().
+ * @return Exit status of function.
+ * @retval 0 Both ends were created.
+ * @retval -1 They couldn't be, and errno was set accordingly. */
+int socks_pair_open(int fds[2]);
+
+/** @brief Sends a request over the client end of a pair, and waits for the
+ * response. Same as socks_client_process(), but the connection is left open
+ * for the next request.
+ * @param[in] client_fd Client end of the pair.
+ * @param[in] input Request to send.
+ * @param[in] nbyte Length of the request (in bytes).
+ * @param[out] output Buffer for the response.
+ * @param[in] maxlen Size of 'output' (in bytes).
+ * @return Length of the response, or -1 in the event of an error (in which
+ * case errno was set accordingly; EMSGSIZE means the response didn't fit in
+ * 'output' and was discarded, and the pair can still be used). */
+ssize_t socks_pair_request(int client_fd, const char *input, uint16_t nbyte,
+                           char *output, uint16_t maxlen);
+
+/** @brief Same as socks_pair_request(), but receives the response into a
+ * buffer of exactly its size, plus a terminating NUL, as for
+ * socks_client_process_alloc().
+ * @param[in] client_fd Client end of the pair.
+ * @param[in] input Request to send.
+ * @param[in] nbyte Length of the request (in bytes).
+ * @param[out] output Response, which the caller must free().
+ * @return Length of the response, or -1 in the event of an error (in which
+ * case errno was set accordingly and nothing was allocated). */
+ssize_t socks_pair_request_alloc(int client_fd, const char *input,
+                                 uint16_t nbyte, char **output);
+
+/** @brief Reads one request from the server end of a pair, and passes it to
+ * 'callback'. Blocks until a request arrives, unless socks_server_wait() or
+ * socks_server_poll() on 'server_fd' showed that one is waiting.
+ * @param[in] server_fd Server end of the pair.
+ * @param[in] callback Callback function for the server to use.
+ * @return Callback's exit code, or -1 if communications failed (in which case
+ * errno was set accordingly; ECONNRESET means the client end was closed). */
+int socks_pair_process(int server_fd, socks_callback_t callback);
+
+/** @brief Handles requests from the server end of a pair until the client
+ * end is closed. Callback failures are ignored, as they are for pre-forked
+ * workers.
+ * @param[in] server_fd Server end of the pair.
+ * @param[in] callback Callback function for the server to use.
+ * @return Exit status of function.
+ * @retval 0 The client end was closed between requests.
+ * @retval -1 Communications failed, and errno was set accordingly. */
+int socks_pair_serve(int server_fd, socks_callback_t callback);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
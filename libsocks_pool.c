@@ -0,0 +1,1041 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "eintr_wrappers.h"
+#include "libsocks_pool.h"
+#include "libsocks_pvt.h"
+
+/*----------------------------------------------------------------------------*/
+
+enum {
+    queue_initial_capacity = 16,
+    tenant_bucket_count = 256,
+    tenant_collect_threshold = 4096
+};
+
+struct socks_job {
+    int connection_fd;
+    enum socks_priority priority;
+    struct socks_tenant *tenant;
+    struct socks_peer peer;
+    int peer_known;
+    struct socks_trace trace;
+    uint16_t size;
+    char msg[];
+};
+
+struct socks_queue {
+    struct socks_job **jobs;
+    unsigned int head;
+    unsigned int count;
+    unsigned int capacity;
+};
+
+/* With tenants enabled, admitted jobs are queued per tenant instead of per
+ * worker. Tenants with queued jobs in a class form a ring, and workers serve
+ * them in weighted round-robin order: 'weight' jobs from the tenant at the
+ * head, then on to the next one. Tenants are only freed once they're idle,
+ * so a job can always point at its own. */
+struct socks_tenant {
+    struct socks_tenant *chain;
+    unsigned long id;
+    unsigned int weight;
+    unsigned int inflight;
+    int pinned;
+    double tokens;
+    uint64_t refilled_ns;
+    struct socks_tenant *ring[SOCKS_PRIORITY_COUNT];
+    struct socks_queue queues[SOCKS_PRIORITY_COUNT];
+};
+
+struct socks_fair {
+    struct socks_tenant *head;
+    struct socks_tenant *tail;
+    unsigned int credit;
+};
+
+struct socks_worker {
+    struct socks_pool *pool;
+    unsigned int index;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct socks_queue queues[SOCKS_PRIORITY_COUNT];
+};
+
+struct socks_class {
+    unsigned int pending;
+    unsigned int limit;
+    enum socks_overload policy;
+    unsigned long admitted;
+    unsigned long shed;
+    unsigned long throttled;
+    unsigned long completed;
+};
+
+struct socks_pool {
+    socks_callback_t callback;
+    socks_cache_t *cache;
+    unsigned int thread_count;
+    unsigned int next;
+    unsigned int pending;
+    unsigned int active;
+    int stopping;
+    char *busy_msg;
+    uint16_t busy_len;
+    struct socks_class classes[SOCKS_PRIORITY_COUNT];
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    pthread_cond_t drain_cond;
+    enum socks_tenant_key tenant_key;
+    struct socks_tenant_limits limits;
+    pthread_mutex_t tenant_lock;
+    unsigned int tenant_count;
+    unsigned int tenant_collect_at;
+    struct socks_fair fair[SOCKS_PRIORITY_COUNT];
+    struct socks_tenant *tenants[tenant_bucket_count];
+    struct socks_worker workers[];
+};
+
+/*----------------------------------------------------------------------------*/
+
+/** @brief Closes a connection, and finishes timing its request. */
+static void connection_close(int connection_fd, struct socks_trace *trace)
+{
+    close_noeintr(connection_fd);
+    socks_trace_mark(trace, SOCKS_STAGE_CLOSE);
+    socks_trace_end(trace);
+}
+
+static void job_discard(struct socks_job *job)
+{
+    connection_close(job->connection_fd, &job->trace);
+    free(job);
+}
+
+/** @brief Doubles the capacity of a queue, unwrapping its contents to the
+ * start of the new buffer. Must be called with the owning worker locked. */
+static int queue_grow(struct socks_queue *queue)
+{
+    unsigned int capacity = queue->capacity * 2;
+    struct socks_job **jobs;
+
+    if (capacity == 0) {
+        capacity = queue_initial_capacity;
+    }
+
+    jobs = malloc(capacity * sizeof(*jobs));
+
+    if (jobs == NULL) {
+        return -1;
+    }
+
+    for (unsigned int x = 0; x < queue->count; x++) {
+        jobs[x] = queue->jobs[(queue->head + x) % queue->capacity];
+    }
+
+    free(queue->jobs);
+    queue->jobs = jobs;
+    queue->head = 0;
+    queue->capacity = capacity;
+    return 0;
+}
+
+/** @brief Appends a job to a queue. Must be called with the queue's owner
+ * locked. */
+static int queue_push(struct socks_queue *queue, struct socks_job *job)
+{
+    if ((queue->count == queue->capacity) && (queue_grow(queue) != 0)) {
+        return -1;
+    }
+
+    queue->jobs[(queue->head + queue->count) % queue->capacity] = job;
+    queue->count++;
+    return 0;
+}
+
+/** @brief Removes the oldest job from a queue, if there is one. Must be
+ * called with the queue's owner locked. */
+static struct socks_job *queue_pop(struct socks_queue *queue)
+{
+    struct socks_job *job;
+
+    if (queue->count == 0) {
+        return NULL;
+    }
+
+    job = queue->jobs[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    return job;
+}
+
+static int worker_push(struct socks_worker *worker, struct socks_job *job)
+{
+    int result;
+
+    pthread_mutex_lock(&worker->lock);
+    result = queue_push(&worker->queues[job->priority], job);
+    pthread_mutex_unlock(&worker->lock);
+    return result;
+}
+
+static struct socks_job *worker_pop(struct socks_worker *worker,
+                                    enum socks_priority priority)
+{
+    struct socks_job *job;
+
+    pthread_mutex_lock(&worker->lock);
+    job = queue_pop(&worker->queues[priority]);
+    pthread_mutex_unlock(&worker->lock);
+    return job;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Everything in this section must be called with the tenant lock held. */
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000000000) + (uint64_t) now.tv_nsec;
+}
+
+static void tenant_free(struct socks_tenant *tenant)
+{
+    for (int x = 0; x < SOCKS_PRIORITY_COUNT; x++) {
+        free(tenant->queues[x].jobs);
+    }
+
+    free(tenant);
+}
+
+/** @brief Frees every tenant that has nothing in flight, has a full token
+ * bucket and no configured weight, i.e. every tenant that would be recreated
+ * in the same state. Keeps the table from growing with each new pid. The
+ * next collection waits until the table has doubled from what's left, so
+ * that a table full of busy or weighted tenants isn't scanned again for
+ * every new one. */
+static void tenant_collect(struct socks_pool *pool, uint64_t now)
+{
+    double burst = (double) pool->limits.burst;
+
+    for (int x = 0; x < tenant_bucket_count; x++) {
+        struct socks_tenant **link = &pool->tenants[x];
+
+        while (*link != NULL) {
+            struct socks_tenant *tenant = *link;
+            double tokens = tenant->tokens + (pool->limits.rate *
+                            (double)(now - tenant->refilled_ns) / 1e9);
+
+            if ((tenant->inflight == 0) && (tenant->pinned == 0) &&
+                ((pool->limits.rate == 0) || (tokens >= burst))) {
+                *link = tenant->chain;
+                tenant_free(tenant);
+                pool->tenant_count--;
+            } else {
+                link = &tenant->chain;
+            }
+        }
+    }
+
+    pool->tenant_collect_at = pool->tenant_count * 2;
+
+    if (pool->tenant_collect_at < tenant_collect_threshold) {
+        pool->tenant_collect_at = tenant_collect_threshold;
+    }
+}
+
+static struct socks_tenant *tenant_find(struct socks_pool *pool,
+                                        unsigned long id, uint64_t now)
+{
+    struct socks_tenant **bucket = &pool->tenants[id % tenant_bucket_count];
+    struct socks_tenant *tenant;
+
+    for (tenant = *bucket; tenant != NULL; tenant = tenant->chain) {
+        if (tenant->id == id) {
+            return tenant;
+        }
+    }
+
+    if (pool->tenant_count >= pool->tenant_collect_at) {
+        tenant_collect(pool, now);
+    }
+
+    tenant = calloc(1, sizeof(*tenant));
+
+    if (tenant == NULL) {
+        return NULL;
+    }
+
+    tenant->id = id;
+    tenant->weight = 1;
+    tenant->tokens = (double) pool->limits.burst;
+    tenant->refilled_ns = now;
+    tenant->chain = *bucket;
+    *bucket = tenant;
+    pool->tenant_count++;
+    return tenant;
+}
+
+/** @brief Charges a request to a tenant's token bucket and concurrency
+ * limit. Returns 1 (and counts the request as in flight) if it may proceed,
+ * and 0 if it should be shed. */
+static int tenant_charge(struct socks_pool *pool, struct socks_tenant *tenant,
+                         uint64_t now)
+{
+    const struct socks_tenant_limits *limits = &pool->limits;
+
+    if ((limits->concurrency != 0) &&
+        (tenant->inflight >= limits->concurrency)) {
+        return 0;
+    }
+
+    if (limits->rate != 0) {
+        tenant->tokens += limits->rate *
+                          (double)(now - tenant->refilled_ns) / 1e9;
+        tenant->refilled_ns = now;
+
+        if (tenant->tokens > (double) limits->burst) {
+            tenant->tokens = (double) limits->burst;
+        }
+
+        if (tenant->tokens < 1) {
+            return 0;
+        }
+
+        tenant->tokens -= 1;
+    }
+
+    tenant->inflight++;
+    return 1;
+}
+
+static int fair_push(struct socks_pool *pool, struct socks_job *job)
+{
+    struct socks_tenant *tenant = job->tenant;
+    struct socks_fair *fair = &pool->fair[job->priority];
+    struct socks_queue *queue = &tenant->queues[job->priority];
+
+    if (queue_push(queue, job) != 0) {
+        return -1;
+    }
+
+    if (queue->count == 1) {
+        tenant->ring[job->priority] = NULL;
+
+        if (fair->head == NULL) {
+            fair->head = tenant;
+            fair->credit = tenant->weight;
+        } else {
+            fair->tail->ring[job->priority] = tenant;
+        }
+
+        fair->tail = tenant;
+    }
+
+    return 0;
+}
+
+/** @brief Takes the next job of a class in weighted round-robin order. */
+static struct socks_job *fair_pop(struct socks_pool *pool,
+                                  enum socks_priority priority)
+{
+    struct socks_fair *fair = &pool->fair[priority];
+    struct socks_tenant *tenant = fair->head;
+    struct socks_job *job;
+
+    if (tenant == NULL) {
+        return NULL;
+    }
+
+    job = queue_pop(&tenant->queues[priority]);
+    fair->credit--;
+
+    if ((tenant->queues[priority].count != 0) && (fair->credit != 0)) {
+        return job;
+    }
+
+    fair->head = tenant->ring[priority];
+
+    if (tenant->queues[priority].count != 0) {
+        tenant->ring[priority] = NULL;
+
+        if (fair->head == NULL) {
+            fair->head = tenant;
+        } else {
+            fair->tail->ring[priority] = tenant;
+        }
+
+        fair->tail = tenant;
+    } else if (fair->head == NULL) {
+        fair->tail = NULL;
+    }
+
+    if (fair->head != NULL) {
+        fair->credit = fair->head->weight;
+    }
+
+    return job;
+}
+
+/** @brief Takes the oldest job of the tenant with the most jobs queued in a
+ * class, so that overload sheds the heaviest tenant first. */
+static struct socks_job *fair_pop_heaviest(struct socks_pool *pool,
+                                           enum socks_priority priority)
+{
+    struct socks_fair *fair = &pool->fair[priority];
+    struct socks_tenant *heaviest = fair->head;
+
+    if (heaviest == NULL) {
+        return NULL;
+    }
+
+    for (struct socks_tenant *tenant = fair->head; tenant != NULL;
+         tenant = tenant->ring[priority]) {
+        if (tenant->queues[priority].count >
+            heaviest->queues[priority].count) {
+            heaviest = tenant;
+        }
+    }
+
+    if (heaviest == fair->head) {
+        return fair_pop(pool, priority);
+    }
+
+    /* Every tenant in the ring has a job queued, so one that has strictly
+     * more than the head has at least two, and stays in the ring. */
+
+    return queue_pop(&heaviest->queues[priority]);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/** @brief Removes the oldest queued job of a priority class, looking at the
+ * given worker's queue first and then stealing from the others. Updates the
+ * pending counters if a job was found. */
+static struct socks_job *pool_take(struct socks_pool *pool,
+                                   unsigned int first,
+                                   enum socks_priority priority)
+{
+    struct socks_class *class = &pool->classes[priority];
+
+    if (__atomic_load_n(&class->pending, __ATOMIC_ACQUIRE) == 0) {
+        return NULL;
+    }
+
+    if (pool->tenant_key != SOCKS_TENANT_NONE) {
+        struct socks_job *job;
+
+        pthread_mutex_lock(&pool->tenant_lock);
+        job = fair_pop(pool, priority);
+        pthread_mutex_unlock(&pool->tenant_lock);
+
+        if (job != NULL) {
+            __atomic_sub_fetch(&class->pending, 1, __ATOMIC_ACQ_REL);
+            __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+        }
+
+        return job;
+    }
+
+    for (unsigned int x = 0; x < pool->thread_count; x++) {
+        unsigned int victim = (first + x) % pool->thread_count;
+        struct socks_job *job = worker_pop(&pool->workers[victim], priority);
+
+        if (job != NULL) {
+            __atomic_sub_fetch(&class->pending, 1, __ATOMIC_ACQ_REL);
+            __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+            return job;
+        }
+    }
+
+    return NULL;
+}
+
+/** @brief Takes the next job for a worker: the oldest job of the highest
+ * non-empty priority class, preferring the worker's own queue. */
+static struct socks_job *worker_next_job(struct socks_worker *worker)
+{
+    struct socks_pool *pool = worker->pool;
+
+    for (int x = 0; x < SOCKS_PRIORITY_COUNT; x++) {
+        struct socks_job *job = pool_take(pool, worker->index,
+                                          (enum socks_priority) x);
+
+        if (job != NULL) {
+            return job;
+        }
+    }
+
+    return NULL;
+}
+
+/** @brief Sleeps until there's queued work or the pool is stopping. Returns
+ * 1 if the worker should exit, and 0 otherwise. */
+static int worker_idle(struct socks_pool *pool)
+{
+    int done;
+
+    pthread_mutex_lock(&pool->idle_lock);
+
+    while ((__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) == 0) &&
+           (pool->stopping == 0)) {
+        pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+    }
+
+    done = (pool->stopping != 0) &&
+           (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) == 0);
+
+    pthread_mutex_unlock(&pool->idle_lock);
+    return done;
+}
+
+/** @brief Gives back a tenant's in-flight slot. */
+static void tenant_release(struct socks_pool *pool,
+                           struct socks_tenant *tenant)
+{
+    if (tenant != NULL) {
+        pthread_mutex_lock(&pool->tenant_lock);
+        tenant->inflight--;
+        pthread_mutex_unlock(&pool->tenant_lock);
+    }
+}
+
+/** @brief Marks an admitted job as finished (or dropped), and wakes
+ * socks_pool_drain() once none are left. */
+static void pool_finish(struct socks_pool *pool, struct socks_tenant *tenant)
+{
+    tenant_release(pool, tenant);
+
+    if (__atomic_sub_fetch(&pool->active, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_broadcast(&pool->drain_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    struct socks_worker *worker = (struct socks_worker *) arg;
+    struct socks_pool *pool = worker->pool;
+
+    while (1) {
+        struct socks_job *job = worker_next_job(worker);
+
+        if (job != NULL) {
+            struct socks_tenant *tenant = job->tenant;
+
+            socks_request_dispatch_traced(job->connection_fd, pool->callback,
+                                          pool->cache,
+                                          job->peer_known ? &job->peer : NULL,
+                                          &job->trace, job->msg, job->size);
+            __atomic_add_fetch(&pool->classes[job->priority].completed, 1,
+                               __ATOMIC_RELAXED);
+            job_discard(job);
+            pool_finish(pool, tenant);
+            continue;
+        }
+
+        if (worker_idle(pool) != 0) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void pool_stop(struct socks_pool *pool, unsigned int started)
+{
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+
+    for (unsigned int x = 0; x < started; x++) {
+        pthread_join(pool->workers[x].thread, NULL);
+    }
+}
+
+static void pool_free(struct socks_pool *pool)
+{
+    for (unsigned int x = 0; x < pool->thread_count; x++) {
+        for (int y = 0; y < SOCKS_PRIORITY_COUNT; y++) {
+            free(pool->workers[x].queues[y].jobs);
+        }
+
+        pthread_mutex_destroy(&pool->workers[x].lock);
+    }
+
+    for (int x = 0; x < tenant_bucket_count; x++) {
+        while (pool->tenants[x] != NULL) {
+            struct socks_tenant *tenant = pool->tenants[x];
+
+            pool->tenants[x] = tenant->chain;
+            tenant_free(tenant);
+        }
+    }
+
+    pthread_cond_destroy(&pool->idle_cond);
+    pthread_cond_destroy(&pool->drain_cond);
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_mutex_destroy(&pool->tenant_lock);
+    free(pool->busy_msg);
+    free(pool);
+}
+
+/** @brief Answers a connection with the pool's busy response, without running
+ * the callback. The caller closes it. */
+static void pool_shed(struct socks_pool *pool, int connection_fd,
+                      struct socks_trace *trace, enum socks_priority priority)
+{
+    if (pool->busy_msg != NULL) {
+        socks_server_respond(connection_fd, pool->busy_msg, pool->busy_len);
+    } else {
+        socks_server_respond(connection_fd, SOCKS_POOL_BUSY,
+                             sizeof(SOCKS_POOL_BUSY));
+    }
+
+    socks_trace_mark(trace, SOCKS_STAGE_RESPOND);
+    __atomic_add_fetch(&pool->classes[priority].shed, 1, __ATOMIC_RELAXED);
+}
+
+/** @brief Reserves a queue slot in a priority class, applying the class's
+ * overload policy if it's full. Returns 1 if the incoming request may be
+ * queued, and 0 if it should be shed instead. */
+static int pool_admit(struct socks_pool *pool, unsigned int target,
+                      enum socks_priority priority)
+{
+    struct socks_class *class = &pool->classes[priority];
+    unsigned int depth;
+    struct socks_job *victim;
+
+    depth = __atomic_add_fetch(&class->pending, 1, __ATOMIC_ACQ_REL);
+
+    if ((class->limit == 0) || (depth <= class->limit)) {
+        return 1;
+    }
+
+    if ((class->policy == SOCKS_OVERLOAD_DROP_OLDEST) &&
+        (pool->tenant_key != SOCKS_TENANT_NONE)) {
+        pthread_mutex_lock(&pool->tenant_lock);
+        victim = fair_pop_heaviest(pool, priority);
+        pthread_mutex_unlock(&pool->tenant_lock);
+
+        if (victim != NULL) {
+            __atomic_sub_fetch(&class->pending, 1, __ATOMIC_ACQ_REL);
+            __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+        }
+    } else if (class->policy == SOCKS_OVERLOAD_DROP_OLDEST) {
+        victim = pool_take(pool, target, priority);
+    } else {
+        victim = NULL;
+    }
+
+    if (victim != NULL) {
+        struct socks_tenant *tenant = victim->tenant;
+
+        pool_shed(pool, victim->connection_fd, &victim->trace, priority);
+        job_discard(victim);
+        pool_finish(pool, tenant);
+        return 1;
+    }
+
+    __atomic_sub_fetch(&class->pending, 1, __ATOMIC_ACQ_REL);
+    return 0;
+}
+
+/** @brief Queues an admitted job on the given worker. Pending counts were
+ * already bumped by pool_admit(), so a worker can never see the job before
+ * it has been counted. */
+static int pool_submit(struct socks_pool *pool, unsigned int target,
+                       struct socks_job *job)
+{
+    struct socks_class *class = &pool->classes[job->priority];
+
+    int result;
+
+    __atomic_add_fetch(&pool->active, 1, __ATOMIC_ACQ_REL);
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+
+    if (job->tenant != NULL) {
+        pthread_mutex_lock(&pool->tenant_lock);
+        result = fair_push(pool, job);
+        pthread_mutex_unlock(&pool->tenant_lock);
+    } else {
+        result = worker_push(&pool->workers[target], job);
+    }
+
+    if (result != 0) {
+        __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+        __atomic_sub_fetch(&pool->active, 1, __ATOMIC_ACQ_REL);
+        __atomic_sub_fetch(&class->pending, 1, __ATOMIC_ACQ_REL);
+        tenant_release(pool, job->tenant);
+        job_discard(job);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    __atomic_add_fetch(&class->admitted, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_signal(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+    return 0;
+}
+
+/** @brief Reads the peer's credentials and charges the request to its
+ * tenant. Returns 1 if the request may proceed (with 'job_tenant' set), and 0
+ * if it should be shed. Does nothing unless tenants are enabled. */
+static int pool_admit_tenant(struct socks_pool *pool, int connection_fd,
+                             struct socks_peer *peer,
+                             struct socks_tenant **job_tenant)
+{
+    struct socks_tenant *tenant;
+    unsigned long id;
+    uint64_t now;
+    int result = 0;
+
+    *job_tenant = NULL;
+
+    if (pool->tenant_key == SOCKS_TENANT_NONE) {
+        return 1;
+    }
+
+    if (socks_peer_fetch(connection_fd, peer) != 0) {
+        return 0;
+    }
+
+    id = (pool->tenant_key == SOCKS_TENANT_UID) ? (unsigned long) peer->uid :
+         (unsigned long) peer->pid;
+
+    pthread_mutex_lock(&pool->tenant_lock);
+    now = now_ns();
+    tenant = tenant_find(pool, id, now);
+
+    if ((tenant != NULL) && (tenant_charge(pool, tenant, now) != 0)) {
+        *job_tenant = tenant;
+        result = 1;
+    }
+
+    pthread_mutex_unlock(&pool->tenant_lock);
+    return result;
+}
+
+/** @brief Sheds a request that's been accepted but not read. The body still
+ * has to be drained: closing a unix socket with unread data resets the
+ * connection, and the client would never see the busy response. */
+static void pool_reject(struct socks_pool *pool, int connection_fd,
+                        uint16_t msgsize, struct socks_trace *trace,
+                        enum socks_priority priority)
+{
+    char discard;
+
+    if (msgsize != 0) {
+        socks_request_read(connection_fd, &discard, 1);
+    }
+
+    pool_shed(pool, connection_fd, trace, priority);
+    connection_close(connection_fd, trace);
+}
+
+/*----------------------------------------------------------------------------*/
+
+socks_pool_t *socks_pool_create(unsigned int threads,
+                                socks_callback_t callback)
+{
+    struct socks_pool *pool;
+    pthread_condattr_t monotonic;
+
+    if ((threads == 0) || (callback == NULL)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pool = calloc(1, sizeof(*pool) + (threads * sizeof(pool->workers[0])));
+
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->callback = callback;
+    pool->thread_count = threads;
+    pool->tenant_collect_at = tenant_collect_threshold;
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+    pthread_mutex_init(&pool->tenant_lock, NULL);
+
+    /* socks_pool_drain() times out by the monotonic clock, so that setting
+     * the system clock doesn't cut a drain short or stretch it out. */
+    pthread_condattr_init(&monotonic);
+    pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool->drain_cond, &monotonic);
+    pthread_condattr_destroy(&monotonic);
+
+    for (unsigned int x = 0; x < threads; x++) {
+        pool->workers[x].pool = pool;
+        pool->workers[x].index = x;
+        pthread_mutex_init(&pool->workers[x].lock, NULL);
+    }
+
+    for (unsigned int x = 0; x < threads; x++) {
+        int result = pthread_create(&pool->workers[x].thread, NULL,
+                                    worker_main, &pool->workers[x]);
+
+        if (result != 0) {
+            pool_stop(pool, x);
+            pool_free(pool);
+            errno = result;
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+int socks_pool_process(socks_pool_t *pool, int socket_fd)
+{
+    return socks_pool_process_priority(pool, socket_fd, SOCKS_PRIORITY_NORMAL);
+}
+
+int socks_pool_process_priority(socks_pool_t *pool, int socket_fd,
+                                enum socks_priority priority)
+{
+    int connection_fd;
+    ssize_t result;
+    uint16_t msgsize;
+    unsigned int target;
+    struct socks_job *job;
+    struct socks_tenant *tenant;
+    struct socks_peer peer;
+    struct socks_trace trace;
+
+    if (((int) priority < 0) || (priority >= SOCKS_PRIORITY_COUNT)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    connection_fd = socks_request_accept_traced(socket_fd, &msgsize, &trace);
+
+    if (connection_fd < 0) {
+        return connection_fd;
+    }
+
+    target = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+    target %= pool->thread_count;
+
+    /* Admission happens before the body is buffered, so that shedding a
+     * request costs as little as possible. Tenant limits come first, so that
+     * a throttled tenant can't push other tenants' requests out of the
+     * queue. */
+
+    if (pool_admit_tenant(pool, connection_fd, &peer, &tenant) == 0) {
+        __atomic_add_fetch(&pool->classes[priority].throttled, 1,
+                           __ATOMIC_RELAXED);
+        pool_reject(pool, connection_fd, msgsize, &trace, priority);
+        return 0;
+    }
+
+    if (pool_admit(pool, target, priority) == 0) {
+        tenant_release(pool, tenant);
+        pool_reject(pool, connection_fd, msgsize, &trace, priority);
+        return 0;
+    }
+
+    job = malloc(sizeof(*job) + msgsize + 1);
+
+    if (job == NULL) {
+        __atomic_sub_fetch(&pool->classes[priority].pending, 1,
+                           __ATOMIC_ACQ_REL);
+        tenant_release(pool, tenant);
+        connection_close(connection_fd, &trace);
+        return -1;
+    }
+
+    job->connection_fd = connection_fd;
+    job->priority = priority;
+    job->tenant = tenant;
+    job->peer = peer;
+    job->peer_known = (tenant != NULL);
+    job->trace = trace;
+    job->size = msgsize;
+    job->msg[msgsize] = '\x00';
+
+    result = socks_request_read(connection_fd, job->msg, msgsize);
+
+    if (result < 0) {
+        __atomic_sub_fetch(&pool->classes[priority].pending, 1,
+                           __ATOMIC_ACQ_REL);
+        tenant_release(pool, tenant);
+        job_discard(job);
+        return (int) result;
+    }
+
+    socks_trace_body(&job->trace, job->msg, msgsize);
+    return pool_submit(pool, target, job);
+}
+
+int socks_pool_set_limit(socks_pool_t *pool, enum socks_priority priority,
+                         unsigned int depth, enum socks_overload policy)
+{
+    if (((int) priority < 0) || (priority >= SOCKS_PRIORITY_COUNT) ||
+        ((policy != SOCKS_OVERLOAD_REJECT) &&
+         (policy != SOCKS_OVERLOAD_DROP_OLDEST))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pool->classes[priority].limit = depth;
+    pool->classes[priority].policy = policy;
+    return 0;
+}
+
+int socks_pool_set_busy(socks_pool_t *pool, const void *buf, uint16_t nbyte)
+{
+    char *copy = malloc((size_t) nbyte + 1);
+
+    if (copy == NULL) {
+        return -1;
+    }
+
+    if (nbyte != 0) {
+        memcpy(copy, buf, nbyte);
+    }
+
+    free(pool->busy_msg);
+    pool->busy_msg = copy;
+    pool->busy_len = nbyte;
+    return 0;
+}
+
+void socks_pool_set_cache(socks_pool_t *pool, socks_cache_t *cache)
+{
+    pool->cache = cache;
+}
+
+int socks_pool_set_tenants(socks_pool_t *pool, enum socks_tenant_key key,
+                           const struct socks_tenant_limits *limits)
+{
+    uint64_t now = now_ns();
+
+    if ((key != SOCKS_TENANT_NONE) && (key != SOCKS_TENANT_UID) &&
+        (key != SOCKS_TENANT_PID)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((limits != NULL) && (limits->rate < 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pool->tenant_key = key;
+    memset(&pool->limits, 0, sizeof(pool->limits));
+
+    if (limits != NULL) {
+        pool->limits = *limits;
+    }
+
+    if (pool->limits.burst == 0) {
+        pool->limits.burst = 1;
+    }
+
+    /* Tenants created early by socks_pool_set_weight() start full, as though
+     * they'd been created now. */
+    pthread_mutex_lock(&pool->tenant_lock);
+
+    for (int x = 0; x < tenant_bucket_count; x++) {
+        for (struct socks_tenant *tenant = pool->tenants[x]; tenant != NULL;
+             tenant = tenant->chain) {
+            tenant->tokens = (double) pool->limits.burst;
+            tenant->refilled_ns = now;
+        }
+    }
+
+    pthread_mutex_unlock(&pool->tenant_lock);
+    return 0;
+}
+
+int socks_pool_set_weight(socks_pool_t *pool, unsigned long id,
+                          unsigned int weight)
+{
+    struct socks_tenant *tenant;
+
+    if (weight == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool->tenant_lock);
+    tenant = tenant_find(pool, id, now_ns());
+
+    if (tenant != NULL) {
+        tenant->weight = weight;
+        tenant->pinned = 1;
+    }
+
+    pthread_mutex_unlock(&pool->tenant_lock);
+    return (tenant != NULL) ? 0 : -1;
+}
+
+void socks_pool_get_stats(socks_pool_t *pool, struct socks_pool_stats *stats)
+{
+    for (int x = 0; x < SOCKS_PRIORITY_COUNT; x++) {
+        struct socks_class *class = &pool->classes[x];
+
+        stats->depth[x] = __atomic_load_n(&class->pending, __ATOMIC_RELAXED);
+        stats->admitted[x] = __atomic_load_n(&class->admitted,
+                                             __ATOMIC_RELAXED);
+        stats->shed[x] = __atomic_load_n(&class->shed, __ATOMIC_RELAXED);
+        stats->throttled[x] = __atomic_load_n(&class->throttled,
+                                              __ATOMIC_RELAXED);
+        stats->completed[x] = __atomic_load_n(&class->completed,
+                                              __ATOMIC_RELAXED);
+    }
+}
+
+int socks_pool_drain(socks_pool_t *pool, unsigned int timeout_ms)
+{
+    struct timespec deadline;
+    int result = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += (time_t)(timeout_ms / 1000);
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&pool->idle_lock);
+
+    while ((__atomic_load_n(&pool->active, __ATOMIC_ACQUIRE) != 0) &&
+           (result == 0)) {
+        result = pthread_cond_timedwait(&pool->drain_cond, &pool->idle_lock,
+                                        &deadline);
+    }
+
+    pthread_mutex_unlock(&pool->idle_lock);
+
+    if (__atomic_load_n(&pool->active, __ATOMIC_ACQUIRE) != 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    return 0;
+}
+
+int socks_pool_destroy(socks_pool_t *pool)
+{
+    pool_stop(pool, pool->thread_count);
+    pool_free(pool);
+    return 0;
+}
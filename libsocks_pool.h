@@ -0,0 +1,191 @@
+#ifndef LIBSOCKS_POOL_H
+#define LIBSOCKS_POOL_H
+
+#include "libsocks.h"
+#include "libsocks_cache.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief Default response to shed requests (see socks_pool_set_busy()). */
+#define SOCKS_POOL_BUSY "busy"
+
+/** @brief Opaque handle for a libsocks worker pool. */
+typedef struct socks_pool socks_pool_t;
+
+/** @brief Priority classes for pooled requests. Workers always take queued
+ * requests of a higher class before those of a lower one. The class of a
+ * request is chosen by the server (typically by listening on one socket per
+ * class), and is given to socks_pool_process_priority(). */
+enum socks_priority {
+    SOCKS_PRIORITY_HIGH = 0,
+    SOCKS_PRIORITY_NORMAL,
+    SOCKS_PRIORITY_LOW,
+    SOCKS_PRIORITY_COUNT
+};
+
+/** @brief What to do when a request arrives for a priority class whose queue
+ * is already at its limit. The shed request is answered with the pool's busy
+ * response (see socks_pool_set_busy()) without running the callback. */
+enum socks_overload {
+    SOCKS_OVERLOAD_REJECT = 0,  /**< Shed the incoming request. */
+    SOCKS_OVERLOAD_DROP_OLDEST  /**< Shed the oldest queued request. */
+};
+
+/** @brief What identifies a tenant: the uid or the pid of the connecting
+ * process, as reported by SO_PEERCRED. */
+enum socks_tenant_key {
+    SOCKS_TENANT_NONE = 0,
+    SOCKS_TENANT_UID,
+    SOCKS_TENANT_PID
+};
+
+/** @brief Limits applied to each tenant separately. A request that exceeds
+ * them is shed with the pool's busy response. Zero means no limit. */
+struct socks_tenant_limits {
+    double rate;              /**< Sustained requests per second. */
+    unsigned int burst;       /**< Requests allowed at once above the rate. */
+    unsigned int concurrency; /**< Requests queued or running at once. */
+};
+
+/** @brief Per-class counters for a pool, as filled in by
+ * socks_pool_get_stats(). Requests evicted from the queue by
+ * SOCKS_OVERLOAD_DROP_OLDEST count as both admitted and shed, and requests
+ * that exceeded a tenant limit count as both throttled and shed. */
+struct socks_pool_stats {
+    unsigned long depth[SOCKS_PRIORITY_COUNT];     /**< Currently queued. */
+    unsigned long admitted[SOCKS_PRIORITY_COUNT];  /**< Accepted into queue. */
+    unsigned long shed[SOCKS_PRIORITY_COUNT];      /**< Answered as busy. */
+    unsigned long throttled[SOCKS_PRIORITY_COUNT]; /**< Over a tenant limit. */
+    unsigned long completed[SOCKS_PRIORITY_COUNT]; /**< Callback has run. */
+};
+
+/** @brief Creates a pool of worker threads that run a libsocks callback.
+ * Requests are handed to the pool with socks_pool_process(), which only
+ * reads the request from the socket. Each worker has its own queue, and idle
+ * workers steal queued requests from busy ones, so a few slow requests don't
+ * hold up the rest.
+ * @param[in] threads Number of worker threads to start.
+ * @param[in] callback Callback function for the workers to use. It may be
+ * called from several threads at once.
+ * @return Handle for the new pool, or NULL in the event of an error (in which
+ * case errno was set accordingly). */
+socks_pool_t *socks_pool_create(unsigned int threads,
+                                socks_callback_t callback);
+
+/** @brief Accepts a client from a libsocks server, reads its request and
+ * queues it for the pool. Should be called only when a client is connected
+ * and waiting, as determined by socks_server_wait() or socks_server_poll().
+ * Returns without waiting for the callback to run. May be called from several
+ * I/O threads at once.
+ * @param[in] pool Pool that should run the request.
+ * @param[in] socket_fd File descriptor of open libsocks server.
+ * @return Exit status of function.
+ * @retval 0 The request was queued.
+ * @retval <0 The request couldn't be read, and errno was set accordingly. */
+int socks_pool_process(socks_pool_t *pool, int socket_fd);
+
+/** @brief Same as socks_pool_process(), but queues the request in the given
+ * priority class instead of SOCKS_PRIORITY_NORMAL. If the class is at its
+ * limit, the request is shed before its body is read. A shed request still
+ * counts as processed (the return value is 0).
+ * @param[in] pool Pool that should run the request.
+ * @param[in] socket_fd File descriptor of open libsocks server.
+ * @param[in] priority Priority class for the request.
+ * @return Same as socks_pool_process(). */
+int socks_pool_process_priority(socks_pool_t *pool, int socket_fd,
+                                enum socks_priority priority);
+
+/** @brief Bounds the number of queued requests in a priority class. Queues
+ * are unbounded by default. Should be called before the pool starts serving.
+ * @param[in] pool Pool to configure.
+ * @param[in] priority Priority class to limit.
+ * @param[in] depth Maximum number of queued requests, or 0 for no limit.
+ * @param[in] policy Which request to shed when the limit is reached.
+ * @return Exit status of function.
+ * @retval 0 Limit was set.
+ * @retval -1 An argument was invalid, and errno was set to EINVAL. */
+int socks_pool_set_limit(socks_pool_t *pool, enum socks_priority priority,
+                         unsigned int depth, enum socks_overload policy);
+
+/** @brief Groups requests by tenant, so that no single client can hold up
+ * the rest. Within each priority class, queued requests are then served
+ * round-robin across tenants (weighted by socks_pool_set_weight()) rather
+ * than in arrival order, SOCKS_OVERLOAD_DROP_OLDEST sheds from the tenant
+ * with the most requests queued, and each tenant is held to 'limits'. The
+ * peer's credentials are read once per connection, and are also available to
+ * the callback through socks_server_peer(). Must be called before the pool
+ * starts serving.
+ * @param[in] pool Pool to configure.
+ * @param[in] key How tenants are told apart, or SOCKS_TENANT_NONE to turn
+ * tenants off (the default).
+ * @param[in] limits Per-tenant limits, or NULL for none. A zero burst is
+ * taken as 1.
+ * @return Exit status of function.
+ * @retval 0 Tenants were configured.
+ * @retval -1 An argument was invalid, and errno was set to EINVAL. */
+int socks_pool_set_tenants(socks_pool_t *pool, enum socks_tenant_key key,
+                           const struct socks_tenant_limits *limits);
+
+/** @brief Sets a tenant's share of the workers: when several tenants have
+ * requests queued in the same class, a tenant of weight N gets N of its
+ * requests served for each one of a tenant of weight 1. The default weight
+ * is 1. May be called while the pool is serving.
+ * @param[in] pool Pool to configure.
+ * @param[in] id Uid or pid of the tenant, depending on the key given to
+ * socks_pool_set_tenants().
+ * @param[in] weight Weight of the tenant (at least 1).
+ * @return Exit status of function.
+ * @retval 0 Weight was set.
+ * @retval -1 The weight was 0 (EINVAL), or memory couldn't be allocated. */
+int socks_pool_set_weight(socks_pool_t *pool, unsigned long id,
+                          unsigned int weight);
+
+/** @brief Sets the response that's sent to shed requests. The default is
+ * SOCKS_POOL_BUSY (including its NUL), so that clients can tell a shed
+ * request from an empty response. The buffer is copied. Should be called
+ * before the pool starts serving.
+ * @param[in] pool Pool to configure.
+ * @param[in] buf Buffer holding the busy response (may be NULL if 'nbyte' is
+ * 0).
+ * @param[in] nbyte Length of the busy response (in bytes).
+ * @return Exit status of function.
+ * @retval 0 Busy response was set.
+ * @retval -1 The buffer couldn't be copied, and errno was set accordingly. */
+int socks_pool_set_busy(socks_pool_t *pool, const void *buf, uint16_t nbyte);
+
+/** @brief Makes the pool answer cacheable requests from 'cache' when
+ * possible, as described for socks_server_process_cached(). Should be called
+ * before the pool starts serving.
+ * @param[in] pool Pool to configure.
+ * @param[in] cache Cache to use, or NULL for none. */
+void socks_pool_set_cache(socks_pool_t *pool, socks_cache_t *cache);
+
+/** @brief Takes a snapshot of a pool's counters. Each counter is read
+ * atomically, but the snapshot as a whole isn't.
+ * @param[in] pool Pool to inspect.
+ * @param[out] stats Destination for the counters. */
+void socks_pool_get_stats(socks_pool_t *pool, struct socks_pool_stats *stats);
+
+/** @brief Waits until every request the pool has accepted so far has been
+ * answered, for at most 'timeout_ms' milliseconds. Used to drain a pool
+ * before exiting, once the caller has stopped calling socks_pool_process().
+ * @param[in] pool Pool to drain.
+ * @param[in] timeout_ms Deadline in milliseconds.
+ * @return Exit status of function.
+ * @retval 0 No requests are queued or running.
+ * @retval -1 The deadline passed first (errno is set to ETIMEDOUT). */
+int socks_pool_drain(socks_pool_t *pool, unsigned int timeout_ms);
+
+/** @brief Waits for all queued requests to finish, then stops the pool's
+ * threads and frees it.
+ * @param[in] pool Pool to destroy.
+ * @return Exit status of function. Always 0. */
+int socks_pool_destroy(socks_pool_t *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,311 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libsocks_prefork.h"
+
+/*----------------------------------------------------------------------------*/
+
+enum {
+    respawn_window_ms = 1000,
+    respawn_delay_ms = 100
+};
+
+struct worker {
+    pid_t pid;
+    struct timespec started;
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+static pid_t supervisor_pid = 0;
+
+/*----------------------------------------------------------------------------*/
+
+static void handle_stop(int signo)
+{
+    (void) signo;
+    stop_requested = 1;
+}
+
+static void handle_child(int signo)
+{
+    /* Only installed so that SIGCHLD interrupts sigsuspend(). */
+    (void) signo;
+}
+
+static long elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((now.tv_sec - start->tv_sec) * 1000L) +
+           ((now.tv_nsec - start->tv_nsec) / 1000000L);
+}
+
+/** @brief Sleeps for the specified number of milliseconds with 'wait_mask'
+ * installed as the signal mask, so that a stop request can still be handled
+ * while the supervisor is backing off. */
+static void supervisor_sleep(unsigned int count, const sigset_t *wait_mask)
+{
+    sigset_t saved_mask;
+    struct timespec duration = {
+        .tv_sec = count / 1000,
+        .tv_nsec = (long)(count % 1000) * 1000000L
+    };
+
+    sigprocmask(SIG_SETMASK, wait_mask, &saved_mask);
+    nanosleep(&duration, NULL);
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+}
+
+/** @brief Main loop of a worker process. Stop signals are held off while a
+ * request is being processed, so a worker is only ever terminated between
+ * requests. Never returns. */
+static void worker_run(int socket_fd, socks_callback_t callback,
+                       const sigset_t *stop_signals)
+{
+    while (1) {
+        if (socks_server_wait(socket_fd) != 0) {
+            _exit(EXIT_FAILURE);
+        }
+
+        /* A failed request (or a lost accept() race on the shared socket)
+         * shouldn't take the worker down with it. */
+
+        sigprocmask(SIG_BLOCK, stop_signals, NULL);
+        socks_server_process(socket_fd, callback);
+        sigprocmask(SIG_UNBLOCK, stop_signals, NULL);
+    }
+}
+
+static pid_t worker_spawn(int socket_fd, socks_callback_t callback,
+                          const sigset_t *worker_mask,
+                          const sigset_t *stop_signals)
+{
+    struct sigaction default_action;
+    pid_t pid = fork();
+
+    if (pid != 0) {
+        return pid;
+    }
+
+    default_action.sa_handler = SIG_DFL;
+    default_action.sa_flags = 0;
+    sigemptyset(&default_action.sa_mask);
+
+    sigaction(SIGTERM, &default_action, NULL);
+    sigaction(SIGINT, &default_action, NULL);
+    sigaction(SIGCHLD, &default_action, NULL);
+    sigprocmask(SIG_SETMASK, worker_mask, NULL);
+
+    worker_run(socket_fd, callback, stop_signals);
+    _exit(EXIT_FAILURE);
+}
+
+/** @brief Reaps any workers that have exited. Returns 1 if at least one of
+ * them died shortly after being started (which suggests that respawning
+ * should be throttled), and 0 otherwise. */
+static int workers_reap(struct worker *workers, unsigned int count)
+{
+    int crashed_early = 0;
+
+    for (unsigned int x = 0; x < count; x++) {
+        int status;
+
+        if (workers[x].pid <= 0) {
+            continue;
+        }
+
+        if (waitpid(workers[x].pid, &status, WNOHANG) != workers[x].pid) {
+            continue;
+        }
+
+        if (elapsed_ms(&workers[x].started) < respawn_window_ms) {
+            crashed_early = 1;
+        }
+
+        workers[x].pid = -1;
+    }
+
+    return crashed_early;
+}
+
+/** @brief Starts a worker in every empty slot. Returns the number of slots
+ * that are still empty afterwards (because fork() failed). */
+static unsigned int workers_fill(struct worker *workers, unsigned int count,
+                                 int socket_fd, socks_callback_t callback,
+                                 const sigset_t *worker_mask,
+                                 const sigset_t *stop_signals)
+{
+    unsigned int missing = 0;
+
+    for (unsigned int x = 0; x < count; x++) {
+        if (workers[x].pid > 0) {
+            continue;
+        }
+
+        workers[x].pid = worker_spawn(socket_fd, callback, worker_mask,
+                                      stop_signals);
+
+        if (workers[x].pid < 0) {
+            missing++;
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &workers[x].started);
+    }
+
+    return missing;
+}
+
+static void workers_stop(struct worker *workers, unsigned int count)
+{
+    for (unsigned int x = 0; x < count; x++) {
+        if (workers[x].pid > 0) {
+            kill(workers[x].pid, SIGTERM);
+        }
+    }
+
+    for (unsigned int x = 0; x < count; x++) {
+        if (workers[x].pid > 0) {
+            int status;
+
+            while ((waitpid(workers[x].pid, &status, 0) < 0) &&
+                   (errno == EINTR)) {
+                continue;
+            }
+
+            workers[x].pid = -1;
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+int socks_server_prefork(int socket_fd, unsigned int count,
+                         socks_callback_t callback)
+{
+    int flags;
+    sigset_t stop_signals;
+    sigset_t blocked_signals;
+    sigset_t original_mask;
+    sigset_t wait_mask;
+    struct sigaction stop_action;
+    struct sigaction child_action;
+    struct sigaction old_term;
+    struct sigaction old_int;
+    struct sigaction old_child;
+    struct worker *workers;
+
+    if ((count == 0) || (supervisor_pid != 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    flags = fcntl(socket_fd, F_GETFL);
+
+    if (flags < 0) {
+        return -1;
+    }
+
+    workers = calloc(count, sizeof(*workers));
+
+    if (workers == NULL) {
+        return -1;
+    }
+
+    if (fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+        free(workers);
+        return -1;
+    }
+
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGINT);
+
+    blocked_signals = stop_signals;
+    sigaddset(&blocked_signals, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &blocked_signals, &original_mask);
+
+    wait_mask = original_mask;
+    sigdelset(&wait_mask, SIGTERM);
+    sigdelset(&wait_mask, SIGINT);
+    sigdelset(&wait_mask, SIGCHLD);
+
+    stop_action.sa_handler = handle_stop;
+    stop_action.sa_flags = 0;
+    sigemptyset(&stop_action.sa_mask);
+
+    child_action.sa_handler = handle_child;
+    child_action.sa_flags = SA_NOCLDSTOP;
+    sigemptyset(&child_action.sa_mask);
+
+    sigaction(SIGTERM, &stop_action, &old_term);
+    sigaction(SIGINT, &stop_action, &old_int);
+    sigaction(SIGCHLD, &child_action, &old_child);
+
+    stop_requested = 0;
+    supervisor_pid = getpid();
+
+    for (unsigned int x = 0; x < count; x++) {
+        workers[x].pid = -1;
+    }
+
+    while (stop_requested == 0) {
+        unsigned int missing;
+
+        if (workers_reap(workers, count) != 0) {
+            supervisor_sleep(respawn_delay_ms, &wait_mask);
+        }
+
+        if (stop_requested != 0) {
+            break;
+        }
+
+        missing = workers_fill(workers, count, socket_fd, callback, &wait_mask,
+                               &stop_signals);
+
+        /* If fork() failed, there may be no child left to wake us up with
+         * SIGCHLD, so back off and retry instead of suspending. */
+
+        if (missing != 0) {
+            supervisor_sleep(respawn_delay_ms, &wait_mask);
+        } else {
+            sigsuspend(&wait_mask);
+        }
+    }
+
+    workers_stop(workers, count);
+    free(workers);
+
+    sigaction(SIGTERM, &old_term, NULL);
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGCHLD, &old_child, NULL);
+    sigprocmask(SIG_SETMASK, &original_mask, NULL);
+
+    supervisor_pid = 0;
+    fcntl(socket_fd, F_SETFL, flags);
+    return 0;
+}
+
+int socks_server_prefork_stop(void)
+{
+    if (supervisor_pid == 0) {
+        errno = ESRCH;
+        return -1;
+    }
+
+    if (getpid() == supervisor_pid) {
+        stop_requested = 1;
+        return 0;
+    }
+
+    return kill(supervisor_pid, SIGTERM);
+}
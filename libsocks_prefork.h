@@ -0,0 +1,41 @@
+#ifndef LIBSOCKS_PREFORK_H
+#define LIBSOCKS_PREFORK_H
+
+#include "libsocks.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief Runs an open libsocks server as a pool of pre-forked worker
+ * processes. Each worker runs the normal socks_server_wait() /
+ * socks_server_process() loop on the shared listening socket. The calling
+ * process becomes a supervisor: it restarts any worker that exits, and keeps
+ * the pool at 'count' workers until SIGTERM or SIGINT is received (or until
+ * socks_server_prefork_stop() is called). The listening socket is switched to
+ * non-blocking mode while the pool is running, so that workers which lose an
+ * accept() race go back to waiting instead of blocking.
+ *
+ * @param[in] socket_fd File descriptor of open libsocks server.
+ * @param[in] count Number of worker processes to run.
+ * @param[in] callback Callback function for the workers to use.
+ * @return Exit status of function.
+ * @retval 0 The pool was stopped and all workers were reaped.
+ * @retval -1 The pool couldn't be started, and errno was set accordingly. */
+int socks_server_prefork(int socket_fd, unsigned int count,
+                         socks_callback_t callback);
+
+/** @brief Requests shutdown of the running pre-forked server. Safe to call
+ * from a worker's callback (the supervisor is signalled), or from a signal
+ * handler in the supervisor. Workers finish their current request before
+ * exiting.
+ * @return Exit status of function.
+ * @retval 0 Shutdown was requested.
+ * @retval -1 No pre-forked server is running, and errno was set to ESRCH. */
+int socks_server_prefork_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
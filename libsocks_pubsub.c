@@ -0,0 +1,546 @@
+#define _GNU_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "eintr_wrappers.h"
+#include "libsocks_pubsub.h"
+#include "libsocks_pvt.h"
+
+/*----------------------------------------------------------------------------*/
+
+enum {
+    batch_packets = 64,
+    handshake_timeout_ms = 100
+};
+
+/** @brief A published message, shared by every subscriber queue it's on.
+ * 'data' holds the topic, its NUL terminator, and then the message. */
+struct socks_message {
+    unsigned int refs;
+    uint16_t topic_len;
+    uint16_t len;
+    char header[2];
+    char data[];
+};
+
+struct socks_subscriber {
+    int fd;
+    char *topics;
+    uint16_t topics_len;
+    unsigned int head;
+    unsigned int count;
+    unsigned char header_sent;
+    struct socks_message **queue;
+};
+
+struct socks_pubsub {
+    unsigned int queue_limit;
+    enum socks_slow_policy policy;
+    unsigned int count;
+    unsigned int capacity;
+    unsigned long dropped;
+    struct socks_subscriber *subscribers;
+};
+
+/*----------------------------------------------------------------------------*/
+
+static void message_release(struct socks_message *message)
+{
+    if (--message->refs == 0) {
+        free(message);
+    }
+}
+
+static int message_same_topic(const struct socks_message *a,
+                              const struct socks_message *b)
+{
+    return (a->topic_len == b->topic_len) &&
+           (memcmp(a->data, b->data, a->topic_len) == 0);
+}
+
+static struct socks_message **queue_slot(const struct socks_pubsub *pubsub,
+                                         struct socks_subscriber *sub,
+                                         unsigned int index)
+{
+    return &sub->queue[(sub->head + index) % pubsub->queue_limit];
+}
+
+static int subscriber_wants(const struct socks_subscriber *sub,
+                            const struct socks_message *message)
+{
+    const char *cursor = sub->topics;
+    const char *end = sub->topics + sub->topics_len;
+
+    while (cursor < end) {
+        size_t length = strnlen(cursor, (size_t)(end - cursor));
+
+        if ((length == message->topic_len) &&
+            (memcmp(cursor, message->data, length) == 0)) {
+            return 1;
+        }
+
+        cursor += length + 1;
+    }
+
+    return 0;
+}
+
+/** @brief Closes a subscriber and removes it from the publisher. The last
+ * subscriber is moved into its slot. */
+static void subscriber_remove(struct socks_pubsub *pubsub, unsigned int index)
+{
+    struct socks_subscriber *sub = &pubsub->subscribers[index];
+
+    for (unsigned int x = 0; x < sub->count; x++) {
+        message_release(*queue_slot(pubsub, sub, x));
+    }
+
+    close_noeintr(sub->fd);
+    free(sub->queue);
+    free(sub->topics);
+
+    pubsub->count--;
+    pubsub->subscribers[index] = pubsub->subscribers[pubsub->count];
+}
+
+/** @brief Applies SOCKS_SLOW_COALESCE to a full queue: the new message
+ * replaces a queued one on the same topic in place, or else the oldest queued
+ * message is dropped. A message that's partly sent is never touched. Returns
+ * 1 if the new message was queued, and 0 if it was dropped. */
+static int subscriber_coalesce(struct socks_pubsub *pubsub,
+                               struct socks_subscriber *sub,
+                               struct socks_message *message)
+{
+    unsigned int first = (sub->header_sent != 0) ? 1 : 0;
+
+    pubsub->dropped++;
+
+    if (first >= sub->count) {
+        return 0;
+    }
+
+    for (unsigned int x = first; x < sub->count; x++) {
+        struct socks_message **slot = queue_slot(pubsub, sub, x);
+
+        if (message_same_topic(*slot, message)) {
+            message_release(*slot);
+            *slot = message;
+            message->refs++;
+            return 1;
+        }
+    }
+
+    message_release(*queue_slot(pubsub, sub, first));
+
+    for (unsigned int x = first + 1; x < sub->count; x++) {
+        *queue_slot(pubsub, sub, x - 1) = *queue_slot(pubsub, sub, x);
+    }
+
+    *queue_slot(pubsub, sub, sub->count - 1) = message;
+    message->refs++;
+    return 1;
+}
+
+/** @brief Queues a message for one subscriber. Returns 1 if it was queued,
+ * 0 if it was dropped, and -1 if the subscriber should be disconnected. */
+static int subscriber_enqueue(struct socks_pubsub *pubsub,
+                              struct socks_subscriber *sub,
+                              struct socks_message *message)
+{
+    if (sub->count < pubsub->queue_limit) {
+        *queue_slot(pubsub, sub, sub->count) = message;
+        message->refs++;
+        sub->count++;
+        return 1;
+    }
+
+    switch (pubsub->policy) {
+        case SOCKS_SLOW_DROP:
+            pubsub->dropped++;
+            return 0;
+
+        case SOCKS_SLOW_COALESCE:
+            return subscriber_coalesce(pubsub, sub, message);
+
+        default:
+            pubsub->dropped++;
+            return -1;
+    }
+}
+
+/** @brief Sends a batch of packets without blocking. Returns the number of
+ * packets that were sent, or -1 if none could be. */
+static int send_packets(int fd, struct iovec *iov, unsigned int count)
+{
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr packets[batch_packets];
+    int result;
+
+    memset(packets, 0, count * sizeof(packets[0]));
+
+    for (unsigned int x = 0; x < count; x++) {
+        packets[x].msg_hdr.msg_iov = &iov[x];
+        packets[x].msg_hdr.msg_iovlen = 1;
+    }
+
+    do {
+        result = sendmmsg(fd, packets, count, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while ((result < 0) && (errno == EINTR));
+
+    return result;
+#else
+    unsigned int sent = 0;
+
+    while (sent < count) {
+        ssize_t result = send(fd, iov[sent].iov_base, iov[sent].iov_len,
+                              MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if ((result < 0) && (errno == EINTR)) {
+            continue;
+        }
+
+        if (result < 0) {
+            return (sent == 0) ? -1 : (int) sent;
+        }
+
+        sent++;
+    }
+
+    return (int) sent;
+#endif
+}
+
+/** @brief Sends as much of a subscriber's queue as the socket will take.
+ * Each message is two packets (header and body), and as many as
+ * batch_packets go out per system call. Returns 1 if data is still queued,
+ * 0 if the queue was emptied, and -1 if the connection failed. */
+static int subscriber_flush(struct socks_pubsub *pubsub,
+                            struct socks_subscriber *sub)
+{
+    while (sub->count != 0) {
+        struct iovec iov[batch_packets];
+        unsigned int used = 0;
+        unsigned int index = 0;
+        int header = (sub->header_sent == 0);
+        int sent;
+
+        while ((used < batch_packets) && (index < sub->count)) {
+            struct socks_message *message = *queue_slot(pubsub, sub, index);
+
+            if (header) {
+                iov[used].iov_base = message->header;
+                iov[used].iov_len = 2;
+            } else {
+                iov[used].iov_base = message->data;
+                iov[used].iov_len = message->len;
+                index++;
+            }
+
+            header = !header;
+            used++;
+        }
+
+        sent = send_packets(sub->fd, iov, used);
+
+        if (sent < 0) {
+            return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 1 : -1;
+        }
+
+        for (int x = 0; x < sent; x++) {
+            if (sub->header_sent == 0) {
+                sub->header_sent = 1;
+                continue;
+            }
+
+            message_release(*queue_slot(pubsub, sub, 0));
+            sub->head = (sub->head + 1) % pubsub->queue_limit;
+            sub->count--;
+            sub->header_sent = 0;
+        }
+
+        if ((unsigned int) sent < used) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+socks_pubsub_t *socks_pubsub_create(unsigned int queue_limit,
+                                    enum socks_slow_policy policy)
+{
+    struct socks_pubsub *pubsub;
+
+    if ((queue_limit == 0) || ((int) policy < 0) ||
+        (policy > SOCKS_SLOW_COALESCE)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pubsub = calloc(1, sizeof(*pubsub));
+
+    if (pubsub == NULL) {
+        return NULL;
+    }
+
+    pubsub->queue_limit = queue_limit;
+    pubsub->policy = policy;
+    return pubsub;
+}
+
+void socks_pubsub_destroy(socks_pubsub_t *pubsub)
+{
+    while (pubsub->count != 0) {
+        subscriber_remove(pubsub, pubsub->count - 1);
+    }
+
+    free(pubsub->subscribers);
+    free(pubsub);
+}
+
+int socks_pubsub_accept(socks_pubsub_t *pubsub, int socket_fd)
+{
+    const struct timeval timeout = {
+        .tv_sec = handshake_timeout_ms / 1000,
+        .tv_usec = (handshake_timeout_ms % 1000) * 1000
+    };
+    int connection_fd;
+    ssize_t result;
+    struct socks_subscriber sub;
+
+    if (pubsub->count == pubsub->capacity) {
+        unsigned int capacity = (pubsub->capacity == 0) ? 8 :
+                                (pubsub->capacity * 2);
+        struct socks_subscriber *subscribers;
+
+        subscribers = realloc(pubsub->subscribers,
+                              capacity * sizeof(*subscribers));
+
+        if (subscribers == NULL) {
+            return -1;
+        }
+
+        pubsub->subscribers = subscribers;
+        pubsub->capacity = capacity;
+    }
+
+    connection_fd = accept_noeintr(socket_fd, NULL, NULL);
+
+    if (connection_fd < 0) {
+        return connection_fd;
+    }
+
+    /* The publisher is single-threaded, so a subscriber that connects and
+     * then stalls must not hold it up for longer than the timeout. */
+    memset(&sub, 0, sizeof(sub));
+    sub.fd = connection_fd;
+    sub.queue = calloc(pubsub->queue_limit, sizeof(sub.queue[0]));
+
+    if ((sub.queue == NULL) ||
+        (setsockopt(connection_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                    sizeof(timeout)) != 0)) {
+        result = -1;
+    } else {
+        result = socks_frame_recv_alloc(connection_fd, &sub.topics);
+
+        if ((result < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            errno = ETIMEDOUT;
+        }
+    }
+
+    if (result >= 0) {
+        sub.topics_len = (uint16_t) result;
+        result = socks_frame_send(connection_fd, "", 0);
+    }
+
+    if (result < 0) {
+        int prev_errno = errno;
+        close_noeintr(connection_fd);
+        free(sub.topics);
+        free(sub.queue);
+        errno = prev_errno;
+        return (int) result;
+    }
+
+    pubsub->subscribers[pubsub->count++] = sub;
+    return 0;
+}
+
+int socks_pubsub_publish(socks_pubsub_t *pubsub, const char *topic,
+                         const void *buf, uint16_t nbyte)
+{
+    size_t topic_len = strnlen(topic, UINT16_MAX);
+    size_t total = topic_len + 1 + nbyte;
+    struct socks_message *message;
+    int queued = 0;
+
+    if (total > UINT16_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    message = malloc(sizeof(*message) + total);
+
+    if (message == NULL) {
+        return -1;
+    }
+
+    message->refs = 1;
+    message->topic_len = (uint16_t) topic_len;
+    message->len = (uint16_t) total;
+    socks_frame_header(message->len, message->header);
+    memcpy(message->data, topic, topic_len);
+    message->data[topic_len] = '\x00';
+    memcpy(message->data + topic_len + 1, buf, nbyte);
+
+    for (unsigned int x = 0; x < pubsub->count;) {
+        struct socks_subscriber *sub = &pubsub->subscribers[x];
+        int result;
+
+        if (subscriber_wants(sub, message) == 0) {
+            x++;
+            continue;
+        }
+
+        result = subscriber_enqueue(pubsub, sub, message);
+
+        if (result < 0) {
+            subscriber_remove(pubsub, x);
+            continue;
+        }
+
+        queued += result;
+        x++;
+    }
+
+    message_release(message);
+    return queued;
+}
+
+int socks_pubsub_flush(socks_pubsub_t *pubsub)
+{
+    int pending = 0;
+
+    for (unsigned int x = 0; x < pubsub->count;) {
+        int result = subscriber_flush(pubsub, &pubsub->subscribers[x]);
+
+        if (result < 0) {
+            subscriber_remove(pubsub, x);
+            continue;
+        }
+
+        pending += result;
+        x++;
+    }
+
+    return pending;
+}
+
+unsigned int socks_pubsub_count(socks_pubsub_t *pubsub)
+{
+    return pubsub->count;
+}
+
+unsigned long socks_pubsub_dropped(socks_pubsub_t *pubsub)
+{
+    return pubsub->dropped;
+}
+
+/*----------------------------------------------------------------------------*/
+
+int socks_subscribe(const char *filename, const char *const *topics)
+{
+    size_t total = 0;
+    size_t offset = 0;
+    int socket_fd;
+    ssize_t result;
+    char ack;
+
+    for (const char *const *topic = topics; *topic != NULL; topic++) {
+        total += strnlen(*topic, UINT16_MAX) + 1;
+    }
+
+    if (total > UINT16_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    char buffer[total + 1];
+
+    for (const char *const *topic = topics; *topic != NULL; topic++) {
+        size_t length = strnlen(*topic, UINT16_MAX);
+
+        memcpy(buffer + offset, *topic, length);
+        buffer[offset + length] = '\x00';
+        offset += length + 1;
+    }
+
+    socket_fd = socks_client_connect(filename);
+
+    if (socket_fd < 0) {
+        return socket_fd;
+    }
+
+    result = socks_frame_send(socket_fd, buffer, (uint16_t) total);
+
+    if (result >= 0) {
+        result = socks_frame_recv(socket_fd, &ack, 0);
+    }
+
+    if (result < 0) {
+        close_noeintr(socket_fd);
+        return (int) result;
+    }
+
+    return socket_fd;
+}
+
+ssize_t socks_subscription_recv(int subscription_fd, char *topic,
+                                size_t topic_size, char *output,
+                                uint16_t maxlen)
+{
+    ssize_t result;
+    size_t topic_len;
+    size_t copied;
+
+    result = socks_frame_recv(subscription_fd, output, maxlen);
+
+    if (result < 0) {
+        return result;
+    }
+
+    topic_len = strnlen(output, (size_t) result);
+
+    if (topic_len == (size_t) result) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    if (topic_size != 0) {
+        copied = (topic_len < topic_size) ? topic_len : (topic_size - 1);
+        memcpy(topic, output, copied);
+        topic[copied] = '\x00';
+    }
+
+    result -= (ssize_t)(topic_len + 1);
+    memmove(output, output + topic_len + 1, (size_t) result);
+    return result;
+}
+
+int socks_subscription_close(int subscription_fd)
+{
+    return close_noeintr(subscription_fd);
+}
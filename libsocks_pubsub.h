@@ -0,0 +1,116 @@
+#ifndef LIBSOCKS_PUBSUB_H
+#define LIBSOCKS_PUBSUB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief Opaque handle for a libsocks publisher. */
+typedef struct socks_pubsub socks_pubsub_t;
+
+/** @brief What to do when a message is published to a subscriber whose
+ * queue is already full (because it isn't reading fast enough). */
+enum socks_slow_policy {
+    SOCKS_SLOW_DISCONNECT = 0, /**< Close the subscriber's connection. */
+    SOCKS_SLOW_DROP,           /**< Drop the new message for it. */
+    SOCKS_SLOW_COALESCE        /**< Replace its queued message on the same
+                                    topic (or else its oldest one). */
+};
+
+/*----------------------------------------------------------------------------*/
+
+/** @brief Creates a publisher. Subscribers connect to a libsocks server
+ * socket (opened with socks_server_open()) that's dedicated to
+ * subscriptions, and are added with socks_pubsub_accept(). Published messages
+ * are reference-counted and shared between all of their subscribers' queues.
+ * A publisher isn't thread-safe, and should be driven from a single thread.
+ * @param[in] queue_limit Maximum number of messages queued per subscriber.
+ * @param[in] policy What to do when a subscriber's queue is full.
+ * @return Handle for the new publisher, or NULL in the event of an error (in
+ * which case errno was set accordingly). */
+socks_pubsub_t *socks_pubsub_create(unsigned int queue_limit,
+                                    enum socks_slow_policy policy);
+
+/** @brief Closes all subscriber connections and frees a publisher. */
+void socks_pubsub_destroy(socks_pubsub_t *pubsub);
+
+/** @brief Accepts a subscriber from a libsocks server, reads its topic list,
+ * and acknowledges the subscription. Should be called only when a client is
+ * waiting, as determined by socks_server_wait() or socks_server_poll(). A
+ * client that doesn't send its topic list within 100ms is dropped, and this
+ * fails with ETIMEDOUT, so a stalled subscriber can't hold up publishing.
+ * @param[in] pubsub Publisher to add the subscriber to.
+ * @param[in] socket_fd File descriptor of the open subscription server.
+ * @return Exit status of function.
+ * @retval 0 The subscriber was added.
+ * @retval <0 The subscriber couldn't be added, and errno was set
+ * accordingly. */
+int socks_pubsub_accept(socks_pubsub_t *pubsub, int socket_fd);
+
+/** @brief Queues a message for every subscriber of 'topic'. Nothing is sent
+ * until socks_pubsub_flush() is called, so several messages can go out in
+ * one batch.
+ * @param[in] pubsub Publisher to publish through.
+ * @param[in] topic NUL-terminated topic name.
+ * @param[in] buf Message to publish.
+ * @param[in] nbyte Length of the message (in bytes). The topic, its
+ * terminator and the message must fit in 65535 bytes together.
+ * @return Number of subscribers the message was queued for, or -1 in the
+ * event of an error (in which case errno was set accordingly). */
+int socks_pubsub_publish(socks_pubsub_t *pubsub, const char *topic,
+                         const void *buf, uint16_t nbyte);
+
+/** @brief Sends as much queued data as possible to every subscriber without
+ * blocking. Subscribers whose connection has failed are dropped.
+ * @param[in] pubsub Publisher to flush.
+ * @return Number of subscribers that still have data queued (so the caller
+ * should flush again once they're writable). */
+int socks_pubsub_flush(socks_pubsub_t *pubsub);
+
+/** @brief Returns the number of connected subscribers. */
+unsigned int socks_pubsub_count(socks_pubsub_t *pubsub);
+
+/** @brief Returns the number of messages that have been dropped or coalesced
+ * because of slow subscribers. */
+unsigned long socks_pubsub_dropped(socks_pubsub_t *pubsub);
+
+/*----------------------------------------------------------------------------*/
+
+/** @brief Connects to a subscription server and subscribes to a list of
+ * topics. Returns once the server has acknowledged the subscription, so
+ * every message published after that point will be received.
+ * @param[in] filename Filename of the subscription server's socketfile.
+ * @param[in] topics NULL-terminated array of NUL-terminated topic names.
+ * @return File descriptor of the subscription, or a negative number in the
+ * event of an error (in which case errno was set accordingly). */
+int socks_subscribe(const char *filename, const char *const *topics);
+
+/** @brief Receives the next published message from a subscription. Blocks
+ * until a message arrives (socks_server_wait() or socks_server_poll() can be
+ * used on the subscription's file descriptor to avoid that).
+ * @param[in] subscription_fd File descriptor returned by socks_subscribe().
+ * @param[out] topic Buffer for the message's NUL-terminated topic. Long
+ * topics are truncated.
+ * @param[in] topic_size Size of the topic buffer (in bytes).
+ * @param[out] output Buffer for the message. It's also used as scratch space
+ * while receiving, so it needs room for the topic and its terminator too.
+ * @param[in] maxlen Size of the output buffer (in bytes).
+ * @return Length of the message, or a negative number in the event of an
+ * error (in which case errno was set accordingly). A message that doesn't fit
+ * fails with EMSGSIZE and is skipped, so the subscription stays usable. */
+ssize_t socks_subscription_recv(int subscription_fd, char *topic,
+                                size_t topic_size, char *output,
+                                uint16_t maxlen);
+
+/** @brief Closes a subscription. */
+int socks_subscription_close(int subscription_fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,241 @@
+#ifndef LIBSOCKS_PVT_H
+#define LIBSOCKS_PVT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "libsocks.h"
+#include "libsocks_cache.h"
+#include "libsocks_log.h"
+#include "libsocks_slowlog.h"
+
+/* Internal request-handling steps shared between the libsocks translation
+ * units. Not part of the installed API. */
+
+/** @brief Accepts a pending connection on a libsocks server and reads the
+ * request header from it.
+ * @param[in] socket_fd File descriptor of open libsocks server.
+ * @param[out] msgsize Length of the request body that follows.
+ * @return File descriptor of the accepted connection, or a negative number
+ * in the event of an error (in which case nothing is left open). */
+int socks_request_accept(int socket_fd, uint16_t *msgsize);
+
+/** @brief Reads a request body of 'msgsize' bytes from an accepted
+ * connection. Same return convention as read(). */
+ssize_t socks_request_read(int connection_fd, char *buf, uint16_t msgsize);
+
+/** @brief Runs 'callback' on a request that has already been read, and sends
+ * an empty response if the callback didn't respond. Doesn't close the
+ * connection.
+ * @return Callback's exit code, or the failing function's return code if
+ * communications failed. */
+int socks_request_dispatch(int connection_fd, socks_callback_t callback,
+                           const char *msg, uint16_t len);
+
+/** @brief Same as socks_request_dispatch(), but answers the request from
+ * 'cache' if possible, and stores the callback's response in it otherwise.
+ * 'cache' may be NULL. */
+int socks_request_dispatch_cached(int connection_fd, socks_callback_t callback,
+                                  socks_cache_t *cache, const char *msg,
+                                  uint16_t len);
+
+/** @brief Same as socks_request_dispatch_cached(), but with the peer's
+ * credentials already known (as fetched by socks_peer_fetch()), so that
+ * socks_server_peer() doesn't have to ask the kernel again. 'peer' may be
+ * NULL. */
+int socks_request_dispatch_peer(int connection_fd, socks_callback_t callback,
+                                socks_cache_t *cache,
+                                const struct socks_peer *peer,
+                                const char *msg, uint16_t len);
+
+struct socks_batch;
+
+/** @brief Same as socks_request_dispatch(), but for a request that arrived on
+ * a stream connection: its response (or an empty one, if the callback didn't
+ * respond) is added to 'batch' rather than sent. Doesn't touch the
+ * connection, so it costs no system calls of its own.
+ * @return Callback's exit code, or -1 if the response couldn't be added. */
+int socks_request_dispatch_batch(int connection_fd, socks_callback_t callback,
+                                 struct socks_batch *batch, const char *msg,
+                                 uint16_t len);
+
+/** @brief Reads the credentials of the process at the other end of an
+ * accepted connection (SO_PEERCRED). Returns 0, or -1 with errno set. */
+int socks_peer_fetch(int connection_fd, struct socks_peer *peer);
+
+struct sockaddr_un;
+
+/** @brief Fills in the unix-domain address of a socketfile. Returns 0, or -1
+ * with errno set to ENAMETOOLONG if the filename doesn't fit. */
+int socks_address_make(const char *filename, struct sockaddr_un *result);
+
+/** @brief Creates a unix-domain socket of the given type (SOCK_SEQPACKET or
+ * SOCK_STREAM), binds it to 'filename' (replacing any file already there),
+ * and listens on it. Same return convention as socks_server_open(). */
+int socks_listener_open(const char *filename, mode_t mode, int type);
+
+/*----------------------------------------------------------------------------*/
+
+/** @brief Timing of one request for the slow-request log. It's inactive
+ * (and every step below does nothing) unless the log was enabled when the
+ * request began. */
+struct socks_trace {
+    int active;
+    uint64_t start;
+    struct socks_slow_request record;
+};
+
+/** @brief Starts timing a request, just before it's accepted. */
+void socks_trace_begin(struct socks_trace *trace);
+
+/** @brief Records the end of a stage. 'trace' may be NULL. */
+void socks_trace_mark(struct socks_trace *trace, enum socks_stage stage);
+
+/** @brief Records the end of the body read, with the body's size and
+ * prefix. 'trace' may be NULL. */
+void socks_trace_body(struct socks_trace *trace, const char *msg,
+                      uint16_t len);
+
+/** @brief Finishes timing a request once it's closed, and records it if
+ * it's slow or sampled. 'trace' may be NULL. */
+void socks_trace_end(struct socks_trace *trace);
+
+/** @brief Same as socks_request_accept(), but starts timing the request in
+ * 'trace' (which may be NULL), and fetches the client's credentials if it's
+ * active. */
+int socks_request_accept_traced(int socket_fd, uint16_t *msgsize,
+                                struct socks_trace *trace);
+
+/** @brief Same as socks_request_dispatch_peer(), but times the callback and
+ * response in 'trace' (which may be NULL), and takes the client's
+ * credentials from it if 'peer' is NULL. */
+int socks_request_dispatch_traced(int connection_fd, socks_callback_t callback,
+                                  socks_cache_t *cache,
+                                  const struct socks_peer *peer,
+                                  struct socks_trace *trace, const char *msg,
+                                  uint16_t len);
+
+/*----------------------------------------------------------------------------*/
+
+/** @brief Creates a libsocks client socket and connects it to a server.
+ * @return Connected file descriptor, or a negative number in the event of an
+ * error (in which case errno was set accordingly). */
+int socks_client_connect(const char *filename);
+
+/** @brief Checks that a file descriptor is a listening AF_UNIX
+ * SOCK_SEQPACKET socket, i.e. something a libsocks server can accept from.
+ * @return 0 if it is, or -1 with errno set otherwise (EPROTOTYPE for the
+ * wrong socket type, EINVAL if it isn't listening, EAFNOSUPPORT for the wrong
+ * address family, and ENOTSOCK if it isn't a socket). */
+int socks_listener_check(int socket_fd);
+
+/** @brief Serializes the 2-byte header that precedes a frame of 'nbyte'
+ * bytes. */
+void socks_frame_header(uint16_t nbyte, char header[2]);
+
+/** @brief Sends one framed message (header and body). Same return convention
+ * as write(). */
+ssize_t socks_frame_send(int fd, const void *buf, uint16_t nbyte);
+
+/** @brief Receives one framed message into 'buf'. Fails with EMSGSIZE if the
+ * message doesn't fit, in which case the message is discarded and the next
+ * one can still be received. Same return convention as read(). */
+ssize_t socks_frame_recv(int fd, void *buf, size_t bufsize);
+
+/** @brief Receives only the header of a framed message, leaving its body to
+ * be read with socks_request_read(). Same return convention as read(). */
+ssize_t socks_frame_recv_header(int fd, uint16_t *msgsize);
+
+/** @brief Same as socks_frame_recv(), but into a buffer of exactly the
+ * message's size plus a terminating NUL, which the caller must free(). */
+ssize_t socks_frame_recv_alloc(int fd, char **buf);
+
+/*----------------------------------------------------------------------------*/
+
+/** @brief Rate-limiting state for one place that logs. socks_log() keeps one
+ * of these per call site. */
+struct socks_log_site {
+    unsigned long window;
+    unsigned int count;
+    unsigned long suppressed;
+};
+
+/** @brief Logs a printf-style message through the hook set with
+ * socks_log_set_hook(), or the default logger. Doesn't change errno. */
+void socks_log_write(struct socks_log_site *site, enum socks_log_level level,
+                     const char *format, ...)
+    __attribute__ ((format (printf, 3, 4)));
+
+/** @brief Logs a message, rate-limited separately from every other place
+ * that logs. Use in place of fprintf(stderr, ...); no newline needed. */
+#define socks_log(level, ...)                                                 \
+    do {                                                                      \
+        static struct socks_log_site log_site_;                               \
+        socks_log_write(&log_site_, (level), __VA_ARGS__);                    \
+    } while (0)
+
+/*----------------------------------------------------------------------------*/
+
+struct socks_cache_entry;
+
+/** @brief State for the request that a callback is currently handling. One
+ * of these lives on the stack of socks_request_dispatch_cached() for the
+ * duration of each callback, and is reachable from the handling thread via
+ * socks_request_current(). Requests that arrived on a stream connection have
+ * a 'batch', which collects their responses instead of sending them, and
+ * requests being timed for the slow-request log have a 'trace'. */
+struct socks_request {
+    int connection_fd;
+    const char *msg;
+    uint16_t len;
+    socks_cache_t *cache;
+    uint64_t generation;
+    struct socks_cache_entry *capture;
+    struct socks_peer peer;
+    int peer_known;
+    struct socks_batch *batch;
+    int responded;
+    struct socks_trace *trace;
+};
+
+/** @brief Returns the request being handled by the calling thread, provided
+ * that it belongs to 'response_fd'. Returns NULL otherwise. */
+struct socks_request *socks_request_current(int response_fd);
+
+/** @brief Releases everything allocated with socks_server_alloc() by the
+ * calling thread. Called once each request has been answered. */
+void socks_arena_reset(void);
+
+/** @brief Adds a framed response to a stream connection's batch, sending
+ * what's already there first if it's full. Same return convention as
+ * write(). */
+ssize_t socks_batch_append(struct socks_batch *batch, const void *buf,
+                           uint16_t nbyte);
+
+/*----------------------------------------------------------------------------*/
+
+/** @brief Looks a request up in a cache, and sends the cached response to
+ * 'response_fd' on a hit. On a miss, '*generation' receives the request's
+ * invalidation count, for socks_cache_capture().
+ * @retval 1 The request was answered from the cache.
+ * @retval 0 The request is cacheable, but wasn't found.
+ * @retval -1 The request isn't cacheable. */
+int socks_cache_respond(socks_cache_t *cache, int response_fd,
+                        const char *msg, uint16_t len, uint64_t *generation);
+
+/** @brief Copies a request and its response into a new, unlinked cache
+ * entry, which remembers the 'generation' its request missed at. Returns NULL
+ * if memory couldn't be allocated. */
+struct socks_cache_entry *socks_cache_capture(const char *msg, uint16_t len,
+                                              const void *buf, uint16_t nbyte,
+                                              uint64_t generation);
+
+/** @brief Inserts a captured entry into a cache, replacing any older entry
+ * for the same request. Takes ownership of the entry, and drops it instead if
+ * the cache was invalidated since its request missed. */
+void socks_cache_commit(socks_cache_t *cache, struct socks_cache_entry *entry);
+
+/** @brief Frees a captured entry that won't be committed. */
+void socks_cache_discard(struct socks_cache_entry *entry);
+
+#endif
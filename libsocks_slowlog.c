@@ -0,0 +1,367 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "eintr_wrappers.h"
+#include "libsocks_pvt.h"
+#include "libsocks_slowlog.h"
+
+/*----------------------------------------------------------------------------*/
+
+enum {
+    /* Longest line socks_slowlog_dump() writes. */
+    dump_line_max = 512
+};
+
+/* Each slot is guarded by a sequence number, which is odd while the slot is
+ * being written, and 2 * (position + 1) once the record for 'position' is in
+ * it. Readers copy a slot and then check that its sequence didn't change, so
+ * neither side ever waits for the other. */
+struct slow_slot {
+    unsigned long sequence;
+    struct socks_slow_request record;
+};
+
+static pthread_mutex_t slow_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct slow_slot *slow_ring = NULL;
+static size_t slow_capacity = 0;
+static unsigned long slow_next = 0;
+
+static int slow_enabled = 0;
+static uint64_t slow_threshold_ns = 0;
+static unsigned long slow_sample_every = 0;
+static __thread unsigned long slow_sample_count = 0;
+
+static const char *const stage_names[SOCKS_STAGE_COUNT] = {
+    "accept", "header", "body", "callback", "respond", "close"
+};
+
+/*----------------------------------------------------------------------------*/
+
+static uint64_t now_ns(clockid_t clock)
+{
+    struct timespec now;
+
+    clock_gettime(clock, &now);
+    return ((uint64_t) now.tv_sec * 1000000000) + (uint64_t) now.tv_nsec;
+}
+
+/** @brief Claims the next slot in the ring and copies 'record' into it. If the
+ * ring has wrapped all the way around onto a slot that's still being
+ * written, the record is dropped. */
+static void slow_store(const struct socks_slow_request *record)
+{
+    unsigned long pos = __atomic_fetch_add(&slow_next, 1, __ATOMIC_RELAXED);
+    struct slow_slot *slot = &slow_ring[pos % slow_capacity];
+    unsigned long sequence = __atomic_load_n(&slot->sequence,
+                                             __ATOMIC_RELAXED);
+
+    if ((sequence & 1) ||
+        !__atomic_compare_exchange_n(&slot->sequence, &sequence, sequence | 1,
+                                     0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->record = *record;
+    __atomic_store_n(&slot->sequence, 2 * (pos + 1), __ATOMIC_RELEASE);
+}
+
+/** @brief Copies the record for position 'pos' out of the ring. Returns 0, or
+ * -1 if the slot holds a different position's record or is being
+ * written. */
+static int slow_load(unsigned long pos, struct socks_slow_request *record)
+{
+    struct slow_slot *slot = &slow_ring[pos % slow_capacity];
+    unsigned long sequence = __atomic_load_n(&slot->sequence,
+                                             __ATOMIC_ACQUIRE);
+
+    if (sequence != 2 * (pos + 1)) {
+        return -1;
+    }
+
+    memcpy(record, &slot->record, sizeof(*record));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == sequence) ?
+           0 : -1;
+}
+
+/** @brief Returns the first position still in the ring, and sets 'end' to
+ * the position after the last. */
+static unsigned long slow_range(unsigned long *end)
+{
+    *end = __atomic_load_n(&slow_next, __ATOMIC_ACQUIRE);
+    return (*end > slow_capacity) ? *end - slow_capacity : 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Text formatting for socks_slowlog_dump(), which can't use stdio. */
+
+static char *append_string(char *out, const char *end, const char *string)
+{
+    while ((*string != '\x00') && (out < end)) {
+        *out++ = *string++;
+    }
+
+    return out;
+}
+
+static char *append_number(char *out, const char *end, uint64_t value)
+{
+    char digits[20];
+    int count = 0;
+
+    do {
+        digits[count++] = (char)('0' + (value % 10));
+        value /= 10;
+    } while (value != 0);
+
+    while ((count > 0) && (out < end)) {
+        *out++ = digits[--count];
+    }
+
+    return out;
+}
+
+/** @brief Appends a microsecond count, or '-' for a stage that wasn't
+ * reached. */
+static char *append_us(char *out, const char *end, uint64_t ns)
+{
+    if (ns == 0) {
+        return append_string(out, end, "-");
+    }
+
+    return append_number(out, end, ns / 1000);
+}
+
+static char *append_record(char *out, const char *end,
+                           const struct socks_slow_request *record)
+{
+    char padded[7] = "000000";
+    uint64_t usec = (uint64_t) record->start.tv_nsec / 1000;
+
+    for (int x = 5; x >= 0; x--, usec /= 10) {
+        padded[x] = (char)('0' + (usec % 10));
+    }
+
+    out = append_string(out, end, "slow request: at=");
+    out = append_number(out, end, (uint64_t) record->start.tv_sec);
+    out = append_string(out, end, ".");
+    out = append_string(out, end, padded);
+    out = append_string(out, end, " total_us=");
+    out = append_number(out, end, record->total_ns / 1000);
+
+    for (int x = 0; x < SOCKS_STAGE_COUNT; x++) {
+        out = append_string(out, end, " ");
+        out = append_string(out, end, stage_names[x]);
+        out = append_string(out, end, "_us=");
+        out = append_us(out, end, record->stage_ns[x]);
+    }
+
+    out = append_string(out, end, " size=");
+    out = append_number(out, end, record->size);
+
+    if (record->peer_known) {
+        out = append_string(out, end, " pid=");
+        out = append_number(out, end, (uint64_t) record->peer.pid);
+        out = append_string(out, end, " uid=");
+        out = append_number(out, end, (uint64_t) record->peer.uid);
+    }
+
+    out = append_string(out, end, record->sampled ? " sampled" : "");
+    out = append_string(out, end, " prefix=\"");
+
+    for (uint16_t x = 0; (x < record->prefix_length) && (out < end); x++) {
+        char c = record->prefix[x];
+        *out++ = ((c >= ' ') && (c <= '~') && (c != '"')) ? c : '.';
+    }
+
+    return append_string(out, end, "\"\n");
+}
+
+static void dump_handler(int signum)
+{
+    int prev_errno = errno;
+
+    (void) signum;
+    socks_slowlog_dump(STDERR_FILENO);
+    errno = prev_errno;
+}
+
+/*----------------------------------------------------------------------------*/
+
+void socks_trace_begin(struct socks_trace *trace)
+{
+    trace->active = __atomic_load_n(&slow_enabled, __ATOMIC_ACQUIRE);
+
+    if (trace->active) {
+        memset(&trace->record, 0, sizeof(trace->record));
+        trace->start = now_ns(CLOCK_MONOTONIC);
+    }
+}
+
+void socks_trace_mark(struct socks_trace *trace, enum socks_stage stage)
+{
+    if ((trace != NULL) && trace->active) {
+        trace->record.stage_ns[stage] = now_ns(CLOCK_MONOTONIC) -
+                                        trace->start;
+    }
+}
+
+void socks_trace_body(struct socks_trace *trace, const char *msg,
+                      uint16_t len)
+{
+    if ((trace == NULL) || !trace->active) {
+        return;
+    }
+
+    socks_trace_mark(trace, SOCKS_STAGE_BODY);
+    trace->record.size = len;
+    trace->record.prefix_length = (len < SOCKS_SLOWLOG_PREFIX) ?
+                                  len : SOCKS_SLOWLOG_PREFIX;
+    memcpy(trace->record.prefix, msg, trace->record.prefix_length);
+}
+
+void socks_trace_end(struct socks_trace *trace)
+{
+    uint64_t threshold;
+    unsigned long every;
+    uint64_t start;
+    int slow;
+
+    if ((trace == NULL) || !trace->active) {
+        return;
+    }
+
+    trace->record.total_ns = now_ns(CLOCK_MONOTONIC) - trace->start;
+    threshold = __atomic_load_n(&slow_threshold_ns, __ATOMIC_RELAXED);
+    every = __atomic_load_n(&slow_sample_every, __ATOMIC_RELAXED);
+    slow = (threshold != 0) && (trace->record.total_ns > threshold);
+
+    if (!slow && ((every == 0) || (++slow_sample_count % every != 0))) {
+        return;
+    }
+
+    start = now_ns(CLOCK_REALTIME) - trace->record.total_ns;
+    trace->record.start.tv_sec = (time_t)(start / 1000000000);
+    trace->record.start.tv_nsec = (long)(start % 1000000000);
+    trace->record.sampled = !slow;
+    slow_store(&trace->record);
+}
+
+/*----------------------------------------------------------------------------*/
+
+int socks_slowlog_enable(size_t capacity, unsigned long threshold_us,
+                         unsigned long sample_every)
+{
+    int result = 0;
+
+    if ((threshold_us == 0) && (sample_every == 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&slow_lock);
+
+    if (slow_ring == NULL) {
+        if (capacity == 0) {
+            errno = EINVAL;
+            result = -1;
+        } else {
+            struct slow_slot *ring = calloc(capacity, sizeof(*ring));
+
+            slow_capacity = capacity;
+            __atomic_store_n(&slow_ring, ring, __ATOMIC_RELEASE);
+            result = (ring == NULL) ? -1 : 0;
+        }
+    } else if ((capacity != 0) && (capacity != slow_capacity)) {
+        errno = EBUSY;
+        result = -1;
+    }
+
+    if (result == 0) {
+        __atomic_store_n(&slow_threshold_ns, (uint64_t) threshold_us * 1000,
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&slow_sample_every, sample_every, __ATOMIC_RELAXED);
+        __atomic_store_n(&slow_enabled, 1, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&slow_lock);
+    return result;
+}
+
+void socks_slowlog_disable(void)
+{
+    __atomic_store_n(&slow_enabled, 0, __ATOMIC_RELEASE);
+}
+
+size_t socks_slowlog_read(struct socks_slow_request *records, size_t count)
+{
+    unsigned long end;
+    unsigned long pos;
+    size_t copied = 0;
+
+    if (__atomic_load_n(&slow_ring, __ATOMIC_ACQUIRE) == NULL) {
+        return 0;
+    }
+
+    pos = slow_range(&end);
+
+    if (end - pos > count) {
+        pos = end - count;
+    }
+
+    for (; pos < end; pos++) {
+        copied += (slow_load(pos, &records[copied]) == 0);
+    }
+
+    return copied;
+}
+
+int socks_slowlog_dump(int fd)
+{
+    struct socks_slow_request record;
+    char line[dump_line_max];
+    unsigned long end;
+    unsigned long pos;
+
+    if (__atomic_load_n(&slow_ring, __ATOMIC_ACQUIRE) == NULL) {
+        return 0;
+    }
+
+    for (pos = slow_range(&end); pos < end; pos++) {
+        char *line_end;
+
+        if (slow_load(pos, &record) != 0) {
+            continue;
+        }
+
+        line_end = append_record(line, line + sizeof(line), &record);
+
+        if (write_noeintr(fd, line, (size_t)(line_end - line)) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int socks_slowlog_dump_on_signal(int signum)
+{
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = dump_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    return sigaction(signum, &action, NULL);
+}
@@ -0,0 +1,99 @@
+#ifndef LIBSOCKS_SLOWLOG_H
+#define LIBSOCKS_SLOWLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "libsocks.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A log of individual slow requests, for finding out which requests are slow
+ * and where their time went. While it's enabled, each request handled by
+ * socks_server_process() or a pool is timed stage by stage. A request is
+ * recorded if it took longer than a threshold, or if it's picked by 1-in-N
+ * sampling. Records go into a fixed-size ring in memory, allocated up front,
+ * that keeps the most recent ones; they can be read back, or dumped as text
+ * (from a signal handler, if need be). */
+
+/** @brief Stages of handling a request, in the order they normally finish.
+ * The response is usually sent from inside the callback, in which case
+ * SOCKS_STAGE_RESPOND finishes before SOCKS_STAGE_CALLBACK does. */
+enum socks_stage {
+    SOCKS_STAGE_ACCEPT = 0,
+    SOCKS_STAGE_HEADER,
+    SOCKS_STAGE_BODY,
+    SOCKS_STAGE_CALLBACK,
+    SOCKS_STAGE_RESPOND,
+    SOCKS_STAGE_CLOSE,
+    SOCKS_STAGE_COUNT
+};
+
+/** @brief Number of bytes of each request's payload that are recorded. */
+#define SOCKS_SLOWLOG_PREFIX 32
+
+/** @brief A recorded request. */
+struct socks_slow_request {
+    /** When the request was accepted (CLOCK_REALTIME). */
+    struct timespec start;
+    /** Time from the start of the accept to the end of each stage, in
+     * nanoseconds, or 0 if the request never finished that stage. */
+    uint64_t stage_ns[SOCKS_STAGE_COUNT];
+    /** Time from the start of the accept to the end of the close. */
+    uint64_t total_ns;
+    /** Credentials of the client, if 'peer_known' is set. */
+    struct socks_peer peer;
+    int peer_known;
+    /** Set if the request was recorded by sampling rather than for being
+     * slow. */
+    int sampled;
+    /** Size of the request, and the first bytes of it. */
+    uint16_t size;
+    uint16_t prefix_length;
+    char prefix[SOCKS_SLOWLOG_PREFIX];
+};
+
+/** @brief Starts recording slow requests, for the whole process.
+ * @param[in] capacity Number of records the ring holds. The ring is
+ * allocated by the first call; later calls must pass 0 or the same capacity.
+ * @param[in] threshold_us Requests that take longer than this, in
+ * microseconds, are recorded. 0 records none for being slow.
+ * @param[in] sample_every Every this many requests, one is recorded however
+ * fast it was. 0 turns sampling off.
+ * @return Exit status of function.
+ * @retval 0 Recording started.
+ * @retval -1 Recording couldn't start, and errno was set to EINVAL (no
+ * capacity, or nothing to record), EBUSY (a different capacity than the ring
+ * has) or ENOMEM. */
+int socks_slowlog_enable(size_t capacity, unsigned long threshold_us,
+                         unsigned long sample_every);
+
+/** @brief Stops recording slow requests. The records so far are kept. */
+void socks_slowlog_disable(void);
+
+/** @brief Copies the most recent records, oldest first.
+ * @param[out] records Destination for the records.
+ * @param[in] count Most records to copy.
+ * @return Number of records copied. */
+size_t socks_slowlog_read(struct socks_slow_request *records, size_t count);
+
+/** @brief Writes the records in the ring as text, one line per record, oldest
+ * first. Only uses async-signal-safe functions, and takes no locks, so it can
+ * be called from a signal handler.
+ * @param[in] fd File descriptor to write to.
+ * @return 0, or -1 if a write failed (with errno set accordingly). */
+int socks_slowlog_dump(int fd);
+
+/** @brief Installs a handler that dumps the records to stderr whenever the
+ * process gets signal 'signum' (e.g. SIGUSR1).
+ * @return 0, or -1 with errno set if the handler couldn't be installed. */
+int socks_slowlog_dump_on_signal(int signum);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
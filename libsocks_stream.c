@@ -0,0 +1,372 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "eintr_wrappers.h"
+#include "libsocks_pvt.h"
+#include "libsocks_stream.h"
+
+/*----------------------------------------------------------------------------*/
+
+/* Each buffer holds several of the largest frames, so that a full one still
+ * has room for the rest of a frame that's only partly arrived. */
+
+enum {
+    header_size = 2,
+    frame_maxlen = header_size + UINT16_MAX,
+    buffer_size = 4 * frame_maxlen
+};
+
+/* Frames waiting to be sent. Once sending fails, 'error' holds errno, and
+ * nothing more is sent. */
+struct socks_batch {
+    int fd;
+    int error;
+    size_t length;
+    char data[buffer_size];
+};
+
+/* Frames received but not yet handled are input[start, end). input has a
+ * spare byte past 'capacity', for the NUL after the last frame. A client's
+ * input grows when responses arrive faster than they're received. */
+struct socks_stream {
+    size_t start;
+    size_t end;
+    size_t capacity;
+    char *input;
+    struct socks_batch output;
+};
+
+/*----------------------------------------------------------------------------*/
+
+static uint16_t frame_size(const char *header)
+{
+    return (uint16_t)(((unsigned char) header[0]) |
+                      (((unsigned char) header[1]) << 8));
+}
+
+/** @brief Returns the length of the body of the next frame in the input, or
+ * -1 if it hasn't all arrived yet. */
+static long stream_next(const struct socks_stream *stream)
+{
+    size_t available = stream->end - stream->start;
+    uint16_t msgsize;
+
+    if (available < header_size) {
+        return -1;
+    }
+
+    msgsize = frame_size(stream->input + stream->start);
+    return (available < (size_t) header_size + msgsize) ? -1 : msgsize;
+}
+
+/** @brief Moves the unhandled input to the front of the buffer, and grows
+ * the buffer if that still leaves less than a whole frame's room. */
+static int stream_reserve(struct socks_stream *stream)
+{
+    if (stream->start != 0) {
+        memmove(stream->input, stream->input + stream->start,
+                stream->end - stream->start);
+        stream->end -= stream->start;
+        stream->start = 0;
+    }
+
+    if (stream->capacity - stream->end < frame_maxlen) {
+        size_t capacity = stream->capacity * 2;
+        char *input = realloc(stream->input, capacity + 1);
+
+        if (input == NULL) {
+            return -1;
+        }
+
+        stream->input = input;
+        stream->capacity = capacity;
+    }
+
+    return 0;
+}
+
+/** @brief Makes room in the input, and reads as much more as fits with a
+ * single read(). */
+static int stream_fill(struct socks_stream *stream)
+{
+    ssize_t result;
+
+    if (stream_reserve(stream) != 0) {
+        return -1;
+    }
+
+    result = read_noeintr(stream->output.fd, stream->input + stream->end,
+                          stream->capacity - stream->end);
+
+    if (result == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    if (result < 0) {
+        return -1;
+    }
+
+    stream->end += (size_t) result;
+    return 0;
+}
+
+static int batch_flush(struct socks_batch *batch)
+{
+    size_t sent = 0;
+
+    while ((sent < batch->length) && (batch->error == 0)) {
+        ssize_t result = write_noeintr(batch->fd, batch->data + sent,
+                                       batch->length - sent);
+
+        if (result < 0) {
+            batch->error = errno;
+        } else {
+            sent += (size_t) result;
+        }
+    }
+
+    batch->length = 0;
+
+    if (batch->error != 0) {
+        errno = batch->error;
+        return -1;
+    }
+
+    return 0;
+}
+
+/** @brief Sends everything queued on a client connection, reading whatever
+ * responses arrive in the meantime. Otherwise a server that's blocked
+ * sending responses would stop reading, and neither end could go on. */
+static int stream_flush(struct socks_stream *stream)
+{
+    struct socks_batch *batch = &stream->output;
+    size_t sent = 0;
+
+    while ((sent < batch->length) && (batch->error == 0)) {
+        struct pollfd pollfd = {batch->fd, POLLIN | POLLOUT, 0};
+        ssize_t result;
+
+        if (poll(&pollfd, 1, -1) < 0) {
+            batch->error = (errno == EINTR) ? 0 : errno;
+            continue;
+        }
+
+        if (pollfd.revents & POLLIN) {
+            if (stream_reserve(stream) != 0) {
+                batch->error = errno;
+                break;
+            }
+
+            result = recv(batch->fd, stream->input + stream->end,
+                          stream->capacity - stream->end, MSG_DONTWAIT);
+
+            if (result > 0) {
+                stream->end += (size_t) result;
+            } else if (result == 0) {
+                batch->error = ECONNRESET;
+            } else if ((errno != EAGAIN) && (errno != EINTR)) {
+                batch->error = errno;
+            }
+        }
+
+        if ((batch->error == 0) &&
+            (pollfd.revents & (POLLOUT | POLLERR | POLLHUP))) {
+            result = send(batch->fd, batch->data + sent, batch->length - sent,
+                          MSG_DONTWAIT | MSG_NOSIGNAL);
+
+            if (result >= 0) {
+                sent += (size_t) result;
+            } else if ((errno != EAGAIN) && (errno != EINTR)) {
+                batch->error = errno;
+            }
+        }
+    }
+
+    batch->length = 0;
+
+    if (batch->error != 0) {
+        errno = batch->error;
+        return -1;
+    }
+
+    return 0;
+}
+
+static struct socks_stream *stream_create(int fd)
+{
+    struct socks_stream *stream = malloc(sizeof(*stream));
+    char *input = malloc(buffer_size + 1);
+
+    if ((stream == NULL) || (input == NULL)) {
+        int prev_errno = errno;
+        free(stream);
+        free(input);
+        close_noeintr(fd);
+        errno = prev_errno;
+        return NULL;
+    }
+
+    stream->start = 0;
+    stream->end = 0;
+    stream->capacity = buffer_size;
+    stream->input = input;
+    stream->output.fd = fd;
+    stream->output.error = 0;
+    stream->output.length = 0;
+    return stream;
+}
+
+/*----------------------------------------------------------------------------*/
+
+ssize_t socks_batch_append(struct socks_batch *batch, const void *buf,
+                           uint16_t nbyte)
+{
+    if ((batch->length + header_size + nbyte > sizeof(batch->data)) &&
+        (batch_flush(batch) != 0)) {
+        return -1;
+    }
+
+    socks_frame_header(nbyte, batch->data + batch->length);
+    memcpy(batch->data + batch->length + header_size, buf, nbyte);
+    batch->length += header_size + (size_t) nbyte;
+    return nbyte;
+}
+
+int socks_stream_server_open(const char *filename, mode_t mode)
+{
+    return socks_listener_open(filename, mode, SOCK_STREAM);
+}
+
+socks_stream_t *socks_stream_accept(int socket_fd)
+{
+    int connection_fd = accept_noeintr(socket_fd, NULL, NULL);
+
+    if (connection_fd < 0) {
+        return NULL;
+    }
+
+    return stream_create(connection_fd);
+}
+
+int socks_stream_process(socks_stream_t *stream, socks_callback_t callback)
+{
+    int count = 0;
+    long msgsize;
+
+    if (stream_fill(stream) != 0) {
+        return -1;
+    }
+
+    while ((stream->output.error == 0) &&
+           ((msgsize = stream_next(stream)) >= 0)) {
+        char *msg = stream->input + stream->start + header_size;
+        char saved = msg[msgsize];
+
+        /* The NUL after the message lands on the next frame's header (if
+         * there is one), so it's put back afterwards. */
+
+        msg[msgsize] = '\x00';
+        stream->start += header_size + (size_t) msgsize;
+        socks_request_dispatch_batch(stream->output.fd, callback,
+                                     &stream->output, msg, (uint16_t) msgsize);
+        msg[msgsize] = saved;
+        count++;
+    }
+
+    if (batch_flush(&stream->output) != 0) {
+        return -1;
+    }
+
+    return count;
+}
+
+socks_stream_t *socks_stream_connect(const char *filename)
+{
+    struct sockaddr_un address;
+    int socket_fd;
+
+    if (socks_address_make(filename, &address) < 0) {
+        return NULL;
+    }
+
+    socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (socket_fd < 0) {
+        return NULL;
+    }
+
+    if (connect_noeintr(socket_fd, (struct sockaddr *) &address,
+                        sizeof(address)) != 0) {
+        int prev_errno = errno;
+        close_noeintr(socket_fd);
+        errno = prev_errno;
+        return NULL;
+    }
+
+    return stream_create(socket_fd);
+}
+
+ssize_t socks_stream_send(socks_stream_t *stream, const void *buf,
+                          uint16_t nbyte)
+{
+    struct socks_batch *batch = &stream->output;
+
+    if ((batch->length + header_size + nbyte > sizeof(batch->data)) &&
+        (stream_flush(stream) != 0)) {
+        return -1;
+    }
+
+    return socks_batch_append(batch, buf, nbyte);
+}
+
+int socks_stream_flush(socks_stream_t *stream)
+{
+    return stream_flush(stream);
+}
+
+ssize_t socks_stream_recv(socks_stream_t *stream, void *buf, size_t bufsize)
+{
+    long msgsize;
+
+    if (stream_flush(stream) != 0) {
+        return -1;
+    }
+
+    while ((msgsize = stream_next(stream)) < 0) {
+        if (stream_fill(stream) != 0) {
+            return -1;
+        }
+    }
+
+    stream->start += header_size + (size_t) msgsize;
+
+    if ((size_t) msgsize > bufsize) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    memcpy(buf, stream->input + stream->start - (size_t) msgsize,
+           (size_t) msgsize);
+    return msgsize;
+}
+
+int socks_stream_fd(socks_stream_t *stream)
+{
+    return stream->output.fd;
+}
+
+void socks_stream_close(socks_stream_t *stream)
+{
+    close_noeintr(stream->output.fd);
+    free(stream->input);
+    free(stream);
+}
@@ -0,0 +1,110 @@
+#ifndef LIBSOCKS_STREAM_H
+#define LIBSOCKS_STREAM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "libsocks.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Pipelined transport over SOCK_STREAM. A stream connection stays open and
+ * carries any number of requests, each answered in order, with the usual
+ * 2-byte little-endian framing. Both ends buffer: one read() picks up every
+ * frame that has arrived, and the responses to all of them go back in one
+ * write(), so a burst of small requests costs a couple of system calls
+ * rather than a few per request. While a client sends, it also reads any
+ * responses that have come back, and keeps them in memory until they're
+ * received, so it can have any number of requests in flight; the memory
+ * this takes grows with the number of unreceived responses.
+ *
+ * Stream servers have socketfiles of their own (opened with
+ * socks_stream_server_open()), and ordinary libsocks clients can't talk to
+ * them. Callbacks work as usual, but should call socks_server_respond() at
+ * most once per request, since every response is matched to a request by
+ * its position. */
+
+/** @brief Opaque handle for one end of a stream connection. */
+typedef struct socks_stream socks_stream_t;
+
+/*----------------------------------------------------------------------------*/
+
+/** @brief Creates a unix-domain stream socket and opens it as a libsocks
+ * stream server. Closed with socks_server_close(), and waited for with
+ * socks_server_wait() or socks_server_poll().
+ * @param[in] filename Filename of target socketfile.
+ * @param[in] mode Permissions for the socketfile.
+ * @return File descriptor of the server, or -1 in the event of an error (in
+ * which case errno was set accordingly). */
+int socks_stream_server_open(const char *filename, mode_t mode);
+
+/** @brief Accepts a connection on a stream server. Should be called only
+ * when a client is waiting, as determined by socks_server_wait() or
+ * socks_server_poll().
+ * @param[in] socket_fd File descriptor of open stream server.
+ * @return Handle for the connection, or NULL in the event of an error (in
+ * which case errno was set accordingly). */
+socks_stream_t *socks_stream_accept(int socket_fd);
+
+/** @brief Reads whatever requests have arrived on a connection (blocking
+ * until at least part of one has), passes each complete one to 'callback' in
+ * order, and sends all of their responses at once. Callback results are
+ * ignored, as they are for pre-forked workers.
+ * @param[in] stream Connection accepted with socks_stream_accept().
+ * @param[in] callback Callback function for the server to use.
+ * @return Number of requests handled (which may be 0 if only part of one
+ * arrived), or -1 in the event of an error (in which case errno was set
+ * accordingly; ECONNRESET means the client closed the connection). */
+int socks_stream_process(socks_stream_t *stream, socks_callback_t callback);
+
+/*----------------------------------------------------------------------------*/
+
+/** @brief Opens a connection to a stream server.
+ * @param[in] filename Filename of the server's socketfile.
+ * @return Handle for the connection, or NULL in the event of an error (in
+ * which case errno was set accordingly). */
+socks_stream_t *socks_stream_connect(const char *filename);
+
+/** @brief Queues a request on a connection. Requests are sent when the queue
+ * fills up, or by socks_stream_flush() or socks_stream_recv().
+ * @param[in] stream Connection opened with socks_stream_connect().
+ * @param[in] buf Request to send.
+ * @param[in] nbyte Length of the request (in bytes).
+ * @return Number of bytes queued, or -1 in the event of an error (in which
+ * case errno was set accordingly). */
+ssize_t socks_stream_send(socks_stream_t *stream, const void *buf,
+                          uint16_t nbyte);
+
+/** @brief Sends every request queued on a connection.
+ * @return Exit status of function.
+ * @retval 0 The queue is empty.
+ * @retval -1 Sending failed, and errno was set accordingly. */
+int socks_stream_flush(socks_stream_t *stream);
+
+/** @brief Receives the response to the oldest request without one, sending
+ * any queued requests first.
+ * @param[in] stream Connection opened with socks_stream_connect().
+ * @param[out] buf Buffer for the response.
+ * @param[in] bufsize Size of 'buf' (in bytes).
+ * @return Length of the response, or -1 in the event of an error (in which
+ * case errno was set accordingly; EMSGSIZE means the response didn't fit and
+ * was discarded, and the next one can still be received). */
+ssize_t socks_stream_recv(socks_stream_t *stream, void *buf, size_t bufsize);
+
+/*----------------------------------------------------------------------------*/
+
+/** @brief Returns the file descriptor of a connection, for use with
+ * socks_server_wait(), socks_server_poll() or an event loop. */
+int socks_stream_fd(socks_stream_t *stream);
+
+/** @brief Closes a connection and frees it. Queued requests or responses
+ * that haven't been sent are discarded. */
+void socks_stream_close(socks_stream_t *stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
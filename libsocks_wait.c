@@ -0,0 +1,168 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "libsocks_wait.h"
+
+/*----------------------------------------------------------------------------*/
+
+enum {
+    /* How long to yield between checks before sleeping. */
+    yield_ns = 50000,
+
+    /* Spinning checks the clock only this often. */
+    spin_checks = 16,
+
+    /* Weight of each new inter-arrival time in the average, as a shift:
+     * 1/8. */
+    average_shift = 3
+};
+
+struct socks_waiter {
+    uint64_t max_spin_ns;
+    uint64_t budget_ns;
+    uint64_t interarrival_ns;
+    uint64_t last_arrival;
+    unsigned long spun;
+    unsigned long yielded;
+    unsigned long slept;
+};
+
+/*----------------------------------------------------------------------------*/
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000000000) + (uint64_t) now.tv_nsec;
+}
+
+/** @brief Checks whether 'fd' is readable. Returns 1 if it is, 0 if not
+ * (or if interrupted), and -1 on an error. With a negative 'timeout', blocks
+ * until it is. */
+static int check_readable(int fd, int timeout)
+{
+    struct pollfd pollfd = {.fd = fd, .events = POLLIN, .revents = 0};
+    int result = poll(&pollfd, 1, timeout);
+
+    if ((result < 0) && (errno == EINTR)) {
+        return 0;
+    }
+
+    return (result > 0) ? 1 : result;
+}
+
+/** @brief Checks 'fd' until it's readable or 'deadline' passes, yielding
+ * between checks if asked to. */
+static int check_until(int fd, uint64_t deadline, int yield)
+{
+    int result;
+
+    do {
+        for (int x = 0; x < spin_checks; x++) {
+            result = check_readable(fd, 0);
+
+            if (result != 0) {
+                return result;
+            }
+
+            if (yield) {
+                sched_yield();
+            }
+        }
+    } while (now_ns() < deadline);
+
+    return 0;
+}
+
+/** @brief Folds the time since the last arrival into the average, and sets
+ * the budget from it. */
+static void waiter_arrived(struct socks_waiter *waiter)
+{
+    uint64_t now = now_ns();
+    uint64_t gap = now - waiter->last_arrival;
+
+    if (waiter->last_arrival == 0) {
+        waiter->last_arrival = now;
+        return;
+    }
+
+    waiter->last_arrival = now;
+    waiter->interarrival_ns = (waiter->interarrival_ns == 0) ? gap :
+                              waiter->interarrival_ns -
+                              (waiter->interarrival_ns >> average_shift) +
+                              (gap >> average_shift);
+
+    if (waiter->interarrival_ns > waiter->max_spin_ns) {
+        waiter->budget_ns = 0;
+    } else if (2 * waiter->interarrival_ns > waiter->max_spin_ns) {
+        waiter->budget_ns = waiter->max_spin_ns;
+    } else {
+        waiter->budget_ns = 2 * waiter->interarrival_ns;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+socks_waiter_t *socks_waiter_create(unsigned int max_spin_us)
+{
+    struct socks_waiter *waiter = calloc(1, sizeof(*waiter));
+
+    if (waiter == NULL) {
+        return NULL;
+    }
+
+    /* Spin for the whole budget until the traffic has been measured. */
+    waiter->max_spin_ns = (uint64_t) max_spin_us * 1000;
+    waiter->budget_ns = waiter->max_spin_ns;
+    return waiter;
+}
+
+void socks_waiter_destroy(socks_waiter_t *waiter)
+{
+    free(waiter);
+}
+
+int socks_server_wait_adaptive(int socket_fd, socks_waiter_t *waiter)
+{
+    uint64_t start = now_ns();
+    int result = 0;
+
+    if (waiter->budget_ns != 0) {
+        result = check_until(socket_fd, start + waiter->budget_ns, 0);
+        waiter->spun += (result > 0);
+    }
+
+    if (result == 0) {
+        result = check_until(socket_fd, now_ns() + yield_ns, 1);
+        waiter->yielded += (result > 0);
+    }
+
+    while (result == 0) {
+        result = check_readable(socket_fd, -1);
+        waiter->slept += (result > 0);
+    }
+
+    if (result < 0) {
+        return -1;
+    }
+
+    waiter_arrived(waiter);
+    return 0;
+}
+
+void socks_waiter_get_stats(socks_waiter_t *waiter,
+                            struct socks_waiter_stats *stats)
+{
+    stats->spun = waiter->spun;
+    stats->yielded = waiter->yielded;
+    stats->slept = waiter->slept;
+    stats->budget_us = (unsigned int)(waiter->budget_ns / 1000);
+    stats->interarrival_us = (unsigned int)(waiter->interarrival_ns / 1000);
+}
@@ -0,0 +1,69 @@
+#ifndef LIBSOCKS_WAIT_H
+#define LIBSOCKS_WAIT_H
+
+#include "libsocks.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Adaptive waiting, for servers on dedicated cores that need the lowest
+ * latency they can get. socks_server_wait() sleeps in the kernel, so every
+ * request pays for a wakeup; polling with sleeps in between pays for the
+ * sleep instead. socks_server_wait_adaptive() first spins, checking the
+ * socket without blocking, for up to a budget of microseconds; then yields
+ * the CPU between checks for a short while; and only then sleeps.
+ *
+ * The budget follows the traffic. The waiter keeps an average of the time
+ * between arrivals, and spins for about twice that while it's within the
+ * configured maximum, so a busy server catches the next request while still
+ * spinning. When requests are further apart than the maximum, spinning
+ * would rarely pay off, so the waiter goes almost straight to sleep and an
+ * idle server uses no CPU. */
+
+/** @brief Opaque handle for an adaptive waiter. Each waiter should be used by
+ * one thread at a time. */
+typedef struct socks_waiter socks_waiter_t;
+
+/** @brief Default limit on spinning, in microseconds. */
+#define SOCKS_WAIT_DEFAULT_SPIN_US 100
+
+/** @brief How a waiter's waits have ended, and its current budget. */
+struct socks_waiter_stats {
+    unsigned long spun;
+    unsigned long yielded;
+    unsigned long slept;
+    unsigned int budget_us;
+    unsigned int interarrival_us;
+};
+
+/** @brief Creates an adaptive waiter.
+ * @param[in] max_spin_us Most time to spend spinning in one wait, in
+ * microseconds. 0 disables spinning, but still yields before sleeping.
+ * @return Handle for the new waiter, or NULL if memory couldn't be
+ * allocated. */
+socks_waiter_t *socks_waiter_create(unsigned int max_spin_us);
+
+/** @brief Frees an adaptive waiter. */
+void socks_waiter_destroy(socks_waiter_t *waiter);
+
+/** @brief Waits for a client to connect to a libsocks server, as
+ * socks_server_wait() does, spinning and yielding before sleeping.
+ * @param[in] socket_fd File descriptor of open libsocks server (or of any
+ * other socket that readiness makes sense for).
+ * @param[in] waiter Waiter to use.
+ * @return Exit status of function.
+ * @retval 0 A client is now waiting, and socks_server_process() can be used.
+ * @retval -1 The wait failed, and errno was set accordingly. */
+int socks_server_wait_adaptive(int socket_fd, socks_waiter_t *waiter);
+
+/** @brief Reads how a waiter's waits have ended so far, and its current
+ * budget. */
+void socks_waiter_get_stats(socks_waiter_t *waiter,
+                            struct socks_waiter_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,281 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libsocks_dircache.h"
+#include "libsocks_dirs.h"
+#include "libsocks_dirs_stats.h"
+
+/* Benchmark for the directory code. Builds synthetic trees below a base
+ * directory and reports wall time, throughput and filesystem calls per path
+ * for each API. Linked against its own copy of the directory sources, built
+ * with SOCKS_DIRS_STATS, so the calls can be counted. */
+
+enum {
+    deep_depth = 16
+};
+
+enum api {
+    API_CHDIR = 0,
+    API_AT,
+    API_CACHED,
+    API_BATCH,
+    API_COUNT
+};
+
+static const char *const api_names[API_COUNT] = {"chdir", "at", "cached",
+                                                 "batch"};
+
+static const char *const op_names[SOCKS_DIRS_OP_COUNT] = {"stat", "open",
+                                                          "mkdir", "chdir",
+                                                          "chown"};
+
+static unsigned int path_count = 2000;
+static unsigned int thread_count = 4;
+static const char *base_dir = "/tmp";
+static char root[PATH_MAX];
+static char **paths;
+static socks_dircache_t *dircache;
+
+static const char help[] = \
+"Usage: %s [-d DIR] [-n COUNT] [-t THREADS]\n"
+"\n"
+"Benchmarks directory creation below DIR (default /tmp) with COUNT paths per\n"
+"scenario (default 2000), and THREADS concurrent callers (default 4).\n"
+"\n";
+
+/*----------------------------------------------------------------------------*/
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000000000) + (uint64_t) now.tv_nsec;
+}
+
+static void set_paths(const char *scenario, const char *api, int leaf)
+{
+    for (unsigned int x = 0; x < path_count; x++) {
+        int length = snprintf(paths[x], PATH_MAX, "%s/%s/%s", root, api,
+                              scenario);
+
+        if (strncmp(scenario, "wide", 4) == 0) {
+            snprintf(paths[x] + length, (size_t)(PATH_MAX - length), "/d%u",
+                     x);
+            continue;
+        }
+
+        length += snprintf(paths[x] + length, (size_t)(PATH_MAX - length),
+                           "/i%u", x);
+
+        for (int y = 1; y < deep_depth; y++) {
+            length += snprintf(paths[x] + length, (size_t)(PATH_MAX - length),
+                               "/c%d", y);
+        }
+
+        if (leaf != 0) {
+            snprintf(paths[x] + length, (size_t)(PATH_MAX - length), "/leaf");
+        }
+    }
+}
+
+static int mkdirs_one(enum api api, const char *path)
+{
+    unsigned int length = (unsigned int) strlen(path);
+    int result;
+
+    switch (api) {
+        case API_CHDIR:
+            socks_store_cwd();
+            result = socks_mkdirs_chdir(path, length, 0755, (uid_t) -1,
+                                        (gid_t) -1);
+            socks_restore_cwd();
+            return result;
+
+        case API_CACHED:
+            return socks_mkdirs_cached(dircache, path, length, 0755,
+                                       (uid_t) -1, (gid_t) -1);
+
+        default:
+            return socks_mkdirs(path, length, 0755, (uid_t) -1, (gid_t) -1);
+    }
+}
+
+struct slice {
+    enum api api;
+    unsigned int first;
+    unsigned int last;
+    int result;
+};
+
+static void *run_slice(void *arg)
+{
+    struct slice *slice = arg;
+
+    for (unsigned int x = slice->first; x < slice->last; x++) {
+        if (mkdirs_one(slice->api, paths[x]) != 0) {
+            slice->result = -1;
+        }
+    }
+
+    return NULL;
+}
+
+/** @brief Creates every path with one API and prints a line of results. */
+static int run(const char *scenario, enum api api, unsigned int threads)
+{
+    struct slice slices[threads];
+    pthread_t ids[threads];
+    unsigned long before[SOCKS_DIRS_OP_COUNT];
+    uint64_t start;
+    uint64_t elapsed;
+    int result = 0;
+
+    memcpy(before, socks_dirs_counters, sizeof(before));
+    start = now_ns();
+
+    if (api == API_BATCH) {
+        result = socks_mkdirs_batch(AT_FDCWD, (const char *const *) paths,
+                                    path_count, 0755, (uid_t) -1, (gid_t) -1,
+                                    threads, NULL);
+    } else {
+        for (unsigned int x = 0; x < threads; x++) {
+            slices[x].api = api;
+            slices[x].first = (path_count * x) / threads;
+            slices[x].last = (path_count * (x + 1)) / threads;
+            slices[x].result = 0;
+            pthread_create(&ids[x], NULL, run_slice, &slices[x]);
+        }
+
+        for (unsigned int x = 0; x < threads; x++) {
+            pthread_join(ids[x], NULL);
+            result |= slices[x].result;
+        }
+    }
+
+    elapsed = now_ns() - start;
+
+    printf("%-16s %-7s %7u %10.2f %11.0f", scenario, api_names[api], threads,
+           (double) elapsed / 1e6,
+           (double) path_count / ((double) elapsed / 1e9));
+
+    for (int x = 0; x < SOCKS_DIRS_OP_COUNT; x++) {
+        printf(" %6.2f", (double)(socks_dirs_counters[x] - before[x]) /
+                         (double) path_count);
+    }
+
+    printf("%s\n", (result != 0) ? "  FAILED" : "");
+    return result;
+}
+
+/** @brief Runs one tree shape through every API: first with nothing there,
+ * then again with everything there, then with only the leaves missing. */
+static int run_shape(const char *shape, enum api api, unsigned int threads)
+{
+    char scenario[32];
+    int result = 0;
+
+    set_paths(shape, api_names[api], 0);
+    snprintf(scenario, sizeof(scenario), "%s-new", shape);
+    result |= run(scenario, api, threads);
+    snprintf(scenario, sizeof(scenario), "%s-existing", shape);
+    result |= run(scenario, api, threads);
+
+    if (strncmp(shape, "deep", 4) == 0) {
+        set_paths(shape, api_names[api], 1);
+        snprintf(scenario, sizeof(scenario), "%s-leaf", shape);
+        result |= run(scenario, api, threads);
+    }
+
+    return result;
+}
+
+static void scan_opts(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:n:t:h")) != -1) {
+        switch (opt) {
+            case 'd':
+                base_dir = optarg;
+                break;
+
+            case 'n':
+                path_count = (unsigned int) strtoul(optarg, NULL, 0);
+                break;
+
+            case 't':
+                thread_count = (unsigned int) strtoul(optarg, NULL, 0);
+                break;
+
+            default:
+                printf(help, argv[0]);
+                exit((opt == 'h') ? 0 : -1);
+        }
+    }
+
+    if ((path_count == 0) || (thread_count == 0)) {
+        fprintf(stderr, "COUNT and THREADS must be positive.\n");
+        exit(-1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char command[PATH_MAX + 16];
+    int result = 0;
+
+    scan_opts(argc, argv);
+    snprintf(root, sizeof(root), "%s/libsocks_bench.%ld", base_dir,
+             (long) getpid());
+
+    if (mkdir(root, 0755) != 0) {
+        fprintf(stderr, "Couldn't create %s (%s)\n", root, strerror(errno));
+        return -1;
+    }
+
+    paths = calloc(path_count, sizeof(*paths));
+    dircache = socks_dircache_create(path_count, 0);
+
+    for (unsigned int x = 0; (paths != NULL) && (x < path_count); x++) {
+        paths[x] = malloc(PATH_MAX);
+    }
+
+    printf("# %s, %u paths, depth %d\n", root, path_count, deep_depth);
+    printf("%-16s %-7s %7s %10s %11s", "scenario", "api", "threads", "ms",
+           "paths/s");
+
+    for (int x = 0; x < SOCKS_DIRS_OP_COUNT; x++) {
+        printf(" %6s", op_names[x]);
+    }
+
+    printf("\n");
+
+    for (int api = 0; api < API_COUNT; api++) {
+        result |= run_shape("deep", (enum api) api, 1);
+        result |= run_shape("wide", (enum api) api, 1);
+    }
+
+    /* socks_mkdirs_chdir() changes the working directory, so it can't run
+     * concurrently. */
+
+    for (int api = API_AT; api < API_COUNT; api++) {
+        result |= run_shape("deep-mt", (enum api) api, thread_count);
+        result |= run_shape("wide-mt", (enum api) api, thread_count);
+    }
+
+    snprintf(command, sizeof(command), "rm -rf '%s'", root);
+    result |= system(command);
+
+    return (result == 0) ? 0 : -1;
+}
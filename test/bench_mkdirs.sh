@@ -0,0 +1,21 @@
+#!/bin/bash
+# Runs the directory benchmark on a tmpfs mount and on a disk-backed
+# filesystem. Usage: bench_mkdirs.sh [COUNT] [THREADS]
+
+BENCH="$(dirname "$0")/bench_mkdirs"
+COUNT="${1:-2000}"
+THREADS="${2:-4}"
+
+TMPFS_DIR="${TMPFS_DIR:-/dev/shm}"
+DISK_DIR="${DISK_DIR:-/var/tmp}"
+
+for DIR in "$TMPFS_DIR" "$DISK_DIR"; do
+    if [ ! -d "$DIR" ] || [ ! -w "$DIR" ]; then
+        echo "# skipping $DIR (not a writable directory)"
+        continue
+    fi
+
+    echo "# $(stat --file-system --format=%T "$DIR") filesystem"
+    "$BENCH" -d "$DIR" -n "$COUNT" -t "$THREADS" || exit 1
+    echo
+done
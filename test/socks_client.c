@@ -1,40 +1,64 @@
 #define _POSIX_C_SOURCE 200809L
 
+#include <errno.h>
 #include <libgen.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "libsocks.h"
 
 const char *progname;
 
+static void usage(void)
+{
+    fprintf(stderr, "usage: %s [-r DEADLINE_MS] FILENAME COMMAND\n", progname);
+    exit(1);
+}
+
 int main(int argc, char **argv)
 {
     ssize_t result;
-    char buffer[1024];
+    char *response;
     char *cmd;
+    char *endptr;
     uint16_t cmd_len;
+    struct socks_retry_policy retry = {1, 100, 0};
+    int opt;
 
     progname = basename(argv[0]);
 
-    if (argc != 3) {
-        fprintf(stderr, "usage: %s FILENAME COMMAND\n", progname);
-        exit(1);
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+        if (opt != 'r') {
+            usage();
+        }
+
+        errno = 0;
+        retry.deadline_ms = (unsigned int) strtoul(optarg, &endptr, 10);
+
+        if ((errno != 0) || (endptr == optarg) || (*endptr != '\x00') ||
+            (socks_client_set_retry(&retry) != 0)) {
+            usage();
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage();
     }
 
-    cmd = argv[2];
+    cmd = argv[optind + 1];
     cmd_len = (uint16_t) strnlen(cmd, 1024);
 
-    result = socks_client_process(argv[1], cmd, cmd_len, buffer, 1024);
+    result = socks_client_process_alloc(argv[optind], cmd, cmd_len, &response);
 
     if (result < 0) {
         perror(NULL);
         return (int) result;
     }
 
-    buffer[result] = '\x00';
-    printf("response: [%s]\n", buffer);
+    printf("response: [%s]\n", response);
+    free(response);
     return 0;
 }
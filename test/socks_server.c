@@ -4,6 +4,7 @@
 #include <inttypes.h>
 #include <libgen.h>
 #include <limits.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,18 +13,46 @@
 #include <unistd.h>
 
 #include "libsocks.h"
+#include "libsocks_cache.h"
+#include "libsocks_handoff.h"
+#include "libsocks_pool.h"
+#include "libsocks_prefork.h"
+#include "libsocks_slowlog.h"
+#include "libsocks_wait.h"
 
 static char progname[PATH_MAX];
 static volatile char shutdown = 0;
 static volatile char blocking = 1;
+static volatile char adaptive = 0;
 static mode_t socket_mode = 0755;
+static unsigned int worker_count = 0;
+static unsigned int thread_count = 0;
+static unsigned int queue_depth = 0;
+static unsigned int cache_ttl = 0;
+static unsigned int tenant_limit = 0;
+static unsigned int spin_budget = SOCKS_WAIT_DEFAULT_SPIN_US;
+static unsigned int slow_threshold = 0;
+static const char *control_path = NULL;
+static socks_cache_t *cache = NULL;
+static unsigned long counter = 0;
 char **remaining = NULL;
 
 static const char help[] = \
-"Usage: %s [-u UID] SOCKET_PATH\n"
+"Usage: %s [-m MODE] [-c TTL] [-H CONTROL] [-a USEC] [-l USEC]\n"
+"       [-w COUNT | -t COUNT [-q DEPTH] [-u LIMIT]] SOCKET_PATH\n"
 "\n"
 "Launches a libsocks demo server connected to SOCKET_PATH. Socket can \n"
-"optionally be launched with user-specified permissions.\n"
+"optionally be launched with user-specified permissions. If COUNT is given,\n"
+"the server runs as a supervisor with COUNT pre-forked worker processes.\n"
+"With -t, callbacks are run on a pool of COUNT worker threads. With -q,\n"
+"requests beyond DEPTH queued ones are answered with 'busy', and with -u,\n"
+"so are requests beyond LIMIT in flight from the same uid. With -c,\n"
+"responses to 'count' are cached for TTL milliseconds. With -H, the server\n"
+"takes over the socket from a server already listening on CONTROL (if there\n"
+"is one), and hands its own socket over when the next one starts. With -a,\n"
+"the server spins for up to USEC microseconds waiting for each request\n"
+"before sleeping. With -l, requests slower than USEC microseconds are\n"
+"recorded, and dumped to stderr on SIGUSR1.\n"
 "\n";
 
 /*----------------------------------------------------------------------------*/
@@ -61,9 +90,24 @@ static mode_t scan_mode(const char *input)
     return (mode_t) result;
 }
 
+static unsigned int scan_count(const char *input)
+{
+    char *endptr;
+    uintmax_t result;
+    result = strtoumax(input, &endptr, 10);
+
+    if ((errno != 0) || (endptr == input) || (result == 0) ||
+        (result > UINT16_MAX)) {
+        fprintf(stderr, "Couldn't scan count [%s]\n", input);
+        exit(-1);
+    }
+
+    return (unsigned int) result;
+}
+
 static void scan_opts(int argc, char **argv)
 {
-    const char optstring[] = ":m:";
+    const char optstring[] = ":m:c:w:t:q:H:u:a:l:";
 
     check_help(argc, argv);
     int opt = getopt(argc, argv, optstring);
@@ -74,6 +118,39 @@ static void scan_opts(int argc, char **argv)
                 socket_mode = scan_mode(optarg);
                 break;
 
+            case 'c':
+                cache_ttl = scan_count(optarg);
+                break;
+
+            case 'w':
+                worker_count = scan_count(optarg);
+                break;
+
+            case 't':
+                thread_count = scan_count(optarg);
+                break;
+
+            case 'q':
+                queue_depth = scan_count(optarg);
+                break;
+
+            case 'H':
+                control_path = optarg;
+                break;
+
+            case 'u':
+                tenant_limit = scan_count(optarg);
+                break;
+
+            case 'a':
+                spin_budget = scan_count(optarg);
+                adaptive = 1;
+                break;
+
+            case 'l':
+                slow_threshold = scan_count(optarg);
+                break;
+
             case ':':
                 fprintf(stderr, "Option -%c requires an operand.\n", optopt);
                 exit(-1);
@@ -142,6 +219,75 @@ static int callback(int response_fd, const char *input, uint16_t nbyte)
         return 0;
     }
 
+    if (strcmp(input, "pid") == 0) {
+        char pid_string[32];
+        int length = snprintf(pid_string, sizeof(pid_string), "%jd",
+                              (intmax_t) getpid());
+        result = socks_server_respond(response_fd, pid_string,
+                                      (uint16_t)(length + 1));
+        return (int)((result < 0) ? result : 0);
+    }
+
+    if (strcmp(input, "whoami") == 0) {
+        char peer_string[64];
+        struct socks_peer peer;
+        int length;
+
+        if (socks_server_peer(response_fd, &peer) != 0) {
+            return -1;
+        }
+
+        length = snprintf(peer_string, sizeof(peer_string), "%jd %jd",
+                          (intmax_t) peer.uid, (intmax_t) peer.pid);
+        result = socks_server_respond(response_fd, peer_string,
+                                      (uint16_t)(length + 1));
+        return (int)((result < 0) ? result : 0);
+    }
+
+    if (strcmp(input, "count") == 0) {
+        char count_string[32];
+        int length = snprintf(count_string, sizeof(count_string), "%lu",
+                              ++counter);
+        result = socks_server_respond(response_fd, count_string,
+                                      (uint16_t)(length + 1));
+        return (int)((result < 0) ? result : 0);
+    }
+
+    if (strcmp(input, "invalidate") == 0) {
+        if (cache != NULL) {
+            socks_cache_invalidate_opcode(cache, 'c');
+        }
+        return 0;
+    }
+
+    if (strcmp(input, "count_invalidate") == 0) {
+        char count_string[32];
+        int length = snprintf(count_string, sizeof(count_string), "%lu",
+                              ++counter);
+        result = socks_server_respond(response_fd, count_string,
+                                      (uint16_t)(length + 1));
+
+        if (cache != NULL) {
+            socks_cache_invalidate_opcode(cache, 'c');
+        }
+
+        return (int)((result < 0) ? result : 0);
+    }
+
+    if (strcmp(input, "count_unrelated") == 0) {
+        char count_string[32];
+        int length = snprintf(count_string, sizeof(count_string), "%lu",
+                              ++counter);
+        result = socks_server_respond(response_fd, count_string,
+                                      (uint16_t)(length + 1));
+
+        if (cache != NULL) {
+            socks_cache_invalidate(cache, "cold", 4);
+        }
+
+        return (int)((result < 0) ? result : 0);
+    }
+
     if (strcmp(input, "fail") == 0) {
         return -1;
     }
@@ -153,17 +299,30 @@ static int callback(int response_fd, const char *input, uint16_t nbyte)
 
     if (strcmp(input, "set_nonblocking") == 0) {
         blocking = 0;
+        adaptive = 0;
         result = socks_server_respond(response_fd, "ok", sizeof("ok"));
         return (int)((result < 0) ? result : 0);
     }
 
     if (strcmp(input, "set_blocking") == 0) {
         blocking = 1;
+        adaptive = 0;
+        result = socks_server_respond(response_fd, "ok", sizeof("ok"));
+        return (int)((result < 0) ? result : 0);
+    }
+
+    if (strcmp(input, "set_adaptive") == 0) {
+        blocking = 1;
+        adaptive = 1;
         result = socks_server_respond(response_fd, "ok", sizeof("ok"));
         return (int)((result < 0) ? result : 0);
     }
 
     if (strcmp(input, "shutdown") == 0) {
+        if (worker_count != 0) {
+            return socks_server_prefork_stop();
+        }
+
         shutdown = 1;
         return 0;
     }
@@ -176,10 +335,21 @@ static int callback(int response_fd, const char *input, uint16_t nbyte)
 int main(int argc, char **argv)
 {
     int result;
-    int socks_fd;
+    int socks_fd = -1;
+    int control_fd = -1;
+    int handed_off = 0;
+    socks_pool_t *pool = NULL;
+    socks_waiter_t *waiter = NULL;
 
     scan_opts(argc, argv);
-    socks_fd = socks_server_open(*remaining, socket_mode);
+
+    if (control_path != NULL) {
+        socks_fd = socks_handoff_receive(control_path, 5000);
+    }
+
+    if (socks_fd < 0) {
+        socks_fd = socks_server_open_activated(*remaining, socket_mode);
+    }
 
     if (socks_fd < 0) {
         perror(NULL);
@@ -188,13 +358,91 @@ int main(int argc, char **argv)
         exit(socks_fd);
     }
 
+    if (control_path != NULL) {
+        control_fd = socks_server_open_activated(control_path, socket_mode);
+
+        if (control_fd < 0) {
+            fprintf(stderr, "%s: couldn't open control socket [%s] (%s)\n",
+                    argv[0], control_path, strerror(errno));
+            exit(control_fd);
+        }
+    }
+
+    if (cache_ttl != 0) {
+        cache = socks_cache_create(1024 * 1024, 0);
+
+        if (cache == NULL) {
+            fprintf(stderr, "socks_cache_create: failed (%s)\n",
+                    strerror(errno));
+            return -1;
+        }
+
+        socks_cache_set_opcode(cache, 'c', cache_ttl);
+    }
+
+    if ((slow_threshold != 0) &&
+        ((socks_slowlog_enable(256, slow_threshold, 0) != 0) ||
+         (socks_slowlog_dump_on_signal(SIGUSR1) != 0))) {
+        fprintf(stderr, "socks_slowlog_enable: failed (%s)\n",
+                strerror(errno));
+        return -1;
+    }
+
+    waiter = socks_waiter_create(spin_budget);
+
+    if (waiter == NULL) {
+        fprintf(stderr, "socks_waiter_create: failed (%s)\n",
+                strerror(errno));
+        return -1;
+    }
+
+    if (worker_count != 0) {
+        result = socks_server_prefork(socks_fd, worker_count, callback);
+
+        if (result != 0) {
+            fprintf(stderr, "socks_server_prefork: failed (%s)\n",
+                    strerror(errno));
+            return result;
+        }
+
+        return socks_server_close(socks_fd);
+    }
+
+    /* Pooled callbacks run asynchronously, so the main loop has to poll in
+     * order to notice a shutdown request. It also polls when it has to watch
+     * the control socket. */
+
+    if (thread_count != 0) {
+        pool = socks_pool_create(thread_count, callback);
+
+        if (pool == NULL) {
+            fprintf(stderr, "socks_pool_create: failed (%s)\n",
+                    strerror(errno));
+            return -1;
+        }
+
+        socks_pool_set_busy(pool, "busy", sizeof("busy"));
+        socks_pool_set_cache(pool, cache);
+        socks_pool_set_limit(pool, SOCKS_PRIORITY_NORMAL, queue_depth,
+                             SOCKS_OVERLOAD_REJECT);
+
+        if (tenant_limit != 0) {
+            struct socks_tenant_limits limits = {0, 0, tenant_limit};
+            socks_pool_set_tenants(pool, SOCKS_TENANT_UID, &limits);
+        }
+    }
+
     while (1) {
         if (shutdown) {
             break;
         }
 
-        if (blocking) {
-            result = socks_server_wait(socks_fd);
+        if (blocking && (pool == NULL) && (control_fd < 0)) {
+            if (adaptive) {
+                result = socks_server_wait_adaptive(socks_fd, waiter);
+            } else {
+                result = socks_server_wait(socks_fd);
+            }
 
             if (result != 0) {
                 fprintf(stderr, "socks_server_wait: failed (%s)\n",
@@ -202,7 +450,7 @@ int main(int argc, char **argv)
                 return result;
             }
         } else {
-            while (1) {
+            while (shutdown == 0) {
                 result = socks_server_poll(socks_fd);
                 if (result < 0) {
                     fprintf(stderr, "socks_server_wait: failed (%s)\n",
@@ -213,11 +461,26 @@ int main(int argc, char **argv)
                 if (result) {
                     break;
                 }
+
+                if ((control_fd >= 0) && (socks_server_poll(control_fd) > 0) &&
+                    (socks_handoff_send(control_fd, socks_fd, 5000) == 0)) {
+                    handed_off = 1;
+                    break;
+                }
+
                 sleep_ms(2);
             }
+
+            if (shutdown || handed_off) {
+                break;
+            }
         }
 
-        result = socks_server_process(socks_fd, callback);
+        if (pool != NULL) {
+            result = socks_pool_process(pool, socks_fd);
+        } else {
+            result = socks_server_process_cached(socks_fd, callback, cache);
+        }
 
         if (result != 0) {
             if (errno != 0) {
@@ -229,6 +492,24 @@ int main(int argc, char **argv)
         }
     }
 
+    if (pool != NULL) {
+        if (handed_off && (socks_pool_drain(pool, 10000) != 0)) {
+            fprintf(stderr, "socks_pool_drain: failed (%s)\n",
+                    strerror(errno));
+        }
+
+        socks_pool_destroy(pool);
+    }
+
+    if (control_fd >= 0) {
+        socks_server_close(control_fd);
+    }
+
+    if (cache != NULL) {
+        socks_cache_destroy(cache);
+    }
+
+    socks_waiter_destroy(waiter);
     result = socks_server_close(socks_fd);
 
     if (result != 0) {
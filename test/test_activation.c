@@ -0,0 +1,247 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "nunit.h"
+#include "libsocks.h"
+#include "libsocks_pvt.h"
+
+static char socket_path[64];
+static int inherited_fd = -1;
+static int second_fd = -1;
+
+static int echo_callback(int response_fd, const char *msg, uint16_t len)
+{
+    return (socks_server_respond(response_fd, msg, len) < 0) ? -1 : 0;
+}
+
+/** @brief Runs 'child' in a child process that inherits 'inherited_fd' as
+ * file descriptor 3 (and 'second_fd' as 4, if it's set), with LISTEN_PID set
+ * to 'pid_offset' plus its own pid. Returns the child's exit status. */
+static int spawn(int (*child)(void), int pid_offset)
+{
+    char pid_string[32];
+    int status;
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        snprintf(pid_string, sizeof(pid_string), "%ld",
+                 (long) getpid() + pid_offset);
+
+        if ((dup2(inherited_fd, 3) != 3) ||
+            ((second_fd >= 0) && (dup2(second_fd, 4) != 4)) ||
+            (setenv("LISTEN_PID", pid_string, 1) != 0) ||
+            (setenv("LISTEN_FDS", (second_fd >= 0) ? "2" : "1", 1) != 0)) {
+            _exit(EXIT_FAILURE);
+        }
+
+        _exit(child());
+    }
+
+    if ((pid < 0) || (waitpid(pid, &status, 0) != pid) ||
+        !WIFEXITED(status)) {
+        return -1;
+    }
+
+    return WEXITSTATUS(status);
+}
+
+static int bind_socket(const char *path, int type, int listening)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    int fd = socket(AF_UNIX, type, 0);
+
+    strcpy(address.sun_path, path);
+
+    if ((fd < 0) ||
+        (bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0) ||
+        (listening && (listen(fd, 4) != 0))) {
+        return -1;
+    }
+
+    return fd;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int serve_child(void)
+{
+    int fd = socks_server_open_activated(socket_path, 0600);
+
+    if ((fd != 3) || (socks_server_process(fd, echo_callback) != 0)) {
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static int reject_child(void)
+{
+    int fd = socks_server_open_activated(socket_path, 0600);
+
+    return ((fd < 0) && ((errno == EPROTOTYPE) || (errno == EINVAL))) ?
+           EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Names the inherited socket by a relative path, from its directory. */
+static int spelling_child(void)
+{
+    char relative[sizeof(socket_path) + 2];
+    int fd;
+
+    snprintf(relative, sizeof(relative), "./%s", strrchr(socket_path, '/') + 1);
+
+    if (chdir("/tmp") != 0) {
+        return EXIT_FAILURE;
+    }
+
+    fd = socks_server_open_activated(relative, 0600);
+    return (fd == 3) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int mismatch_child(void)
+{
+    int fd = socks_server_open_activated(socket_path, 0600);
+
+    return ((fd < 0) && (errno == ENOENT)) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int fallback_child(void)
+{
+    int fd = socks_server_open_activated(socket_path, 0600);
+
+    return ((fd >= 0) && (fd != 3)) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int activated_test(void)
+{
+    char buffer[16];
+    int client_fd;
+
+    label_test();
+
+    /* The request is sent before the server process even exists, and waits
+     * in the backlog of the inherited socket. */
+    inherited_fd = socks_server_open(socket_path, 0600);
+    assert_nonnegative(inherited_fd);
+    client_fd = socks_client_connect(socket_path);
+    assert_nonnegative(client_fd);
+    assert_true(socks_frame_send(client_fd, "hello", 6) == 6);
+
+    assert_zero(spawn(serve_child, 0));
+    assert_true(socks_frame_recv(client_fd, buffer, sizeof(buffer)) == 6);
+    assert_zero(strcmp(buffer, "hello"));
+
+    close(client_fd);
+
+    /* Any spelling of the socket's path finds it. */
+    assert_zero(spawn(spelling_child, 0));
+    return EXIT_SUCCESS;
+}
+
+static int validation_test(void)
+{
+    char other[sizeof(socket_path) + 8];
+
+    label_test();
+
+    inherited_fd = bind_socket(socket_path, SOCK_STREAM, 1);
+    assert_nonnegative(inherited_fd);
+    assert_zero(spawn(reject_child, 0));
+    close(inherited_fd);
+    unlink(socket_path);
+
+    inherited_fd = bind_socket(socket_path, SOCK_SEQPACKET, 0);
+    assert_nonnegative(inherited_fd);
+    assert_zero(spawn(reject_child, 0));
+    close(inherited_fd);
+    unlink(socket_path);
+
+    /* Every inherited socket is checked, not just the one that matches. */
+    snprintf(other, sizeof(other), "%s.other", socket_path);
+    inherited_fd = socks_server_open(socket_path, 0600);
+    assert_nonnegative(inherited_fd);
+    second_fd = bind_socket(other, SOCK_STREAM, 1);
+    assert_nonnegative(second_fd);
+    assert_zero(spawn(reject_child, 0));
+    unlink(other);
+
+    return EXIT_SUCCESS;
+}
+
+static int fallback_test(void)
+{
+    label_test();
+
+    /* A socket meant for another process (LISTEN_PID) is left alone, and a
+     * fresh one is bound instead. */
+    inherited_fd = socks_server_open(socket_path, 0600);
+    assert_nonnegative(inherited_fd);
+    assert_zero(spawn(fallback_child, 1));
+
+    return EXIT_SUCCESS;
+}
+
+static int mismatch_test(void)
+{
+    struct stat before;
+    struct stat after;
+    char other[sizeof(socket_path) + 8];
+
+    label_test();
+
+    /* A socket bound to some other path isn't adopted, and the socketfile
+     * that is there stays in place rather than being bound afresh. */
+    snprintf(other, sizeof(other), "%s.other", socket_path);
+    inherited_fd = socks_server_open(other, 0600);
+    assert_nonnegative(inherited_fd);
+    assert_success(close(socks_server_open(socket_path, 0600)));
+    assert_success(stat(socket_path, &before));
+
+    assert_zero(spawn(mismatch_child, 0));
+    assert_success(stat(socket_path, &after));
+    assert_true(before.st_ino == after.st_ino);
+    unlink(other);
+
+    return EXIT_SUCCESS;
+}
+
+static int setup(void)
+{
+    snprintf(socket_path, sizeof(socket_path),
+             "/tmp/libsocks_test_activation.%ld", (long) getpid());
+    unlink(socket_path);
+    return 0;
+}
+
+static int teardown(void)
+{
+    if (inherited_fd >= 0) {
+        close(inherited_fd);
+        inherited_fd = -1;
+    }
+
+    if (second_fd >= 0) {
+        close(second_fd);
+        second_fd = -1;
+    }
+
+    unlink(socket_path);
+    return 0;
+}
+
+test_t test_suite[] = {activated_test, validation_test, fallback_test,
+                       mismatch_test, NULL};
+
+void nunit_config(void)
+{
+    register_suite(test_suite, "test_suite", setup, teardown);
+}
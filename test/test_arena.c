@@ -0,0 +1,160 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nunit.h"
+#include "libsocks.h"
+#include "libsocks_arena.h"
+#include "test_common.h"
+
+/* "first" answers with the address of its first allocation. "many" makes
+ * lots of small allocations and checks that they're aligned and disjoint.
+ * "large" overflows the arena several times over. */
+static int callback(int response_fd, const char *msg, uint16_t len)
+{
+    char response[32];
+    int length;
+    (void) len;
+
+    if (strcmp(msg, "first") == 0) {
+        void *first = socks_server_alloc(response_fd, 24);
+
+        length = snprintf(response, sizeof(response), "%p", first);
+        return (socks_server_respond(response_fd, response,
+                                     (uint16_t)(length + 1)) < 0) ? -1 : 0;
+    }
+
+    if (strcmp(msg, "many") == 0) {
+        unsigned char *blocks[2000];
+
+        for (int x = 0; x < 2000; x++) {
+            blocks[x] = socks_server_alloc(response_fd, (size_t)(x % 40) + 1);
+
+            if ((blocks[x] == NULL) || ((uintptr_t) blocks[x] % 16 != 0)) {
+                return -1;
+            }
+
+            memset(blocks[x], x & 0xFF, (size_t)(x % 40) + 1);
+        }
+
+        for (int x = 0; x < 2000; x++) {
+            for (int y = 0; y < (x % 40) + 1; y++) {
+                if (blocks[x][y] != (x & 0xFF)) {
+                    return -1;
+                }
+            }
+        }
+    }
+
+    if (strcmp(msg, "large") == 0) {
+        for (int x = 0; x < 4; x++) {
+            char *block = socks_server_alloc(response_fd,
+                                             SOCKS_ARENA_DEFAULT_SIZE);
+
+            if (block == NULL) {
+                return -1;
+            }
+
+            memset(block, 'x', SOCKS_ARENA_DEFAULT_SIZE);
+        }
+    }
+
+    return (socks_server_respond(response_fd, "ok", sizeof("ok")) < 0) ? -1 : 0;
+}
+
+static int request(const char *msg, char *response, uint16_t maxlen)
+{
+    ssize_t result = socks_client_process(socket_path, msg,
+                                          (uint16_t)(strlen(msg) + 1),
+                                          response, maxlen);
+
+    return (result > 0) ? 0 : -1;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int reuse_test(void)
+{
+    char first[32];
+    char second[32];
+    char response[32];
+    pthread_t server;
+    void *failures;
+
+    label_test();
+
+    /* Everything allocated by a request is released once it's answered, so
+     * the next request on the same thread starts at the same address. */
+    assert_success(pthread_create(&server, NULL, serve, (void *) 5L));
+    assert_success(request("first", first, sizeof(first)));
+    assert_success(request("many", response, sizeof(response)));
+    assert_success(request("large", response, sizeof(response)));
+    assert_zero(strcmp(response, "ok"));
+    assert_success(request("many", response, sizeof(response)));
+    assert_zero(strcmp(response, "ok"));
+    assert_success(request("first", second, sizeof(second)));
+    pthread_join(server, &failures);
+
+    assert_zero((long) failures);
+    assert_zero(strcmp(first, second));
+
+    return EXIT_SUCCESS;
+}
+
+static int resize_test(void)
+{
+    char response[32];
+    pthread_t server;
+    void *failures;
+
+    label_test();
+
+    assert_failure(socks_arena_set_size(0));
+    assert_true(errno == EINVAL);
+
+    assert_success(socks_arena_set_size(256));
+    assert_success(pthread_create(&server, NULL, serve, (void *) 3L));
+    assert_success(request("many", response, sizeof(response)));
+    assert_success(request("large", response, sizeof(response)));
+    assert_success(request("many", response, sizeof(response)));
+    pthread_join(server, &failures);
+    assert_success(socks_arena_set_size(SOCKS_ARENA_DEFAULT_SIZE));
+
+    assert_zero((long) failures);
+
+    return EXIT_SUCCESS;
+}
+
+static int outside_test(void)
+{
+    label_test();
+
+    errno = 0;
+    assert_true(socks_server_alloc(socket_fd, 16) == NULL);
+    assert_true(errno == EINVAL);
+
+    return EXIT_SUCCESS;
+}
+
+static int setup(void)
+{
+    return open_server("arena", callback);
+}
+
+static int teardown(void)
+{
+    return close_server();
+}
+
+test_t test_suite[] = {reuse_test, resize_test, outside_test, NULL};
+
+void nunit_config(void)
+{
+    register_suite(test_suite, "test_suite", setup, teardown);
+}
@@ -2,11 +2,20 @@
 
 #include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "nunit.h"
 #include "libsocks_dirs.h"
+#include "libsocks_dirs_stats.h"
+
+/* Deep enough at both ends that a linear walk, from either end, costs well
+ * over the bisection bound. */
+enum {
+    existing_depth = 24,
+    new_depth = 24
+};
 
 char first_buffer[PATH_MAX + 1] = {0};
 char second_buffer[PATH_MAX + 1] = {0};
@@ -32,7 +41,105 @@ static int directory_test(void)
     return EXIT_SUCCESS;
 }
 
-test_t test_suite[] = {directory_test, NULL};
+static int mkdirs_chdir_test(void)
+{
+    char path[64];
+    int length;
+
+    label_test();
+
+    /* Most of the path exists; only the last two components are new. */
+    length = snprintf(path, sizeof(path), "/tmp/libsocks_test_chdir.%ld/a/b",
+                      (long) getpid());
+    assert_success(socks_mkdirs(path, (unsigned int) length, 0755, (uid_t) -1,
+                                (gid_t) -1));
+    strcat(path, "/c/d");
+
+    assert_success(socks_store_cwd());
+    assert_success(socks_mkdirs_chdir(path, (unsigned int) strlen(path), 0755,
+                                      (uid_t) -1, (gid_t) -1));
+    getcwd(first_buffer, PATH_MAX);
+    assert_success(socks_restore_cwd());
+    assert_zero(strcmp(first_buffer, path));
+
+    /* Everything exists now. */
+    assert_success(socks_store_cwd());
+    assert_success(socks_mkdirs_chdir(path, (unsigned int) strlen(path), 0755,
+                                      (uid_t) -1, (gid_t) -1));
+    getcwd(second_buffer, PATH_MAX);
+    assert_success(socks_restore_cwd());
+    assert_zero(strcmp(second_buffer, path));
+
+    snprintf(path, sizeof(path), "rm -rf /tmp/libsocks_test_chdir.%ld",
+             (long) getpid());
+    assert_success(system(path));
+
+    return EXIT_SUCCESS;
+}
+
+/** @brief Returns the number of stats socks_mkdirs_chdir() spent looking for
+ * the existing part of 'path', leaving the cwd where it was. Each directory
+ * it creates costs two more stats (the inode checks), which are taken off. */
+static long probe_count(const char *path)
+{
+    unsigned long stats = socks_dirs_counters[SOCKS_DIRS_STAT];
+    unsigned long mkdirs = socks_dirs_counters[SOCKS_DIRS_MKDIR];
+
+    if ((socks_store_cwd() != 0) ||
+        (socks_mkdirs_chdir(path, (unsigned int) strlen(path), 0755,
+                            (uid_t) -1, (gid_t) -1) != 0) ||
+        (socks_restore_cwd() != 0)) {
+        return -1;
+    }
+
+    stats = socks_dirs_counters[SOCKS_DIRS_STAT] - stats;
+    mkdirs = socks_dirs_counters[SOCKS_DIRS_MKDIR] - mkdirs;
+
+    return (long)(stats - (2 * mkdirs));
+}
+
+static int probe_test(void)
+{
+    char path[PATH_MAX];
+    char base[64];
+    long components = 2 + existing_depth + new_depth;
+    long bound = 2;
+    int length;
+
+    label_test();
+
+    snprintf(base, sizeof(base), "/tmp/libsocks_test_chdir.%ld",
+             (long) getpid());
+    length = snprintf(path, sizeof(path), "%s", base);
+
+    for (int x = 0; x < existing_depth; x++) {
+        length += snprintf(path + length, sizeof(path) - length, "/d%d", x);
+    }
+
+    assert_success(socks_mkdirs(path, (unsigned int) length, 0755, (uid_t) -1,
+                                (gid_t) -1));
+
+    for (int x = 0; x < new_depth; x++) {
+        length += snprintf(path + length, sizeof(path) - length, "/n%d", x);
+    }
+
+    /* The deepest two prefixes, then a bisection over the rest. */
+    for (long x = components; x > 0; x /= 2) {
+        bound++;
+    }
+
+    assert_true(probe_count(path) <= bound);
+
+    /* Once the whole path exists, the first probe finds it. */
+    assert_true(probe_count(path) == 1);
+
+    snprintf(path, sizeof(path), "rm -rf %s", base);
+    assert_success(system(path));
+
+    return EXIT_SUCCESS;
+}
+
+test_t test_suite[] = {directory_test, mkdirs_chdir_test, probe_test, NULL};
 
 void nunit_config(void)
 {
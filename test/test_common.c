@@ -0,0 +1,52 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "test_common.h"
+
+char socket_path[64];
+int socket_fd = -1;
+
+static socks_callback_t server_callback = NULL;
+
+void set_socket_path(const char *name)
+{
+    snprintf(socket_path, sizeof(socket_path), "/tmp/libsocks_test_%s.%ld",
+             name, (long) getpid());
+    unlink(socket_path);
+}
+
+int open_server(const char *name, socks_callback_t callback)
+{
+    set_socket_path(name);
+    server_callback = callback;
+    socket_fd = socks_server_open(socket_path, 0700);
+    return (socket_fd < 0) ? -1 : 0;
+}
+
+int close_server(void)
+{
+    if (socket_fd >= 0) {
+        socks_server_close(socket_fd);
+        socket_fd = -1;
+    }
+
+    unlink(socket_path);
+    return 0;
+}
+
+void *serve(void *arg)
+{
+    long count = (long) arg;
+    long failures = 0;
+
+    for (long x = 0; x < count; x++) {
+        if ((socks_server_wait(socket_fd) != 0) ||
+            (socks_server_process(socket_fd, server_callback) != 0)) {
+            failures++;
+        }
+    }
+
+    return (void *) failures;
+}
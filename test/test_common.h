@@ -0,0 +1,41 @@
+#ifndef TEST_COMMON_H
+#define TEST_COMMON_H
+
+#include "libsocks.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The fixture shared by the nunit tests that run a server on a socket in
+ * /tmp. Each test gets its own path, so they can run in parallel. */
+
+/** @brief The test's socket, "/tmp/libsocks_test_<name>.<pid>". */
+extern char socket_path[64];
+
+/** @brief The listening socket opened by open_server(), or -1. */
+extern int socket_fd;
+
+/** @brief Sets socket_path for the test called 'name', and removes anything
+ * an earlier run left there. */
+void set_socket_path(const char *name);
+
+/** @brief Sets socket_path and opens a server on it, with mode 0700.
+ * Requests handled by serve() go to 'callback'.
+ * @return 0, or -1 if the server couldn't be opened. */
+int open_server(const char *name, socks_callback_t callback);
+
+/** @brief Closes socket_fd, if it's open, and removes socket_path.
+ * @return 0. */
+int close_server(void);
+
+/** @brief Thread body that serves '(long) arg' requests on socket_fd with the
+ * callback given to open_server().
+ * @return The number of requests that failed, cast to a pointer. */
+void *serve(void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,328 @@
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+#include "libsocks_coro.hpp"
+
+/* nunit's macros use names that the standard library does too, so it comes
+ * last. */
+extern "C" {
+#include "nunit.h"
+}
+
+using socks::coro::incoming;
+using socks::coro::scheduler;
+using socks::coro::task;
+
+enum {
+    client_count = 20,
+    delay_ms = 50
+};
+
+static char front_path[64];
+static char back_path[64];
+static int front_fd = -1;
+static int back_fd = -1;
+
+/* Answers with the request in upper case. */
+static task<int> upper(incoming &request)
+{
+    std::string answer(request.message());
+
+    for (char &c : answer) {
+        c = static_cast<char>(toupper(static_cast<unsigned char>(c)));
+    }
+
+    co_await request.respond(answer.data(),
+                             static_cast<std::uint16_t>(answer.size()));
+    co_return 0;
+}
+
+/* Waits a while (as though for something slow), then asks the back end to
+ * answer. "quiet" gets no response at all, and "throw" throws. */
+static task<int> relay(incoming &request)
+{
+    std::string answer;
+
+    if (request.message() == "quiet") {
+        co_return 0;
+    }
+
+    if (request.message() == "throw") {
+        throw std::runtime_error("handler failed");
+    }
+
+    co_await request.owner().sleep_for(std::chrono::milliseconds(delay_ms));
+
+    if (co_await socks::coro::process(request.owner(), back_path,
+                                      request.data(), request.size(),
+                                      answer) < 0) {
+        co_return -1;
+    }
+
+    co_await request.respond(answer.data(),
+                             static_cast<std::uint16_t>(answer.size()));
+    co_return 0;
+}
+
+struct tally {
+    scheduler *owner;
+    int finished;
+    int correct;
+};
+
+static task<void> client(tally &counts, int number)
+{
+    char msg[16];
+    char expected[16];
+    std::string answer;
+
+    snprintf(msg, sizeof(msg), "msg%d", number);
+    snprintf(expected, sizeof(expected), "MSG%d", number);
+
+    if ((co_await socks::coro::process(*counts.owner, front_path, msg,
+                                       static_cast<std::uint16_t>(strlen(msg)),
+                                       answer) >= 0) &&
+        (answer == expected)) {
+        counts.correct++;
+    }
+
+    if (++counts.finished == client_count) {
+        counts.owner->stop();
+    }
+}
+
+/* Plain libsocks server, for the client test. */
+static int echo(int response_fd, const char *msg, uint16_t len)
+{
+    return (socks_server_respond(response_fd, msg, len) < 0) ? -1 : 0;
+}
+
+static void *serve_blocking(void *arg)
+{
+    long count = reinterpret_cast<long>(arg);
+
+    for (long x = 0; x < count; x++) {
+        if ((socks_server_wait(back_fd) != 0) ||
+            (socks_server_process(back_fd, echo) != 0)) {
+            return reinterpret_cast<void *>(-1L);
+        }
+    }
+
+    return nullptr;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int fanout_test()
+{
+    scheduler owner;
+    tally counts = {&owner, 0, 0};
+
+    label_test();
+
+    owner.spawn(socks::coro::serve(owner, front_fd, relay));
+    owner.spawn(socks::coro::serve(owner, back_fd, upper));
+
+    for (int x = 0; x < client_count; x++) {
+        owner.spawn(client(counts, x));
+    }
+
+    /* Every request waits delay_ms before going to the back end, all on one
+     * thread, so this only finishes quickly if they all wait at once. */
+    auto start = std::chrono::steady_clock::now();
+    assert_success(owner.run());
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    assert_true(counts.finished == client_count);
+    assert_true(counts.correct == client_count);
+    assert_true(elapsed < std::chrono::milliseconds(client_count * delay_ms /
+                                                    2));
+
+    return EXIT_SUCCESS;
+}
+
+static int client_test()
+{
+    scheduler owner;
+    pthread_t server;
+    void *server_result;
+    ssize_t results[3] = {-2, -2, -2};
+    std::string answers[3];
+
+    label_test();
+
+    assert_success(pthread_create(&server, nullptr, serve_blocking,
+                                  reinterpret_cast<void *>(2L)));
+
+    auto call = [&](int x, const char *path, const char *msg) -> task<void> {
+        results[x] = co_await socks::coro::process(
+            owner, path, msg, static_cast<std::uint16_t>(strlen(msg)),
+            answers[x]);
+    };
+
+    owner.spawn(call(0, back_path, "first"));
+    owner.spawn(call(1, back_path, ""));
+    owner.spawn(call(2, "/nonexistent/libsocks_test_coro", "lost"));
+    assert_success(owner.run());
+
+    pthread_join(server, &server_result);
+    assert_true(server_result == nullptr);
+    assert_true(results[0] == 5);
+    assert_true(answers[0] == "first");
+    assert_zero(results[1]);
+    assert_true(answers[1].empty());
+    assert_true(results[2] == -1);
+
+    return EXIT_SUCCESS;
+}
+
+static int respond_test()
+{
+    scheduler owner;
+    std::atomic<int> done(0);
+    pthread_t thread;
+
+    label_test();
+
+    /* Blocking clients on another thread, for a change. */
+    auto clients = [](void *arg) -> void * {
+        auto *counter = static_cast<std::atomic<int> *>(arg);
+        char output[16];
+
+        if ((socks_client_process(front_path, "quiet", 5, output,
+                                  sizeof(output)) == 0) &&
+            (socks_client_process(front_path, "throw", 5, output,
+                                  sizeof(output)) < 0)) {
+            counter->store(1);
+        } else {
+            counter->store(-1);
+        }
+
+        return nullptr;
+    };
+
+    assert_success(pthread_create(&thread, nullptr, clients, &done));
+    owner.spawn(socks::coro::serve(owner, front_fd, relay));
+
+    auto watch = [&]() -> task<void> {
+        while (done.load() == 0) {
+            co_await owner.sleep_for(std::chrono::milliseconds(1));
+        }
+
+        owner.stop();
+    };
+
+    owner.spawn(watch());
+    assert_success(owner.run());
+    pthread_join(thread, nullptr);
+    assert_true(done.load() == 1);
+
+    return EXIT_SUCCESS;
+}
+
+static int backlog_test()
+{
+    const struct socks_retry_policy policy = {1, 8, 100};
+    struct sockaddr_un address;
+    std::vector<int> pending;
+    scheduler owner;
+    ssize_t result = -2;
+    int error = 0;
+    int listen_fd;
+    std::string answer;
+
+    label_test();
+
+    /* A listener that never accepts, with its backlog already full. */
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path),
+             "/tmp/libsocks_test_coro_c.%ld", static_cast<long>(getpid()));
+    listen_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    assert_nonnegative(listen_fd);
+    assert_success(bind(listen_fd, reinterpret_cast<sockaddr *>(&address),
+                        sizeof(address)));
+    assert_success(listen(listen_fd, 0));
+
+    for (;;) {
+        int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+
+        assert_nonnegative(fd);
+        pending.push_back(fd);
+
+        if (connect(fd, reinterpret_cast<sockaddr *>(&address),
+                    sizeof(address)) != 0) {
+            assert_true(errno == EAGAIN);
+            break;
+        }
+    }
+
+    assert_success(socks_client_set_retry(&policy));
+
+    auto call = [&]() -> task<void> {
+        result = co_await socks::coro::process(owner, address.sun_path, "x", 1,
+                                               answer);
+        error = errno;
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    owner.spawn(call());
+    assert_success(owner.run());
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    socks_client_set_retry(nullptr);
+
+    for (int fd : pending) {
+        close(fd);
+    }
+
+    close(listen_fd);
+    unlink(address.sun_path);
+
+    assert_true(result == -1);
+    assert_true(error == EAGAIN);
+    assert_true(elapsed >= std::chrono::milliseconds(policy.deadline_ms));
+    assert_true(elapsed < std::chrono::milliseconds(10 * policy.deadline_ms));
+
+    return EXIT_SUCCESS;
+}
+
+static int setup()
+{
+    snprintf(front_path, sizeof(front_path), "/tmp/libsocks_test_coro.%ld",
+             static_cast<long>(getpid()));
+    snprintf(back_path, sizeof(back_path), "/tmp/libsocks_test_coro_b.%ld",
+             static_cast<long>(getpid()));
+    front_fd = socks_server_open(front_path, 0700);
+    back_fd = socks_server_open(back_path, 0700);
+    return ((front_fd < 0) || (back_fd < 0)) ? -1 : 0;
+}
+
+static int teardown()
+{
+    socks_server_close(front_fd);
+    socks_server_close(back_fd);
+    unlink(front_path);
+    unlink(back_path);
+    return 0;
+}
+
+static test_t test_suite[] = {fanout_test, client_test, respond_test,
+                              backlog_test, nullptr};
+
+extern "C" void nunit_config(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+    register_suite(test_suite, "test_suite", setup, teardown);
+}
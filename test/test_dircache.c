@@ -0,0 +1,213 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nunit.h"
+#include "libsocks_dircache.h"
+
+static char base[64];
+static char path[PATH_MAX];
+static struct socks_dircache_stats stats;
+
+static int make_base(void)
+{
+    snprintf(base, sizeof(base), "/tmp/libsocks_test_dircache.%ld",
+             (long) getpid());
+    snprintf(path, sizeof(path), "%s/a/b/c", base);
+    return mkdir(base, 0755);
+}
+
+static int remove_base(void)
+{
+    char command[PATH_MAX + 16];
+
+    snprintf(command, sizeof(command), "rm -rf '%s'", base);
+    return system(command);
+}
+
+static int mkdirs(socks_dircache_t *cache)
+{
+    return socks_mkdirs_cached(cache, path, (unsigned int) strlen(path), 0755,
+                               (uid_t) -1, (gid_t) -1);
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int hit_test(void)
+{
+    socks_dircache_t *cache;
+    char other[PATH_MAX];
+
+    label_test();
+
+    cache = socks_dircache_create(16, 0);
+    assert_true(cache != NULL);
+
+    assert_success(mkdirs(cache));
+    assert_success(mkdirs(cache));
+    assert_success(mkdirs(cache));
+
+    socks_dircache_get_stats(cache, &stats);
+    assert_true(stats.misses == 1);
+    assert_true(stats.hits == 2);
+    assert_true(stats.entries == 1);
+
+    /* A directory that was replaced has a new inode, so it's walked again. */
+    snprintf(other, sizeof(other), "%s.new", path);
+    assert_success(mkdir(other, 0700));
+    assert_success(rmdir(path));
+    assert_success(rename(other, path));
+    assert_success(mkdirs(cache));
+
+    socks_dircache_get_stats(cache, &stats);
+    assert_true(stats.stale == 1);
+    assert_true(stats.misses == 2);
+
+    socks_dircache_invalidate(cache, path, (unsigned int) strlen(path));
+    socks_dircache_get_stats(cache, &stats);
+    assert_true(stats.entries == 0);
+
+    socks_dircache_destroy(cache);
+    return EXIT_SUCCESS;
+}
+
+static int capacity_test(void)
+{
+    socks_dircache_t *cache;
+    char other[PATH_MAX];
+
+    label_test();
+
+    cache = socks_dircache_create(2, 0);
+    assert_true(cache != NULL);
+
+    for (int x = 0; x < 5; x++) {
+        int length = snprintf(other, sizeof(other), "%s/n%d", base, x);
+
+        assert_success(socks_mkdirs_cached(cache, other, (unsigned int) length,
+                                           0755, (uid_t) -1, (gid_t) -1));
+    }
+
+    socks_dircache_get_stats(cache, &stats);
+    assert_true(stats.entries == 2);
+    assert_true(stats.evictions == 3);
+
+    socks_dircache_destroy(cache);
+    return EXIT_SUCCESS;
+}
+
+static int inotify_test(void)
+{
+    socks_dircache_t *cache;
+
+    label_test();
+
+    cache = socks_dircache_create(16, SOCKS_DIRCACHE_INOTIFY);
+    assert_true(cache != NULL);
+
+    assert_success(mkdirs(cache));
+    assert_success(rmdir(path));
+
+    socks_dircache_get_stats(cache, &stats);
+    assert_true(stats.entries == 0);
+    assert_true(stats.evictions == 1);
+
+    assert_success(mkdirs(cache));
+    socks_dircache_get_stats(cache, &stats);
+    assert_true(stats.stale == 0);
+    assert_true(stats.misses == 2);
+
+    socks_dircache_destroy(cache);
+    return EXIT_SUCCESS;
+}
+
+static int key_test(void)
+{
+    static const char *const spellings[] = {"%s/a/b/c/", "%s//a/b//c",
+                                            "%s/a/./b/c/."};
+    socks_dircache_t *cache;
+    char other[PATH_MAX];
+
+    label_test();
+
+    cache = socks_dircache_create(16, 0);
+    assert_true(cache != NULL);
+    assert_success(mkdirs(cache));
+
+    /* Other spellings of the same path share its entry. */
+    for (int x = 0; x < 3; x++) {
+        int length = snprintf(other, sizeof(other), spellings[x], base);
+
+        assert_success(socks_mkdirs_cached(cache, other, (unsigned int) length,
+                                           0755, (uid_t) -1, (gid_t) -1));
+    }
+
+    socks_dircache_get_stats(cache, &stats);
+    assert_true(stats.misses == 1);
+    assert_true(stats.hits == 3);
+    assert_true(stats.entries == 1);
+
+    snprintf(other, sizeof(other), "%s//a/b/c/", base);
+    socks_dircache_invalidate(cache, other, (unsigned int) strlen(other));
+    socks_dircache_get_stats(cache, &stats);
+    assert_true(stats.entries == 0);
+
+    socks_dircache_destroy(cache);
+    return EXIT_SUCCESS;
+}
+
+static int alias_test(void)
+{
+    socks_dircache_t *cache;
+    char link[PATH_MAX];
+    int length;
+
+    label_test();
+
+    cache = socks_dircache_create(16, SOCKS_DIRCACHE_INOTIFY);
+    assert_true(cache != NULL);
+
+    /* A symlink caches the same directory under a second key, with the same
+     * watch. Dropping one entry keeps the other, and its watch. */
+    length = snprintf(link, sizeof(link), "%s/link", base);
+    assert_success(mkdirs(cache));
+    assert_success(symlink(path, link));
+    assert_success(socks_mkdirs_cached(cache, link, (unsigned int) length,
+                                       0755, (uid_t) -1, (gid_t) -1));
+
+    socks_dircache_invalidate(cache, path, (unsigned int) strlen(path));
+    socks_dircache_get_stats(cache, &stats);
+    assert_true(stats.entries == 1);
+    assert_true(stats.evictions == 0);
+
+    assert_success(rmdir(path));
+    socks_dircache_get_stats(cache, &stats);
+    assert_true(stats.entries == 0);
+    assert_true(stats.evictions == 1);
+
+    socks_dircache_destroy(cache);
+    return EXIT_SUCCESS;
+}
+
+static int setup(void)
+{
+    return make_base();
+}
+
+static int teardown(void)
+{
+    return remove_base();
+}
+
+test_t test_suite[] = {hit_test, capacity_test, inotify_test, key_test,
+                       alias_test, NULL};
+
+void nunit_config(void)
+{
+    register_suite(test_suite, "test_suite", setup, teardown);
+}
@@ -0,0 +1,294 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nunit.h"
+#include "libsocks.h"
+#include "libsocks_log.h"
+#include "libsocks_pvt.h"
+
+enum {
+    thread_count = 4,
+    thread_messages = 100
+};
+
+static char socket_path[64];
+static int saved_stderr = -1;
+
+static char last_message[256];
+static enum socks_log_level last_level;
+static int hook_calls;
+
+static struct socks_log_site sites[thread_count][thread_messages];
+
+static void hook(void *context, enum socks_log_level level,
+                 const char *message)
+{
+    (*(int *) context)++;
+    last_level = level;
+    snprintf(last_message, sizeof(last_message), "%s", message);
+}
+
+/** @brief Fails to reach the (missing) server, which logs a warning. */
+static int fail_connect(void)
+{
+    char buffer[8];
+
+    return (socks_client_process(socket_path, "hi", sizeof("hi"), buffer,
+                                 sizeof(buffer)) < 0) && (errno == ENOENT);
+}
+
+/* Each message comes from its own site, so none are rate-limited. */
+static void *log_many(void *arg)
+{
+    long thread = (long) arg;
+
+    for (int x = 0; x < thread_messages; x++) {
+        socks_log_write(&sites[thread][x], SOCKS_LOG_ERROR, "thread %ld:%d",
+                        thread, x);
+    }
+
+    return NULL;
+}
+
+/** @brief Points stderr at a pipe, and returns its read end. */
+static int capture_stderr(void)
+{
+    int fds[2];
+
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    dup2(fds[1], STDERR_FILENO);
+    close(fds[1]);
+    return fds[0];
+}
+
+/** @brief Counts the lines waiting in a pipe. */
+static int count_lines(int fd)
+{
+    char buffer[4096];
+    ssize_t length;
+    int lines = 0;
+
+    while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t x = 0; x < length; x++) {
+            lines += (buffer[x] == '\n');
+        }
+    }
+
+    return lines;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int hook_test(void)
+{
+    struct socks_log_stats before;
+    struct socks_log_stats after;
+
+    label_test();
+
+    socks_log_set_hook(hook, &hook_calls);
+    socks_log_get_stats(&before);
+
+    assert_true(fail_connect());
+    assert_true(hook_calls == 1);
+    assert_true(last_level == SOCKS_LOG_WARN);
+    assert_true(strstr(last_message, socket_path) != NULL);
+    assert_true(strchr(last_message, '\n') == NULL);
+
+    socks_log_get_stats(&after);
+    assert_true(after.logged == before.logged + 1);
+
+    return EXIT_SUCCESS;
+}
+
+static int level_test(void)
+{
+    label_test();
+
+    socks_log_set_hook(hook, &hook_calls);
+    socks_log_set_level(SOCKS_LOG_ERROR);
+    assert_true(fail_connect());
+    socks_log_set_level(SOCKS_LOG_OFF);
+    assert_true(fail_connect());
+    assert_zero(hook_calls);
+
+    socks_log_set_level(SOCKS_LOG_DEBUG);
+    assert_true(fail_connect());
+    assert_true(hook_calls == 1);
+
+    return EXIT_SUCCESS;
+}
+
+static int rate_test(void)
+{
+    const struct timespec pause = {1, 100000000};
+    struct socks_log_stats before;
+    struct socks_log_stats after;
+
+    label_test();
+
+    /* Start from a fresh second, since earlier tests logged from the same
+     * site. */
+    socks_log_set_hook(hook, &hook_calls);
+    nanosleep(&pause, NULL);
+    socks_log_get_stats(&before);
+
+    /* At most a burst gets through per second, which this can straddle. */
+    for (int x = 0; x < 50; x++) {
+        assert_true(fail_connect());
+    }
+
+    assert_true(hook_calls >= SOCKS_LOG_BURST);
+    assert_true(hook_calls <= 2 * SOCKS_LOG_BURST);
+    socks_log_get_stats(&after);
+    assert_true(after.suppressed - before.suppressed ==
+                (unsigned long)(50 - hook_calls));
+
+    /* The next second's first message owns up to what was missed. */
+    nanosleep(&pause, NULL);
+    assert_true(fail_connect());
+    assert_true(strstr(last_message, "similar suppressed") != NULL);
+
+    return EXIT_SUCCESS;
+}
+
+static int ring_test(void)
+{
+    pthread_t threads[thread_count];
+    struct socks_log_stats before;
+    struct socks_log_stats after;
+    int capture;
+    int lines = 0;
+
+    label_test();
+
+    capture = capture_stderr();
+    assert_true(capture >= 0);
+    socks_log_get_stats(&before);
+
+    for (long x = 0; x < thread_count; x++) {
+        assert_success(pthread_create(&threads[x], NULL, log_many,
+                                      (void *) x));
+    }
+
+    for (int x = 0; x < thread_count; x++) {
+        pthread_join(threads[x], NULL);
+    }
+
+    /* Whatever fit in the ring reaches stderr, once flushed. */
+    socks_log_flush();
+    lines = count_lines(capture);
+    close(capture);
+    dup2(saved_stderr, STDERR_FILENO);
+
+    socks_log_get_stats(&after);
+    assert_true((after.logged - before.logged) +
+                (after.dropped - before.dropped) ==
+                thread_count * thread_messages);
+    assert_true(lines == (int)(after.logged - before.logged));
+    assert_true(lines > 0);
+
+    return EXIT_SUCCESS;
+}
+
+static int fork_test(void)
+{
+    static const char filler[4096];
+    int capture;
+    int status;
+    pid_t child;
+
+    label_test();
+
+    /* Fill stderr's pipe, so that the drain thread blocks and what's logged
+     * next is still queued when the process forks. */
+    capture = capture_stderr();
+    assert_true(capture >= 0);
+    fcntl(STDERR_FILENO, F_SETFL, O_NONBLOCK);
+
+    while (write(STDERR_FILENO, filler, sizeof(filler)) > 0) {
+    }
+
+    fcntl(STDERR_FILENO, F_SETFL, 0);
+    log_many((void *) 0L);
+    child = fork();
+
+    /* The child writes only its own message, to a pipe of its own, and
+     * exits with the number of lines it wrote. */
+    if (child == 0) {
+        int fds[2];
+
+        if (pipe(fds) != 0) {
+            _exit(255);
+        }
+
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, O_NONBLOCK);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[1]);
+        socks_log_write(&sites[1][0], SOCKS_LOG_ERROR, "child");
+        socks_log_flush();
+        close(STDERR_FILENO);
+        _exit(count_lines(fds[0]));
+    }
+
+    /* Empty the pipe and put stderr back before anything can fail, since
+     * nunit reports failures on stderr. */
+    if ((child < 0) || (waitpid(child, &status, 0) != child)) {
+        status = -1;
+    }
+
+    count_lines(capture);
+    socks_log_flush();
+    count_lines(capture);
+    close(capture);
+    dup2(saved_stderr, STDERR_FILENO);
+
+    assert_true(WIFEXITED(status) && (WEXITSTATUS(status) == 1));
+
+    return EXIT_SUCCESS;
+}
+
+static int setup(void)
+{
+    snprintf(socket_path, sizeof(socket_path), "/tmp/libsocks_test_log.%ld",
+             (long) getpid());
+    unlink(socket_path);
+    hook_calls = 0;
+    last_message[0] = '\x00';
+    saved_stderr = dup(STDERR_FILENO);
+    return (saved_stderr < 0) ? -1 : 0;
+}
+
+static int teardown(void)
+{
+    socks_log_set_hook(NULL, NULL);
+    socks_log_set_level(SOCKS_LOG_WARN);
+    socks_log_flush();
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stderr);
+    return 0;
+}
+
+test_t test_suite[] = {hook_test, level_test, rate_test, ring_test, fork_test,
+                       NULL};
+
+void nunit_config(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+    register_suite(test_suite, "test_suite", setup, teardown);
+}
@@ -0,0 +1,200 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "libsocks_message.hpp"
+
+/* nunit's macros use names that the standard library does too, so it comes
+ * last. */
+extern "C" {
+#include "nunit.h"
+}
+
+#include "test_common.h"
+
+enum class shape : std::uint8_t { square = 1, circle = 2 };
+
+struct point {
+    std::int32_t x;
+    std::int16_t y;
+    bool visible;
+};
+
+SOCKS_MESSAGE(point, x, y, visible);
+
+struct drawing {
+    std::uint64_t id;
+    shape kind;
+    point origin;
+    std::string_view label;
+    std::array<std::uint16_t, 3> sizes;
+    double scale;
+    std::string_view note;
+};
+
+SOCKS_MESSAGE(drawing, id, kind, origin, label, sizes, scale, note);
+
+/* Encoding a fixed-size message can happen at compile time. */
+constexpr std::array<char, 7> encoded_point()
+{
+    std::array<char, 7> buffer{};
+    socks::encode(point{-2, 0x1234, true}, buffer.data(), buffer.size());
+    return buffer;
+}
+
+static_assert(socks::is_fixed<point> && (socks::fixed_size<point> == 7),
+              "point should pack to 7 bytes");
+static_assert(!socks::is_fixed<drawing>, "drawing has strings");
+static_assert((encoded_point()[0] == '\xfe') &&
+              (encoded_point()[3] == '\xff') &&
+              (encoded_point()[4] == '\x34') &&
+              (encoded_point()[5] == '\x12') &&
+              (encoded_point()[6] == '\x01'),
+              "fields should be little-endian and unpadded");
+
+static const drawing sample = {0x0102030405060708ULL, shape::circle,
+                               {7, -3, false}, "label",
+                               {{1, 2, 0xffff}}, 0.5, "a note"};
+
+/* Answers a drawing with its origin, moved along by the drawing's id. */
+static int callback(int response_fd, const char *msg, uint16_t len)
+{
+    auto request = socks::view<drawing>::from(msg, len);
+
+    if (!request) {
+        return -1;
+    }
+
+    point origin = request->get<&drawing::origin>().decode();
+    origin.x += static_cast<std::int32_t>(request->get<&drawing::id>());
+    return (socks::respond(response_fd, origin) < 0) ? -1 : 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int roundtrip_test()
+{
+    char buffer[128];
+    drawing decoded{};
+    std::ptrdiff_t length;
+
+    label_test();
+
+    length = socks::encode(sample, buffer, sizeof(buffer));
+    assert_true(length == static_cast<std::ptrdiff_t>(
+                              socks::encoded_size(sample)));
+    assert_true(length == 8 + 1 + 7 + 7 + 6 + 8 + 8);
+
+    assert_true(socks::decode(buffer, static_cast<std::size_t>(length),
+                              decoded));
+    assert_true(decoded.id == sample.id);
+    assert_true(decoded.kind == shape::circle);
+    assert_true((decoded.origin.x == 7) && (decoded.origin.y == -3) &&
+                !decoded.origin.visible);
+    assert_true(decoded.label == "label");
+    assert_true(decoded.sizes == sample.sizes);
+    assert_true(decoded.scale == 0.5);
+    assert_true(decoded.note == "a note");
+
+    /* Strings are decoded in place, not copied. */
+    assert_true((decoded.label.data() > buffer) &&
+                (decoded.label.data() < buffer + length));
+
+    return EXIT_SUCCESS;
+}
+
+static int view_test()
+{
+    char buffer[128];
+    std::ptrdiff_t length = socks::encode(sample, buffer, sizeof(buffer));
+
+    label_test();
+
+    auto message = socks::view<drawing>::from(
+        buffer, static_cast<std::size_t>(length));
+    assert_true(message.has_value());
+    assert_true(message->get<&drawing::id>() == sample.id);
+    assert_true(message->get<1>() == shape::circle);
+    assert_true(message->get<&drawing::origin>().get<&point::y>() == -3);
+    assert_true(message->get<&drawing::sizes>()[2] == 0xffff);
+    assert_true(message->get<&drawing::scale>() == 0.5);
+    assert_true(message->get<&drawing::note>() == "a note");
+    assert_true(message->get<&drawing::note>().data() ==
+                buffer + length - 6);
+
+    return EXIT_SUCCESS;
+}
+
+static int malformed_test()
+{
+    char buffer[128];
+    std::ptrdiff_t length = socks::encode(sample, buffer, sizeof(buffer));
+    drawing decoded{};
+
+    label_test();
+
+    /* Truncated, padded, or with a string running off the end. */
+    for (std::ptrdiff_t x = 0; x < length; x++) {
+        assert_false(socks::view<drawing>::from(
+                         buffer, static_cast<std::size_t>(x)).has_value());
+    }
+
+    assert_false(socks::decode(buffer, static_cast<std::size_t>(length) + 1,
+                               decoded));
+
+    buffer[16] = 100;
+    assert_false(socks::view<drawing>::from(
+                     buffer, static_cast<std::size_t>(length)).has_value());
+
+    assert_true(socks::encode(sample, buffer, 10) == -1);
+
+    return EXIT_SUCCESS;
+}
+
+static int request_test()
+{
+    pthread_t server;
+    void *server_result;
+    socks::reply reply;
+
+    label_test();
+
+    assert_success(pthread_create(&server, nullptr, serve,
+                                  reinterpret_cast<void *>(1L)));
+    assert_true(socks::request(socket_path, sample, reply) ==
+                static_cast<ssize_t>(socks::fixed_size<point>));
+    pthread_join(server, &server_result);
+    assert_true(server_result == nullptr);
+
+    auto origin = reply.as<point>();
+    assert_true(origin.has_value());
+    assert_true(origin->get<&point::x>() ==
+                static_cast<std::int32_t>(7 + 0x05060708));
+    assert_true(origin->get<&point::y>() == -3);
+    assert_false(reply.as<drawing>().has_value());
+
+    return EXIT_SUCCESS;
+}
+
+static int setup()
+{
+    return open_server("message", callback);
+}
+
+static int teardown()
+{
+    return close_server();
+}
+
+static test_t test_suite[] = {roundtrip_test, view_test, malformed_test,
+                              request_test, nullptr};
+
+extern "C" void nunit_config(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+    register_suite(test_suite, "test_suite", setup, teardown);
+}
@@ -0,0 +1,244 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nunit.h"
+#include "libsocks_dirs.h"
+
+enum {
+    thread_count = 8,
+    batch_count = 300
+};
+
+static char base[64];
+static char cwd_before[PATH_MAX];
+static char cwd_after[PATH_MAX];
+
+static int is_directory(const char *path)
+{
+    struct stat buffer;
+
+    return (stat(path, &buffer) == 0) && S_ISDIR(buffer.st_mode);
+}
+
+static int make_base(void)
+{
+    snprintf(base, sizeof(base), "/tmp/libsocks_test_mkdirs_at.%ld",
+             (long) getpid());
+    return mkdir(base, 0755);
+}
+
+static int remove_base(void)
+{
+    char command[PATH_MAX + 16];
+
+    snprintf(command, sizeof(command), "rm -rf '%s'", base);
+    return system(command);
+}
+
+static void *mkdirs_thread(void *arg)
+{
+    char path[PATH_MAX];
+    long index = (long) arg;
+    int length;
+
+    length = snprintf(path, sizeof(path), "%s/shared/deeper/t%ld/a/b/c", base,
+                      index);
+
+    return (void *)(long) socks_mkdirs(path, (unsigned int) length, 0755,
+                                       (uid_t) -1, (gid_t) -1);
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int relative_test(void)
+{
+    char path[PATH_MAX];
+    int dir_fd;
+    int fd;
+
+    label_test();
+
+    getcwd(cwd_before, sizeof(cwd_before));
+    dir_fd = open(base, O_RDONLY | O_DIRECTORY);
+    assert_nonnegative(dir_fd);
+
+    assert_success(socks_mkdirs_at(dir_fd, "one/two/three", 13, 0755,
+                                   (uid_t) -1, (gid_t) -1));
+    assert_success(socks_mkdirs_at(dir_fd, "one/./two/../four", 17, 0755,
+                                   (uid_t) -1, (gid_t) -1));
+
+    fd = socks_mkdirs_open(dir_fd, "one/two", 7, 0755, (uid_t) -1,
+                           (gid_t) -1);
+    assert_nonnegative(fd);
+    assert_success(mkdirat(fd, "five", 0755));
+    close(fd);
+    close(dir_fd);
+
+    getcwd(cwd_after, sizeof(cwd_after));
+    assert_zero(strcmp(cwd_before, cwd_after));
+
+    snprintf(path, sizeof(path), "%s/one/two/three", base);
+    assert_true(is_directory(path));
+    snprintf(path, sizeof(path), "%s/one/four", base);
+    assert_true(is_directory(path));
+    snprintf(path, sizeof(path), "%s/one/two/five", base);
+    assert_true(is_directory(path));
+
+    return EXIT_SUCCESS;
+}
+
+static int symlink_test(void)
+{
+    char path[PATH_MAX];
+    char target[PATH_MAX];
+
+    label_test();
+
+    /* Existing components may be symlinks, as with socks_mkdirs_chdir(). */
+    snprintf(target, sizeof(target), "%s/real", base);
+    snprintf(path, sizeof(path), "%s/link", base);
+    assert_success(mkdir(target, 0755));
+    assert_success(symlink(target, path));
+
+    snprintf(path, sizeof(path), "%s/link/new", base);
+    assert_success(socks_mkdirs(path, (unsigned int) strlen(path), 0755,
+                                (uid_t) -1, (gid_t) -1));
+    snprintf(path, sizeof(path), "%s/real/new", base);
+    assert_true(is_directory(path));
+
+    /* A component that isn't a directory stops the walk. */
+    snprintf(path, sizeof(path), "%s/file", base);
+    assert_success(close(open(path, O_CREAT | O_WRONLY, 0644)));
+    snprintf(path, sizeof(path), "%s/file/sub", base);
+    assert_failure(socks_mkdirs(path, (unsigned int) strlen(path), 0755,
+                                (uid_t) -1, (gid_t) -1));
+
+    return EXIT_SUCCESS;
+}
+
+static int concurrent_test(void)
+{
+    pthread_t threads[thread_count];
+    char path[PATH_MAX];
+    void *result;
+
+    label_test();
+
+    for (long x = 0; x < thread_count; x++) {
+        assert_success(pthread_create(&threads[x], NULL, mkdirs_thread,
+                                      (void *) x));
+    }
+
+    for (long x = 0; x < thread_count; x++) {
+        assert_success(pthread_join(threads[x], &result));
+        assert_zero((int)(long) result);
+    }
+
+    for (long x = 0; x < thread_count; x++) {
+        snprintf(path, sizeof(path), "%s/shared/deeper/t%ld/a/b/c", base, x);
+        assert_true(is_directory(path));
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static int batch_test(void)
+{
+    static char storage[batch_count + 3][PATH_MAX];
+    static char too_long[2 * PATH_MAX];
+    const char *paths[batch_count + 3];
+    int errors[batch_count + 3];
+    char path[PATH_MAX];
+    int dir_fd;
+
+    label_test();
+
+    for (int x = 0; x < batch_count; x++) {
+        snprintf(storage[x], PATH_MAX, "%s/tenants/t%03d/run", base, x % 250);
+        paths[x] = storage[x];
+    }
+
+    snprintf(storage[batch_count], PATH_MAX, "%s//tenants/./t000/run/a",
+             base);
+    snprintf(storage[batch_count + 1], PATH_MAX, "%s/file/sub", base);
+    snprintf(storage[batch_count + 2], PATH_MAX, "%s/tenants", base);
+
+    for (int x = batch_count; x < batch_count + 3; x++) {
+        paths[x] = storage[x];
+    }
+
+    snprintf(path, sizeof(path), "%s/file", base);
+    assert_success(close(open(path, O_CREAT | O_WRONLY, 0644)));
+
+    assert_failure(socks_mkdirs_batch(AT_FDCWD, paths, batch_count + 3, 0755,
+                                      (uid_t) -1, (gid_t) -1, 4, errors));
+
+    for (int x = 0; x < batch_count + 3; x++) {
+        assert_true(errors[x] == ((x == batch_count + 1) ? ENOTDIR : 0));
+        assert_true((x == batch_count + 1) || is_directory(paths[x]));
+    }
+
+    /* Again, with everything but one leaf already there. */
+    snprintf(storage[batch_count + 2], PATH_MAX, "%s/tenants/t001/run/leaf",
+             base);
+    assert_failure(socks_mkdirs_batch(AT_FDCWD, paths, batch_count + 3, 0755,
+                                      (uid_t) -1, (gid_t) -1, 4, errors));
+
+    for (int x = 0; x < batch_count + 3; x++) {
+        assert_true(errors[x] == ((x == batch_count + 1) ? ENOTDIR : 0));
+        assert_true((x == batch_count + 1) || is_directory(paths[x]));
+    }
+
+    /* Relative paths start from the given directory. */
+    dir_fd = open(base, O_RDONLY | O_DIRECTORY);
+    assert_nonnegative(dir_fd);
+    paths[0] = "rel/a";
+    paths[1] = "rel/b";
+    assert_success(socks_mkdirs_batch(dir_fd, paths, 2, 0755, (uid_t) -1,
+                                      (gid_t) -1, 0, NULL));
+    close(dir_fd);
+
+    snprintf(path, sizeof(path), "%s/rel/b", base);
+    assert_true(is_directory(path));
+
+    /* Paths longer than PATH_MAX fail on their own. */
+    memset(too_long, 'a', sizeof(too_long) - 1);
+    snprintf(path, sizeof(path), "%s/short", base);
+    paths[0] = path;
+    paths[1] = too_long;
+    assert_failure(socks_mkdirs_batch(AT_FDCWD, paths, 2, 0755, (uid_t) -1,
+                                      (gid_t) -1, 0, errors));
+    assert_zero(errors[0]);
+    assert_true(errors[1] == ENAMETOOLONG);
+    assert_true(errno == ENAMETOOLONG);
+    assert_true(is_directory(path));
+
+    return EXIT_SUCCESS;
+}
+
+static int setup(void)
+{
+    return make_base();
+}
+
+static int teardown(void)
+{
+    return remove_base();
+}
+
+test_t test_suite[] = {relative_test, symlink_test, concurrent_test, batch_test,
+                       NULL};
+
+void nunit_config(void)
+{
+    register_suite(test_suite, "test_suite", setup, teardown);
+}
@@ -0,0 +1,131 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nunit.h"
+#include "libsocks.h"
+#include "libsocks_notify.h"
+#include "test_common.h"
+
+static socks_notify_t *notify = NULL;
+
+static char received[256];
+static size_t received_length;
+static int terminated;
+static int response_fds;
+
+/* Appends each notification to 'received', followed by a comma. */
+static int callback(int response_fd, const char *msg, uint16_t len)
+{
+    if (msg[len] != '\x00') {
+        terminated = 0;
+    }
+
+    if (response_fd != -1) {
+        response_fds++;
+    }
+
+    if (received_length + len + 1 < sizeof(received)) {
+        memcpy(received + received_length, msg, len);
+        received_length += len;
+        received[received_length++] = ',';
+    }
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int single_test(void)
+{
+    label_test();
+
+    assert_true(socks_notify(socket_path, "one", 3) == 3);
+    assert_true(socks_notify(socket_path, "", 0) == 0);
+    assert_true(socks_notify_process(notify, callback) == 2);
+    assert_zero(strcmp(received, "one,,"));
+    assert_true(terminated);
+    assert_zero(response_fds);
+
+    return EXIT_SUCCESS;
+}
+
+static int batch_test(void)
+{
+    char msg[16];
+    int notify_fd;
+
+    label_test();
+
+    notify_fd = socks_notify_connect(socket_path);
+    assert_true(notify_fd >= 0);
+
+    for (int x = 0; x < 6; x++) {
+        int length = snprintf(msg, sizeof(msg), "n%d", x);
+        assert_true(socks_notify_send(notify_fd, msg, (uint16_t) length) ==
+                    length);
+    }
+
+    close(notify_fd);
+
+    /* The batch size is 4, so this takes two calls. */
+    assert_success(socks_server_wait(socks_notify_fd(notify)));
+    assert_true(socks_notify_process(notify, callback) == 4);
+    assert_true(socks_notify_process(notify, callback) == 2);
+    assert_zero(strcmp(received, "n0,n1,n2,n3,n4,n5,"));
+    assert_true(terminated);
+
+    return EXIT_SUCCESS;
+}
+
+static int empty_test(void)
+{
+    label_test();
+
+    assert_zero(socks_notify_process(notify, callback));
+    assert_zero(received_length);
+
+    return EXIT_SUCCESS;
+}
+
+static int missing_test(void)
+{
+    char path[80];
+
+    label_test();
+
+    snprintf(path, sizeof(path), "%s.missing", socket_path);
+    assert_true(socks_notify(path, "lost", 4) < 0);
+    assert_true(socks_notify_connect(path) < 0);
+
+    return EXIT_SUCCESS;
+}
+
+static int setup(void)
+{
+    set_socket_path("notify");
+    memset(received, 0, sizeof(received));
+    received_length = 0;
+    terminated = 1;
+    response_fds = 0;
+
+    notify = socks_notify_open(socket_path, 0700, 4);
+    return (notify == NULL) ? -1 : 0;
+}
+
+static int teardown(void)
+{
+    socks_notify_close(notify);
+    return close_server();
+}
+
+test_t test_suite[] = {single_test, batch_test, empty_test, missing_test,
+                       NULL};
+
+void nunit_config(void)
+{
+    register_suite(test_suite, "test_suite", setup, teardown);
+}
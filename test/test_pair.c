@@ -0,0 +1,170 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "nunit.h"
+#include "libsocks.h"
+#include "libsocks_pair.h"
+
+static int fds[2] = {-1, -1};
+
+/* Echoes each request back with the pid of the process handling it, except
+ * for "quiet", which gets no response at all. */
+static int callback(int response_fd, const char *msg, uint16_t len)
+{
+    char buffer[64];
+    int length;
+    (void) len;
+
+    if (strcmp(msg, "quiet") == 0) {
+        return 0;
+    }
+
+    length = snprintf(buffer, sizeof(buffer), "%s %ld", msg, (long) getpid());
+    return (socks_server_respond(response_fd, buffer, (uint16_t) length) < 0) ?
+           -1 : 0;
+}
+
+static void *serve(void *arg)
+{
+    (void) arg;
+    return (socks_pair_serve(fds[SOCKS_PAIR_SERVER], callback) == 0) ?
+           NULL : (void *) -1L;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int child_test(void)
+{
+    char expected[64];
+    char buffer[64];
+    pid_t pid;
+    int status;
+
+    label_test();
+
+    pid = fork();
+
+    if (pid == 0) {
+        close(fds[SOCKS_PAIR_CLIENT]);
+        _exit((socks_pair_serve(fds[SOCKS_PAIR_SERVER], callback) == 0) ?
+              EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    assert_true(pid > 0);
+    close(fds[SOCKS_PAIR_SERVER]);
+    fds[SOCKS_PAIR_SERVER] = -1;
+
+    /* One connection carries every request, in turn. */
+    for (int x = 0; x < 3; x++) {
+        snprintf(expected, sizeof(expected), "ping %ld", (long) pid);
+        assert_true(socks_pair_request(fds[SOCKS_PAIR_CLIENT], "ping",
+                                       sizeof("ping"), buffer,
+                                       sizeof(buffer)) ==
+                    (ssize_t) strlen(expected));
+        assert_zero(strncmp(buffer, expected, strlen(expected)));
+    }
+
+    assert_zero(socks_pair_request(fds[SOCKS_PAIR_CLIENT], "quiet",
+                                   sizeof("quiet"), buffer, sizeof(buffer)));
+
+    close(fds[SOCKS_PAIR_CLIENT]);
+    fds[SOCKS_PAIR_CLIENT] = -1;
+    assert_true(waitpid(pid, &status, 0) == pid);
+    assert_true(WIFEXITED(status) && (WEXITSTATUS(status) == EXIT_SUCCESS));
+
+    return EXIT_SUCCESS;
+}
+
+static int thread_test(void)
+{
+    char expected[64];
+    pthread_t server;
+    void *server_result;
+    char *response;
+    char buffer[8];
+    int length;
+
+    label_test();
+
+    assert_success(pthread_create(&server, NULL, serve, NULL));
+
+    length = snprintf(expected, sizeof(expected), "hello %ld",
+                      (long) getpid());
+    assert_true(socks_pair_request_alloc(fds[SOCKS_PAIR_CLIENT], "hello",
+                                         sizeof("hello"), &response) ==
+                length);
+    assert_zero(strcmp(response, expected));
+    free(response);
+
+    /* A response that doesn't fit is dropped, and the next one still
+     * arrives intact. */
+    assert_true(socks_pair_request(fds[SOCKS_PAIR_CLIENT], "hello",
+                                   sizeof("hello"), buffer,
+                                   sizeof(buffer)) < 0);
+    assert_true(errno == EMSGSIZE);
+    assert_zero(socks_pair_request(fds[SOCKS_PAIR_CLIENT], "quiet",
+                                   sizeof("quiet"), buffer, sizeof(buffer)));
+
+    close(fds[SOCKS_PAIR_CLIENT]);
+    fds[SOCKS_PAIR_CLIENT] = -1;
+    pthread_join(server, &server_result);
+    assert_true(server_result == NULL);
+
+    return EXIT_SUCCESS;
+}
+
+static int process_test(void)
+{
+    char buffer[64];
+
+    label_test();
+
+    /* The request is queued before the server end looks at it, so this
+     * doesn't need a second thread. */
+    assert_true(write(fds[SOCKS_PAIR_CLIENT], "\x05\x00", 2) == 2);
+    assert_true(write(fds[SOCKS_PAIR_CLIENT], "quiet", 5) == 5);
+    assert_true(socks_server_poll(fds[SOCKS_PAIR_SERVER]) == 1);
+    assert_zero(socks_pair_process(fds[SOCKS_PAIR_SERVER], callback));
+    assert_true(read(fds[SOCKS_PAIR_CLIENT], buffer, sizeof(buffer)) == 2);
+    assert_true((buffer[0] == 0) && (buffer[1] == 0));
+
+    close(fds[SOCKS_PAIR_CLIENT]);
+    fds[SOCKS_PAIR_CLIENT] = -1;
+    assert_true(socks_pair_process(fds[SOCKS_PAIR_SERVER], callback) < 0);
+    assert_true(errno == ECONNRESET);
+
+    return EXIT_SUCCESS;
+}
+
+static int setup(void)
+{
+    return socks_pair_open(fds);
+}
+
+static int teardown(void)
+{
+    for (int x = 0; x < 2; x++) {
+        if (fds[x] >= 0) {
+            close(fds[x]);
+            fds[x] = -1;
+        }
+    }
+
+    return 0;
+}
+
+test_t test_suite[] = {child_test, thread_test, process_test, NULL};
+
+void nunit_config(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+    register_suite(test_suite, "test_suite", setup, teardown);
+}
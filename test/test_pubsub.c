@@ -0,0 +1,233 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nunit.h"
+#include "libsocks.h"
+#include "libsocks_pubsub.h"
+#include "libsocks_pvt.h"
+
+static const char socket_path[] = "/tmp/libsocks_test_pubsub.sock";
+
+struct subscription {
+    const char *const *topics;
+    pthread_t thread;
+    int fd;
+};
+
+static void *subscribe_thread(void *arg)
+{
+    struct subscription *sub = arg;
+
+    sub->fd = socks_subscribe(socket_path, sub->topics);
+    return NULL;
+}
+
+/* socks_subscribe() waits for the server's acknowledgement, so the server
+ * side has to accept from this thread while a helper thread subscribes. */
+static int subscribe(socks_pubsub_t *pubsub, int socket_fd,
+                     const char *const *topics)
+{
+    struct subscription sub = {topics, 0, -1};
+
+    if (pthread_create(&sub.thread, NULL, subscribe_thread, &sub) != 0) {
+        return -1;
+    }
+
+    if ((socks_server_wait(socket_fd) < 0) ||
+        (socks_pubsub_accept(pubsub, socket_fd) != 0)) {
+        pthread_join(sub.thread, NULL);
+        return -1;
+    }
+
+    pthread_join(sub.thread, NULL);
+    return sub.fd;
+}
+
+static int expect(int fd, const char *topic, const char *message)
+{
+    char topic_buf[32];
+    char output[128];
+    ssize_t len = socks_subscription_recv(fd, topic_buf, sizeof(topic_buf),
+                                          output, sizeof(output));
+
+    if ((len < 0) || ((size_t) len != strlen(message))) {
+        return -1;
+    }
+
+    if ((strcmp(topic_buf, topic) != 0) || (memcmp(output, message, len))) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int fanout_test(void)
+{
+    const char *const weather[] = {"weather", NULL};
+    const char *const both[] = {"weather", "news", NULL};
+    socks_pubsub_t *pubsub;
+    int socket_fd;
+    int first;
+    int second;
+
+    label_test();
+
+    socket_fd = socks_server_open(socket_path, S_IRWXU);
+    assert_nonnegative(socket_fd);
+
+    pubsub = socks_pubsub_create(8, SOCKS_SLOW_DROP);
+    assert_true(pubsub != NULL);
+
+    first = subscribe(pubsub, socket_fd, weather);
+    assert_nonnegative(first);
+    second = subscribe(pubsub, socket_fd, both);
+    assert_nonnegative(second);
+    assert_true(socks_pubsub_count(pubsub) == 2);
+
+    assert_true(socks_pubsub_publish(pubsub, "weather", "rain", 4) == 2);
+    assert_true(socks_pubsub_publish(pubsub, "news", "none", 4) == 1);
+    assert_true(socks_pubsub_publish(pubsub, "sports", "skip", 4) == 0);
+    assert_zero(socks_pubsub_flush(pubsub));
+
+    assert_success(expect(first, "weather", "rain"));
+    assert_success(expect(second, "weather", "rain"));
+    assert_success(expect(second, "news", "none"));
+
+    /* A subscriber that hangs up is dropped on the next flush. */
+    socks_subscription_close(first);
+    socks_pubsub_publish(pubsub, "weather", "sun", 3);
+    socks_pubsub_flush(pubsub);
+    assert_true(socks_pubsub_count(pubsub) == 1);
+    assert_success(expect(second, "weather", "sun"));
+
+    socks_subscription_close(second);
+    socks_pubsub_destroy(pubsub);
+    socks_server_close(socket_fd);
+    return EXIT_SUCCESS;
+}
+
+static int coalesce_test(void)
+{
+    const char *const topics[] = {"a", "b", NULL};
+    socks_pubsub_t *pubsub;
+    int socket_fd;
+    int fd;
+
+    label_test();
+
+    socket_fd = socks_server_open(socket_path, S_IRWXU);
+    assert_nonnegative(socket_fd);
+
+    pubsub = socks_pubsub_create(2, SOCKS_SLOW_COALESCE);
+    assert_true(pubsub != NULL);
+
+    fd = subscribe(pubsub, socket_fd, topics);
+    assert_nonnegative(fd);
+
+    /* The queue holds two messages: the newer "a" replaces the older one in
+     * place, and then "b" pushes out the oldest. */
+    socks_pubsub_publish(pubsub, "a", "1", 1);
+    socks_pubsub_publish(pubsub, "b", "1", 1);
+    socks_pubsub_publish(pubsub, "a", "2", 1);
+    assert_true(socks_pubsub_dropped(pubsub) == 1);
+    socks_pubsub_publish(pubsub, "b", "2", 1);
+    assert_true(socks_pubsub_dropped(pubsub) == 2);
+    assert_zero(socks_pubsub_flush(pubsub));
+
+    assert_success(expect(fd, "a", "2"));
+    assert_success(expect(fd, "b", "2"));
+
+    socks_subscription_close(fd);
+    socks_pubsub_destroy(pubsub);
+    socks_server_close(socket_fd);
+    return EXIT_SUCCESS;
+}
+
+static int disconnect_test(void)
+{
+    const char *const topics[] = {"a", NULL};
+    socks_pubsub_t *pubsub;
+    int socket_fd;
+    int fd;
+
+    label_test();
+
+    socket_fd = socks_server_open(socket_path, S_IRWXU);
+    assert_nonnegative(socket_fd);
+
+    pubsub = socks_pubsub_create(1, SOCKS_SLOW_DISCONNECT);
+    assert_true(pubsub != NULL);
+
+    fd = subscribe(pubsub, socket_fd, topics);
+    assert_nonnegative(fd);
+
+    assert_true(socks_pubsub_publish(pubsub, "a", "1", 1) == 1);
+    assert_true(socks_pubsub_publish(pubsub, "a", "2", 1) == 0);
+    assert_true(socks_pubsub_count(pubsub) == 0);
+
+    socks_subscription_close(fd);
+    socks_pubsub_destroy(pubsub);
+    socks_server_close(socket_fd);
+    return EXIT_SUCCESS;
+}
+
+static int stalled_test(void)
+{
+    const char *const topics[] = {"a", NULL};
+    struct timespec start;
+    struct timespec end;
+    socks_pubsub_t *pubsub;
+    int socket_fd;
+    int stalled_fd;
+    int fd;
+
+    label_test();
+
+    socket_fd = socks_server_open(socket_path, S_IRWXU);
+    assert_nonnegative(socket_fd);
+
+    pubsub = socks_pubsub_create(4, SOCKS_SLOW_DROP);
+    assert_true(pubsub != NULL);
+
+    /* A client that connects and never sends its topics is dropped after a
+     * short wait, and the next subscriber gets through. */
+    stalled_fd = socks_client_connect(socket_path);
+    assert_nonnegative(stalled_fd);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    errno = 0;
+    assert_true(socks_pubsub_accept(pubsub, socket_fd) < 0);
+    assert_true(errno == ETIMEDOUT);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    assert_true(end.tv_sec - start.tv_sec < 2);
+    assert_zero(socks_pubsub_count(pubsub));
+
+    fd = subscribe(pubsub, socket_fd, topics);
+    assert_nonnegative(fd);
+    assert_true(socks_pubsub_publish(pubsub, "a", "1", 1) == 1);
+    assert_success(socks_pubsub_flush(pubsub));
+    assert_success(expect(fd, "a", "1"));
+
+    close(stalled_fd);
+    socks_subscription_close(fd);
+    socks_pubsub_destroy(pubsub);
+    socks_server_close(socket_fd);
+    return EXIT_SUCCESS;
+}
+
+test_t test_suite[] = {fanout_test, coalesce_test, disconnect_test,
+                       stalled_test, NULL};
+
+void nunit_config(void)
+{
+    register_suite(test_suite, "test_suite", default_setup, default_teardown);
+}
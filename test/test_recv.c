@@ -0,0 +1,184 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "nunit.h"
+#include "libsocks.h"
+#include "libsocks_pvt.h"
+#include "test_common.h"
+
+static int pair[2] = {-1, -1};
+static char large[UINT16_MAX];
+
+/* Answers with the number of bytes of 'large' given in the request. */
+static int callback(int response_fd, const char *msg, uint16_t len)
+{
+    unsigned long size = strtoul(msg, NULL, 10);
+    (void) len;
+
+    return (socks_server_respond(response_fd, large, (uint16_t) size) < 0) ?
+           -1 : 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int alloc_test(void)
+{
+    static const char *const sizes[] = {"0", "1", "200", "65535"};
+    pthread_t server;
+    void *server_result;
+    char *response;
+
+    label_test();
+
+    assert_success(pthread_create(&server, NULL, serve, (void *) 4L));
+
+    for (int x = 0; x < 4; x++) {
+        ssize_t expected = (ssize_t) strtol(sizes[x], NULL, 10);
+
+        assert_true(socks_client_process_alloc(socket_path, sizes[x],
+                                               (uint16_t)(strlen(sizes[x]) + 1),
+                                               &response) == expected);
+        assert_zero(memcmp(response, large, (size_t) expected));
+        assert_true(response[expected] == '\x00');
+        free(response);
+    }
+
+    pthread_join(server, &server_result);
+    assert_true(server_result == NULL);
+
+    return EXIT_SUCCESS;
+}
+
+static int oversize_test(void)
+{
+    pthread_t server;
+    void *server_result;
+    char buffer[8];
+
+    label_test();
+
+    /* A message that doesn't fit is dropped whole, and the stream stays in
+     * step for the next one. */
+    assert_true(socks_frame_send(pair[0], large, 100) == 100);
+    assert_true(socks_frame_send(pair[0], "ok", 3) == 3);
+
+    errno = 0;
+    assert_true(socks_frame_recv(pair[1], buffer, sizeof(buffer)) < 0);
+    assert_true(errno == EMSGSIZE);
+    assert_true(socks_frame_recv(pair[1], buffer, sizeof(buffer)) == 3);
+    assert_zero(strcmp(buffer, "ok"));
+
+    /* Likewise one byte over, while an exact fit is received. */
+    assert_true(socks_frame_send(pair[0], large, sizeof(buffer) + 1) ==
+                (ssize_t) sizeof(buffer) + 1);
+    assert_true(socks_frame_send(pair[0], large, sizeof(buffer)) ==
+                (ssize_t) sizeof(buffer));
+
+    errno = 0;
+    assert_true(socks_frame_recv(pair[1], buffer, sizeof(buffer)) < 0);
+    assert_true(errno == EMSGSIZE);
+    assert_true(socks_frame_recv(pair[1], buffer, sizeof(buffer)) ==
+                (ssize_t) sizeof(buffer));
+    assert_zero(memcmp(buffer, large, sizeof(buffer)));
+
+    /* And through the client, where the response is too big for 'maxlen'. */
+    assert_success(pthread_create(&server, NULL, serve, (void *) 1L));
+
+    errno = 0;
+    assert_true(socks_client_process(socket_path, "100", 4, buffer,
+                                     sizeof(buffer)) < 0);
+    assert_true(errno == EMSGSIZE);
+
+    pthread_join(server, &server_result);
+    assert_true(server_result == NULL);
+
+    return EXIT_SUCCESS;
+}
+
+static int length_test(void)
+{
+    static const uint16_t lengths[] = {0x7F, 0x80, 0xFF, 0x100, 0x1FF, 0x8080,
+                                       UINT16_MAX};
+    static char buffer[UINT16_MAX + 1];
+    struct timeval timeout = {1, 0};
+
+    label_test();
+
+    /* Lengths with the top bit of either header byte set must not be
+     * sign-extended on the way back in, which would leave the receiver
+     * waiting for a body that never comes. */
+    assert_success(setsockopt(pair[1], SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                              sizeof(timeout)));
+
+    for (size_t x = 0; x < sizeof(lengths) / sizeof(lengths[0]); x++) {
+        assert_true(socks_frame_send(pair[0], large, lengths[x]) ==
+                    (ssize_t) lengths[x]);
+        assert_true(socks_frame_recv(pair[1], buffer, sizeof(buffer)) ==
+                    (ssize_t) lengths[x]);
+        assert_zero(memcmp(buffer, large, lengths[x]));
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static int eof_test(void)
+{
+    char header[2];
+    char buffer[16];
+
+    label_test();
+
+    /* The peer promises a body and hangs up without sending it. */
+    socks_frame_header(10, header);
+    assert_true(write(pair[0], header, 2) == 2);
+    close(pair[0]);
+    pair[0] = -1;
+
+    errno = 0;
+    assert_true(socks_frame_recv(pair[1], buffer, sizeof(buffer)) < 0);
+    assert_true(errno == ECONNRESET);
+
+    return EXIT_SUCCESS;
+}
+
+static int setup(void)
+{
+    for (size_t x = 0; x < sizeof(large); x++) {
+        large[x] = (char)('a' + (x % 26));
+    }
+
+    if ((open_server("recv", callback) != 0) ||
+        (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) != 0)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int teardown(void)
+{
+    for (int x = 0; x < 2; x++) {
+        if (pair[x] >= 0) {
+            close(pair[x]);
+            pair[x] = -1;
+        }
+    }
+
+    return close_server();
+}
+
+test_t test_suite[] = {alloc_test, oversize_test, length_test, eof_test,
+                       NULL};
+
+void nunit_config(void)
+{
+    register_suite(test_suite, "test_suite", setup, teardown);
+}
@@ -0,0 +1,190 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nunit.h"
+#include "libsocks.h"
+#include "test_common.h"
+
+static int callback(int response_fd, const char *msg, uint16_t len)
+{
+    return (socks_server_respond(response_fd, msg, len) < 0) ? -1 : 0;
+}
+
+/* Starts a server after 50ms, as a restarting one would, and answers one
+ * request. */
+static void *late_server(void *arg)
+{
+    const struct timespec delay = {0, 50000000};
+
+    (void) arg;
+    nanosleep(&delay, NULL);
+
+    if (open_server("retry", callback) != 0) {
+        return (void *) -1L;
+    }
+
+    return serve((void *) 1L);
+}
+
+static long elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((now.tv_sec - start->tv_sec) * 1000) +
+           ((now.tv_nsec - start->tv_nsec) / 1000000);
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int recover_test(void)
+{
+    const struct socks_retry_policy policy = {1, 20, 5000};
+    struct socks_retry_stats before;
+    struct socks_retry_stats after;
+    pthread_t server;
+    void *server_result;
+    char buffer[8];
+
+    label_test();
+
+    assert_success(socks_client_set_retry(&policy));
+    socks_client_get_retry_stats(&before);
+    assert_success(pthread_create(&server, NULL, late_server, NULL));
+
+    assert_true(socks_client_process(socket_path, "hi", sizeof("hi"), buffer,
+                                     sizeof(buffer)) == sizeof("hi"));
+    pthread_join(server, &server_result);
+    assert_true(server_result == NULL);
+
+    socks_client_get_retry_stats(&after);
+    assert_true(after.retries > before.retries);
+    assert_true(after.recovered == before.recovered + 1);
+    assert_true(after.exhausted == before.exhausted);
+
+    return EXIT_SUCCESS;
+}
+
+static int deadline_test(void)
+{
+    const struct socks_retry_policy policy = {1, 10, 100};
+    struct socks_retry_stats before;
+    struct socks_retry_stats after;
+    struct timespec start;
+    char *buffer;
+    long elapsed;
+
+    label_test();
+
+    assert_success(socks_client_set_retry(&policy));
+    socks_client_get_retry_stats(&before);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    assert_true(socks_client_process_alloc(socket_path, "hi", sizeof("hi"),
+                                           &buffer) < 0);
+    assert_true(errno == ENOENT);
+    elapsed = elapsed_ms(&start);
+    assert_true((elapsed >= 95) && (elapsed < 1000));
+
+    /* Delays grow to the 10ms cap, and are never less than half of it. */
+    socks_client_get_retry_stats(&after);
+    assert_true(after.retries - before.retries >= 5);
+    assert_true(after.retries - before.retries <= 100);
+    assert_true(after.recovered == before.recovered);
+    assert_true(after.exhausted == before.exhausted + 1);
+
+    return EXIT_SUCCESS;
+}
+
+static int invalid_test(void)
+{
+    const struct socks_retry_policy policy = {1, 10, 1000};
+    const size_t lengths[] = {200, PATH_MAX + 10};
+    static char long_path[PATH_MAX + 11];
+    struct socks_retry_stats before;
+    struct socks_retry_stats after;
+    struct timespec start;
+    char buffer[8];
+
+    label_test();
+
+    assert_success(socks_client_set_retry(&policy));
+    socks_client_get_retry_stats(&before);
+
+    /* A path that can never work fails at once, even if errno was left at a
+     * value that's worth retrying. */
+    for (size_t x = 0; x < sizeof(lengths) / sizeof(lengths[0]); x++) {
+        memset(long_path, 'a', lengths[x]);
+        long_path[0] = '/';
+        long_path[lengths[x]] = '\x00';
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        errno = ENOENT;
+        assert_true(socks_client_process(long_path, "hi", sizeof("hi"),
+                                         buffer, sizeof(buffer)) < 0);
+        assert_true(errno == ENAMETOOLONG);
+        assert_true(elapsed_ms(&start) < 100);
+    }
+
+    socks_client_get_retry_stats(&after);
+    assert_true(after.retries == before.retries);
+
+    return EXIT_SUCCESS;
+}
+
+static int disabled_test(void)
+{
+    const struct socks_retry_policy bad[] = {{0, 10, 100}, {5, 4, 100},
+                                             {1, 10, 0}};
+    struct socks_retry_stats before;
+    struct socks_retry_stats after;
+    char buffer[8];
+
+    label_test();
+
+    for (size_t x = 0; x < sizeof(bad) / sizeof(bad[0]); x++) {
+        assert_true(socks_client_set_retry(&bad[x]) == -1);
+        assert_true(errno == EINVAL);
+    }
+
+    assert_success(socks_client_set_retry(NULL));
+    socks_client_get_retry_stats(&before);
+    assert_true(socks_client_process(socket_path, "hi", sizeof("hi"), buffer,
+                                     sizeof(buffer)) < 0);
+    assert_true(errno == ENOENT);
+    socks_client_get_retry_stats(&after);
+    assert_true(after.retries == before.retries);
+    assert_true(after.exhausted == before.exhausted);
+
+    return EXIT_SUCCESS;
+}
+
+static int setup(void)
+{
+    set_socket_path("retry");
+    return 0;
+}
+
+static int teardown(void)
+{
+    socks_client_set_retry(NULL);
+    return close_server();
+}
+
+test_t test_suite[] = {recover_test, deadline_test, invalid_test,
+                       disabled_test, NULL};
+
+void nunit_config(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+    register_suite(test_suite, "test_suite", setup, teardown);
+}
@@ -0,0 +1,333 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nunit.h"
+#include "libsocks.h"
+#include "libsocks_pool.h"
+#include "libsocks_slowlog.h"
+
+enum {
+    capacity = 64
+};
+
+static char socket_path[64];
+static int socket_fd = -1;
+static int hold_fds[2] = {-1, -1};
+static struct socks_slow_request records[capacity];
+
+struct request {
+    const char *msg;
+    uint16_t len;
+};
+
+/* Requests starting with "slow" take 20ms, and ones starting with "hold"
+ * wait for a byte on the hold pipe. */
+static int callback(int response_fd, const char *msg, uint16_t len)
+{
+    const struct timespec pause = {0, 20000000};
+    char release;
+
+    if ((len >= 4) && (memcmp(msg, "slow", 4) == 0)) {
+        nanosleep(&pause, NULL);
+    }
+
+    if ((len >= 4) && (memcmp(msg, "hold", 4) == 0) &&
+        (read(hold_fds[0], &release, 1) != 1)) {
+        return -1;
+    }
+
+    return (socks_server_respond(response_fd, "ok", sizeof("ok")) < 0) ?
+           -1 : 0;
+}
+
+static void *send_request(void *arg)
+{
+    struct request *request = arg;
+    char buffer[8];
+
+    if (socks_client_process(socket_path, request->msg, request->len, buffer,
+                             sizeof(buffer)) != sizeof("ok")) {
+        return (void *) -1L;
+    }
+
+    return NULL;
+}
+
+/** @brief Sends a request whose response may also be the pool's busy one. */
+static void *send_any(void *arg)
+{
+    struct request *request = arg;
+    char buffer[64];
+
+    socks_client_process(socket_path, request->msg, request->len, buffer,
+                         sizeof(buffer));
+    return NULL;
+}
+
+/** @brief Starts a client for 'request', and queues it on 'pool'. */
+static int submit(socks_pool_t *pool, struct request *request,
+                  pthread_t *client)
+{
+    if (pthread_create(client, NULL, send_any, request) != 0) {
+        return -1;
+    }
+
+    if (socks_server_wait(socket_fd) != 0) {
+        return -1;
+    }
+
+    return socks_pool_process(pool, socket_fd);
+}
+
+/** @brief Sends a request from another thread, and handles it here, or on
+ * 'pool' if it isn't NULL. */
+static int roundtrip(socks_pool_t *pool, const char *msg, uint16_t len)
+{
+    struct request request = {msg, len};
+    pthread_t client;
+    void *client_result = (void *) -1L;
+    int result;
+
+    if (pthread_create(&client, NULL, send_request, &request) != 0) {
+        return -1;
+    }
+
+    result = socks_server_wait(socket_fd);
+
+    if (result == 0) {
+        result = (pool != NULL) ? socks_pool_process(pool, socket_fd) :
+                 socks_server_process(socket_fd, callback);
+    }
+
+    pthread_join(client, &client_result);
+
+    if (pool != NULL) {
+        socks_pool_drain(pool, 5000);
+    }
+
+    return ((result == 0) && (client_result == NULL)) ? 0 : -1;
+}
+
+/** @brief Checks that a record's stages finished in order. */
+static int stages_ordered(const struct socks_slow_request *record)
+{
+    const uint64_t *stage = record->stage_ns;
+
+    return (stage[SOCKS_STAGE_ACCEPT] > 0) &&
+           (stage[SOCKS_STAGE_ACCEPT] <= stage[SOCKS_STAGE_HEADER]) &&
+           (stage[SOCKS_STAGE_HEADER] <= stage[SOCKS_STAGE_BODY]) &&
+           (stage[SOCKS_STAGE_BODY] <= stage[SOCKS_STAGE_RESPOND]) &&
+           (stage[SOCKS_STAGE_RESPOND] <= stage[SOCKS_STAGE_CALLBACK]) &&
+           (stage[SOCKS_STAGE_CALLBACK] <= stage[SOCKS_STAGE_CLOSE]) &&
+           (stage[SOCKS_STAGE_CLOSE] <= record->total_ns);
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int threshold_test(void)
+{
+    size_t count;
+
+    label_test();
+
+    assert_success(socks_slowlog_enable(capacity, 10000, 0));
+    count = socks_slowlog_read(records, capacity);
+
+    assert_success(roundtrip(NULL, "fast", 4));
+    assert_true(socks_slowlog_read(records, capacity) == count);
+
+    assert_success(roundtrip(NULL, "slow request", 12));
+    assert_true(socks_slowlog_read(records, capacity) == count + 1);
+
+    assert_zero(records[count].sampled);
+    assert_true(records[count].size == 12);
+    assert_true(records[count].prefix_length == 12);
+    assert_zero(memcmp(records[count].prefix, "slow request", 12));
+    assert_true(records[count].peer_known);
+    assert_true(records[count].peer.pid == getpid());
+    assert_true(records[count].peer.uid == getuid());
+    assert_true(records[count].total_ns >= 20000000);
+    assert_true(stages_ordered(&records[count]));
+    assert_true(records[count].start.tv_sec > 0);
+
+    return EXIT_SUCCESS;
+}
+
+static int sample_test(void)
+{
+    size_t count;
+
+    label_test();
+
+    assert_success(socks_slowlog_enable(0, 0, 4));
+    count = socks_slowlog_read(records, capacity);
+
+    for (int x = 0; x < 8; x++) {
+        assert_success(roundtrip(NULL, "fast", 4));
+    }
+
+    assert_true(socks_slowlog_read(records, capacity) == count + 2);
+    assert_true(records[count].sampled && records[count + 1].sampled);
+    assert_true(stages_ordered(&records[count + 1]));
+
+    return EXIT_SUCCESS;
+}
+
+static int dump_test(void)
+{
+    char payload[100];
+    char output[4096];
+    ssize_t length;
+    int fds[2];
+
+    label_test();
+
+    memset(payload, 'x', sizeof(payload));
+    payload[1] = '\n';
+    assert_success(socks_slowlog_enable(capacity, 0, 1));
+    assert_success(roundtrip(NULL, payload, sizeof(payload)));
+    assert_true(socks_slowlog_read(records, 1) == 1);
+    assert_true(records[0].size == sizeof(payload));
+    assert_true(records[0].prefix_length == SOCKS_SLOWLOG_PREFIX);
+
+    /* The newest record is last, and the payload is made printable. */
+    assert_success(pipe(fds));
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    assert_success(socks_slowlog_dump(fds[1]));
+    close(fds[1]);
+    length = read(fds[0], output, sizeof(output) - 1);
+    close(fds[0]);
+
+    assert_true(length > 0);
+    output[length] = '\x00';
+    assert_true(strstr(output, "slow request: at=") == output);
+    assert_true(strstr(output, "size=100") != NULL);
+    assert_true(strstr(output, " sampled prefix=\"x.xxxxxxxxxxxxxxxxxxxxxxxx"
+                               "xxxxxx\"\n") != NULL);
+    assert_true(output[length - 1] == '\n');
+
+    return EXIT_SUCCESS;
+}
+
+static int pool_test(void)
+{
+    socks_pool_t *pool = socks_pool_create(1, callback);
+    size_t count;
+
+    label_test();
+
+    assert_true(pool != NULL);
+    assert_success(socks_slowlog_enable(capacity, 10000, 0));
+    count = socks_slowlog_read(records, capacity);
+
+    assert_success(roundtrip(pool, "slow pooled", 11));
+    assert_true(socks_slowlog_read(records, capacity) == count + 1);
+    assert_true(records[count].peer_known);
+    assert_true(records[count].size == 11);
+    assert_true(stages_ordered(&records[count]));
+
+    socks_pool_destroy(pool);
+    return EXIT_SUCCESS;
+}
+
+static int shed_test(void)
+{
+    struct request requests[3] = {{"hold", 4}, {"queued", 6}, {"newest", 6}};
+    socks_pool_t *pool = socks_pool_create(1, callback);
+    struct socks_pool_stats stats;
+    pthread_t clients[3];
+    size_t count;
+
+    label_test();
+
+    assert_true(pool != NULL);
+    assert_success(socks_pool_set_limit(pool, SOCKS_PRIORITY_NORMAL, 1,
+                                        SOCKS_OVERLOAD_DROP_OLDEST));
+    assert_success(socks_slowlog_enable(capacity, 0, 1));
+    count = socks_slowlog_read(records, capacity);
+
+    /* The worker is held up, so the second request waits in the queue until
+     * the third pushes it out. */
+    assert_success(submit(pool, &requests[0], &clients[0]));
+
+    do {
+        socks_pool_get_stats(pool, &stats);
+    } while (stats.depth[SOCKS_PRIORITY_NORMAL] != 0);
+
+    assert_success(submit(pool, &requests[1], &clients[1]));
+    assert_success(submit(pool, &requests[2], &clients[2]));
+    assert_true(write(hold_fds[1], "", 1) == 1);
+
+    for (int x = 0; x < 3; x++) {
+        pthread_join(clients[x], NULL);
+    }
+
+    assert_success(socks_pool_drain(pool, 5000));
+    socks_pool_get_stats(pool, &stats);
+    assert_true(stats.shed[SOCKS_PRIORITY_NORMAL] == 1);
+
+    /* The evicted request is recorded too. */
+    assert_true(socks_slowlog_read(records, capacity) == count + 3);
+
+    for (size_t x = count; x < count + 3; x++) {
+        assert_true(records[x].stage_ns[SOCKS_STAGE_CLOSE] > 0);
+    }
+
+    socks_pool_destroy(pool);
+    return EXIT_SUCCESS;
+}
+
+static int disabled_test(void)
+{
+    size_t count;
+
+    label_test();
+
+    socks_slowlog_disable();
+    count = socks_slowlog_read(records, capacity);
+    assert_success(roundtrip(NULL, "slow", 4));
+    assert_true(socks_slowlog_read(records, capacity) == count);
+
+    assert_true(socks_slowlog_enable(capacity + 1, 1, 0) == -1);
+    assert_true(errno == EBUSY);
+    assert_true(socks_slowlog_enable(capacity, 0, 0) == -1);
+    assert_true(errno == EINVAL);
+
+    return EXIT_SUCCESS;
+}
+
+static int setup(void)
+{
+    snprintf(socket_path, sizeof(socket_path),
+             "/tmp/libsocks_test_slowlog.%ld", (long) getpid());
+    socket_fd = socks_server_open(socket_path, 0700);
+    return ((socket_fd < 0) || (pipe(hold_fds) != 0)) ? -1 : 0;
+}
+
+static int teardown(void)
+{
+    socks_slowlog_disable();
+    socks_server_close(socket_fd);
+    unlink(socket_path);
+    close(hold_fds[0]);
+    close(hold_fds[1]);
+    return 0;
+}
+
+test_t test_suite[] = {threshold_test, sample_test, dump_test, pool_test,
+                       shed_test, disabled_test, NULL};
+
+void nunit_config(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+    register_suite(test_suite, "test_suite", setup, teardown);
+}
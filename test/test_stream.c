@@ -0,0 +1,247 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nunit.h"
+#include "libsocks.h"
+#include "libsocks_stream.h"
+#include "test_common.h"
+
+enum {
+    small_count = 50,
+    large_size = 60000,
+    deep_count = 100000,
+    deep_size = 64
+};
+
+static char large[large_size];
+
+struct server_result {
+    int handled;
+    int reads;
+    int closed;
+};
+
+static struct server_result server_result;
+
+/* Echoes requests back, except "empty" and "fail", which get no response. */
+static int callback(int response_fd, const char *msg, uint16_t len)
+{
+    if ((msg[len] != '\x00') || (strcmp(msg, "fail") == 0)) {
+        return -1;
+    }
+
+    if (strcmp(msg, "empty") == 0) {
+        return 0;
+    }
+
+    return (socks_server_respond(response_fd, msg, len) < 0) ? -1 : 0;
+}
+
+/* Serves one connection until the client closes it. */
+static void *serve_stream(void *arg)
+{
+    socks_stream_t *stream;
+    int result;
+    (void) arg;
+
+    if (socks_server_wait(socket_fd) != 0) {
+        return NULL;
+    }
+
+    stream = socks_stream_accept(socket_fd);
+
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    while ((result = socks_stream_process(stream, callback)) >= 0) {
+        server_result.handled += result;
+        server_result.reads++;
+    }
+
+    server_result.closed = (errno == ECONNRESET);
+    socks_stream_close(stream);
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int pipeline_test(void)
+{
+    socks_stream_t *stream;
+    pthread_t server;
+    char msg[16];
+    char buffer[16];
+
+    label_test();
+
+    assert_success(pthread_create(&server, NULL, serve_stream, NULL));
+    stream = socks_stream_connect(socket_path);
+    assert_true(stream != NULL);
+
+    for (int x = 0; x < small_count; x++) {
+        int length = snprintf(msg, sizeof(msg), "m%d", x);
+        assert_true(socks_stream_send(stream, msg, (uint16_t)(length + 1)) ==
+                    length + 1);
+    }
+
+    assert_true(socks_stream_send(stream, "empty", sizeof("empty")) ==
+                sizeof("empty"));
+    assert_true(socks_stream_send(stream, "fail", sizeof("fail")) ==
+                sizeof("fail"));
+
+    /* Responses come back in the order the requests were sent. */
+    for (int x = 0; x < small_count; x++) {
+        int length = snprintf(msg, sizeof(msg), "m%d", x);
+        assert_true(socks_stream_recv(stream, buffer, sizeof(buffer)) ==
+                    length + 1);
+        assert_zero(strcmp(buffer, msg));
+    }
+
+    assert_zero(socks_stream_recv(stream, buffer, sizeof(buffer)));
+    assert_zero(socks_stream_recv(stream, buffer, sizeof(buffer)));
+
+    socks_stream_close(stream);
+    pthread_join(server, NULL);
+
+    /* The requests were all sent at once, so the server should have read
+     * several of them at a time. */
+    assert_true(server_result.handled == small_count + 2);
+    assert_true(server_result.reads < small_count);
+    assert_true(server_result.closed);
+
+    return EXIT_SUCCESS;
+}
+
+static int large_test(void)
+{
+    static char buffer[large_size];
+    socks_stream_t *stream;
+    pthread_t server;
+
+    label_test();
+
+    assert_success(pthread_create(&server, NULL, serve_stream, NULL));
+    stream = socks_stream_connect(socket_path);
+    assert_true(stream != NULL);
+
+    /* Frames this size span reads and fill the buffers, so both ends have
+     * to carry partial frames over. */
+    for (int x = 0; x < 3; x++) {
+        memset(large, 'a' + x, sizeof(large) - 1);
+        assert_true(socks_stream_send(stream, large, large_size) ==
+                    large_size);
+        assert_true(socks_stream_send(stream, "small", sizeof("small")) ==
+                    sizeof("small"));
+    }
+
+    for (int x = 0; x < 3; x++) {
+        if (x == 1) {
+            /* Too big to receive: dropped, and the stream stays in step. */
+            assert_true(socks_stream_recv(stream, buffer, 16) < 0);
+            assert_true(errno == EMSGSIZE);
+        } else {
+            assert_true(socks_stream_recv(stream, buffer, sizeof(buffer)) ==
+                        large_size);
+            assert_true((buffer[0] == 'a' + x) &&
+                        (buffer[large_size - 2] == 'a' + x) &&
+                        (buffer[large_size - 1] == '\x00'));
+        }
+
+        assert_true(socks_stream_recv(stream, buffer, sizeof(buffer)) ==
+                    sizeof("small"));
+        assert_zero(strcmp(buffer, "small"));
+    }
+
+    socks_stream_close(stream);
+    pthread_join(server, NULL);
+    assert_true(server_result.handled == 6);
+    assert_true(server_result.closed);
+
+    return EXIT_SUCCESS;
+}
+
+static int deep_test(void)
+{
+    socks_stream_t *stream;
+    pthread_t server;
+    char msg[deep_size];
+    char buffer[deep_size];
+    int received = 0;
+
+    label_test();
+
+    assert_success(pthread_create(&server, NULL, serve_stream, NULL));
+    stream = socks_stream_connect(socket_path);
+    assert_true(stream != NULL);
+
+    /* Megabytes of requests before the first receive: far more, each way,
+     * than the socket buffers hold, so the client has to take in responses
+     * while it's still sending. */
+    memset(msg, 'd', sizeof(msg) - 1);
+    msg[sizeof(msg) - 1] = '\x00';
+
+    for (int x = 0; x < deep_count; x++) {
+        assert_true(socks_stream_send(stream, msg, deep_size) == deep_size);
+    }
+
+    for (int x = 0; x < deep_count; x++) {
+        received += (socks_stream_recv(stream, buffer, sizeof(buffer)) ==
+                     deep_size);
+    }
+
+    assert_true(received == deep_count);
+    assert_zero(memcmp(buffer, msg, deep_size));
+
+    socks_stream_close(stream);
+    pthread_join(server, NULL);
+    assert_true(server_result.handled == deep_count);
+    assert_true(server_result.closed);
+
+    return EXIT_SUCCESS;
+}
+
+static int refused_test(void)
+{
+    char path[80];
+
+    label_test();
+
+    snprintf(path, sizeof(path), "%s.missing", socket_path);
+    assert_true(socks_stream_connect(path) == NULL);
+
+    /* Ordinary clients can't talk to stream servers. */
+    assert_true(socks_client_process(socket_path, "ping", 5, path,
+                                     sizeof(path)) < 0);
+
+    return EXIT_SUCCESS;
+}
+
+static int setup(void)
+{
+    set_socket_path("stream");
+    memset(&server_result, 0, sizeof(server_result));
+    socket_fd = socks_stream_server_open(socket_path, 0700);
+    return (socket_fd < 0) ? -1 : 0;
+}
+
+static int teardown(void)
+{
+    return close_server();
+}
+
+test_t test_suite[] = {pipeline_test, large_test, deep_test, refused_test,
+                       NULL};
+
+void nunit_config(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+    register_suite(test_suite, "test_suite", setup, teardown);
+}
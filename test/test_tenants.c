@@ -0,0 +1,358 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nunit.h"
+#include "libsocks.h"
+#include "libsocks_pool.h"
+#include "libsocks_pvt.h"
+
+static char socket_path[64];
+static int socket_fd = -1;
+static socks_pool_t *pool = NULL;
+static int hold_pipe[2] = {-1, -1};
+
+static pthread_mutex_t order_lock = PTHREAD_MUTEX_INITIALIZER;
+static char order[64];
+static size_t order_length;
+static int peers_match;
+
+/* Requests are one letter. "h" holds the (only) worker until the test
+ * writes to hold_pipe, so that everything after it queues up. Every request
+ * is checked against the pid of the client that sent it. */
+static int callback(int response_fd, const char *msg, uint16_t len)
+{
+    struct socks_peer peer;
+    char letter;
+
+    if ((socks_server_peer(response_fd, &peer) != 0) ||
+        (strtol(msg + 1, NULL, 10) != (long) peer.pid)) {
+        peers_match = 0;
+    }
+
+    if (msg[0] == 'h') {
+        return (read(hold_pipe[0], &letter, 1) == 1) ? 0 : -1;
+    }
+
+    pthread_mutex_lock(&order_lock);
+
+    if (order_length < sizeof(order) - 1) {
+        order[order_length++] = msg[0];
+    }
+
+    pthread_mutex_unlock(&order_lock);
+    return (socks_server_respond(response_fd, msg, len) < 0) ? -1 : 0;
+}
+
+struct client {
+    pid_t pid;
+    int go_fd;
+};
+
+/** @brief Forks a client that waits for the go-ahead, then opens 'count'
+ * connections and sends 'letter' on each before reading any response. Its
+ * exit status is the number of busy responses. */
+static struct client client_spawn(char letter, int count)
+{
+    struct client client = {-1, -1};
+    int go_pipe[2];
+
+    if (pipe(go_pipe) != 0) {
+        return client;
+    }
+
+    client.pid = fork();
+
+    if (client.pid == 0) {
+        int fds[count];
+        char msg[32];
+        char buffer[32];
+        int busy = 0;
+
+        close(go_pipe[1]);
+
+        if (read(go_pipe[0], buffer, 1) != 1) {
+            _exit(255);
+        }
+
+        snprintf(msg, sizeof(msg), "%c%ld", letter, (long) getpid());
+
+        for (int x = 0; x < count; x++) {
+            fds[x] = socks_client_connect(socket_path);
+
+            if ((fds[x] < 0) ||
+                (socks_frame_send(fds[x], msg, (uint16_t)(strlen(msg) + 1)) <
+                 0)) {
+                _exit(255);
+            }
+        }
+
+        for (int x = 0; x < count; x++) {
+            if (socks_frame_recv(fds[x], buffer, sizeof(buffer)) < 0) {
+                _exit(255);
+            }
+
+            busy += (strcmp(buffer, "busy") == 0);
+        }
+
+        _exit(busy);
+    }
+
+    close(go_pipe[0]);
+    client.go_fd = go_pipe[1];
+    return client;
+}
+
+/** @brief Lets a client go, and queues its 'count' requests in a priority
+ * class. */
+static int client_start(struct client client, int count,
+                        enum socks_priority priority)
+{
+    int result = (write(client.go_fd, "g", 1) == 1) ? 0 : -1;
+
+    close(client.go_fd);
+
+    for (int x = 0; (x < count) && (result == 0); x++) {
+        result = socks_server_wait(socket_fd) |
+                 socks_pool_process_priority(pool, socket_fd, priority);
+    }
+
+    return result;
+}
+
+/** @brief Returns the number of busy responses a client got, or -1. */
+static int client_finish(struct client client)
+{
+    int status;
+
+    if ((waitpid(client.pid, &status, 0) != client.pid) ||
+        !WIFEXITED(status) || (WEXITSTATUS(status) == 255)) {
+        return -1;
+    }
+
+    return WEXITSTATUS(status);
+}
+
+/** @brief Queues a held request, and waits until the worker has taken it. */
+static int hold_worker(struct client *holder)
+{
+    struct socks_pool_stats stats;
+    const struct timespec pause = {0, 1000000};
+
+    *holder = client_spawn('h', 1);
+
+    if ((holder->pid < 0) ||
+        (client_start(*holder, 1, SOCKS_PRIORITY_NORMAL) != 0)) {
+        return -1;
+    }
+
+    do {
+        nanosleep(&pause, NULL);
+        socks_pool_get_stats(pool, &stats);
+    } while (stats.depth[SOCKS_PRIORITY_NORMAL] != 0);
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int fair_test(void)
+{
+    struct client holder;
+    struct client a;
+    struct client b;
+
+    label_test();
+
+    assert_success(socks_pool_set_tenants(pool, SOCKS_TENANT_PID, NULL));
+    assert_success(hold_worker(&holder));
+
+    /* Without tenants, b would wait behind all of a's requests. */
+    a = client_spawn('a', 6);
+    b = client_spawn('b', 2);
+    assert_success(client_start(a, 6, SOCKS_PRIORITY_NORMAL));
+    assert_success(client_start(b, 2, SOCKS_PRIORITY_NORMAL));
+    assert_true(write(hold_pipe[1], "r", 1) == 1);
+
+    assert_zero(client_finish(holder));
+    assert_zero(client_finish(a));
+    assert_zero(client_finish(b));
+    assert_zero(strcmp(order, "ababaaaa"));
+    assert_true(peers_match);
+
+    return EXIT_SUCCESS;
+}
+
+static int weight_test(void)
+{
+    struct client holder;
+    struct client a;
+    struct client b;
+
+    label_test();
+
+    assert_success(socks_pool_set_tenants(pool, SOCKS_TENANT_PID, NULL));
+    assert_success(hold_worker(&holder));
+
+    a = client_spawn('a', 6);
+    b = client_spawn('b', 3);
+    assert_success(socks_pool_set_weight(pool, (unsigned long) a.pid, 3));
+    assert_success(client_start(a, 6, SOCKS_PRIORITY_NORMAL));
+    assert_success(client_start(b, 3, SOCKS_PRIORITY_NORMAL));
+    assert_true(write(hold_pipe[1], "r", 1) == 1);
+
+    assert_zero(client_finish(holder));
+    assert_zero(client_finish(a));
+    assert_zero(client_finish(b));
+    assert_zero(strcmp(order, "aaabaaabb"));
+    assert_true(peers_match);
+
+    return EXIT_SUCCESS;
+}
+
+static int limit_test(void)
+{
+    struct socks_tenant_limits limits = {0.5, 3, 0};
+    struct socks_pool_stats stats;
+    struct client client;
+
+    label_test();
+
+    /* Nothing is held here, so the client's 6 requests arrive faster than
+     * they're refilled: 3 fit in the bucket, and the rest are shed. */
+    assert_success(socks_pool_set_tenants(pool, SOCKS_TENANT_UID, &limits));
+
+    client = client_spawn('r', 6);
+    assert_success(client_start(client, 6, SOCKS_PRIORITY_NORMAL));
+    assert_true(client_finish(client) == 3);
+
+    assert_zero(socks_pool_drain(pool, 5000));
+    socks_pool_get_stats(pool, &stats);
+    assert_true(stats.throttled[SOCKS_PRIORITY_NORMAL] == 3);
+    assert_true(stats.shed[SOCKS_PRIORITY_NORMAL] == 3);
+    assert_true(stats.completed[SOCKS_PRIORITY_NORMAL] == 3);
+
+    return EXIT_SUCCESS;
+}
+
+static int early_weight_test(void)
+{
+    struct socks_tenant_limits limits = {0.5, 3, 0};
+    struct client client;
+
+    label_test();
+
+    /* A tenant weighted before the limits are set still starts with a full
+     * bucket. */
+    assert_success(socks_pool_set_weight(pool, (unsigned long) getuid(), 2));
+    assert_success(socks_pool_set_tenants(pool, SOCKS_TENANT_UID, &limits));
+
+    client = client_spawn('r', 6);
+    assert_success(client_start(client, 6, SOCKS_PRIORITY_NORMAL));
+    assert_true(client_finish(client) == 3);
+
+    return EXIT_SUCCESS;
+}
+
+static int priority_test(void)
+{
+    struct client holder;
+    struct client low;
+    struct client normal;
+    struct client high;
+
+    label_test();
+
+    /* Queued in the reverse of priority order, served in priority order. */
+    assert_success(hold_worker(&holder));
+    low = client_spawn('l', 2);
+    normal = client_spawn('n', 2);
+    high = client_spawn('x', 2);
+    assert_success(client_start(low, 2, SOCKS_PRIORITY_LOW));
+    assert_success(client_start(normal, 2, SOCKS_PRIORITY_NORMAL));
+    assert_success(client_start(high, 2, SOCKS_PRIORITY_HIGH));
+    assert_true(write(hold_pipe[1], "r", 1) == 1);
+
+    assert_zero(client_finish(holder));
+    assert_zero(client_finish(low));
+    assert_zero(client_finish(normal));
+    assert_zero(client_finish(high));
+    assert_zero(strcmp(order, "xxnnll"));
+
+    return EXIT_SUCCESS;
+}
+
+static int drop_oldest_test(void)
+{
+    struct socks_pool_stats stats;
+    struct client holder;
+    struct client a;
+    struct client b;
+
+    label_test();
+
+    /* With room for two, each of b's requests pushes out one of a's, which
+     * get the default busy response. */
+    assert_success(socks_pool_set_limit(pool, SOCKS_PRIORITY_NORMAL, 2,
+                                        SOCKS_OVERLOAD_DROP_OLDEST));
+    assert_success(hold_worker(&holder));
+    a = client_spawn('a', 2);
+    b = client_spawn('b', 2);
+    assert_success(client_start(a, 2, SOCKS_PRIORITY_NORMAL));
+    assert_success(client_start(b, 2, SOCKS_PRIORITY_NORMAL));
+    assert_true(write(hold_pipe[1], "r", 1) == 1);
+
+    assert_zero(client_finish(holder));
+    assert_true(client_finish(a) == 2);
+    assert_zero(client_finish(b));
+    assert_zero(strcmp(order, "bb"));
+
+    assert_zero(socks_pool_drain(pool, 5000));
+    socks_pool_get_stats(pool, &stats);
+    assert_true(stats.admitted[SOCKS_PRIORITY_NORMAL] == 5);
+    assert_true(stats.shed[SOCKS_PRIORITY_NORMAL] == 2);
+    assert_true(stats.completed[SOCKS_PRIORITY_NORMAL] == 3);
+
+    return EXIT_SUCCESS;
+}
+
+static int setup(void)
+{
+    snprintf(socket_path, sizeof(socket_path),
+             "/tmp/libsocks_test_tenants.%ld", (long) getpid());
+    order_length = 0;
+    memset(order, 0, sizeof(order));
+    peers_match = 1;
+
+    socket_fd = socks_server_open(socket_path, 0700);
+    pool = socks_pool_create(1, callback);
+
+    return ((socket_fd < 0) || (pool == NULL) || (pipe(hold_pipe) != 0)) ?
+           -1 : 0;
+}
+
+static int teardown(void)
+{
+    socks_pool_destroy(pool);
+    socks_server_close(socket_fd);
+    close(hold_pipe[0]);
+    close(hold_pipe[1]);
+    unlink(socket_path);
+    return 0;
+}
+
+test_t test_suite[] = {fair_test, weight_test, limit_test, early_weight_test,
+                       priority_test, drop_oldest_test, NULL};
+
+void nunit_config(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+    register_suite(test_suite, "test_suite", setup, teardown);
+}
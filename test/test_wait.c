@@ -0,0 +1,165 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nunit.h"
+#include "libsocks.h"
+#include "libsocks_wait.h"
+#include "test_common.h"
+
+struct clients {
+    int count;
+    long delay_ms;
+};
+
+static int callback(int response_fd, const char *msg, uint16_t len)
+{
+    return (socks_server_respond(response_fd, msg, len) < 0) ? -1 : 0;
+}
+
+/* Sends 'count' requests one after another, after 'delay_ms' of quiet. */
+static void *send_requests(void *arg)
+{
+    struct clients *clients = arg;
+    const struct timespec delay = {clients->delay_ms / 1000,
+                                   (clients->delay_ms % 1000) * 1000000};
+    char buffer[8];
+
+    nanosleep(&delay, NULL);
+
+    for (int x = 0; x < clients->count; x++) {
+        if (socks_client_process(socket_path, "hi", sizeof("hi"), buffer,
+                                 sizeof(buffer)) != sizeof("hi")) {
+            return (void *) -1L;
+        }
+    }
+
+    return NULL;
+}
+
+/** @brief Serves 'count' requests, sent after 'delay_ms', waiting for each
+ * with 'waiter'. */
+static int serve_waiting(socks_waiter_t *waiter, int count, long delay_ms)
+{
+    struct clients clients = {count, delay_ms};
+    pthread_t client;
+    void *client_result = (void *) -1L;
+    int result = 0;
+
+    if (pthread_create(&client, NULL, send_requests, &clients) != 0) {
+        return -1;
+    }
+
+    for (int x = 0; (x < count) && (result == 0); x++) {
+        result = socks_server_wait_adaptive(socket_fd, waiter) |
+                 socks_server_process(socket_fd, callback);
+    }
+
+    pthread_join(client, &client_result);
+    return ((result == 0) && (client_result == NULL)) ? 0 : -1;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int idle_test(void)
+{
+    socks_waiter_t *waiter = socks_waiter_create(50);
+    struct socks_waiter_stats stats;
+
+    label_test();
+
+    /* Nothing arrives within the spin or the yield, so the wait sleeps. */
+    assert_true(waiter != NULL);
+    assert_success(serve_waiting(waiter, 1, 100));
+    socks_waiter_get_stats(waiter, &stats);
+    assert_true(stats.slept == 1);
+    assert_true(stats.spun + stats.yielded == 0);
+
+    socks_waiter_destroy(waiter);
+    return EXIT_SUCCESS;
+}
+
+static int busy_test(void)
+{
+    socks_waiter_t *waiter = socks_waiter_create(1000000);
+    struct socks_waiter_stats stats;
+
+    label_test();
+
+    /* With a generous limit, requests sent back to back are caught while
+     * spinning, and the budget settles near the gap between them. */
+    assert_true(waiter != NULL);
+    assert_success(serve_waiting(waiter, 200, 0));
+    socks_waiter_get_stats(waiter, &stats);
+    assert_true(stats.spun + stats.yielded + stats.slept == 200);
+    assert_true(stats.spun > stats.slept);
+    assert_true(stats.interarrival_us < 1000000);
+    assert_true((stats.budget_us > 0) && (stats.budget_us < 1000000));
+
+    socks_waiter_destroy(waiter);
+    return EXIT_SUCCESS;
+}
+
+static int quiet_test(void)
+{
+    socks_waiter_t *waiter = socks_waiter_create(20);
+    struct socks_waiter_stats stats;
+
+    label_test();
+
+    /* Requests further apart than the limit turn spinning off. */
+    assert_true(waiter != NULL);
+
+    for (int x = 0; x < 3; x++) {
+        assert_success(serve_waiting(waiter, 1, 10));
+    }
+
+    socks_waiter_get_stats(waiter, &stats);
+    assert_true(stats.budget_us == 0);
+    assert_true(stats.interarrival_us >= 10000);
+
+    socks_waiter_destroy(waiter);
+    return EXIT_SUCCESS;
+}
+
+static int disabled_test(void)
+{
+    socks_waiter_t *waiter = socks_waiter_create(0);
+    struct socks_waiter_stats stats;
+
+    label_test();
+
+    assert_true(waiter != NULL);
+    assert_success(serve_waiting(waiter, 20, 0));
+    socks_waiter_get_stats(waiter, &stats);
+    assert_true(stats.spun == 0);
+    assert_true(stats.yielded + stats.slept == 20);
+    assert_true(stats.budget_us == 0);
+
+    socks_waiter_destroy(waiter);
+    return EXIT_SUCCESS;
+}
+
+static int setup(void)
+{
+    return open_server("wait", callback);
+}
+
+static int teardown(void)
+{
+    return close_server();
+}
+
+test_t test_suite[] = {idle_test, busy_test, quiet_test, disabled_test, NULL};
+
+void nunit_config(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+    register_suite(test_suite, "test_suite", setup, teardown);
+}
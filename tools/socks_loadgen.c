@@ -0,0 +1,594 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libsocks.h"
+
+/* Open-loop load generator. Every client thread has a schedule of send times
+ * fixed in advance by the target rate, and latency is measured from the time
+ * each request was scheduled to go out, not from when it actually went out.
+ * A server that stalls therefore shows up as the whole backlog of requests
+ * that would have been sent during the stall, instead of as one slow request
+ * (which is what a closed loop, waiting for each response before sending the
+ * next request, would report). */
+
+enum {
+    sub_bits = 5,
+    sub_count = 1 << sub_bits,
+    bucket_count = (65 - sub_bits) * sub_count,
+    mix_max = 32,
+    error_slots = 256,
+    message_max = UINT16_MAX
+};
+
+/** @brief Log-linear histogram of nanosecond values: exact below
+ * 2 * sub_count, and within 1 / sub_count (about 3%) above. */
+struct histogram {
+    uint64_t counts[bucket_count];
+    uint64_t total;
+    uint64_t max;
+};
+
+struct mix_entry {
+    const char *command;
+    size_t length;
+    unsigned int weight;
+};
+
+enum size_dist {
+    SIZE_FIXED = 0,
+    SIZE_UNIFORM,
+    SIZE_EXP
+};
+
+struct client {
+    pthread_t thread;
+    unsigned int index;
+    uint64_t rng;
+    unsigned long sent;
+    unsigned long ok;
+    unsigned long errors[error_slots];
+    struct histogram corrected;
+    struct histogram service;
+    char message[message_max];
+    char response[message_max];
+};
+
+static const char *socket_path;
+static double target_rate = 1000;
+static double duration_s = 10;
+static unsigned int thread_count = 8;
+static int poisson = 0;
+static int show_histogram = 1;
+static struct mix_entry mix[mix_max];
+static unsigned int mix_count = 0;
+static unsigned int mix_total = 0;
+static enum size_dist size_dist = SIZE_FIXED;
+static unsigned long size_a = 0;
+static unsigned long size_b = 0;
+static uint64_t start_ns;
+static uint64_t end_ns;
+
+static const char help[] = \
+"Usage: %s [-r RATE] [-d SECONDS] [-t THREADS] [-m MIX] [-s SIZE] [-p] [-q]\n"
+"       SOCKET_PATH\n"
+"\n"
+"Sends requests to the libsocks server at SOCKET_PATH at a fixed RATE per\n"
+"second (default 1000) for SECONDS (default 10), from THREADS client threads\n"
+"(default 8). Latency is measured from when each request was scheduled, so\n"
+"it includes time spent waiting behind slow requests.\n"
+"\n"
+"MIX is a comma-separated list of COMMAND[=WEIGHT] (default 'ping'). Each\n"
+"request is a command picked at random by weight, followed by a NUL and SIZE\n"
+"bytes of padding. SIZE is N, uniform:MIN:MAX or exp:MEAN (default 0). With\n"
+"-p, send times follow a Poisson process instead of a fixed interval. With\n"
+"-q, the full histogram isn't printed.\n"
+"\n";
+
+/*----------------------------------------------------------------------------*/
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000000000) + (uint64_t) now.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline_ns)
+{
+    struct timespec deadline = {
+        .tv_sec = (time_t)(deadline_ns / 1000000000),
+        .tv_nsec = (long)(deadline_ns % 1000000000)
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+                           NULL) == EINTR) {
+    }
+}
+
+/** @brief xorshift64* generator; one per thread. */
+static uint64_t rng_next(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/** @brief Uniform double in (0, 1]. */
+static double rng_unit(uint64_t *state)
+{
+    return (double)((rng_next(state) >> 11) + 1) / 9007199254740992.0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static unsigned int bucket_index(uint64_t value)
+{
+    unsigned int shift;
+
+    if (value < 2 * sub_count) {
+        return (unsigned int) value;
+    }
+
+    shift = (unsigned int)(63 - __builtin_clzll(value)) - sub_bits;
+    return ((shift + 1) * sub_count) +
+           (unsigned int)((value >> shift) - sub_count);
+}
+
+static uint64_t bucket_low(unsigned int index)
+{
+    unsigned int shift;
+
+    if (index < 2 * sub_count) {
+        return index;
+    }
+
+    shift = (index / sub_count) - 1;
+    return (uint64_t)((index % sub_count) + sub_count) << shift;
+}
+
+/** @brief Highest value that falls into a bucket. */
+static uint64_t bucket_high(unsigned int index)
+{
+    if (index + 1 == bucket_count) {
+        return UINT64_MAX;
+    }
+
+    return bucket_low(index + 1) - 1;
+}
+
+static void histogram_record(struct histogram *histogram, uint64_t value)
+{
+    histogram->counts[bucket_index(value)]++;
+    histogram->total++;
+
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+static void histogram_merge(struct histogram *into,
+                            const struct histogram *from)
+{
+    for (unsigned int x = 0; x < bucket_count; x++) {
+        into->counts[x] += from->counts[x];
+    }
+
+    into->total += from->total;
+
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+/** @brief Returns the value at or below which 'percentile' percent of the
+ * recorded values fall (rounded up to the end of its bucket). */
+static uint64_t histogram_percentile(const struct histogram *histogram,
+                                     double percentile)
+{
+    uint64_t target = (uint64_t) ceil((double) histogram->total *
+                                      percentile / 100);
+    uint64_t seen = 0;
+
+    if (target == 0) {
+        target = 1;
+    }
+
+    for (unsigned int x = 0; x < bucket_count; x++) {
+        seen += histogram->counts[x];
+
+        if (seen >= target) {
+            uint64_t high = bucket_high(x);
+            return (high < histogram->max) ? high : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+static void print_summary(const char *label, const struct histogram *histogram)
+{
+    static const double percentiles[] = {50, 75, 90, 99, 99.9, 99.99, 100};
+    const size_t count = sizeof(percentiles) / sizeof(percentiles[0]);
+
+    printf("%-10s", label);
+
+    for (size_t x = 0; x < count; x++) {
+        printf(" %10.1f",
+               (double) histogram_percentile(histogram, percentiles[x]) / 1e3);
+    }
+
+    printf("\n");
+}
+
+/** @brief Prints every non-empty bucket with its cumulative percentile. */
+static void print_histogram(const struct histogram *histogram)
+{
+    uint64_t seen = 0;
+
+    printf("\n%14s %12s %12s\n", "latency (us)", "percentile", "count");
+
+    for (unsigned int x = 0; x < bucket_count; x++) {
+        uint64_t high;
+
+        if (histogram->counts[x] == 0) {
+            continue;
+        }
+
+        seen += histogram->counts[x];
+        high = bucket_high(x);
+
+        if (high > histogram->max) {
+            high = histogram->max;
+        }
+
+        printf("%14.1f %12.5f %12" PRIu64 "\n", (double) high / 1e3,
+               100.0 * (double) seen / (double) histogram->total,
+               histogram->counts[x]);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+static const struct mix_entry *pick_command(uint64_t *rng)
+{
+    unsigned int ticket = (unsigned int)(rng_next(rng) % mix_total);
+
+    for (unsigned int x = 0; x < mix_count; x++) {
+        if (ticket < mix[x].weight) {
+            return &mix[x];
+        }
+
+        ticket -= mix[x].weight;
+    }
+
+    return &mix[mix_count - 1];
+}
+
+static unsigned long pick_size(uint64_t *rng)
+{
+    switch (size_dist) {
+        case SIZE_UNIFORM:
+            return size_a + (unsigned long)(rng_next(rng) %
+                                            (size_b - size_a + 1));
+
+        case SIZE_EXP:
+            return (unsigned long)(-(double) size_a * log(rng_unit(rng)));
+
+        default:
+            return size_a;
+    }
+}
+
+/** @brief Builds the next request in the client's message buffer, and
+ * returns its length. */
+static uint16_t build_message(struct client *client)
+{
+    const struct mix_entry *entry = pick_command(&client->rng);
+    unsigned long size = pick_size(&client->rng);
+    size_t length = entry->length + 1;
+
+    if (size > message_max - length) {
+        size = message_max - length;
+    }
+
+    memcpy(client->message, entry->command, entry->length);
+    client->message[entry->length] = '\x00';
+    return (uint16_t)(length + size);
+}
+
+static void *client_main(void *arg)
+{
+    struct client *client = arg;
+    double interval = (double) thread_count * 1e9 / target_rate;
+    uint64_t scheduled;
+
+    /* Threads are staggered across one interval, so that together they send
+     * at an even rate. */
+    scheduled = start_ns + (uint64_t)(interval * client->index /
+                                      thread_count);
+
+    while (scheduled < end_ns) {
+        uint64_t sent;
+        uint64_t done;
+        ssize_t result;
+        uint16_t length = build_message(client);
+
+        sleep_until(scheduled);
+        sent = now_ns();
+        result = socks_client_process(socket_path, client->message, length,
+                                      client->response, message_max - 1);
+        done = now_ns();
+
+        client->sent++;
+
+        if (result >= 0) {
+            client->ok++;
+        } else {
+            client->errors[(errno < error_slots) ? errno : 0]++;
+        }
+
+        histogram_record(&client->corrected, done - scheduled);
+        histogram_record(&client->service, done - sent);
+
+        if (poisson) {
+            scheduled += (uint64_t)(-interval * log(rng_unit(&client->rng)));
+        } else {
+            scheduled += (uint64_t) interval;
+        }
+    }
+
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void usage_error(const char *message, const char *input)
+{
+    fprintf(stderr, "%s [%s]\n", message, input);
+    exit(-1);
+}
+
+static unsigned long scan_ulong(const char *input, const char *message)
+{
+    char *endptr;
+    unsigned long result;
+
+    errno = 0;
+    result = strtoul(input, &endptr, 10);
+
+    if ((errno != 0) || (endptr == input) || (*endptr != '\x00')) {
+        usage_error(message, input);
+    }
+
+    return result;
+}
+
+static double scan_double(const char *input, const char *message)
+{
+    char *endptr;
+    double result;
+
+    errno = 0;
+    result = strtod(input, &endptr);
+
+    if ((errno != 0) || (endptr == input) || (*endptr != '\x00') ||
+        !(result > 0)) {
+        usage_error(message, input);
+    }
+
+    return result;
+}
+
+/** @brief Parses COMMAND[=WEIGHT],... in place. */
+static void scan_mix(char *input)
+{
+    char *saveptr = NULL;
+
+    for (char *item = strtok_r(input, ",", &saveptr); item != NULL;
+         item = strtok_r(NULL, ",", &saveptr)) {
+        char *equals = strchr(item, '=');
+        unsigned long weight = 1;
+
+        if (mix_count == mix_max) {
+            usage_error("Too many commands in mix", item);
+        }
+
+        if (equals != NULL) {
+            *equals = '\x00';
+            weight = scan_ulong(equals + 1, "Couldn't scan weight");
+        }
+
+        if ((weight == 0) || (weight > UINT16_MAX) || (*item == '\x00')) {
+            usage_error("Invalid mix entry", item);
+        }
+
+        mix[mix_count].command = item;
+        mix[mix_count].length = strnlen(item, message_max - 1);
+        mix[mix_count].weight = (unsigned int) weight;
+        mix_total += (unsigned int) weight;
+        mix_count++;
+    }
+}
+
+static void scan_size(char *input)
+{
+    char *second;
+
+    if (strncmp(input, "uniform:", 8) == 0) {
+        second = strchr(input + 8, ':');
+
+        if (second == NULL) {
+            usage_error("Couldn't scan size", input);
+        }
+
+        *second = '\x00';
+        size_dist = SIZE_UNIFORM;
+        size_a = scan_ulong(input + 8, "Couldn't scan size");
+        size_b = scan_ulong(second + 1, "Couldn't scan size");
+
+        if (size_b < size_a) {
+            usage_error("Invalid size range", input);
+        }
+    } else if (strncmp(input, "exp:", 4) == 0) {
+        size_dist = SIZE_EXP;
+        size_a = scan_ulong(input + 4, "Couldn't scan size");
+    } else {
+        size_dist = SIZE_FIXED;
+        size_a = scan_ulong(input, "Couldn't scan size");
+    }
+}
+
+static void scan_opts(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:d:t:m:s:pqh")) != -1) {
+        switch (opt) {
+            case 'r':
+                target_rate = scan_double(optarg, "Couldn't scan rate");
+                break;
+
+            case 'd':
+                duration_s = scan_double(optarg, "Couldn't scan duration");
+                break;
+
+            case 't':
+                thread_count = (unsigned int) scan_ulong(optarg,
+                                                         "Couldn't scan "
+                                                         "thread count");
+                break;
+
+            case 'm':
+                scan_mix(optarg);
+                break;
+
+            case 's':
+                scan_size(optarg);
+                break;
+
+            case 'p':
+                poisson = 1;
+                break;
+
+            case 'q':
+                show_histogram = 0;
+                break;
+
+            default:
+                printf(help, argv[0]);
+                exit((opt == 'h') ? 0 : -1);
+        }
+    }
+
+    if ((thread_count == 0) || (thread_count > 4096)) {
+        fprintf(stderr, "THREADS must be between 1 and 4096.\n");
+        exit(-1);
+    }
+
+    if (optind + 1 != argc) {
+        printf(help, argv[0]);
+        exit(-1);
+    }
+
+    socket_path = argv[optind];
+
+    if (mix_count == 0) {
+        char default_mix[] = "ping";
+        static char storage[sizeof(default_mix)];
+
+        memcpy(storage, default_mix, sizeof(default_mix));
+        scan_mix(storage);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct client *clients;
+    struct histogram *corrected;
+    struct histogram *service;
+    unsigned long errors[error_slots] = {0};
+    unsigned long sent = 0;
+    unsigned long ok = 0;
+    uint64_t finished;
+    double elapsed;
+
+    scan_opts(argc, argv);
+
+    clients = calloc(thread_count, sizeof(*clients));
+    corrected = calloc(1, sizeof(*corrected));
+    service = calloc(1, sizeof(*service));
+
+    if ((clients == NULL) || (corrected == NULL) || (service == NULL)) {
+        perror(NULL);
+        return -1;
+    }
+
+    start_ns = now_ns() + 10000000;
+    end_ns = start_ns + (uint64_t)(duration_s * 1e9);
+
+    for (unsigned int x = 0; x < thread_count; x++) {
+        clients[x].index = x;
+        clients[x].rng = (start_ns ^ (0x9E3779B97F4A7C15ULL * (x + 1))) | 1;
+        memset(clients[x].message, 'x', sizeof(clients[x].message));
+
+        if (pthread_create(&clients[x].thread, NULL, client_main,
+                           &clients[x]) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+    }
+
+    for (unsigned int x = 0; x < thread_count; x++) {
+        pthread_join(clients[x].thread, NULL);
+        sent += clients[x].sent;
+        ok += clients[x].ok;
+        histogram_merge(corrected, &clients[x].corrected);
+        histogram_merge(service, &clients[x].service);
+
+        for (int y = 0; y < error_slots; y++) {
+            errors[y] += clients[x].errors[y];
+        }
+    }
+
+    finished = now_ns();
+    elapsed = (double)(finished - start_ns) / 1e9;
+
+    printf("# %s: %.1f req/s target, %.1f s, %u threads, %s arrivals\n",
+           socket_path, target_rate, duration_s, thread_count,
+           poisson ? "poisson" : "uniform");
+    printf("requests   %lu sent, %lu ok, %lu errors\n", sent, ok, sent - ok);
+    printf("throughput %.1f req/s\n", (double) sent / elapsed);
+
+    for (int x = 0; x < error_slots; x++) {
+        if (errors[x] != 0) {
+            printf("error      %lu x %s\n", errors[x],
+                   (x == 0) ? "unknown" : strerror(x));
+        }
+    }
+
+    printf("\n%-10s %10s %10s %10s %10s %10s %10s %10s\n", "(us)", "p50",
+           "p75", "p90", "p99", "p99.9", "p99.99", "max");
+    print_summary("latency", corrected);
+    print_summary("service", service);
+
+    if (show_histogram) {
+        print_histogram(corrected);
+    }
+
+    free(service);
+    free(corrected);
+    free(clients);
+    return (sent == ok) ? 0 : 1;
+}